@@ -207,6 +207,9 @@ main(int argc, char *argv[])
                     case 'v':  // Show version
                         printf("%s\n", version + 7);
                         goto go_exit;
+                    case 'w':  // Use wide symbols if Kicksmash can
+                        sm_file_wide = 1;
+                        break;
                     default:
                         printf("Unknown -%s\n", ptr);
 show_usage:
@@ -214,6 +217,7 @@ show_usage:
                                "-h - display this help text\n"
                                "-t - limit runtime to 240 minutes\n"
                                "-v - show smashfs version\n"
+                               "-w - send wide symbols (needs fast STM32)\n"
                                "");
                         rc = 1;
                         goto go_exit;
@@ -54,6 +54,9 @@ typedef struct FileHandle FileHandle_t;
 
 #define FL_FLAG_NEEDS_REWIND 0x01 /* EXAMINE_NEXT should rewind dir handle */
 
+#define FP_PREREAD_SIZE 1024      /* Data read from a file as it is opened */
+#define FP_DIRENT_MAX   1024      /* Largest directory entry from the host */
+
 /* DOS FileLock with SmashFS extensions */
 typedef struct fs_lock {
     BPTR            fl_Link;      /* next Dos Lock */
@@ -73,6 +76,9 @@ struct fh_private {
     handle_t      fp_handle;      /* KS file handle */
     uint64_t      fp_pos_cur;     /* Current file position */
     uint64_t      fp_pos_max;     /* Maximum file position */
+    uint8_t      *fp_pre_buf;     /* Data read at open (from offset 0) */
+    uint          fp_pre_len;     /* Valid bytes in fp_pre_buf */
+    uint          fp_pre_eof;     /* fp_pre_buf reaches end of file */
 };
 
 typedef struct {
@@ -475,32 +481,29 @@ FillInfoBlock(FileInfoBlock_t *fib, fileattr_t *fattr, hm_fdirent_t *dent)
 static ULONG
 examine_common(fs_lock_t *lock, FileInfoBlock_t *fib, fileattr_t *fattr)
 {
-    handle_t handle;
-    hm_fdirent_t *dent;
+    static uint32_t dbuf[FP_DIRENT_MAX / sizeof (uint32_t)];
+    hm_fdirent_t *dent = (hm_fdirent_t *) dbuf;
     uint type;
     uint rc;
     uint rlen;
     uint entlen;
 
-    rc = sm_fopen(lock->fl_Key, "", HM_MODE_READDIR | HM_MODE_NOFOLLOW,
-                  &type, 0, &handle);
+    /* Open, read, and close are a single exchange with the host */
+    rc = sm_fstat(lock->fl_Key, "", HM_MODE_READDIR | HM_MODE_NOFOLLOW,
+                  &type, dbuf, sizeof (dbuf), &rlen);
     if (rc != 0) {
         gpack->dp_Res2 = km_status_to_amiga_error(rc);
         return (DOSFALSE);
     }
-
-    rc = sm_fread(handle, 256, (void **) &dent, &rlen, 0);
-    if (rc != 0) {
-        sm_fclose(handle);
-        gpack->dp_Res2 = km_status_to_amiga_error(rc);
+    if (rlen < sizeof (*dent)) {
+        gpack->dp_Res2 = ERROR_OBJECT_NOT_FOUND;
         return (DOSFALSE);
     }
 
     entlen = dent->hmd_elen;
-    if (entlen > 1024) {
-        printf("Corrupt entlen=%x for %x\n", entlen, handle);
+    if ((entlen > FP_DIRENT_MAX) || (entlen > rlen)) {
+        printf("Corrupt entlen=%x for %x\n", entlen, lock->fl_Key);
         gpack->dp_Res2 = ERROR_BAD_TEMPLATE;
-        sm_fclose(handle);
         return (DOSFALSE);
     }
 
@@ -510,8 +513,6 @@ examine_common(fs_lock_t *lock, FileInfoBlock_t *fib, fileattr_t *fattr)
         /* Directory pointer needs rewind for EXAMINE_NEXT */
         lock->fl_Flags |= FL_FLAG_NEEDS_REWIND;
     }
-
-    sm_fclose(handle);
     return (DOSTRUE);
 }
 
@@ -589,7 +590,7 @@ action_examine_next(void)
         return (DOSFALSE);
     }
     entlen = dent->hmd_elen;
-    if (entlen > 1024) {
+    if ((entlen > FP_DIRENT_MAX) || (entlen > rlen)) {
         printf("Corrupt entlen=%x for %x\n", entlen, handle);
         gpack->dp_Res2 = ERROR_BAD_TEMPLATE;
         sm_fclose(handle);
@@ -614,6 +615,26 @@ action_examine_object(void)
     return (examine_common(lock, fib, fattr));
 }
 
+/*
+ * fp_preread_drop
+ * ---------------
+ * Release data which was read as the file was opened. If sync is set,
+ * the host file position (which is at the end of that data) is first
+ * moved back to the current file position.
+ */
+static void
+fp_preread_drop(fh_private_t *fp, uint sync)
+{
+    if (fp->fp_pre_buf == NULL)
+        return;
+    if (sync && (fp->fp_pos_cur != fp->fp_pre_len)) {
+        (void) sm_fseek(fp->fp_handle, SEEK_OFFSET_BEGINNING, fp->fp_pos_cur,
+                        NULL, NULL);
+    }
+    FreeMem(fp->fp_pre_buf, FP_PREREAD_SIZE);
+    fp->fp_pre_buf = NULL;
+}
+
 static ULONG
 action_end(void)
 {
@@ -623,6 +644,7 @@ action_end(void)
     if (fp != NULL) {
         fs_lock_t *lock   = (fs_lock_t *) fp->fp_lock;
         handle_t   handle = fp->fp_handle;
+        fp_preread_drop(fp, 0);
         sm_fclose(handle);
         if (lock != NULL)
             FreeLock(lock);
@@ -647,6 +669,9 @@ action_findinput(void)
     uint          type;
     uint          hm_mode = HM_MODE_READ | HM_MODE_WRITE;
     uint          create_perms = 0;
+    uint8_t      *pre_buf = NULL;
+    uint          pre_len = 0;
+    uint          pre_rc = KM_STATUS_FAIL;
 
     /* Temporarily NIL-terminate name */
     bname = name + *bname;
@@ -655,27 +680,49 @@ action_findinput(void)
 
     if (gpack->dp_Type == ACTION_FINDUPDATE) {
         hm_mode = HM_MODE_READ | HM_MODE_WRITE | HM_MODE_CREATE;
+    } else {
+        /* Files opened for input are read from the start on open */
+        pre_buf = AllocMem(FP_PREREAD_SIZE, MEMF_PUBLIC);
     }
 
     printf("FIND%s p=%x %p '%s'\n",
-           (hm_mode & HM_MODE_WRITE) ? "UPDATE" : "INPUT", phandle, lock, name);
-
-    rc = sm_fopen(phandle, name, hm_mode, &type, create_perms, &handle);
+           (gpack->dp_Type == ACTION_FINDUPDATE) ? "UPDATE" : "INPUT",
+           phandle, lock, name);
+
+    if (pre_buf != NULL) {
+        rc = sm_fopen_read(phandle, name, hm_mode, &type, create_perms,
+                           &handle, pre_buf, FP_PREREAD_SIZE, &pre_len,
+                           &pre_rc);
+        if ((pre_rc != KM_STATUS_OK) && (pre_rc != KM_STATUS_EOF)) {
+            /* Read failed: leave it to action_read() */
+            FreeMem(pre_buf, FP_PREREAD_SIZE);
+            pre_buf = NULL;
+            pre_len = 0;
+        }
+    } else {
+        rc = sm_fopen(phandle, name, hm_mode, &type, create_perms, &handle);
+    }
     *bname = cho;
 
     if (rc != 0) {
+        if (pre_buf != NULL)
+            FreeMem(pre_buf, FP_PREREAD_SIZE);
         gpack->dp_Res2 = km_status_to_amiga_error(rc);
         return (DOSFALSE);
     }
 
     newlock = CreateLock(handle, phandle, SHARED_LOCK);
     if (newlock == NULL) {
+        if (pre_buf != NULL)
+            FreeMem(pre_buf, FP_PREREAD_SIZE);
         sm_fclose(handle);
         return (DOSFALSE);
     }
 
     fp = AllocMem(sizeof (*fp), MEMF_PUBLIC);
     if (fp == NULL) {
+        if (pre_buf != NULL)
+            FreeMem(pre_buf, FP_PREREAD_SIZE);
         sm_fclose(handle);
         gpack->dp_Res2 = ERROR_NO_FREE_STORE;
         return (DOSFALSE);
@@ -685,6 +732,9 @@ action_findinput(void)
     fp->fp_handle  = handle;
     fp->fp_pos_cur = 0;
     fp->fp_pos_max = 0;
+    fp->fp_pre_buf = pre_buf;
+    fp->fp_pre_len = pre_len;
+    fp->fp_pre_eof = (pre_rc == KM_STATUS_EOF);
 
     fh->fh_Port = NULL;            // Non-zero only if interactive
     fh->fh_Type = gvol->vl_msgport;   // Handler message port
@@ -752,6 +802,9 @@ action_findoutput(void)
     fp->fp_handle  = handle;
     fp->fp_pos_cur = 0;
     fp->fp_pos_max = 0;
+    fp->fp_pre_buf = NULL;
+    fp->fp_pre_len = 0;
+    fp->fp_pre_eof = 0;
 
     fh->fh_Port = NULL;            // Non-zero only if interactive
     fh->fh_Type = gvol->vl_msgport;   // Handler message port
@@ -984,8 +1037,27 @@ action_read(void)
     handle = fp->fp_handle;
     printf("READ %x at pos=%llx len=%x\n", handle, fp->fp_pos_cur, len);
 
-    while (count < len) {
-        rc = sm_fread(handle, len, &data, &rlen, 0);
+    if (fp->fp_pre_buf != NULL) {
+        /* Data read at open; the host file position is at its end */
+        if (fp->fp_pos_cur < fp->fp_pre_len) {
+            count = fp->fp_pre_len - fp->fp_pos_cur;
+            if (count > len)
+                count = len;
+            memcpy(buf, fp->fp_pre_buf + fp->fp_pos_cur, count);
+            buf            += count;
+            fp->fp_pos_cur += count;
+            if (fp->fp_pos_max < fp->fp_pos_cur)
+                fp->fp_pos_max = fp->fp_pos_cur;
+        }
+        if (fp->fp_pos_cur >= fp->fp_pre_len) {
+            if (fp->fp_pre_eof)
+                rc = KM_STATUS_EOF;
+            fp_preread_drop(fp, 0);
+        }
+    }
+
+    while ((count < len) && (rc != KM_STATUS_EOF)) {
+        rc = sm_fread(handle, len - count, &data, &rlen, 0);
         if ((rc != 0) && (rc != KM_STATUS_EOF))
             printf("sm_fread got %d\n", rc);
         if (rlen == 0) {
@@ -993,8 +1065,8 @@ action_read(void)
                    handle, fp->fp_pos_cur, count, rc);
             break;
         }
-        if (rlen > len)
-            rlen = len;
+        if (rlen > len - count)
+            rlen = len - count;
         memcpy(buf, data, rlen);
         buf            += rlen;
         count          += rlen;
@@ -1021,15 +1093,14 @@ action_read_link(void)
     fs_lock_t *lock   = (fs_lock_t *) BTOC(GARG1);
     char      *name   = (char *) GARG2;
     char      *buf    = (char *) GARG3;
-    char      *linkpath;
     ULONG      buflen = GARG4;
-    handle_t   handle;
     handle_t   phandle;
     uint type;
     uint rc;
     uint rlen;
+    uint readsize = 1024;
 
-    if ((lock == NULL) || (name == NULL) || (buf == NULL))  {
+    if ((lock == NULL) || (name == NULL) || (buf == NULL) || (buflen == 0)) {
         gpack->dp_Res2 = ERROR_REQUIRED_ARG_MISSING;
         return (DOSFALSE);
     }
@@ -1037,25 +1108,15 @@ action_read_link(void)
 
     printf("ACTION_READ_LINK %x '%s' %p %ul\n", phandle, name, buf, buflen);
 
-    rc = sm_fopen(phandle, name, HM_MODE_READLINK, &type, 0, &handle);
-    if (rc != 0) {
-        gpack->dp_Res2 = km_status_to_amiga_error(rc);
-        return (DOSFALSE);
-    }
-
-    rc = sm_fread(handle, 1024, (void **) &linkpath, &rlen, 0);
+    if (readsize > buflen - 1)
+        readsize = buflen - 1;
+    rc = sm_fstat(phandle, name, HM_MODE_READLINK, &type, buf, readsize,
+                  &rlen);
     if (rc != 0) {
-        sm_fclose(handle);
         gpack->dp_Res2 = km_status_to_amiga_error(rc);
         return (DOSFALSE);
     }
-
-    if (rlen > buflen - 1)
-        rlen = buflen - 1;
-    memcpy(buf, linkpath, rlen);
     buf[rlen] = '\0';
-
-    sm_fclose(handle);
     return (rlen);
 }
 
@@ -1121,6 +1182,7 @@ action_seek(void)
         return (DOSFALSE);
     }
     handle = fp->fp_handle;
+    fp_preread_drop(fp, 1);
 
     printf("SEEK %x to %x mode %d\n", handle, offset, seek_mode);
 
@@ -1380,6 +1442,7 @@ action_write(void)
         return (DOSFALSE);
     }
     handle = fp->fp_handle;
+    fp_preread_drop(fp, 1);
     printf("WRITE %x buf=%p at pos=%llx len=%x\n",
            handle, buf, fp->fp_pos_cur, len);
 
@@ -29,6 +29,7 @@
 #define KM_OP_FSETPERMS       0x19  // File storage set permissions
 #define KM_OP_FSETOWN         0x1a  // File storage set owner / group
 #define KM_OP_FSETDATE        0x1b  // File storage set date
+#define KM_OP_BATCH           0x1c  // Multiple file operations in one message
 
 #define KM_OP_REPLY           0x80  // Reply message flag to remote request
 
@@ -72,6 +73,12 @@
 #define HM_MODE_READLINK    0x2001  // Read symlink (composite)
 
 #define HM_FLAG_SEEK0       0x0001  // Seek the start of file before read
+#define HM_FLAG_COMPRESS    0x0002  // Payload may be / is compressed (sm_lz.h)
+
+/* Host capabilities reported in the KM_OP_ID reply si_features */
+#define HM_FEATURE_COMPRESS 0x0002  // Host handles HM_FLAG_COMPRESS
+
+#define HM_BATCH_PREV_HANDLE 0x0001 // Use handle from prior FOPEN in batch
 
 typedef uint32_t handle_t;
 
@@ -162,4 +169,40 @@ typedef struct {
  * will be two-byte aligned following the comment.
  */
 
+typedef struct {
+    km_msg_hdr_t hm_hdr;     // Standard message header
+    uint32_t     hm_length;  // Length of all entries which follow
+    uint16_t     hm_count;   // Number of entries which follow
+    uint16_t     hm_unused;  // Unused
+} hm_batch_t;
+
+typedef struct {
+    uint16_t     hmb_len;    // Length of the message which follows
+    uint16_t     hmb_flags;  // HM_BATCH_* flags (request only)
+    /* A complete request or reply message follows */
+} hm_batch_ent_t;
+/*
+ * A KM_OP_BATCH request carries several file operation requests, each
+ * preceded by a hm_batch_ent_t. The next entry begins four-byte aligned
+ * following the message. The host executes the requests in order and
+ * sends a single reply in the same format, holding one reply message
+ * per request. A request with HM_BATCH_PREV_HANDLE set has its handle
+ * replaced by the handle returned by the most recent successful
+ * KM_OP_FOPEN in the same batch; if there is no such handle, the
+ * request is not executed and its reply carries only a message header
+ * with failure status. The batch reply km_status is that of the first
+ * request which failed (KM_STATUS_EOF is not a failure). The complete
+ * batch request must fit in a single message, and KM_OP_FWRITE requests
+ * must carry all of their data.
+ */
+
+/*
+ * HM_FLAG_COMPRESS may be used only with a host which reports
+ * HM_FEATURE_COMPRESS. On a KM_OP_FREAD request, it permits the host to
+ * compress the reply; the host then sets HM_FLAG_COMPRESS in the reply
+ * hm_flag if it did so. On a KM_OP_FWRITE request, it indicates that the
+ * data is compressed. For both, hm_length is the length of the payload
+ * as sent, which is in the format described in sm_lz.h.
+ */
+
 #endif /* _HOST_CMD_H */
@@ -19,9 +19,22 @@
 #include "host_cmd.h"
 #include "sm_msg.h"
 #include "sm_file.h"
+#include "sm_lz.h"
 
 static uint     sm_mbuf_size = 0;
 static uint8_t *sm_mbuf      = NULL;
+static uint     sm_zbuf_size = 0;     // Unpacked read data buffer size
+static uint8_t *sm_zbuf      = NULL;  // Unpacked read data
+static uint16_t *sm_lz_hash  = NULL;  // Compressor workspace
+static uint8_t  sm_compress  = 0;     // 0=Unknown, 1=Host can, 2=Host can't
+static uint8_t  sm_zskip     = 0;     // Writes to send before packing again
+uint8_t         sm_file_wide = 0;     // User asked for wide symbols
+
+#define SM_ZSKIP_WRITES 8  // Writes sent unpacked after one did not pack
+
+#define SM_FWRITE_WINDOW 4  // Posted writes which may await replies
+static uint16_t sm_wpend[SM_FWRITE_WINDOW];  // Tags of posted writes
+static uint     sm_wpend_count = 0;
 
 /*
  * sm_fservice
@@ -39,12 +52,84 @@ sm_fservice(void)
         ((states[1] & (MSG_STATE_SERVICE_UP | MSG_STATE_HAVE_FILE)) ==
                       (MSG_STATE_SERVICE_UP | MSG_STATE_HAVE_FILE))) {
         sm_file_active = 1;
+        if (sm_file_wide && (smash_cmd_wide == 0))
+            (void) msg_wide_enable(1);  // Faster file writes if available
         return (1);
     }
     sm_file_active = 0;
+    sm_compress = 0;  // Host may be different when service returns
     return (0);
 }
 
+/*
+ * sm_fcompress
+ * ------------
+ * Returns non-zero if the host accepts HM_FLAG_COMPRESS for file reads
+ * and writes. The host is asked with KM_OP_ID the first time this is
+ * called after file service becomes available.
+ */
+static uint
+sm_fcompress(void)
+{
+    km_msg_hdr_t  msg;
+    km_msg_hdr_t *rdata;
+    smash_id_t   *id;
+    uint          rcvlen;
+    uint          rc;
+
+    if (sm_compress == 0) {
+        msg.km_op     = KM_OP_ID;
+        msg.km_status = 0;
+        msg.km_tag    = host_tag_alloc();
+        rc = host_msg(&msg, sizeof (msg), (void **) &rdata, &rcvlen);
+        host_tag_free(msg.km_tag);
+        if (rc != KM_STATUS_OK)
+            return (0);  // Ask again next time
+
+        id = (smash_id_t *) (rdata + 1);
+        if ((rcvlen >= sizeof (*rdata) + sizeof (*id)) &&
+            (id->si_features & HM_FEATURE_COMPRESS))
+            sm_compress = 1;
+        else
+            sm_compress = 2;
+    }
+    return (sm_compress == 1);
+}
+
+/*
+ * sm_funpack
+ * ----------
+ * Unpacks compressed read data (HM_FLAG_COMPRESS) into a static buffer.
+ * data and len are updated to refer to the unpacked data.
+ */
+static uint
+sm_funpack(void **data, uint *len)
+{
+    int32_t ulen = sm_lz_unpacked_len(*data, *len);
+
+    if (ulen < 0)
+        goto corrupt;
+    if ((sm_zbuf == NULL) || ((uint) ulen > sm_zbuf_size)) {
+        if (sm_zbuf != NULL)
+            free(sm_zbuf);
+        sm_zbuf      = malloc(ulen + 1);
+        sm_zbuf_size = ulen;
+    }
+    if (sm_zbuf == NULL) {
+        printf("malloc(%u) failed\n", ulen + 1);
+        return (MSG_STATUS_NO_MEM);
+    }
+    if (sm_lz_unpack(*data, *len, sm_zbuf, ulen) != ulen)
+        goto corrupt;
+    *data = sm_zbuf;
+    *len  = ulen;
+    return (KM_STATUS_OK);
+
+corrupt:
+    printf("Corrupt compressed read data\n");
+    return (KM_STATUS_FAIL);
+}
+
 /*
  * sm_fopen
  * --------
@@ -158,6 +243,8 @@ sm_fclose(handle_t handle)
     if ((sm_file_active == 0) && (sm_fservice() == 0))
         return (KM_STATUS_UNAVAIL);
 
+    (void) sm_fwrite_wait();  // Release tags of any posted writes
+
     msg.hm_hdr.km_op     = KM_OP_FCLOSE;
     msg.hm_hdr.km_status = 0;
     msg.hm_hdr.km_tag    = host_tag_alloc();
@@ -196,10 +283,14 @@ sm_fread(handle_t handle, uint readsize, void **data, uint *rlen, uint flags)
     hm_freadwrite_t msg;
     hm_freadwrite_t *rdata;
     uint rcvlen;
+    uint rflag;
 
     if ((sm_file_active == 0) && (sm_fservice() == 0))
         return (KM_STATUS_UNAVAIL);
 
+    if ((readsize >= SM_LZ_MIN_LEN) && sm_fcompress())
+        flags |= HM_FLAG_COMPRESS;
+
     msg.hm_hdr.km_op     = KM_OP_FREAD;
     msg.hm_hdr.km_status = 0;
     msg.hm_hdr.km_tag    = host_tag_alloc();
@@ -223,10 +314,13 @@ sm_fread(handle_t handle, uint readsize, void **data, uint *rlen, uint flags)
     }
 #endif
 
-    if (rcvlen >= sizeof (*rdata))
+    if (rcvlen >= sizeof (*rdata)) {
         rcvlen -= sizeof (*rdata);
-    else
+        rflag = rdata->hm_flag;
+    } else {
         rcvlen = 0;
+        rflag = 0;
+    }
     *data = (void *) (rdata + 1);
 
     if (rcvlen != rdata->hm_length) {
@@ -252,6 +346,13 @@ sm_fread(handle_t handle, uint readsize, void **data, uint *rlen, uint flags)
         rcvlen = total_len;
         *data = (void *) sm_mbuf;
     }
+    if (rflag & HM_FLAG_COMPRESS) {
+        uint urc = sm_funpack(data, &rcvlen);
+        if (urc != KM_STATUS_OK) {
+            rc = urc;
+            rcvlen = 0;
+        }
+    }
 sm_read_fail:
     if (rlen != NULL)
         *rlen = rcvlen;
@@ -263,6 +364,499 @@ sm_read_fail:
     return (rc);
 }
 
+/* sm_batch_unsupported is set once the host rejects KM_OP_BATCH */
+static uint8_t sm_batch_unsupported = 0;
+
+/*
+ * sm_batch_add
+ * ------------
+ * Append a request message to a KM_OP_BATCH message being built,
+ * returning the position for the next entry.
+ */
+static uint8_t *
+sm_batch_add(uint8_t *pos, uint flags, const void *msg, uint len)
+{
+    hm_batch_ent_t *ent = (hm_batch_ent_t *) pos;
+
+    ent->hmb_len   = len;
+    ent->hmb_flags = flags;
+    memcpy(ent + 1, msg, len);
+    return (pos + sizeof (*ent) + ((len + 3) & ~3));
+}
+
+/*
+ * sm_batch_next
+ * -------------
+ * Return the next reply message from a KM_OP_BATCH reply, or NULL if
+ * there are no more.
+ */
+static km_msg_hdr_t *
+sm_batch_next(uint8_t **pos, uint8_t *end, uint *len)
+{
+    hm_batch_ent_t *ent = (hm_batch_ent_t *) *pos;
+
+    if ((*pos + sizeof (*ent) > end) ||
+        (ent->hmb_len < sizeof (km_msg_hdr_t)) ||
+        (ent->hmb_len > end - *pos - sizeof (*ent))) {
+        return (NULL);
+    }
+    *len = ent->hmb_len;
+    *pos += sizeof (*ent) + ((ent->hmb_len + 3) & ~3);
+    return ((km_msg_hdr_t *) (ent + 1));
+}
+
+/*
+ * sm_batch
+ * --------
+ * Send a KM_OP_BATCH message and receive the complete reply.
+ *
+ * msg is the batch message, with hm_count and hm_length filled in.
+ * msglen is the total length of the batch message.
+ * ents will be assigned a pointer to the first reply entry.
+ *      Note that this is from a static buffer not allocated by the caller.
+ * entlen will be assigned the length of all reply entries.
+ *
+ * Returns KM_STATUS_OK if a batch reply was received, regardless of the
+ * status of the individual requests. KM_STATUS_UNKCMD is returned if the
+ * host does not support batches.
+ */
+static uint
+sm_batch(hm_batch_t *msg, uint msglen, uint8_t **ents, uint *entlen)
+{
+    hm_batch_t *rdata;
+    uint        rcvlen = 0;
+    uint        rc;
+
+    rc = host_msg(msg, msglen, (void **) &rdata, &rcvlen);
+    if (rcvlen < sizeof (*rdata)) {
+        if (rc == KM_STATUS_UNKCMD)
+            sm_batch_unsupported = 1;  // Older host
+        if (rc == KM_STATUS_OK)
+            rc = KM_STATUS_FAIL;
+        if (rc == KS_STATUS_NODATA)
+            sm_fservice();  // Check if file service is still active
+        return (rc);
+    }
+
+    rcvlen -= sizeof (*rdata);
+    *ents = (uint8_t *) (rdata + 1);
+    *entlen = rdata->hm_length;
+
+    if (rcvlen < rdata->hm_length) {
+        /* More packets are inbound */
+        uint total_len = rdata->hm_length;
+
+        if ((sm_mbuf == NULL) || (total_len >= sm_mbuf_size))  {
+            if (sm_mbuf != NULL)
+                free(sm_mbuf);
+            sm_mbuf      = malloc(total_len);
+            sm_mbuf_size = total_len;
+        }
+        if (sm_mbuf == NULL) {
+            printf("malloc(%u) failed\n", total_len);
+            return (MSG_STATUS_NO_MEM);
+        }
+        memcpy(sm_mbuf, (rdata + 1), rcvlen);
+        rc = host_recv_msg_cont(msg->hm_hdr.km_tag, sm_mbuf + rcvlen,
+                                total_len - rcvlen);
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        *ents = sm_mbuf;
+    }
+    return (KM_STATUS_OK);
+}
+
+/*
+ * sm_fopen_read
+ * -------------
+ * Open the specified file and read its first block of data. This is
+ * done with a single message exchange when the host supports
+ * KM_OP_BATCH, and otherwise with sm_fopen() followed by sm_fread().
+ *
+ * parent_handle, name, mode, hm_type, create_perms, and handle are the
+ *     same as for sm_fopen().
+ * buf is where the data read should be stored.
+ * readsize is the maximum size of data to read.
+ * rlen is the size of the data read.
+ * read_rc is the status of the read (KM_STATUS_EOF if the file is
+ *     shorter than readsize).
+ *
+ * The return value is the status of the open. The file remains open
+ * if that is KM_STATUS_OK, even if the read failed.
+ */
+uint
+sm_fopen_read(handle_t parent_handle, const char *name, uint mode,
+              uint *hm_type, uint create_perms, handle_t *handle,
+              void *buf, uint readsize, uint *rlen, uint *read_rc)
+{
+    uint8_t          *msg;
+    uint8_t          *pos;
+    uint8_t          *ents;
+    uint8_t          *end;
+    hm_batch_t       *bmsg;
+    hm_fopenhandle_t *omsg;
+    hm_freadwrite_t   rmsg;
+    km_msg_hdr_t     *reply;
+    uint namelen = strlen(name) + 1;
+    uint msglen;
+    uint entlen;
+    uint len;
+    uint rc;
+
+    *handle = 0;
+    *rlen = 0;
+    *read_rc = KM_STATUS_FAIL;
+
+    if ((sm_file_active == 0) && (sm_fservice() == 0))
+        return (KM_STATUS_UNAVAIL);
+
+    if (sm_batch_unsupported) {
+        void *data;
+        rc = sm_fopen(parent_handle, name, mode, hm_type, create_perms,
+                      handle);
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        *read_rc = sm_fread(*handle, readsize, &data, rlen, 0);
+        if ((*read_rc != KM_STATUS_OK) && (*read_rc != KM_STATUS_EOF))
+            *rlen = 0;
+        if (*rlen > readsize)
+            *rlen = readsize;
+        if (*rlen > 0)
+            memcpy(buf, data, *rlen);
+        return (rc);
+    }
+
+    if (namelen > 1900) {
+        printf("Path \"%s\" too long\n", name);
+        return (KM_STATUS_FAIL);
+    }
+    msglen = sizeof (*bmsg) + 2 * sizeof (hm_batch_ent_t) +
+             ((sizeof (*omsg) + namelen + 3) & ~3) + sizeof (rmsg);
+    msg = malloc(msglen + sizeof (*omsg) + namelen);
+    if (msg == NULL) {
+        printf("Failed to allocate %u bytes\n", msglen);
+        return (KM_STATUS_FAIL);
+    }
+    bmsg = (hm_batch_t *) msg;
+    omsg = (hm_fopenhandle_t *) (msg + msglen);  // Staging for open request
+
+    bmsg->hm_hdr.km_op     = KM_OP_BATCH;
+    bmsg->hm_hdr.km_status = 0;
+    bmsg->hm_hdr.km_tag    = host_tag_alloc();
+    bmsg->hm_count         = 2;
+    bmsg->hm_unused        = 0;
+
+    omsg->hm_hdr           = bmsg->hm_hdr;
+    omsg->hm_hdr.km_op     = KM_OP_FOPEN;
+    omsg->hm_handle        = parent_handle;  // parent directory handle
+    omsg->hm_mode          = mode;           // open mode
+    omsg->hm_type          = 0;              // unused
+    omsg->hm_aperms        = create_perms;   // Amiga permissions
+    strcpy((char *)(omsg + 1), name);  // Name follows message header
+
+    rmsg.hm_hdr            = bmsg->hm_hdr;
+    rmsg.hm_hdr.km_op      = KM_OP_FREAD;
+    rmsg.hm_handle         = 0;              // From open
+    rmsg.hm_length         = readsize;
+    rmsg.hm_flag           = 0;
+    rmsg.hm_unused         = 0;
+
+    pos = (uint8_t *) (bmsg + 1);
+    pos = sm_batch_add(pos, 0, omsg, sizeof (*omsg) + namelen);
+    pos = sm_batch_add(pos, HM_BATCH_PREV_HANDLE, &rmsg, sizeof (rmsg));
+    bmsg->hm_length = pos - (uint8_t *) (bmsg + 1);
+
+    rc = sm_batch(bmsg, msglen, &ents, &entlen);
+    host_tag_free(bmsg->hm_hdr.km_tag);
+    free(msg);
+    if (rc != KM_STATUS_OK) {
+        if (sm_batch_unsupported)
+            return (sm_fopen_read(parent_handle, name, mode, hm_type,
+                                  create_perms, handle, buf, readsize,
+                                  rlen, read_rc));
+        return (rc);
+    }
+
+    end = ents + entlen;
+    reply = sm_batch_next(&ents, end, &len);
+    if ((reply == NULL) || (len < sizeof (*omsg)))
+        return (KM_STATUS_FAIL);
+    if (reply->km_status != KM_STATUS_OK)
+        return (reply->km_status);
+    omsg = (hm_fopenhandle_t *) reply;
+    *handle = omsg->hm_handle;
+    if (hm_type != NULL)
+        *hm_type = omsg->hm_type;
+
+    reply = sm_batch_next(&ents, end, &len);
+    if ((reply != NULL) && (len >= sizeof (rmsg))) {
+        hm_freadwrite_t *rdata = (hm_freadwrite_t *) reply;
+        *read_rc = reply->km_status;
+        if ((*read_rc == KM_STATUS_OK) || (*read_rc == KM_STATUS_EOF)) {
+            *rlen = len - sizeof (*rdata);
+            if (*rlen > rdata->hm_length)
+                *rlen = rdata->hm_length;
+            if (*rlen > readsize)
+                *rlen = readsize;
+            memcpy(buf, rdata + 1, *rlen);
+        }
+    }
+    return (KM_STATUS_OK);
+}
+
+/*
+ * sm_fstat
+ * --------
+ * Open the specified file, read from it, and close it again. This is
+ * intended for reading a file's directory entry (HM_MODE_READDIR) or
+ * symlink target (HM_MODE_READLINK). It is done with a single message
+ * exchange when the host supports KM_OP_BATCH.
+ *
+ * parent_handle, name, mode, and hm_type are the same as for sm_fopen().
+ * buf is where the data read should be stored.
+ * readsize is the maximum size of data to read.
+ * rlen is the size of the data read.
+ *
+ * The return value is the status of the open if that failed, otherwise
+ * the status of the read.
+ */
+uint
+sm_fstat(handle_t parent_handle, const char *name, uint mode, uint *hm_type,
+         void *buf, uint readsize, uint *rlen)
+{
+    handle_t handle;
+    uint8_t *msg;
+    uint8_t *pos;
+    uint8_t *ents;
+    uint8_t *end;
+    hm_batch_t       *bmsg;
+    hm_fopenhandle_t *omsg;
+    hm_freadwrite_t   rmsg;
+    hm_fhandle_t      cmsg;
+    km_msg_hdr_t     *reply;
+    uint namelen = strlen(name) + 1;
+    uint msglen;
+    uint entlen;
+    uint len;
+    uint rc;
+
+    *rlen = 0;
+    if ((sm_file_active == 0) && (sm_fservice() == 0))
+        return (KM_STATUS_UNAVAIL);
+
+    if (sm_batch_unsupported) {
+        uint read_rc;
+        rc = sm_fopen_read(parent_handle, name, mode, hm_type, 0, &handle,
+                           buf, readsize, rlen, &read_rc);
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        sm_fclose(handle);
+        return (read_rc);
+    }
+
+    if (namelen > 1900) {
+        printf("Path \"%s\" too long\n", name);
+        return (KM_STATUS_FAIL);
+    }
+    msglen = sizeof (*bmsg) + 3 * sizeof (hm_batch_ent_t) +
+             ((sizeof (*omsg) + namelen + 3) & ~3) + sizeof (rmsg) +
+             sizeof (cmsg);
+    msg = malloc(msglen + sizeof (*omsg) + namelen);
+    if (msg == NULL) {
+        printf("Failed to allocate %u bytes\n", msglen);
+        return (KM_STATUS_FAIL);
+    }
+    bmsg = (hm_batch_t *) msg;
+    omsg = (hm_fopenhandle_t *) (msg + msglen);  // Staging for open request
+
+    bmsg->hm_hdr.km_op     = KM_OP_BATCH;
+    bmsg->hm_hdr.km_status = 0;
+    bmsg->hm_hdr.km_tag    = host_tag_alloc();
+    bmsg->hm_count         = 3;
+    bmsg->hm_unused        = 0;
+
+    omsg->hm_hdr           = bmsg->hm_hdr;
+    omsg->hm_hdr.km_op     = KM_OP_FOPEN;
+    omsg->hm_handle        = parent_handle;  // parent directory handle
+    omsg->hm_mode          = mode;           // open mode
+    omsg->hm_type          = 0;              // unused
+    omsg->hm_aperms        = 0;
+    strcpy((char *)(omsg + 1), name);  // Name follows message header
+
+    rmsg.hm_hdr            = bmsg->hm_hdr;
+    rmsg.hm_hdr.km_op      = KM_OP_FREAD;
+    rmsg.hm_handle         = 0;              // From open
+    rmsg.hm_length         = readsize;
+    rmsg.hm_flag           = 0;
+    rmsg.hm_unused         = 0;
+
+    cmsg.hm_hdr            = bmsg->hm_hdr;
+    cmsg.hm_hdr.km_op      = KM_OP_FCLOSE;
+    cmsg.hm_handle         = 0;              // From open
+
+    pos = (uint8_t *) (bmsg + 1);
+    pos = sm_batch_add(pos, 0, omsg, sizeof (*omsg) + namelen);
+    pos = sm_batch_add(pos, HM_BATCH_PREV_HANDLE, &rmsg, sizeof (rmsg));
+    pos = sm_batch_add(pos, HM_BATCH_PREV_HANDLE, &cmsg, sizeof (cmsg));
+    bmsg->hm_length = pos - (uint8_t *) (bmsg + 1);
+
+    rc = sm_batch(bmsg, msglen, &ents, &entlen);
+    host_tag_free(bmsg->hm_hdr.km_tag);
+    free(msg);
+    if (rc != KM_STATUS_OK) {
+        if (sm_batch_unsupported)
+            return (sm_fstat(parent_handle, name, mode, hm_type,
+                             buf, readsize, rlen));
+        return (rc);
+    }
+
+    end = ents + entlen;
+    reply = sm_batch_next(&ents, end, &len);
+    if ((reply == NULL) || (len < sizeof (*omsg)))
+        return (KM_STATUS_FAIL);
+    if (reply->km_status != KM_STATUS_OK)
+        return (reply->km_status);
+    if (hm_type != NULL)
+        *hm_type = ((hm_fopenhandle_t *) reply)->hm_type;
+
+    reply = sm_batch_next(&ents, end, &len);
+    if ((reply == NULL) || (len < sizeof (rmsg)))
+        return (KM_STATUS_FAIL);
+    rc = reply->km_status;
+    if ((rc == KM_STATUS_OK) || (rc == KM_STATUS_EOF)) {
+        hm_freadwrite_t *rdata = (hm_freadwrite_t *) reply;
+        *rlen = len - sizeof (*rdata);
+        if (*rlen > rdata->hm_length)
+            *rlen = rdata->hm_length;
+        if (*rlen > readsize)
+            *rlen = readsize;
+        memcpy(buf, rdata + 1, *rlen);
+    }
+    return (rc);
+}
+
+/*
+ * sm_fwrite_send
+ * --------------
+ * Sends a KM_OP_FWRITE message. If post is non-zero, the reply is not
+ * waited for; the tag is queued for sm_fwrite_reap() instead. A write
+ * which does not fit in the host message window is completed here.
+ */
+static uint
+sm_fwrite_send(hm_freadwrite_t *msg, uint msglen, uint post)
+{
+    hm_freadwrite_t *rdata;
+    uint tag = msg->hm_hdr.km_tag;
+    uint rcvlen;
+    uint rc;
+
+    if (post) {
+        rc = host_msg_post(msg, msglen);
+        if (rc == KM_STATUS_OK) {
+            sm_wpend[sm_wpend_count++] = tag;
+            return (rc);
+        }
+        if (rc != KM_STATUS_UNAVAIL) {
+            host_tag_free(tag);
+            return (rc);
+        }
+    }
+    rc = host_msg(msg, msglen, (void **) &rdata, &rcvlen);
+    host_tag_free(tag);
+    return (rc);
+}
+
+/*
+ * sm_fwrite_reap
+ * --------------
+ * Collects replies to posted writes, oldest first, until no more than
+ * keep remain outstanding. Returns the first failure reported, or
+ * KM_STATUS_OK if all writes collected were successful.
+ */
+static uint
+sm_fwrite_reap(uint keep)
+{
+    hm_freadwrite_t *rdata;
+    uint rcvlen;
+    uint rc;
+    uint first_rc = KM_STATUS_OK;
+
+    while (sm_wpend_count > keep) {
+        uint tag = sm_wpend[0];
+
+        rc = host_recv_msg(tag, (void **) &rdata, &rcvlen);
+        host_tag_free(tag);
+        sm_wpend_count--;
+        memmove(sm_wpend, sm_wpend + 1, sm_wpend_count * sizeof (*sm_wpend));
+        if (first_rc == KM_STATUS_OK)
+            first_rc = rc;
+    }
+    if (first_rc == KS_STATUS_NODATA)
+        sm_fservice();  // Check if file service is still active
+    return (first_rc);
+}
+
+/*
+ * sm_fwrite_wait
+ * --------------
+ * Waits for all writes posted by sm_fwrite_post() to complete. Returns
+ * the first failure reported, or KM_STATUS_OK if all were successful.
+ */
+uint
+sm_fwrite_wait(void)
+{
+    return (sm_fwrite_reap(0));
+}
+
+/*
+ * sm_fwrite_packed
+ * ----------------
+ * Sends write data compressed (HM_FLAG_COMPRESS), if that makes it
+ * smaller. Returns non-zero if the data was sent, in which case rc is
+ * assigned the status of the write. After data fails to pack, the next
+ * SM_ZSKIP_WRITES writes are not attempted, as the file is likely
+ * already compressed. If post is non-zero, the write is posted as with
+ * sm_fwrite_post().
+ */
+static uint
+sm_fwrite_packed(handle_t handle, const void *data, uint writelen,
+                 uint flags, uint post, uint *rc)
+{
+    hm_freadwrite_t *msg;
+    uint zmax = SM_LZ_PACK_MAX(writelen);
+    uint zlen;
+
+    if (sm_zskip > 0) {
+        sm_zskip--;
+        return (0);
+    }
+    if (sm_lz_hash == NULL) {
+        sm_lz_hash = malloc(SM_LZ_HASH_SIZE * sizeof (*sm_lz_hash));
+        if (sm_lz_hash == NULL)
+            return (0);
+    }
+    msg = malloc(sizeof (*msg) + zmax);
+    if (msg == NULL)
+        return (0);
+    zlen = sm_lz_pack(data, writelen, msg + 1, zmax, sm_lz_hash);
+    if (zlen == 0) {
+        sm_zskip = SM_ZSKIP_WRITES;
+        free(msg);
+        return (0);
+    }
+
+    msg->hm_hdr.km_op     = KM_OP_FWRITE;
+    msg->hm_hdr.km_status = 0;
+    msg->hm_hdr.km_tag    = host_tag_alloc();
+    msg->hm_handle        = handle;
+    msg->hm_length        = zlen;
+    msg->hm_flag          = flags | HM_FLAG_COMPRESS;
+    msg->hm_unused        = 0;
+    *rc = sm_fwrite_send(msg, sizeof (*msg) + zlen, post);
+    free(msg);
+    return (1);
+}
+
 /*
  * sm_fwrite
  * ---------
@@ -293,6 +887,12 @@ sm_fwrite(handle_t handle, void *buf, uint writelen, uint padded_header,
     if ((sm_file_active == 0) && (sm_fservice() == 0))
         return (KM_STATUS_UNAVAIL);
 
+    if ((writelen >= SM_LZ_MIN_LEN) && sm_fcompress()) {
+        uint8_t *data = padded_header ? (uint8_t *) buf + sizeof (*msg) : buf;
+        if (sm_fwrite_packed(handle, data, writelen, flags, 0, &rc))
+            goto fwrite_done;
+    }
+
     if (padded_header)
         msg = buf;
     else
@@ -339,11 +939,59 @@ sm_fwrite(handle_t handle, void *buf, uint writelen, uint padded_header,
     }
     host_tag_free(msg->hm_hdr.km_tag);
 
+fwrite_done:
     if (rc == KS_STATUS_NODATA)
         sm_fservice();  // Check if file service is still active
     return (rc);
 }
 
+/*
+ * sm_fwrite_post
+ * --------------
+ * Sends data to be written to the USB host's specified file handle,
+ * without waiting for the host to complete the write. Up to
+ * SM_FWRITE_WINDOW writes may be in flight, which lets the caller
+ * prepare the next block of data while the host is writing. The status
+ * of a write is reported by a later call to this function or by
+ * sm_fwrite_wait(), which must be called before the final status of
+ * the file is known. The buffer may be reused as soon as this function
+ * returns.
+ *
+ * handle is the remote file handle: see sm_fopen().
+ * buf is the data to be written, following uninitialized space reserved
+ *     for a hm_freadwrite_t message header, as with sm_fwrite() when
+ *     padded_header is set.
+ * writelen is the number of bytes to write, which does not include the
+ *     space reserved for the message header.
+ */
+uint
+sm_fwrite_post(handle_t handle, void *buf, uint writelen, uint flags)
+{
+    hm_freadwrite_t *msg = buf;
+    uint rc;
+
+    if ((sm_file_active == 0) && (sm_fservice() == 0))
+        return (KM_STATUS_UNAVAIL);
+
+    rc = sm_fwrite_reap(SM_FWRITE_WINDOW - 1);
+    if (rc != KM_STATUS_OK)
+        return (rc);
+
+    if ((writelen >= SM_LZ_MIN_LEN) && sm_fcompress() &&
+        sm_fwrite_packed(handle, msg + 1, writelen, flags, 1, &rc)) {
+        return (rc);
+    }
+
+    msg->hm_hdr.km_op     = KM_OP_FWRITE;
+    msg->hm_hdr.km_status = 0;
+    msg->hm_hdr.km_tag    = host_tag_alloc();
+    msg->hm_handle        = handle;
+    msg->hm_length        = writelen;
+    msg->hm_flag          = flags;
+    msg->hm_unused        = 0;
+    return (sm_fwrite_send(msg, sizeof (*msg) + writelen, 1));
+}
+
 /*
  * sm_fpath
  * --------
@@ -15,11 +15,18 @@
 uint sm_fservice(void);
 uint sm_fopen(handle_t parent_handle, const char *name, uint mode,
               uint *hm_type, uint create_perms, handle_t *handle);
+uint sm_fopen_read(handle_t parent_handle, const char *name, uint mode,
+                   uint *hm_type, uint create_perms, handle_t *handle,
+                   void *buf, uint readsize, uint *rlen, uint *read_rc);
+uint sm_fstat(handle_t parent_handle, const char *name, uint mode,
+              uint *hm_type, void *buf, uint readsize, uint *rlen);
 uint sm_fclose(handle_t handle);
 uint sm_fread(handle_t handle, uint readsize, void **data, uint *rlen,
               uint flags);
 uint sm_fwrite(handle_t handle, void *buf, uint writelen, uint padded_header,
                uint flags);
+uint sm_fwrite_post(handle_t handle, void *buf, uint writelen, uint flags);
+uint sm_fwrite_wait(void);
 uint sm_fpath(handle_t handle, char **name);
 uint sm_frename(handle_t shandle, const char *name_old,
                 handle_t dhandle, const char *name_new);
@@ -36,6 +43,7 @@ uint sm_fsetprotect(handle_t parent_handle, const char *name, uint perms);
 const char *km_status(uint km_status);
 
 extern uint8_t sm_file_active;
+extern uint8_t sm_file_wide;
 
 #define SEEK_OFFSET_BEGINNING (-1)
 #define SEEK_OFFSET_CURRENT   (0)
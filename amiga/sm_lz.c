@@ -0,0 +1,349 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ * See the LICENSE file for additional details.
+ *
+ * Designed by Chris Hooper in 2024.
+ *
+ * ---------------------------------------------------------------------
+ *
+ * Compression of file read and write message payloads.
+ *
+ * This is a small implementation of the LZ4 block format, shared by
+ * hostsmash and the Amiga-side file transfer code. The decompressor is
+ * written for 68020 and later CPUs, which handle unaligned longword
+ * access, so non-overlapping match data is copied four bytes at a time.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include "sm_lz.h"
+
+#define LZ_MIN_MATCH    4       // Shortest match which may be encoded
+#define LZ_LAST_LITS    5       // Final bytes of block are always literals
+#define LZ_MATCH_LIMIT  12      // No match may start this close to end
+#define LZ_MAX_OFFSET   0xffff  // Furthest back a match may reference
+#define LZ_HASH_SHIFT   (32 - 12)
+
+static uint32_t
+lz_read32(const uint8_t *ptr)
+{
+    uint32_t value;
+    memcpy(&value, ptr, sizeof (value));
+    return (value);
+}
+
+static uint32_t
+lz_hash(const uint8_t *ptr)
+{
+    return ((lz_read32(ptr) * 2654435761U) >> LZ_HASH_SHIFT);
+}
+
+/*
+ * lz_put_len
+ * ----------
+ * Write the extension bytes of a literal or match length which did not
+ * fit in the 4-bit token field.
+ */
+static uint8_t *
+lz_put_len(uint8_t *op, uint32_t len)
+{
+    while (len >= 255) {
+        *(op++) = 255;
+        len -= 255;
+    }
+    *(op++) = len;
+    return (op);
+}
+
+/*
+ * lz_put_seq
+ * ----------
+ * Write one LZ4 sequence: literals followed by a match. A match length
+ * of 0 writes only the literals, which is how a block ends. Returns NULL
+ * if the sequence would not fit before oend.
+ */
+static uint8_t *
+lz_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *lits, uint32_t litlen,
+           uint32_t offset, uint32_t mlen)
+{
+    ptrdiff_t need = 1 + litlen + litlen / 255 + 1;  // Token, literals, len
+    uint8_t  *token;
+
+    if (mlen != 0)
+        need += 2 + mlen / 255 + 1;  // Offset and match length
+    if ((op >= oend) || (oend - op < need))
+        return (NULL);
+    token = op++;
+
+    if (litlen >= 15) {
+        *token = 15 << 4;
+        op = lz_put_len(op, litlen - 15);
+    } else {
+        *token = litlen << 4;
+    }
+    memcpy(op, lits, litlen);
+    op += litlen;
+    if (mlen == 0)
+        return (op);
+
+    *(op++) = offset & 0xff;
+    *(op++) = offset >> 8;
+    mlen -= LZ_MIN_MATCH;
+    if (mlen >= 15) {
+        *token |= 15;
+        op = lz_put_len(op, mlen - 15);
+    } else {
+        *token |= mlen;
+    }
+    return (op);
+}
+
+/*
+ * lz_compress
+ * -----------
+ * Compress a block of at most 64K bytes to LZ4 block format, returning
+ * the compressed length, or 0 if it would not fit in dstmax bytes.
+ */
+static uint32_t
+lz_compress(const uint8_t *src, uint32_t srclen, uint8_t *dst,
+            uint32_t dstmax, uint16_t *hashtab)
+{
+    const uint8_t *ip     = src;
+    const uint8_t *anchor = src;
+    const uint8_t *iend   = src + srclen;
+    const uint8_t *mflimit;
+    const uint8_t *mlimit;
+    uint8_t       *op     = dst;
+    uint8_t       *oend   = dst + dstmax;
+
+    memset(hashtab, 0, SM_LZ_HASH_SIZE * sizeof (*hashtab));
+    if (srclen > LZ_MATCH_LIMIT) {
+        mflimit = iend - LZ_MATCH_LIMIT;
+        mlimit  = iend - LZ_LAST_LITS;
+        while (ip <= mflimit) {
+            uint32_t       hash = lz_hash(ip);
+            const uint8_t *ref  = src + hashtab[hash];
+            uint32_t       mlen;
+
+            hashtab[hash] = ip - src;
+            if ((ref >= ip) || (ip - ref > LZ_MAX_OFFSET) ||
+                (lz_read32(ref) != lz_read32(ip))) {
+                ip++;
+                continue;
+            }
+            while ((ip > anchor) && (ref > src) && (ip[-1] == ref[-1])) {
+                ip--;
+                ref--;
+            }
+            mlen = LZ_MIN_MATCH;
+            while ((ip + mlen < mlimit) && (ip[mlen] == ref[mlen]))
+                mlen++;
+
+            op = lz_put_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+            if (op == NULL)
+                return (0);
+            ip += mlen;
+            anchor = ip;
+            if (ip <= mflimit)
+                hashtab[lz_hash(ip - 2)] = ip - 2 - src;
+        }
+    }
+    op = lz_put_seq(op, oend, anchor, iend - anchor, 0, 0);
+    if (op == NULL)
+        return (0);
+    return (op - dst);
+}
+
+/*
+ * lz_decompress
+ * -------------
+ * Decompress an LZ4 block, returning the decompressed length, or -1 if
+ * the block is corrupt or would not fit in dstmax bytes.
+ */
+static int32_t
+lz_decompress(const uint8_t *src, uint32_t srclen, uint8_t *dst,
+              uint32_t dstmax)
+{
+    const uint8_t *ip   = src;
+    const uint8_t *iend = src + srclen;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = dst + dstmax;
+
+    while (ip < iend) {
+        uint32_t       token = *(ip++);
+        uint32_t       len   = token >> 4;
+        uint32_t       offset;
+        const uint8_t *match;
+
+        if (len == 15) {
+            uint32_t ch;
+            do {
+                if (ip >= iend)
+                    return (-1);
+                ch = *(ip++);
+                len += ch;
+            } while (ch == 255);
+        }
+        if ((len > (uint32_t) (iend - ip)) || (len > (uint32_t) (oend - op)))
+            return (-1);
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (ip >= iend)
+            break;  // Final sequence has only literals
+
+        if (iend - ip < 2)
+            return (-1);
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > (uint32_t) (op - dst)))
+            return (-1);
+
+        len = token & 15;
+        if (len == 15) {
+            uint32_t ch;
+            do {
+                if (ip >= iend)
+                    return (-1);
+                ch = *(ip++);
+                len += ch;
+            } while (ch == 255);
+        }
+        len += LZ_MIN_MATCH;
+        if (len > (uint32_t) (oend - op))
+            return (-1);
+
+        match = op - offset;
+        if (offset >= 4) {
+            while (len >= 4) {
+                memcpy(op, match, 4);
+                op += 4;
+                match += 4;
+                len -= 4;
+            }
+        }
+        while (len-- > 0)
+            *(op++) = *(match++);
+    }
+    return (op - dst);
+}
+
+/*
+ * sm_lz_pack
+ * ----------
+ * Pack a message payload in the chunked format described in sm_lz.h.
+ * Returns the packed length, or 0 if packing would not make the payload
+ * smaller.
+ *
+ * dst must have room for SM_LZ_PACK_MAX(srclen) bytes.
+ * hashtab is compressor workspace of SM_LZ_HASH_SIZE entries.
+ */
+uint32_t
+sm_lz_pack(const void *src, uint32_t srclen, void *dst, uint32_t dstmax,
+           uint16_t *hashtab)
+{
+    const uint8_t *ip = src;
+    uint8_t       *op = dst;
+    uint32_t       pos;
+
+    if (dstmax < SM_LZ_PACK_MAX(srclen))
+        return (0);
+
+    for (pos = 0; pos < srclen; ) {
+        uint32_t rawlen = srclen - pos;
+        uint32_t clen;
+
+        if (rawlen > SM_LZ_CHUNK)
+            rawlen = SM_LZ_CHUNK;
+        clen = lz_compress(ip + pos, rawlen, op + SM_LZ_HDR_LEN,
+                           rawlen - 1, hashtab);
+        if (clen == 0) {
+            /* Does not pay off for this chunk */
+            memcpy(op + SM_LZ_HDR_LEN, ip + pos, rawlen);
+            clen = rawlen | SM_LZ_STORED;
+        }
+        op[0] = clen >> 8;
+        op[1] = clen;
+        op[2] = rawlen >> 8;
+        op[3] = rawlen;
+        op += SM_LZ_HDR_LEN + (clen & ~SM_LZ_STORED);
+        pos += rawlen;
+    }
+    if (op - (uint8_t *) dst >= srclen)
+        return (0);
+    return (op - (uint8_t *) dst);
+}
+
+/*
+ * sm_lz_unpacked_len
+ * ------------------
+ * Return the original length of a packed payload, or -1 if the chunk
+ * headers are not valid.
+ */
+int32_t
+sm_lz_unpacked_len(const void *src, uint32_t srclen)
+{
+    const uint8_t *ip = src;
+    uint32_t       pos;
+    int32_t        total = 0;
+
+    for (pos = 0; pos < srclen; ) {
+        uint32_t clen;
+        uint32_t rawlen;
+
+        if (srclen - pos < SM_LZ_HDR_LEN)
+            return (-1);
+        clen = (ip[pos] << 8) | ip[pos + 1];
+        rawlen = (ip[pos + 2] << 8) | ip[pos + 3];
+        if (((clen & SM_LZ_STORED) && ((clen & ~SM_LZ_STORED) != rawlen)) ||
+            (rawlen > SM_LZ_CHUNK))
+            return (-1);
+        pos += SM_LZ_HDR_LEN + (clen & ~SM_LZ_STORED);
+        total += rawlen;
+    }
+    if (pos != srclen)
+        return (-1);
+    return (total);
+}
+
+/*
+ * sm_lz_unpack
+ * ------------
+ * Unpack a payload produced by sm_lz_pack(), returning the original
+ * length, or -1 if the payload is corrupt or larger than dstmax.
+ */
+int32_t
+sm_lz_unpack(const void *src, uint32_t srclen, void *dst, uint32_t dstmax)
+{
+    const uint8_t *ip = src;
+    uint8_t       *op = dst;
+    uint32_t       pos;
+    uint32_t       opos = 0;
+
+    for (pos = 0; pos < srclen; ) {
+        uint32_t clen;
+        uint32_t rawlen;
+
+        if (srclen - pos < SM_LZ_HDR_LEN)
+            return (-1);
+        clen = (ip[pos] << 8) | ip[pos + 1];
+        rawlen = (ip[pos + 2] << 8) | ip[pos + 3];
+        pos += SM_LZ_HDR_LEN;
+        if ((rawlen > dstmax - opos) ||
+            ((clen & ~SM_LZ_STORED) > srclen - pos))
+            return (-1);
+        if (clen & SM_LZ_STORED) {
+            clen &= ~SM_LZ_STORED;
+            if (clen != rawlen)
+                return (-1);
+            memcpy(op + opos, ip + pos, rawlen);
+        } else if (lz_decompress(ip + pos, clen, op + opos, rawlen) !=
+                   (int32_t) rawlen) {
+            return (-1);
+        }
+        pos += clen;
+        opos += rawlen;
+    }
+    return (opos);
+}
@@ -0,0 +1,41 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ * See the LICENSE file for additional details.
+ *
+ * Designed by Chris Hooper in 2024.
+ *
+ * ---------------------------------------------------------------------
+ *
+ * Compression of file read and write message payloads.
+ */
+
+#ifndef _SM_LZ_H
+#define _SM_LZ_H
+
+/*
+ * A compressed KM_OP_FREAD or KM_OP_FWRITE payload (HM_FLAG_COMPRESS)
+ * is a sequence of chunks, each holding up to SM_LZ_CHUNK bytes of the
+ * original data. Every chunk begins with a four byte header:
+ *     uint16_t (big endian) SM_LZ_STORED flag | length of chunk data
+ *     uint16_t (big endian) uncompressed length of chunk
+ * The chunk data immediately follows the header. It is either LZ4 block
+ * format, or when SM_LZ_STORED is set, the original data. The sender
+ * stores any chunk which would not become smaller by compression.
+ */
+#define SM_LZ_CHUNK      0x4000  // Maximum uncompressed bytes per chunk
+#define SM_LZ_STORED     0x8000  // Chunk data is not compressed
+#define SM_LZ_HDR_LEN    4       // Chunk header length
+#define SM_LZ_HASH_SIZE  4096    // Entries in compressor hash table
+#define SM_LZ_MIN_LEN    256     // Smaller payloads are not worth packing
+
+/* Buffer size which will always hold the packed form of len bytes */
+#define SM_LZ_PACK_MAX(len) \
+        ((len) + SM_LZ_HDR_LEN * (((len) + SM_LZ_CHUNK - 1) / SM_LZ_CHUNK))
+
+uint32_t sm_lz_pack(const void *src, uint32_t srclen, void *dst,
+                    uint32_t dstmax, uint16_t *hashtab);
+int32_t  sm_lz_unpack(const void *src, uint32_t srclen, void *dst,
+                      uint32_t dstmax);
+int32_t  sm_lz_unpacked_len(const void *src, uint32_t srclen);
+
+#endif /* _SM_LZ_H */
@@ -19,6 +19,7 @@
 #ifndef STANDALONE
 #include <exec/execbase.h>
 #endif
+#include <stdlib.h>
 #include <memory.h>
 #include "crc32.h"
 #include "sm_msg.h"
@@ -31,6 +32,7 @@
 #define ROM_BASE         0x00f80000  /* Base address of Kickstart ROM */
 
 uint smash_cmd_shift = 2;
+uint smash_cmd_wide;  // Wide symbols: 0=not probed, 1=enabled, 2=unavailable
 extern uint flag_debug;
 
 #ifndef ROMFS
@@ -169,6 +171,10 @@ send_cmd_core(uint16_t cmd, void *arg, uint16_t arglen,
     uint32_t  val32 = 0;
     uint      replyround;
     uint32_t  rombase_value = *VADDR32(ROM_BASE);
+    uint      words = (arglen + 1) / sizeof (uint16_t);
+    uint      wbits = 3 - smash_cmd_shift;  // Extra bits in a wide symbol
+    uint      group = 16 / wbits;           // Wide symbols in a group
+    uint      wide  = (smash_cmd_wide == 1) && (words > group);
 
     for (pos = 0; pos < ARRAY_SIZE(sm_magic); pos++)
         (void) *VADDR32(ROM_BASE + (sm_magic[pos] << smash_cmd_shift));
@@ -177,10 +183,29 @@ send_cmd_core(uint16_t cmd, void *arg, uint16_t arglen,
     crc = crc32(0, &arglen, sizeof (arglen));
     crc = crc32(crc, &cmd, sizeof (cmd));
     crc = crc32(crc, argbuf, arglen);
+    if (wide)
+        cmd |= KS_CMD_WIDE;  // Not included in CRC
     (void) *VADDR32(ROM_BASE + (cmd << smash_cmd_shift));
 
     /* Send message payload */
-    for (pos = 0; pos < (arglen + 1) / sizeof (uint16_t); pos++) {
+    pos = 0;
+    if (wide) {
+        /*
+         * Each group of wide symbols also carries the payload word which
+         * follows the group, in ROM address lines above A15.
+         */
+        for (; words - pos > group; pos++) {
+            uint     end   = pos + group;
+            uint32_t extra = argbuf[end];
+            for (; pos < end; pos++) {
+                uint32_t sym = argbuf[pos] |
+                               ((extra & ((1 << wbits) - 1)) << 16);
+                extra >>= wbits;
+                (void) *VADDR32(ROM_BASE + (sym << smash_cmd_shift));
+            }
+        }
+    }
+    for (; pos < words; pos++) {
         (void) *VADDR32(ROM_BASE + (argbuf[pos] << smash_cmd_shift));
     }
 
@@ -354,6 +379,10 @@ scc_cleanup:
  * replymax is the length of the reply buffer.
  * replyalen is the actual length of reply data received, filled in
  *     by this function.
+ *
+ * If Kicksmash was reset after wide symbols were negotiated, the command
+ * is sent again with 16-bit symbols and wide symbols must be negotiated
+ * again.
  */
 uint
 send_cmd(uint16_t cmd, void *arg, uint16_t arglen,
@@ -367,6 +396,10 @@ send_cmd(uint16_t cmd, void *arg, uint16_t arglen,
     MMU_DISABLE();
 
     rc = send_cmd_core(cmd, arg, arglen, reply, replymax, replyalen);
+    if ((rc == KS_STATUS_NOWIDE) && (smash_cmd_wide == 1)) {
+        smash_cmd_wide = 0;  // Not probed; sm_fservice() will ask again
+        rc = send_cmd_core(cmd, arg, arglen, reply, replymax, replyalen);
+    }
 
     CACHE_FLUSH();
     MMU_RESTORE();
@@ -376,6 +409,42 @@ send_cmd(uint16_t cmd, void *arg, uint16_t arglen,
     return (rc);
 }
 
+/*
+ * msg_wide_enable
+ * ---------------
+ * Negotiates wide symbol framing (KS_CMD_WIDE) of messages sent to
+ * Kicksmash. Wide symbols are used only if the firmware reports support
+ * for them in the ROM mode currently in use. Specify enable as 0 to go
+ * back to sending 16-bit symbols. Returns 0 on success.
+ */
+uint
+msg_wide_enable(uint enable)
+{
+    smash_id_t id;
+    uint16_t   arg = enable;
+    uint       rlen;
+    uint       shift;
+    uint       rc;
+
+    smash_cmd_wide = 2;  // Negotiate with 16-bit symbols
+    if (enable) {
+        rc = send_cmd(KS_CMD_ID, NULL, 0, &id, sizeof (id), &rlen);
+        if (rc != 0) {
+            smash_cmd_wide = 0;  // Ask again next time
+            return (rc);
+        }
+        shift = ((id.si_mode == 0) || (id.si_mode == 4)) ? 2 : 1;
+        if ((rlen < sizeof (id)) ||
+            ((id.si_features & KS_FEATURE_WIDE_SYM) == 0) ||
+            (shift != smash_cmd_shift))
+            return (KS_STATUS_UNKCMD);
+    }
+    rc = send_cmd(KS_CMD_SET | KS_SET_WIDE, &arg, sizeof (arg), NULL, 0, NULL);
+    if (enable && (rc == 0))
+        smash_cmd_wide = 1;
+    return (rc);
+}
+
 /*
  * msg_init
  * --------
@@ -411,8 +480,8 @@ recv_msg(void *buf, uint len, uint *rlen, uint timeout_ms)
         if (timeout_ms-- == 0)
             break;
     }
-    if (rc == KS_CMD_MSG_SEND)
-        rc = KM_STATUS_OK;
+    if ((rc & ~KS_MSG_PRIORITY) == KS_CMD_MSG_SEND)
+        rc = KM_STATUS_OK;  // Either message lane
     if (rc != KM_STATUS_OK) {
         printf("Get message failed: (%s)\n", smash_err(rc));
 #ifndef ROMFS
@@ -424,6 +493,30 @@ recv_msg(void *buf, uint len, uint *rlen, uint timeout_ms)
 }
 
 
+/*
+ * Several tagged requests may be outstanding with the USB Host at once.
+ * Each tag from host_tag_alloc() is entered in the pending table until
+ * it is released by host_tag_free(). A reply which arrives for a pending
+ * tag other than the one being waited for is stashed here until its
+ * owner asks for it. Replies for unknown tags are discarded.
+ */
+#define HOST_MSG_WINDOW  8        // Maximum tags tracked as pending
+#define HOST_STASH_MAX   0x8000   // Maximum bytes of stashed replies
+
+typedef struct host_stash host_stash_t;
+struct host_stash {
+    host_stash_t *hs_next;   // Next stashed reply (oldest first)
+    uint          hs_rc;     // Receive status of the reply
+    uint          hs_len;    // Length of reply message
+    uint8_t       hs_data[]; // Reply message
+};
+
+static uint16_t      host_pend_tag[HOST_MSG_WINDOW];
+static uint8_t       host_pend_used[HOST_MSG_WINDOW];
+static uint          host_pend_count = 0;
+static host_stash_t *host_stash_head = NULL;
+static uint          host_stash_bytes = 0;
+
 /*
  * host_tag_alloc
  * --------------
@@ -432,27 +525,189 @@ recv_msg(void *buf, uint len, uint *rlen, uint timeout_ms)
 uint
 host_tag_alloc(void)
 {
-    /* XXX: Fake "allocator" for now */
     static uint16_t tag = 0;
-    return (tag++);
+    uint slot;
+
+    tag++;
+    for (slot = 0; slot < HOST_MSG_WINDOW; slot++) {
+        if (host_pend_used[slot] == 0) {
+            host_pend_used[slot] = 1;
+            host_pend_tag[slot]  = tag;
+            host_pend_count++;
+            break;
+        }
+    }
+    return (tag);
 }
 
 /*
  * host_tag_free
  * -------------
- * Deallocate the specified host message tag.
+ * Deallocate the specified host message tag. Any replies for the tag
+ * which were stashed but never received are released.
  *
  * tag is the message tag to deallocate.
  */
 void
 host_tag_free(uint tag)
 {
-    /* XXX: Fake "allocator" for now */
-    (void) tag;
+    host_stash_t **prev = &host_stash_head;
+    host_stash_t  *cur;
+    uint           slot;
+
+    for (slot = 0; slot < HOST_MSG_WINDOW; slot++) {
+        if (host_pend_used[slot] && (host_pend_tag[slot] == (uint16_t) tag)) {
+            host_pend_used[slot] = 0;
+            host_pend_count--;
+            break;
+        }
+    }
+    while ((cur = *prev) != NULL) {
+        if (((km_msg_hdr_t *) cur->hs_data)->km_tag == (uint16_t) tag) {
+            *prev = cur->hs_next;
+            host_stash_bytes -= cur->hs_len;
+            free(cur);
+        } else {
+            prev = &cur->hs_next;
+        }
+    }
+}
+
+/*
+ * host_tag_pending
+ * ----------------
+ * Returns non-zero if the specified tag is allocated and awaiting replies.
+ */
+static uint
+host_tag_pending(uint16_t tag)
+{
+    uint slot;
+
+    for (slot = 0; slot < HOST_MSG_WINDOW; slot++)
+        if (host_pend_used[slot] && (host_pend_tag[slot] == tag))
+            return (1);
+    return (0);
+}
+
+/*
+ * host_stash_put
+ * --------------
+ * Save a received reply which belongs to a pending tag other than the
+ * one currently being waited for. Returns non-zero if it was saved.
+ */
+static uint
+host_stash_put(uint rc, void *buf, uint len)
+{
+    host_stash_t  *ent;
+    host_stash_t **tail;
+
+    if (host_stash_bytes + len > HOST_STASH_MAX)
+        return (0);
+    ent = malloc(sizeof (*ent) + len);
+    if (ent == NULL)
+        return (0);
+    ent->hs_next = NULL;
+    ent->hs_rc   = rc;
+    ent->hs_len  = len;
+    memcpy(ent->hs_data, buf, len);
+    for (tail = &host_stash_head; *tail != NULL; tail = &(*tail)->hs_next)
+        ;
+    *tail = ent;
+    host_stash_bytes += len;
+    return (1);
+}
+
+/*
+ * host_stash_get
+ * --------------
+ * Move the oldest stashed reply for the specified tag to buf, returning
+ * non-zero if one was found.
+ */
+static uint
+host_stash_get(uint16_t tag, void *buf, uint *len, uint *rc)
+{
+    host_stash_t **prev;
+    host_stash_t  *cur;
+
+    for (prev = &host_stash_head; (cur = *prev) != NULL;
+         prev = &cur->hs_next) {
+        if (((km_msg_hdr_t *) cur->hs_data)->km_tag == tag) {
+            *prev = cur->hs_next;
+            host_stash_bytes -= cur->hs_len;
+            memcpy(buf, cur->hs_data, cur->hs_len);
+            *len = cur->hs_len;
+            *rc  = cur->hs_rc;
+            free(cur);
+            return (1);
+        }
+    }
+    return (0);
+}
+
+/*
+ * host_recv_other
+ * ---------------
+ * Handle a received message which is not for the current caller. It is
+ * stashed if its tag is pending, and otherwise discarded.
+ */
+static void
+host_recv_other(uint rc, void *buf, uint len, uint want)
+{
+    km_msg_hdr_t *msg = (km_msg_hdr_t *) buf;
+
+    if (host_tag_pending(msg->km_tag) && host_stash_put(rc, buf, len))
+        return;
+    printf("Discarded message op=%02x status=%02x tag=%04x (want %04x)\n",
+           msg->km_op, msg->km_status, msg->km_tag, want);
 }
 
 #define SEND_MSG_MAX 2000
 
+/*
+ * host_send_space
+ * ---------------
+ * Wait until the Kicksmash Amiga-to-USB buffer has space for a message
+ * of the specified length. While other requests are outstanding, their
+ * replies are collected from the USB-to-Amiga buffer and stashed, so
+ * the USB Host is never held up waiting for space to reply. Firmware
+ * which does not report buffer space is not waited on.
+ *
+ * len is the message payload length.
+ */
+static uint
+host_send_space(uint len)
+{
+    static uint8_t   buf[4200];
+    smash_msg_info_t mi;
+    uint             rlen;
+    uint             rc;
+    uint             timeout = 0;
+
+    len = (len + 1) & ~1;  // Messages are sent as 16-bit words
+    while (1) {
+        rc = send_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi), &rlen);
+        if ((rc != KS_STATUS_OK) || (rlen < sizeof (mi)))
+            return (KS_STATUS_OK);  // Older firmware; just send
+        if (mi.smi_atou_avail >= len)
+            return (KS_STATUS_OK);
+        if (mi.smi_utoa_inuse > 0) {
+            rc = send_cmd(KS_CMD_MSG_RECEIVE, NULL, 0, buf, sizeof (buf),
+                          &rlen);
+            if ((rc & ~KS_MSG_PRIORITY) == KS_CMD_MSG_SEND) {
+                if (rlen > sizeof (buf))
+                    rlen = sizeof (buf);
+                host_recv_other(KM_STATUS_OK, buf, rlen, 0xffff);
+                continue;
+            }
+        }
+        if (timeout++ >= 1000)
+            break;
+        cia_spin(CIA_USEC(1000));
+    }
+    printf("Send space timeout (%u bytes)\n", len);
+    return (KS_STATUS_BADLEN);
+}
+
 /*
  * host_send_msg
  * -------------
@@ -463,6 +718,8 @@ host_tag_free(uint tag)
  * size of the entire message should send messages larger than
  * SEND_MSG_MAX. This can be accomplished by including the complete
  * message length in the message header (for example hm_freadwrite_t).
+ * A short message is sent in the Kicksmash priority lane when no other
+ * requests of this program are outstanding.
  *
  * smsg is the message to send.
  * len is the length of the message to send.
@@ -479,6 +736,22 @@ host_send_msg(void *smsg, uint len)
     if (sendlen > SEND_MSG_MAX)
         sendlen = SEND_MSG_MAX;
 
+    if ((host_pend_count > 1) || (host_stash_head != NULL)) {
+        /* Other requests are in flight; don't overrun Kicksmash buffers */
+        rc = host_send_space(sendlen);
+        if (rc != 0)
+            return (rc);
+    } else if (len <= KS_MSG_PRI_MAX) {
+        /*
+         * Nothing else of ours is queued, so a short request may be sent
+         * ahead of bulk data from other programs. If the priority lane
+         * is full, fall back to the bulk lane.
+         */
+        rc = send_cmd(KS_CMD_MSG_SEND | KS_MSG_PRIORITY, smsg, len,
+                      rbuf, sizeof (rbuf), NULL);
+        if (rc != KS_STATUS_BADLEN)
+            goto send_done;
+    }
     rc = send_cmd(KS_CMD_MSG_SEND, smsg, sendlen, rbuf, sizeof (rbuf), NULL);
     if ((rc == 0) && (sendlen < len)) {
         uint timeout = 0;
@@ -502,7 +775,10 @@ host_send_msg(void *smsg, uint len)
 
             if (rc == KS_STATUS_BADLEN) {
                 if (timeout++ < 10) {
-                    cia_spin(CIA_USEC(1000));
+                    if (host_pend_count > 1)
+                        (void) host_send_space(sendlen);
+                    else
+                        cia_spin(CIA_USEC(1000));
                     continue;
                 }
                 printf("send msg buffer timeout at pos=%x of %x: %s\n",
@@ -518,6 +794,7 @@ host_send_msg(void *smsg, uint len)
             pos += sendlen - sizeof (km_msg_hdr_t);
         }
     }
+send_done:
     if (rc != 0) {
         printf("Send message l=%u failed: (%s)\n",
                len, smash_err(rc));
@@ -549,26 +826,33 @@ host_recv_msg(uint tag, void **rdata, uint *rlen)
     uint rxlen;
     uint count;
 
+    if (host_stash_get(tag, buf, &rxlen, &rc)) {
+        /* Arrived earlier while another request was waiting */
+        *rlen = rxlen;
+        *rdata = buf;
+        if (rc == KM_STATUS_OK)
+            rc = msg->km_status;
+        return (rc);
+    }
+
     for (count = 0; count < 50; count++) {
         rc = recv_msg(buf, sizeof (buf), &rxlen, 500);  // 500 ms timeout
         if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
             return (rc);
+        if (rxlen > sizeof (buf)) {
+            printf("BUG: Rx message op=%x stat=%x too large (%u > %u)\n",
+                   msg->km_op, msg->km_status, rxlen, sizeof (buf));
+            rxlen = sizeof (buf);
+        }
         if (tag == msg->km_tag) {
             /* Got desired message */
-            if (rxlen > sizeof (buf)) {
-                printf("BUG: Rx message op=%x stat=%x too large (%u > %u)\n",
-                       msg->km_op, msg->km_status, rxlen, sizeof (buf));
-                rxlen = sizeof (buf);
-            }
             *rlen = rxlen;
             *rdata = buf;
             if (rc == KM_STATUS_OK)
                 rc = msg->km_status;
             return (rc);
         }
-        // XXX: Need to save this message as it's not for the current caller
-        printf("Discarded message op=%02x status=%02x tag=%04x (want %04x)\n",
-               msg->km_op, msg->km_status, msg->km_tag, tag);
+        host_recv_other(rc, buf, rxlen, tag);
     }
     printf("Message receive timeout\n");
     return (KM_STATUS_FAIL);
@@ -642,6 +926,31 @@ host_msg(void *smsg, uint slen, void **rdata, uint *rlen)
     return (host_recv_msg(smsg_h->km_tag, rdata, rlen));
 }
 
+/*
+ * host_msg_post
+ * -------------
+ * Send a message without waiting for its reply. The message tag must
+ * have been allocated with host_tag_alloc(), and the reply is later
+ * collected with host_recv_msg() using the same tag. Up to
+ * HOST_MSG_WINDOW tags may be outstanding, so several requests can be
+ * queued to the USB Host before the first reply is needed. The message
+ * buffer may be reused as soon as this function returns. If the tag is
+ * not pending because the window is full, KM_STATUS_UNAVAIL is returned
+ * and nothing is sent.
+ *
+ * smsg is the message to send.
+ * slen is the length of the message to send.
+ */
+uint
+host_msg_post(void *smsg, uint slen)
+{
+    km_msg_hdr_t *smsg_h = (km_msg_hdr_t *) smsg;
+
+    if (host_tag_pending(smsg_h->km_tag) == 0)
+        return (KM_STATUS_UNAVAIL);  // Window full; reply can't be matched
+    return (host_send_msg(smsg, slen));
+}
+
 
 static const char *const ks_status_s[] = {
     "OK",                               // KS_STATUS_OK
@@ -652,6 +961,7 @@ static const char *const ks_status_s[] = {
     "KS reports bad length",            // KS_STATUS_BADLEN
     "KS reports no data available",     // KS_STATUS_NODATA
     "KS reports resource locked",       // KS_STATUS_LOCKED
+    "KS reports wide symbols off",      // KS_STATUS_NOWIDE
 };
 STATIC_ASSERT(ARRAY_SIZE(ks_status_s) == (KS_STATUS_LAST_ENT >> 8));
 
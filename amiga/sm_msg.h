@@ -42,11 +42,13 @@ void send_cmd_core_end(void);
 
 uint send_cmd(uint16_t cmd, void *arg, uint16_t arglen,
               void *reply, uint replymax, uint *replyalen);
+uint msg_wide_enable(uint enable);
 
 uint host_msg(void *smsg, uint slen, void **rdata, uint *rlen);
 uint host_send_msg(void *smsg, uint slen);
 uint host_recv_msg(uint tag, void **rdata, uint *rlen);
 uint host_recv_msg_cont(uint tag, void *buf, uint buf_len);
+uint host_msg_post(void *smsg, uint slen);
 
 uint host_tag_alloc(void);
 void host_tag_free(uint tag);
@@ -56,5 +58,6 @@ void dump_memory(void *buf, uint len, uint dump_base);
 const char *smash_err(uint status);
 
 extern uint smash_cmd_shift;
+extern uint smash_cmd_wide;
 
 #endif /* _MSG_H */
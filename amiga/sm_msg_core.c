@@ -38,6 +38,7 @@
 #define ROM_BASE         0x00f80000  /* Base address of Kickstart ROM */
 
 extern uint smash_cmd_shift;
+extern uint smash_cmd_wide;
 extern uint flag_debug;
 
 #ifdef ROMFS
@@ -283,6 +284,10 @@ send_cmd_core(uint16_t cmd, void *arg, uint16_t arglen,
     uint32_t  val32 = 0;
     uint      replyround;
     uint32_t  rombase_value = *VADDR32(ROM_BASE);
+    uint      words = (arglen + 1) / sizeof (uint16_t);
+    uint      wbits = 3 - smash_cmd_shift;  // Extra bits in a wide symbol
+    uint      group = 16 / wbits;           // Wide symbols in a group
+    uint      wide  = (smash_cmd_wide == 1) && (words > group);
     uint16_t  sm_magic[] = { 0x0204, 0x1017, 0x0119, 0x0117 };  // on stack
     //        Decimal        516     4119    281     279
 
@@ -300,10 +305,29 @@ send_cmd_core(uint16_t cmd, void *arg, uint16_t arglen,
     crc = crc32(0, &arglen, sizeof (arglen));
     crc = crc32(crc, &cmd, sizeof (cmd));
     crc = crc32(crc, argbuf, arglen);
+    if (wide)
+        cmd |= KS_CMD_WIDE;  // Not included in CRC
     (void) *VADDR32(ROM_BASE + (cmd << smash_cmd_shift));
 
     /* Send message payload */
-    for (pos = 0; pos < (arglen + 1) / sizeof (uint16_t); pos++) {
+    pos = 0;
+    if (wide) {
+        /*
+         * Each group of wide symbols also carries the payload word which
+         * follows the group, in ROM address lines above A15.
+         */
+        for (; words - pos > group; pos++) {
+            uint     end   = pos + group;
+            uint32_t extra = argbuf[end];
+            for (; pos < end; pos++) {
+                uint32_t sym = argbuf[pos] |
+                               ((extra & ((1 << wbits) - 1)) << 16);
+                extra >>= wbits;
+                (void) *VADDR32(ROM_BASE + (sym << smash_cmd_shift));
+            }
+        }
+    }
+    for (; pos < words; pos++) {
         (void) *VADDR32(ROM_BASE + (argbuf[pos] << smash_cmd_shift));
     }
 
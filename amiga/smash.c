@@ -82,6 +82,7 @@ static struct    timerequest TimeRequest;
 #define MEM_LOOPS         1000000
 #define ROM_WINDOW_SIZE   (512 << 10)  // 512 KB
 #define MAX_CHUNK         (16 << 10)   // 16 KB
+#define MWRITE_WORD_USEC  20           // Time allowed to program a word
 
 static const char cmd_options[] =
     "usage: smash <options>\n"
@@ -760,59 +761,81 @@ fail_loopback:
     return (rc);
 }
 
-static int
-smash_test_loopback_perf(void)
+/*
+ * loopback_perf
+ * -------------
+ * Measure KS_CMD_LOOPBACK throughput in KB/sec. Returns 0 on success.
+ */
+static uint
+loopback_perf(void *buf, uint lb_size, uint xfers, uint *perf)
 {
-    const uint lb_size  = 1000;
-    const uint xfers    = 100;
-    const uint lb_alloc = lb_size + KS_HDR_AND_CRC_LEN;  // Magic+len+cmd+CRC
-    uint32_t  *buf;
     uint       cur;
     uint       rc;
     uint       diff;
     uint       total;
-    uint       perf;
     uint64_t   time_start;
     uint64_t   time_end;
 
-    show_test_state("Loopback perf", -1);
-
-    buf = AllocMem(lb_alloc, MEMF_PUBLIC);
-    if (buf == NULL) {
-        printf("Memory allocation failure\n");
-        return (1);
-    }
-    memset(buf, 0xa5, lb_size);
-
     time_start = smash_time();
 
     for (cur = 0; cur < xfers; cur++) {
         rc = send_cmd(KS_CMD_LOOPBACK, buf, lb_size, buf, lb_size, NULL);
-        if (rc == KS_CMD_LOOPBACK) {
-            rc = 0;
-        } else {
+        if (rc != KS_CMD_LOOPBACK) {
             printf("FAIL: (%s)\n", smash_err(rc));
             if (flag_debug) {
                 dump_memory(buf, lb_size, DUMP_VALUE_UNASSIGNED);
             }
-            goto cleanup;
+            return (rc);
         }
     }
 
-    if (flag_quiet == 0) {
-        time_end = smash_time();
-        diff = (uint) (time_end - time_start);
-        if (diff == 0)
-            diff = 1;
-        total = xfers * (lb_size + KS_HDR_AND_CRC_LEN);
-        perf = total * 1000 / diff;
-        perf *= 2;  // Write data + Read (reply) data
+    time_end = smash_time();
+    diff = (uint) (time_end - time_start);
+    if (diff == 0)
+        diff = 1;
+    total = xfers * (lb_size + KS_HDR_AND_CRC_LEN);
+    *perf = total * 1000 / diff;
+    *perf *= 2;  // Write data + Read (reply) data
+    return (0);
+}
+
+static int
+smash_test_loopback_perf(void)
+{
+    const uint lb_size  = 1000;
+    const uint xfers    = 100;
+    const uint lb_alloc = lb_size + KS_HDR_AND_CRC_LEN;  // Magic+len+cmd+CRC
+    uint32_t  *buf;
+    uint       rc;
+    uint       perf;
+    uint       perf_wide;
+    uint       was_wide = (smash_cmd_wide == 1);
+
+    show_test_state("Loopback perf", -1);
+
+    buf = AllocMem(lb_alloc, MEMF_PUBLIC);
+    if (buf == NULL) {
+        printf("Memory allocation failure\n");
+        return (1);
+    }
+    memset(buf, 0xa5, lb_size);
+
+    /* Compare 16-bit symbols with wide symbols, if available */
+    if (was_wide)
+        (void) msg_wide_enable(0);
+    rc = loopback_perf(buf, lb_size, xfers, &perf);
+    if ((rc == 0) && (msg_wide_enable(1) == 0)) {
+        rc = loopback_perf(buf, lb_size, xfers, &perf_wide);
+        if (!was_wide)
+            (void) msg_wide_enable(0);
+        if ((rc == 0) && (flag_quiet == 0))
+            printf("PASS  %u KB/sec  (wide symbols %u KB/sec)\n",
+                   perf, perf_wide);
+    } else if ((rc == 0) && (flag_quiet == 0)) {
         printf("PASS  %u KB/sec\n", perf);
     }
 
-cleanup:
-    if (buf != NULL)
-        FreeMem(buf, lb_alloc);
+    FreeMem(buf, lb_alloc);
     return (rc);
 }
 
@@ -2231,13 +2254,127 @@ wait_for_flash_done(uint addr, uint erase_mode)
     return (MSG_STATUS_PRG_TMOUT);
 }
 
+/*
+ * flash_write_word
+ * ----------------
+ * Must be called with interrupts and cache disabled
+ *
+ * Programs a single flash word, waiting for programming to complete.
+ */
+static uint
+flash_write_word(uint addr, void *buf, uint len)
+{
+    uint rc;
+
+    rc = flash_cmd_core(KS_CMD_FLASH_WRITE, buf, len);
+    if (rc != 0)
+        return (rc);
+
+    *ADDR32(ROM_BASE + addr);  // Generate address for write
+    return (wait_for_flash_done(ROM_BASE, 0));
+}
+
+/*
+ * flash_mwrite_core
+ * -----------------
+ * Must be called with interrupts and cache disabled
+ *
+ * Programs up to KS_MWRITE_MAX consecutive flash words with a single
+ * Kicksmash command. Kicksmash drives the unlock and program data for
+ * every word, while this code generates the unlock addresses followed
+ * by the word address, pausing after each word for it to be programmed.
+ * Flash status can not be read until the sequence completes, so the
+ * caller must wait for the last word and verify the result.
+ */
+static uint
+flash_mwrite_core(uint addr, void *buf, uint len)
+{
+    uint32_t addrs[8];
+    uint     num_addr;
+    uint     wordsize = 1 << smash_cmd_shift;
+    uint     pos;
+    uint     word;
+    uint     rc;
+
+    rc = send_cmd_core(KS_CMD_FLASH_MWRITE, buf, len,
+                       addrs, sizeof (addrs), &num_addr);
+    if (rc != 0) {
+        if (rc != KS_STATUS_UNKCMD) {
+            /* Attempt to drain data and wait for Kicksmash to enable flash */
+            for (pos = 0; pos < 1000; pos++)
+                (void) *ADDR32(ROM_BASE);
+            cia_spin(CIA_USEC_LONG(25000));
+        }
+        return (rc);
+    }
+
+    num_addr /= 4;
+    for (pos = 0; pos < num_addr; pos++)
+        addrs[pos] = ROM_BASE + ((addrs[pos] << smash_cmd_shift) & 0x7ffff);
+
+    cia_spin(CIA_USEC(10));
+    (void) *ADDR32(addrs[0]);  // Generate OE strobe to kick off DMA
+    cia_spin(1);
+
+    for (word = 0; word < len; word += wordsize) {
+        for (pos = 0; pos < num_addr; pos++)
+            (void) *ADDR32(addrs[pos]);  // Generate unlock address
+        (void) *ADDR32(ROM_BASE + addr + word);  // Generate address for write
+        cia_spin(CIA_USEC(MWRITE_WORD_USEC));
+    }
+    return (0);
+}
+
+/*
+ * flash_mwrite
+ * ------------
+ * Must be called with interrupts and cache disabled
+ *
+ * Programs consecutive flash words using KS_CMD_FLASH_MWRITE. Any word
+ * which did not program in the time allowed is written again using
+ * KS_CMD_FLASH_WRITE, which waits for flash status.
+ */
+static uint
+flash_mwrite(uint addr, void *buf, uint len)
+{
+    uint8_t *xbuf = buf;
+    uint     wordsize = 1 << smash_cmd_shift;
+    uint     pos;
+    uint     rc;
+
+    rc = flash_mwrite_core(addr, buf, len);
+    if (rc != 0)
+        return (rc);
+    rc = wait_for_flash_done(ROM_BASE, 0);
+    if (rc != 0)
+        return (rc);
+
+    for (pos = 0; pos < len; pos += wordsize) {
+        uint32_t value;
+
+        if (wordsize == 4)
+            value = *ADDR32(ROM_BASE + addr + pos);
+        else
+            value = *ADDR16(ROM_BASE + addr + pos);
+        if (memcmp((uint8_t *) &value + 4 - wordsize, xbuf + pos,
+                   wordsize) != 0) {
+            rc = flash_write_word(addr + pos, xbuf + pos, wordsize);
+            if (rc != 0)
+                return (rc);
+        }
+    }
+    return (0);
+}
+
 static uint
 write_to_flash(uint bank, uint addr, void *buf, uint len)
 {
+    static uint8_t mwrite_unsupported;
     uint rc;
     uint xlen;
     uint8_t *xbuf = buf;
     uint16_t bankarg = bank;
+    uint wordsize = 1 << smash_cmd_shift;
 
     SUPERVISOR_STATE_ENTER();
     INTERRUPTS_DISABLE();
@@ -2253,15 +2390,23 @@ write_to_flash(uint bank, uint addr, void *buf, uint len)
         /* Write flash data */
         while (len > 0) {
             xlen = len;
-            if (xlen > 4)
-                xlen = 4;
-
-            rc = flash_cmd_core(KS_CMD_FLASH_WRITE, xbuf, xlen);
-            if (rc != 0)
-                break;
-
-            *ADDR32(ROM_BASE + addr);  // Generate address for write
-            rc = wait_for_flash_done(ROM_BASE, 0);
+            if (xlen > KS_MWRITE_MAX * wordsize)
+                xlen = KS_MWRITE_MAX * wordsize;
+            xlen &= ~(wordsize - 1);
+
+            if ((xlen != 0) && !mwrite_unsupported) {
+                rc = flash_mwrite(addr, xbuf, xlen);
+                if (rc == KS_STATUS_UNKCMD) {
+                    /* Older Kicksmash firmware: write one word at a time */
+                    mwrite_unsupported = 1;
+                    continue;
+                }
+            } else {
+                xlen = len;
+                if (xlen > 4)
+                    xlen = 4;
+                rc = flash_write_word(addr, xbuf, xlen);
+            }
             if (rc != 0)
                 break;
 
@@ -2387,9 +2387,10 @@ put_file(const char *src, const char *dst)
             rc = RC_FAILURE;
             break;
         }
-        rc = sm_fwrite(handle, bufptr, bytes, 1, 0);
+        /* Read the next block while the host writes this one */
+        rc = sm_fwrite_post(handle, bufptr, bytes, 0);
         if (rc != KM_STATUS_OK) {
-            printf("Remote write %s failed at pos %x: %s\n",
+            printf("Remote write %s failed near pos %x: %s\n",
                    dst, (uint) pos, smash_err(rc));
             rc = RC_FAILURE;
             break;
@@ -2397,6 +2398,13 @@ put_file(const char *src, const char *dst)
 
         pos += bytes;
     }
+    if (rc == RC_SUCCESS) {
+        rc = sm_fwrite_wait();
+        if (rc != KM_STATUS_OK) {
+            printf("Remote write %s failed: %s\n", dst, smash_err(rc));
+            rc = RC_FAILURE;
+        }
+    }
 
     time_end = smash_time();
     diff = (uint) (time_end - time_start);
@@ -454,7 +454,6 @@ void dma1_channel1_isr(void) __attribute__((alias("unknown_handler")));
 void dma1_channel2_isr(void) __attribute__((alias("unknown_handler")));
 void dma1_channel3_isr(void) __attribute__((alias("unknown_handler")));
 void dma1_channel4_isr(void) __attribute__((alias("unknown_handler")));
-void dma1_channel5_isr(void) __attribute__((alias("unknown_handler")));
 void dma1_channel6_isr(void) __attribute__((alias("unknown_handler")));
 void dma1_channel7_isr(void) __attribute__((alias("unknown_handler")));
 void adc1_2_isr(void) __attribute__((alias("unknown_handler")));
@@ -498,8 +497,6 @@ void tim7_isr(void) __attribute__((alias("unknown_handler")));
 void dma2_channel1_isr(void) __attribute__((alias("unknown_handler")));
 void dma2_channel2_isr(void) __attribute__((alias("unknown_handler")));
 void dma2_channel3_isr(void) __attribute__((alias("unknown_handler")));
-void dma2_channel4_5_isr(void) __attribute__((alias("unknown_handler")));
-void dma2_channel5_isr(void) __attribute__((alias("unknown_handler")));
 void eth_isr(void) __attribute__((alias("unknown_handler")));
 void eth_wkup_isr(void) __attribute__((alias("unknown_handler")));
 void can2_tx_isr(void) __attribute__((alias("unknown_handler")));
@@ -888,6 +888,40 @@ get_chip_block_info(uint32_t chipid)
     return (&chip_blocks[pos]);
 }
 
+/*
+ * ee_sector_info
+ * --------------
+ * Reports the start address and size (both in device words) of the
+ * erase sector which contains the specified device word address. The
+ * chipid is the value reported by ee_id(). Sectors within the boot block
+ * are bounded by the bits set in the chip's cb_map.
+ */
+void
+ee_sector_info(uint32_t chipid, uint32_t addr, uint32_t *start,
+               uint32_t *size)
+{
+    const chip_blocks_t *cb = get_chip_block_info(chipid);
+    uint32_t bsize = cb->cb_bsize << 10;
+    uint     bnum  = addr / bsize;
+    uint32_t base  = bnum * bsize;
+
+    if (bnum == cb->cb_bbnum) {
+        uint32_t ssize  = cb->cb_ssize << 10;
+        uint     nsect  = cb->cb_bsize / cb->cb_ssize;
+        uint     sfirst = (addr - base) / ssize;
+        uint     slast  = sfirst + 1;
+
+        while ((sfirst > 0) && ((cb->cb_map & BIT(sfirst)) == 0))
+            sfirst--;
+        while ((slast < nsect) && ((cb->cb_map & BIT(slast)) == 0))
+            slast++;
+        base += sfirst * ssize;
+        bsize = (slast - sfirst) * ssize;
+    }
+    *start = base;
+    *size  = bsize;
+}
+
 /*
  * ee_erase
  * --------
@@ -20,6 +20,8 @@ void     ee_id(uint32_t *part1, uint32_t *part2);
 void     ee_init(void);
 void     ee_read_mode(void);
 int      ee_erase(uint mode, uint32_t addr, uint32_t len, int verbose);
+void     ee_sector_info(uint32_t chipid, uint32_t addr, uint32_t *start,
+                        uint32_t *size);
 void     ee_status_clear(void);
 void     ee_cmd(uint32_t addr, uint32_t cmd);
 void     ee_poll(void);
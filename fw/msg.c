@@ -21,6 +21,8 @@
 #include "main.h"
 #include "msg.h"
 #include "m29f160xt.h"
+#include "cmdline.h"
+#include "prom_access.h"
 #include "timer.h"
 #include "utils.h"
 #include "gpio.h"
@@ -48,14 +50,36 @@
 #define LOG_DMA_CONTROLLER DMA1
 #define LOG_DMA_CHANNEL    DMA_CHANNEL5
 #define LOG_DMA_NVIC_IRQ   NVIC_TIM2_IRQ
+#define LOG_DMA_DONE_IRQ   NVIC_DMA1_CHANNEL5_IRQ
 #define LOG_DMA_TIMER      TIM2
+#define HI_DMA_CONTROLLER  DMA2
+#define HI_DMA_CHANNEL     DMA_CHANNEL5
+#define HI_DMA_TIMER       TIM5
 #else
 #define LOG_DMA_CONTROLLER DMA2
 #define LOG_DMA_CHANNEL    DMA_CHANNEL5
 #define LOG_DMA_NVIC_IRQ   NVIC_TIM5_IRQ
+#ifdef STM32F103xE
+#define LOG_DMA_DONE_IRQ   NVIC_DMA2_CHANNEL4_5_IRQ
+#else
+#define LOG_DMA_DONE_IRQ   NVIC_DMA2_CHANNEL5_IRQ
+#endif
 #define LOG_DMA_TIMER      TIM5
+#define HI_DMA_CONTROLLER  DMA1
+#define HI_DMA_CHANNEL     DMA_CHANNEL5
+#define HI_DMA_TIMER       TIM2
 #endif
 
+/*
+ * Entries in the Amiga address capture ring. This may be overridden at
+ * build time, and must be a power of 2 no larger than 32768.
+ */
+#ifndef CAPTURE_BUF_COUNT
+#define CAPTURE_BUF_COUNT  2048
+#endif
+#define CAPTURE_BATCH_WRAPS 2   // Ring wraps per poll before batch parsing
+#define CAPTURE_POLL_MSEC   10  // Interval to check capture load
+
 #define CAPTURE_SW       0
 #define CAPTURE_ADDR     1
 #define CAPTURE_DATA_LO  2
@@ -116,8 +140,11 @@ static uint16_t reboot_magic_end;
 static uint64_t ks_timeout_timer = 0;  // timer too frequent complaint message
 static uint     ks_timeout_count = 0;  // count of complaint messages
 
-static uint     consumer_spin;
+static uint     capture_batches;          // Count of entries to batch mode
+static volatile uint8_t capture_batch;    // Parse captures per half ring
+static uint64_t capture_poll_time;        // Next capture load check
 static uint8_t  capture_mode = CAPTURE_ADDR;
+static uint8_t  capture_wide;   // Capture A16-A19 for KS_CMD_WIDE messages
 static uint8_t  msg_lock;       // Bits !USB 0=atou 1=utoa, !Amiga 2=atou 3=utoa
 static uint     consumer_wrap;
 static uint     consumer_wrap_last_poll;
@@ -127,12 +154,11 @@ static uint64_t expire_update_amiga_app;  // Expiration time for last Amiga app
 static uint64_t expire_update_usb_app;    // Expiration time for last USB app
 static uint16_t state_amiga_app;          // Amiga app state
 static uint16_t state_usb_app;            // USB app state
+static uint8_t  atou_notify;              // USB host wants KS_CMD_MSG_NOTIFY
+static uint64_t expire_atou_notify;       // Expiration time for atou_notify
+static volatile uint8_t atou_notify_pending;  // Amiga -> USB became non-empty
 
 /* Message interface through Kicksmash between Amiga and USB host */
-static uint     prod_atou;      // Producer for Amiga -> USB buffer
-static uint     cons_atou;      // Consumer for Amiga -> USB buffer
-static uint     prod_utoa;      // Producer for USB buffer -> Amiga
-static uint     cons_utoa;      // Consumer for USB buffer -> Amiga
 static uint     messages_atou;  // Count of Amiga-to-USB messages
 static uint     messages_utoa;  // Count of USB-to-Amiga messages
 static uint     messages_amiga; // Messages sent by Amiga
@@ -145,14 +171,40 @@ static uint     fail_cmd_u;     // Invalid command failures from USB Host
 /* Buffers for DMA from/to GPIOs and Timer event generation registers */
 #define ADDR_BUF_COUNT 1024
 #define ALIGN  __attribute__((aligned(16)))
-ALIGN volatile uint16_t buffer_rxa_lo[ADDR_BUF_COUNT];
-ALIGN volatile uint16_t buffer_rxd[ADDR_BUF_COUNT];
+ALIGN volatile uint16_t buffer_rxa_lo[CAPTURE_BUF_COUNT];
+ALIGN volatile uint16_t buffer_rxd[CAPTURE_BUF_COUNT];
 ALIGN volatile uint16_t          buffer_txd_lo[ADDR_BUF_COUNT * 2];
 ALIGN volatile uint16_t          buffer_txd_hi[ADDR_BUF_COUNT];
 
 /* The message buffers must be a power-of-2 in size */
-ALIGN uint8_t  msg_atou[0x1000];  // Amiga -> USB buffer
-ALIGN uint8_t  msg_utoa[0x1000];  // USB -> Amiga buffer
+ALIGN uint8_t  msg_atou[0x1000];     // Amiga -> USB buffer
+ALIGN uint8_t  msg_utoa[0x1000];     // USB -> Amiga buffer
+ALIGN uint8_t  msg_atou_pri[0x200];  // Amiga -> USB priority buffer
+ALIGN uint8_t  msg_utoa_pri[0x200];  // USB -> Amiga priority buffer
+
+/*
+ * Each direction has a bulk lane and a small priority lane. Messages
+ * sent with KS_MSG_PRIORITY are queued to the priority lane, which is
+ * always drained first, so short control messages don't wait behind
+ * a large file transfer.
+ */
+typedef struct {
+    uint8_t *ml_buf;   // Message storage
+    uint     ml_size;  // Size of message storage (power of 2)
+    uint     ml_prod;  // Producer
+    uint     ml_cons;  // Consumer
+} msg_lane_t;
+
+#define LANE_BULK 0
+#define LANE_PRI  1
+static msg_lane_t lane_atou[2] = {
+    { msg_atou,     sizeof (msg_atou),     0, 0 },
+    { msg_atou_pri, sizeof (msg_atou_pri), 0, 0 },
+};
+static msg_lane_t lane_utoa[2] = {
+    { msg_utoa,     sizeof (msg_utoa),     0, 0 },
+    { msg_utoa_pri, sizeof (msg_utoa_pri), 0, 0 },
+};
 
 #ifdef CAPTURE_GPIOS
 ALIGN uint16_t buffer_a[ADDR_BUF_COUNT];
@@ -286,109 +338,170 @@ gpio_showbuf(uint count)
  * against the total_size - 1. That will yield a positive which is the
  * number of elements in use.
  */
-#define SPACE_INUSE_ATOU ((prod_atou - cons_atou) & (sizeof (msg_atou) - 1))
-#define SPACE_INUSE_UTOA ((prod_utoa - cons_utoa) & (sizeof (msg_utoa) - 1))
-#define SPACE_AVAIL_ATOU (sizeof (msg_atou) - 2 - SPACE_INUSE_ATOU)
-#define SPACE_AVAIL_UTOA (sizeof (msg_utoa) - 2 - SPACE_INUSE_UTOA)
+#define LANE_INUSE(l) (((l)->ml_prod - (l)->ml_cons) & ((l)->ml_size - 1))
+#define LANE_AVAIL(l) ((l)->ml_size - 2 - LANE_INUSE(l))
+#define LANE_EMPTY(l) ((l)->ml_prod == (l)->ml_cons)
+#define LANE_FLUSH(l) ((l)->ml_cons = (l)->ml_prod)
+
+/* Space in use counts both lanes; space available is for the bulk lane */
+#define SPACE_INUSE_ATOU (LANE_INUSE(&lane_atou[LANE_BULK]) + \
+                          LANE_INUSE(&lane_atou[LANE_PRI]))
+#define SPACE_INUSE_UTOA (LANE_INUSE(&lane_utoa[LANE_BULK]) + \
+                          LANE_INUSE(&lane_utoa[LANE_PRI]))
+#define SPACE_AVAIL_ATOU LANE_AVAIL(&lane_atou[LANE_BULK])
+#define SPACE_AVAIL_UTOA LANE_AVAIL(&lane_utoa[LANE_BULK])
+#define ATOU_EMPTY (LANE_EMPTY(&lane_atou[LANE_BULK]) && \
+                    LANE_EMPTY(&lane_atou[LANE_PRI]))
 
+/*
+ * lane_add
+ * --------
+ * Append a message, which may be in two pieces, to a message lane.
+ * Nothing is added and 1 is returned if there is not enough space.
+ */
 static uint
-atou_add(uint len, void *ptr)
+lane_add(msg_lane_t *lane, uint len1, const void *ptr1,
+         uint len2, const void *ptr2)
 {
-    uint xlen;
-    uint8_t *sptr = ptr;
-    len = (len + 1) & ~1;  // Round up to 16-bit alignment
-    if (len > SPACE_AVAIL_ATOU)
+    const uint8_t *sptr;
+    uint           len;
+    uint           xlen;
+    uint           part;
+
+    if (((len1 + len2 + 1) & ~1) > LANE_AVAIL(lane))
         return (1);
-    xlen = sizeof (msg_atou) - prod_atou;
-    if (len <= xlen) {
-        memcpy(msg_atou + prod_atou, sptr, len);
-    } else {
-        memcpy(msg_atou + prod_atou, sptr, xlen);
-        memcpy(msg_atou, sptr + xlen, len - xlen);
+    for (part = 0; part < 2; part++) {
+        sptr = (part == 0) ? ptr1 : ptr2;
+        len  = (part == 0) ? len1 : len2;
+        if (len == 0)
+            continue;
+        len  = (len + 1) & ~1;  // Round up to 16-bit alignment
+        xlen = lane->ml_size - lane->ml_prod;
+        if (len <= xlen) {
+            memcpy(lane->ml_buf + lane->ml_prod, sptr, len);
+        } else {
+            memcpy(lane->ml_buf + lane->ml_prod, sptr, xlen);
+            memcpy(lane->ml_buf, sptr + xlen, len - xlen);
+        }
+        lane->ml_prod = (lane->ml_prod + len) & (lane->ml_size - 1);
     }
-    prod_atou = (prod_atou + len) & (sizeof (msg_atou) - 1);
+    return (0);
+}
+
+static uint
+atou_add(uint pri, uint len1, void *ptr1, uint len2, void *ptr2)
+{
+    uint was_empty = ATOU_EMPTY;
+    if (lane_add(&lane_atou[pri ? LANE_PRI : LANE_BULK],
+                 len1, ptr1, len2, ptr2))
+        return (1);
     messages_atou++;
+    if (was_empty && atou_notify)
+        atou_notify_pending = 1;  // Sent by msg_usb_service()
     return (0);
 }
 
 static uint
-utoa_add(uint len, void *ptr)
+utoa_add(uint pri, uint len1, void *ptr1, uint len2, void *ptr2)
 {
-    uint xlen;
-    uint8_t *sptr = ptr;
-    len = (len + 1) & ~1;  // Round up to 16-bit alignment
-    if (len > SPACE_AVAIL_UTOA)
+    if (lane_add(&lane_utoa[pri ? LANE_PRI : LANE_BULK],
+                 len1, ptr1, len2, ptr2))
         return (1);
-    xlen = sizeof (msg_utoa) - prod_utoa;
-    if (len <= xlen) {
-        memcpy(msg_utoa + prod_utoa, sptr, len);
-    } else {
-        memcpy(msg_utoa + prod_utoa, sptr, xlen);
-        memcpy(msg_utoa, sptr + xlen, len - xlen);
-    }
-    prod_utoa = (prod_utoa + len) & (sizeof (msg_utoa) - 1);
     messages_utoa++;
     return (0);
 }
 
+/*
+ * lane_next_msg_len
+ * -----------------
+ * Return the length of the message at the head of a lane, or 0 if the
+ * lane is empty. A lane which does not begin with a valid message is
+ * flushed.
+ */
 static uint16_t
-atou_next_msg_len(void)
+lane_next_msg_len(msg_lane_t *lane)
 {
     uint     len;
     uint     pos;
-    uint     inuse = SPACE_INUSE_ATOU;
     uint     count;
     uint16_t magic;
 
-    if (inuse < KS_HDR_AND_CRC_LEN) {
+    if (LANE_INUSE(lane) < KS_HDR_AND_CRC_LEN) {
         /* Invalid */
-        cons_atou = prod_atou;
+        LANE_FLUSH(lane);
         return (0);
     }
 
     /* Check magic */
-    for (pos = cons_atou, count = 0; count < ARRAY_SIZE(sm_magic); count++) {
-        magic = *(uint16_t *) (msg_atou + pos);
+    for (pos = lane->ml_cons, count = 0; count < ARRAY_SIZE(sm_magic);
+         count++) {
+        magic = *(uint16_t *) (lane->ml_buf + pos);
         if (magic != sm_magic[count]) {
             printf("Bad msg %u %04x != %04x\n", count, magic, sm_magic[count]);
-            cons_atou = prod_atou;
+            LANE_FLUSH(lane);
             return (0);
         }
-        pos = (pos + 2) & (sizeof (msg_atou) - 1);
+        pos = (pos + 2) & (lane->ml_size - 1);
     }
 
-    len     = *(uint16_t *) (msg_atou + pos);
+    len     = *(uint16_t *) (lane->ml_buf + pos);
     len     = (len + 1) & ~1;  // Round up
     return (len + KS_HDR_AND_CRC_LEN);
 }
 
-static uint16_t
-utoa_next_msg_len(void)
+/*
+ * lane_next_msg
+ * -------------
+ * Return the lane holding the next message to be delivered from the
+ * specified direction, serving the priority lane first. The message
+ * length is returned in len, which is 0 if no message is pending.
+ */
+static msg_lane_t *
+lane_next_msg(msg_lane_t *lanes, uint *len)
 {
-    uint     len;
-    uint     pos;
-    uint     inuse = SPACE_INUSE_UTOA;
-    uint     count;
-    uint16_t magic;
+    msg_lane_t *lane = &lanes[LANE_PRI];
 
-    if (inuse < KS_HDR_AND_CRC_LEN) {
-        cons_utoa = prod_utoa;
-        return (0);
-    }
-    /* Check magic */
-    for (pos = cons_utoa, count = 0; count < ARRAY_SIZE(sm_magic); count++) {
-        magic = *(uint16_t *) (msg_utoa + pos);
-        if (magic != sm_magic[count]) {
-            printf("bad msg %u %04x != %04x\n", count, magic, sm_magic[count]);
-            cons_utoa = prod_utoa;
-            return (0);
-        }
-        pos = (pos + 2) & (sizeof (msg_utoa) - 1);
+    *len = lane_next_msg_len(lane);
+    if (*len == 0) {
+        lane = &lanes[LANE_BULK];
+        *len = lane_next_msg_len(lane);
     }
+    return (lane);
+}
 
-    len     = *(uint16_t *) (msg_utoa + pos);
-    len     = (len + 1) & ~1;  // Round up
-    return (len + KS_HDR_AND_CRC_LEN);
+static msg_lane_t *
+atou_next_msg_len(uint *len)
+{
+    return (lane_next_msg(lane_atou, len));
+}
+
+static msg_lane_t *
+utoa_next_msg_len(uint *len)
+{
+    return (lane_next_msg(lane_utoa, len));
+}
+
+/*
+ * lane_msg_parts
+ * --------------
+ * Split the message of len bytes at the head of a lane into the pieces
+ * before and after the end of the circular buffer.
+ */
+static void
+lane_msg_parts(msg_lane_t *lane, uint len, uint8_t **buf1, uint *len1,
+               uint8_t **buf2, uint *len2)
+{
+    *len1 = lane->ml_size - lane->ml_cons;
+    if (*len1 > len) {
+        /* Send data doesn't wrap */
+        *len1 = len;
+        *len2 = 0;
+    } else {
+        /* Send data from end + beginning of circular buffer */
+        *len2 = len - *len1;
+    }
+    *buf1 = lane->ml_buf + lane->ml_cons;
+    *buf2 = lane->ml_buf;
 }
 
 /*
@@ -517,12 +630,12 @@ config_tim5_ch1_dma(bool verbose)
     /* DMA from address GPIOs A16-A31 to memory */
     config_dma(DMA2, DMA_CHANNEL5, 0, 16,
                &GPIO_IDR(SOCKET_A16_PORT),
-               buffer_rxd, ADDR_BUF_COUNT);
+               buffer_rxd, CAPTURE_BUF_COUNT);
 #else
     /* DMA from address GPIOs A0-A15 to memory */
     config_dma(DMA2, DMA_CHANNEL5, 0, 16,
                &GPIO_IDR(SOCKET_A0_PORT),
-               buffer_rxa_lo, ADDR_BUF_COUNT);
+               buffer_rxa_lo, CAPTURE_BUF_COUNT);
 #endif
 
     /* Set up TIM5 CH1 to trigger DMA based on external PA0 pin */
@@ -599,9 +712,10 @@ config_tim2_ch1_dma(bool verbose)
             break;
     }
 #ifdef CAPTURE_DMA_SWAP
-    config_dma(DMA1, DMA_CHANNEL5, 0, 16, src, buffer_rxa_lo, ADDR_BUF_COUNT);
+    config_dma(DMA1, DMA_CHANNEL5, 0, 16, src, buffer_rxa_lo,
+               CAPTURE_BUF_COUNT);
 #else
-    config_dma(DMA1, DMA_CHANNEL5, 0, 16, src, buffer_rxd, ADDR_BUF_COUNT);
+    config_dma(DMA1, DMA_CHANNEL5, 0, 16, src, buffer_rxd, CAPTURE_BUF_COUNT);
 #endif
 
     timer_set_ti1_ch1(TIM2);        // Capture input from channel 1 only
@@ -635,7 +749,9 @@ static void
 configure_oe_capture_rx(bool verbose)
 {
     consumer_wrap = 0;
+    consumer_wrap_last_poll = 0;
     rx_consumer = 0;
+    capture_batch = false;  // DMA reset clears half/full interrupt enables
     config_tim2_ch1_dma(verbose);
     config_tim5_ch1_dma(verbose);
 
@@ -643,8 +759,12 @@ configure_oe_capture_rx(bool verbose)
      * Not enough memory bandwidth on at least one CPU I have to have both
      * DMAs active and STM32 keep up with the Amiga. That particular STM32
      * does not have DFU, so it might be a remarked STM32F103 or something
-     * else.
+     * else. The A16-A19 capture DMA is therefore only enabled while the
+     * Amiga has asked for wide symbols (KS_SET_WIDE), which it does only
+     * when the user opts in.
      */
+    if (capture_wide)
+        TIM_CCER(HI_DMA_TIMER) |= TIM_CCER_CC1E;  // Also capture A16-A19
     TIM_CCER(LOG_DMA_TIMER) |= TIM_CCER_CC1E;  // timer_enable_oc_output()
 }
 
@@ -685,6 +805,10 @@ ks_reply(uint flags, uint status, uint rlen1, const void *rbuf1,
     TIM_CCER(TIM2) = 0;  // Disable everything
     TIM_CCER(TIM5) = 0;
 
+    /* The capture DMA channel is reused below, without its interrupts */
+    DMA_CCR(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL) &=
+        ~(DMA_CCR_HTIE | DMA_CCR_TCIE);
+
     if ((ee_mode == EE_MODE_32) || (ee_mode == EE_MODE_32_SWAP)) {
         /*
          * For 32-bit mode, we need to separate low and high 16 bits as
@@ -990,7 +1114,11 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
             reply.si_ks_time[3] = 0;
             strcpy(reply.si_serial, (const char *)usb_serial_str);
             reply.si_rev      = SWAP16(0x0001);     // Protocol version 0.1
-            reply.si_features = SWAP16(0x0001);     // Features
+            reply.si_features = SWAP16(0x0001 |     // Features
+                                       KS_FEATURE_MSG_NOTIFY |
+                                       KS_FEATURE_FLASH_MWRITE |
+                                       KS_FEATURE_WIDE_SYM |
+                                       KS_FEATURE_MSG_PRIORITY);
             reply.si_usbid    = SWAP32(0x12091610); // Matches USB ID
             reply.si_mode     = ee_mode;
             reply.si_unused1  = 0;
@@ -1173,6 +1301,60 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
             }
             break;
         }
+        case KS_CMD_FLASH_MWRITE: {
+            /* Send command sequence to perform multiple flash writes */
+            static const uint32_t addr[] = {
+                SWAP32(0x00555), SWAP32(0x002aa), SWAP32(0x00555)
+            };
+            static uint32_t data[KS_MWRITE_MAX * 4];
+            uint16_t *data16 = (uint16_t *) data;
+            uint      wordsize;
+            uint      count;
+            uint      pos;
+
+            cons_s = rx_consumer - (cmd_len + 1) / 2 - 1;
+            if ((int) cons_s < 0)
+                cons_s += ARRAY_SIZE(buffer_rxa_lo);
+
+            if ((ee_mode == EE_MODE_32) || (ee_mode == EE_MODE_32_SWAP))
+                wordsize = 4;
+            else
+                wordsize = 2;
+            count = cmd_len / wordsize;
+            if ((count == 0) || (count > KS_MWRITE_MAX) ||
+                (count * wordsize != cmd_len)) {
+                ks_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                break;
+            }
+
+            /*
+             * Build the complete data sequence before replying, as the
+             * Amiga will begin generating addresses shortly after.
+             */
+            for (pos = 0; pos < count; pos++) {
+                uint32_t wdata = buffer_rxa_lo[cons_s];
+                if (++cons_s == ARRAY_SIZE(buffer_rxa_lo))
+                    cons_s = 0;
+                if (wordsize == 4) {
+                    wdata |= (buffer_rxa_lo[cons_s] << 16);
+                    if (++cons_s == ARRAY_SIZE(buffer_rxa_lo))
+                        cons_s = 0;
+                    data[pos * 4 + 0] = 0x00aa00aa;
+                    data[pos * 4 + 1] = 0x00550055;
+                    data[pos * 4 + 2] = 0x00a000a0;
+                    data[pos * 4 + 3] = wdata;
+                } else {
+                    data16[pos * 4 + 0] = 0x00aa;
+                    data16[pos * 4 + 1] = 0x0055;
+                    data16[pos * 4 + 2] = 0x00a0;
+                    data16[pos * 4 + 3] = wdata;
+                }
+            }
+
+            ks_reply(0, KS_STATUS_OK, sizeof (addr), &addr, 0, NULL);
+            ks_reply(KS_REPLY_WE_RAW, 0, count * 4 * wordsize, data, 0, NULL);
+            break;
+        }
         case KS_CMD_FLASH_ERASE: {
             static const uint32_t addr[] = {
                 SWAP32(0x00555), SWAP32(0x002aa), SWAP32(0x00555),
@@ -1250,6 +1432,20 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
                     printf(" %02x", config.nv_mem[pos]);
                 printf("\n");
 #endif
+            } else if (cmd & KS_SET_WIDE) {
+                if (cmd_len != 2) {
+                    ks_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                if (capture_mode != CAPTURE_ADDR) {
+                    ks_reply(0, KS_STATUS_BADARG, 0, NULL, 0, NULL);
+                    break;
+                }
+                cons_s = rx_consumer - (cmd_len + 1) / 2 - 1;
+                if ((int) cons_s < 0)
+                    cons_s += ARRAY_SIZE(buffer_rxa_lo);
+                capture_wide = (buffer_rxa_lo[cons_s] != 0);
+                ks_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
             } else {
                 ks_reply(0, KS_STATUS_BADARG, 0, NULL, 0, NULL);
             }
@@ -1556,11 +1752,8 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
                 /* Receive data doesn't wrap */
                 len1 = raw_len;
                 buf1 = (uint8_t *) &buffer_rxa_lo[cons_s];
-                if ((cmd & KS_MSG_ALTBUF) == 0) {
-                    rc = atou_add(len1, buf1);
-                } else {
-                    rc = utoa_add(len1, buf1);
-                }
+                len2 = 0;
+                buf2 = NULL;
             } else {
                 /* Send data from end of buffer + beginning of buffer */
                 cons_s += ARRAY_SIZE(buffer_rxa_lo);
@@ -1570,29 +1763,11 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
 
                 len2 = raw_len - len1;
                 buf2 = (uint8_t *) buffer_rxa_lo;
-
-                if ((cmd & KS_MSG_ALTBUF) == 0) {
-                    if (raw_len > SPACE_AVAIL_ATOU) {
-                        rc = 1;
-                    } else {
-                        rc = atou_add(len1, buf1);
-                        if (rc == 0) {
-                            rc = atou_add(len2, buf2);
-                            messages_atou--;
-                        }
-                    }
-                } else {
-                    if (raw_len > SPACE_AVAIL_UTOA) {
-                        rc = 1;
-                    } else {
-                        rc = utoa_add(len1, buf1);
-                        if (rc == 0) {
-                            rc = utoa_add(len2, buf2);
-                            messages_utoa--;
-                        }
-                    }
-                }
             }
+            if ((cmd & KS_MSG_ALTBUF) == 0)
+                rc = atou_add(cmd & KS_MSG_PRIORITY, len1, buf1, len2, buf2);
+            else
+                rc = utoa_add(cmd & KS_MSG_PRIORITY, len1, buf1, len2, buf2);
             if (rc != 0) {
                 ks_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
             } else {
@@ -1611,11 +1786,12 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
             break;
         }
         case KS_CMD_MSG_RECEIVE: {
-            uint     len;
-            uint     len1;
-            uint     len2;
-            uint8_t *buf1;
-            uint8_t *buf2;
+            msg_lane_t *lane;
+            uint        len;
+            uint        len1;
+            uint        len2;
+            uint8_t    *buf1;
+            uint8_t    *buf2;
 
             if ((((cmd & KS_MSG_ALTBUF) == 0) && (msg_lock & BIT(3))) ||
                 (((cmd & KS_MSG_ALTBUF) != 0) && (msg_lock & BIT(2)))) {
@@ -1623,43 +1799,18 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
                 break;
             }
 
-            if ((cmd & KS_MSG_ALTBUF) == 0) {
-                len = utoa_next_msg_len();
-                len1 = sizeof (msg_utoa) - cons_utoa;
-                if (len1 > len) {
-                    /* Send data doesn't wrap */
-                    len1 = len;
-                    len2 = 0;
-                } else {
-                    /* Send data from end + beginning of circular buffer */
-                    len2 = len - len1;
-                }
-                buf1 = msg_utoa + cons_utoa;
-                buf2 = msg_utoa;
-            } else {
-                len = atou_next_msg_len();
-                len1 = sizeof (msg_atou) - cons_atou;
-                if (len1 > len) {
-                    /* Send data doesn't wrap */
-                    len1 = len;
-                    len2 = 0;
-                } else {
-                    /* Send data from end + beginning of circular buffer */
-                    len2 = len - len1;
-                }
-                buf1 = msg_atou + cons_atou;
-                buf2 = msg_atou;
-            }
+            if ((cmd & KS_MSG_ALTBUF) == 0)
+                lane = utoa_next_msg_len(&len);
+            else
+                lane = atou_next_msg_len(&len);
             if (len == 0) {
                 ks_reply(0, KS_STATUS_NODATA, 0, NULL, 0, NULL);
                 break;
             }
 
+            lane_msg_parts(lane, len, &buf1, &len1, &buf2, &len2);
             ks_reply(KS_REPLY_RAW, 0, len1, buf1, len2, buf2);
-            if ((cmd & KS_MSG_ALTBUF) == 0)
-                cons_utoa = (cons_utoa + len) & (sizeof (msg_utoa) - 1);
-            else
-                cons_atou = (cons_atou + len) & (sizeof (msg_atou) - 1);
+            lane->ml_cons = (lane->ml_cons + len) & (lane->ml_size - 1);
             break;
         }
         case KS_CMD_MSG_LOCK: {
@@ -1684,10 +1835,14 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
             break;
         }
         case KS_CMD_MSG_FLUSH:
-            if (cmd & KS_MSG_ALTBUF)
-                cons_atou = prod_atou;
-            else
-                cons_utoa = prod_utoa;  // default: flush "my" receive buffer
+            if (cmd & KS_MSG_ALTBUF) {
+                LANE_FLUSH(&lane_atou[LANE_BULK]);
+                LANE_FLUSH(&lane_atou[LANE_PRI]);
+            } else {
+                /* default: flush "my" receive buffer */
+                LANE_FLUSH(&lane_utoa[LANE_BULK]);
+                LANE_FLUSH(&lane_utoa[LANE_PRI]);
+            }
             ks_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
             break;
         case KS_CMD_CLOCK: {
@@ -1743,6 +1898,41 @@ execute_cmd(uint16_t cmd, uint16_t cmd_len)
     }
 }
 
+/*
+ * capture_batch_start
+ * -------------------
+ * Switches parsing of captured ROM addresses from an interrupt on every
+ * OE edge to the capture DMA half-transfer and transfer-complete
+ * interrupts. This routine is called from interrupt context.
+ */
+static void
+capture_batch_start(void)
+{
+    timer_disable_irq(LOG_DMA_TIMER, TIM_DIER_CC1IE);
+    dma_clear_interrupt_flags(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL,
+                              DMA_HTIF | DMA_TCIF | DMA_GIF);
+    DMA_CCR(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL) |=
+        DMA_CCR_HTIE | DMA_CCR_TCIE;
+    capture_batch = true;
+    capture_batches++;
+}
+
+/*
+ * capture_batch_stop
+ * ------------------
+ * Returns to parsing captured ROM addresses on every OE edge, for the
+ * lowest message latency. Any captures not yet parsed are handled
+ * immediately, as the timer capture flag will already be pending.
+ */
+static void
+capture_batch_stop(void)
+{
+    DMA_CCR(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL) &=
+        ~(DMA_CCR_HTIE | DMA_CCR_TCIE);
+    capture_batch = false;
+    timer_enable_irq(LOG_DMA_TIMER, TIM_DIER_CC1IE);
+}
+
 /*
  * fast_magic_search() looks for the next occurrence of the start of the
  *                     magic address sequence for when an Amiga program
@@ -1801,6 +1991,84 @@ fast_magic_search(uint prod)
     return (1);
 }
 
+/*
+ * wide_capture_skew
+ * -----------------
+ * Returns how many more OE edges the A16-A19 capture DMA has seen than
+ * the A0-A15 capture DMA. Both transfer counters keep running while they
+ * are read, so reads are repeated until neither counter changed between
+ * them. The Amiga is delaying before reading the reply when this is
+ * called, so the ROM bus is normally quiet.
+ */
+static uint
+wide_capture_skew(void)
+{
+    uint lo;
+    uint hi;
+    uint tries;
+
+    for (tries = 0; tries < 16; tries++) {
+        lo = dma_get_number_of_data(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL);
+        hi = dma_get_number_of_data(HI_DMA_CONTROLLER, HI_DMA_CHANNEL);
+        if ((lo == dma_get_number_of_data(LOG_DMA_CONTROLLER,
+                                          LOG_DMA_CHANNEL)) &&
+            (hi == dma_get_number_of_data(HI_DMA_CONTROLLER,
+                                          HI_DMA_CHANNEL))) {
+            break;
+        }
+    }
+    return (lo - hi);
+}
+
+/*
+ * wide_symbol_unpack
+ * ------------------
+ * Rewrites a message which was received with wide symbols (KS_CMD_WIDE)
+ * in the capture ring as if it had been sent with 16-bit symbols, so the
+ * CRC check and command handlers need not be aware of the framing. The
+ * rewritten message ends at the same position in the ring, but starts
+ * earlier, overwriting captures which were already processed. Returns
+ * the new ring position of the message length. This routine is called
+ * from interrupt context.
+ */
+static uint
+wide_symbol_unpack(uint cons_start, uint16_t cmd_len, uint16_t cmd)
+{
+    uint mask   = ARRAY_SIZE(buffer_rxa_lo) - 1;
+    uint bits   = ((ee_mode == EE_MODE_32) ||
+                   (ee_mode == EE_MODE_32_SWAP)) ? 1 : 2;
+    uint group  = 16 / bits;
+    uint groups = ((cmd_len + 1) / 2) / (group + 1);
+    uint start  = (cons_start - groups) & mask;
+    uint in     = cons_start + 2;
+    uint out    = start - ARRAY_SIZE(sm_magic);
+    uint skew;
+    uint pos;
+
+    /*
+     * The A16-A19 capture DMA is started slightly before the A0-A15
+     * capture DMA, so it may have seen more OE edges.
+     */
+    skew = wide_capture_skew();
+
+    for (pos = 0; pos < ARRAY_SIZE(sm_magic); pos++)
+        buffer_rxa_lo[out++ & mask] = sm_magic[pos];
+    buffer_rxa_lo[out++ & mask] = cmd_len;
+    buffer_rxa_lo[out++ & mask] = cmd & ~KS_CMD_WIDE;
+
+    while (groups-- > 0) {
+        uint16_t extra = 0;
+        for (pos = 0; pos < group; pos++, in++, out++) {
+            uint hi = buffer_rxd[(in + skew) & mask] >> 4;  // A16-A19
+            buffer_rxa_lo[out & mask] = buffer_rxa_lo[in & mask];
+            extra |= (hi & ((1 << bits) - 1)) << (pos * bits);
+        }
+        buffer_rxa_lo[out++ & mask] = extra;
+    }
+    /* Remaining 16-bit symbols are already in place */
+    return (start);
+}
+
 /*
  * process_addresses
  * -----------------
@@ -1859,6 +2127,12 @@ new_cmd_post:
             case ARRAY_SIZE(sm_magic) + 1:
                 /* Command phase */
                 cmd = buffer_rxa_lo[rx_consumer];
+                if (cmd & KS_CMD_WIDE) {
+                    /* Fewer data symbols: see wide_symbol_unpack() */
+                    uint group = ((ee_mode == EE_MODE_32) ||
+                                  (ee_mode == EE_MODE_32_SWAP)) ? 16 : 8;
+                    len -= len / (group + 1);
+                }
                 if (len == 0)
                     magic_pos++;  // Skip following Data Phase
                 magic_pos++;
@@ -1877,6 +2151,15 @@ new_cmd_post:
             case ARRAY_SIZE(sm_magic) + 4:
                 /* Bottom half of CRC */
                 crc_rx |= buffer_rxa_lo[rx_consumer];
+                if ((cmd & KS_CMD_WIDE) && !capture_wide) {
+                    /* Upper address lines were not captured (reset?) */
+                    ks_reply(0, KS_STATUS_NOWIDE, 0, NULL, 0, NULL);
+                    goto cmd_done;
+                }
+                if (cmd & KS_CMD_WIDE) {
+                    cons_start = wide_symbol_unpack(cons_start, cmd_len, cmd);
+                    cmd &= ~KS_CMD_WIDE;
+                }
                 uint len1 = cmd_len + 4;
                 uint32_t ncrc;
                 if (len1 > sizeof (buffer_rxa_lo) - cons_start * 2) {
@@ -1925,7 +2208,7 @@ new_cmd_post:
                     /* Execution phase */
                     execute_cmd(cmd, cmd_len);
                 }
-
+cmd_done:
                 magic_pos = 0;  // Restart magic detection
 
                 /* Clobber magic so it doesn't get executed again */
@@ -1954,17 +2237,21 @@ new_cmd_post:
 
         if (++rx_consumer == ARRAY_SIZE(buffer_rxa_lo)) {
             rx_consumer = 0;
-            if (++consumer_wrap - consumer_wrap_last_poll > 20) {
+            if ((++consumer_wrap - consumer_wrap_last_poll >
+                 CAPTURE_BATCH_WRAPS) && !capture_batch) {
                 /*
-                 * Spinning too much in interrupt context.
-                 * Disable interrupt -- it will be re-enabled in ee_poll().
+                 * Sustained capture load. Rather than take an interrupt
+                 * on every OE edge, parse once per half of the ring.
+                 * Per-edge interrupts resume in msg_poll() once the load
+                 * subsides, or after the next reply to the Amiga.
                  */
-                nvic_disable_irq(LOG_DMA_NVIC_IRQ);
-                consumer_spin++;
+                capture_batch_start();
                 return;
             }
         }
     }
+    if (capture_batch)
+        return;  // The next half-transfer interrupt will continue
 
     dma_left = dma_get_number_of_data(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL);
     prod = ARRAY_SIZE(buffer_rxa_lo) - dma_left;
@@ -1988,6 +2275,38 @@ tim5_isr(void)
     process_addresses();
 }
 
+/*
+ * capture_dma_isr
+ * ---------------
+ * Handles capture DMA half-transfer and transfer-complete interrupts,
+ * which are enabled only while captured addresses are parsed in batches.
+ */
+static void
+capture_dma_isr(void)
+{
+    dma_clear_interrupt_flags(LOG_DMA_CONTROLLER, LOG_DMA_CHANNEL,
+                              DMA_HTIF | DMA_TCIF | DMA_GIF);
+    process_addresses();
+}
+
+void
+dma1_channel5_isr(void)
+{
+    capture_dma_isr();
+}
+
+void
+dma2_channel4_5_isr(void)
+{
+    capture_dma_isr();
+}
+
+void
+dma2_channel5_isr(void)
+{
+    capture_dma_isr();
+}
+
 int
 address_log_replay(uint max)
 {
@@ -2012,25 +2331,29 @@ address_log_replay(uint max)
     if (max == 0x999) {  // magic value
         printf("T2C1=%04x %08lx->%08lx addrbuf_hi=%08x\n"
                "T5C1=%04x %08lx->%08lx addrbuf_lo=%08x\n"
-               "Wrap=%u  Spin=%u\n"
+               "Wrap=%u  Batch=%u\n"
                "KS CMD       Amiga=%-8u  USB=%u\n"
                "KS CRC Fail  Amiga=%-8u  USB=%u\n"
                "KS Unk CMD   Amiga=%-8u  USB=%u\n"
                "Buf Messages  AtoU=%-8u UtoA=%u\n"
                "Message Prod  AtoU=%-8u UtoA=%u\n"
-               "Message Cons  AtoU=%-8u UtoA=%u\n",
+               "Message Cons  AtoU=%-8u UtoA=%u\n"
+               "Priority P/C  AtoU=%x/%-6x UtoA=%x/%x\n",
                (uint) DMA_CNDTR(DMA1, DMA_CHANNEL5),
                DMA_CPAR(DMA1, DMA_CHANNEL5), DMA_CMAR(DMA1, DMA_CHANNEL5),
                (uintptr_t)buffer_rxd,
                (uint) DMA_CNDTR(DMA2, DMA_CHANNEL5),
                DMA_CPAR(DMA2, DMA_CHANNEL5), DMA_CMAR(DMA2, DMA_CHANNEL5),
                (uintptr_t)buffer_rxa_lo,
-               consumer_wrap, consumer_spin, messages_amiga, messages_usb,
+               consumer_wrap, capture_batches, messages_amiga, messages_usb,
                fail_crc_a, fail_crc_u, fail_cmd_a, fail_cmd_u,
-               messages_atou, messages_utoa, prod_atou, prod_utoa,
-               cons_atou, cons_utoa);
+               messages_atou, messages_utoa,
+               lane_atou[LANE_BULK].ml_prod, lane_utoa[LANE_BULK].ml_prod,
+               lane_atou[LANE_BULK].ml_cons, lane_utoa[LANE_BULK].ml_cons,
+               lane_atou[LANE_PRI].ml_prod, lane_atou[LANE_PRI].ml_cons,
+               lane_utoa[LANE_PRI].ml_prod, lane_utoa[LANE_PRI].ml_cons);
         consumer_wrap = 0;
-        consumer_spin = 0;
+        capture_batches = 0;
         messages_amiga = 0;
         messages_usb = 0;
         messages_atou = 0;
@@ -2204,14 +2527,18 @@ bus_snoop(uint mode)
 void
 msg_poll(void)
 {
-    if (consumer_wrap_last_poll != consumer_wrap) {
-        consumer_wrap_last_poll = consumer_wrap;
-        /*
-         * Re-enable message interrupt if it was disabled during
-         * interrupt processing due to excessive time.
-         */
-        nvic_enable_irq(LOG_DMA_NVIC_IRQ);
+    if (!timer_tick_has_elapsed(capture_poll_time))
+        return;
+    capture_poll_time = timer_tick_plus_msec(CAPTURE_POLL_MSEC);
+
+    if (capture_batch && (consumer_wrap_last_poll == consumer_wrap)) {
+        /* Capture load has subsided -- return to per-edge parsing */
+        disable_irq();
+        if (capture_batch)
+            capture_batch_stop();
+        enable_irq();
     }
+    consumer_wrap_last_poll = consumer_wrap;
 }
 
 void
@@ -2308,7 +2635,12 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
             reply.si_ks_time[3] = 0;
             strcpy(reply.si_serial, (const char *)usb_serial_str);
             reply.si_rev      = SWAP16(0x0001);     // Protocol version 0.1
-            reply.si_features = SWAP16(0x0001);     // Features
+            reply.si_features = SWAP16(0x0001 |     // Features
+                                       KS_FEATURE_MSG_NOTIFY |
+                                       KS_FEATURE_FLASH_CRC |
+                                       KS_FEATURE_FLASH_USB |
+                                       KS_FEATURE_FLASH_MWRITE |
+                                       KS_FEATURE_MSG_PRIORITY);
             reply.si_usbid    = SWAP32(0x12091610); // Matches USB ID
             reply.si_mode     = ee_mode;
             reply.si_unused1  = 0;
@@ -2353,6 +2685,114 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
             usb_msg_reply(0, KS_STATUS_OK, sizeof (config.bi),
                           &config.bi, 0, NULL);
             break;
+        case KS_CMD_FLASH_CRC: {
+            /* Compute CRC of each flash sector in the requested range */
+            smash_crc_t reply[16];
+            uint32_t    addr;
+            uint32_t    len;
+            uint        count = ARRAY_SIZE(reply);
+            uint        cur;
+
+            if (cmd_len != 8) {
+                usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                break;
+            }
+            if (amiga_not_in_reset) {
+                usb_msg_reply(0, KS_STATUS_LOCKED, 0, NULL, 0, NULL);
+                break;
+            }
+            addr = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+            len  = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+            if (prom_crc(addr, len, reply, &count) != RC_SUCCESS) {
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+                break;
+            }
+            for (cur = 0; cur < count; cur++) {
+                reply[cur].sc_addr = SWAP32(reply[cur].sc_addr);
+                reply[cur].sc_len  = SWAP32(reply[cur].sc_len);
+                reply[cur].sc_crc  = SWAP32(reply[cur].sc_crc);
+            }
+            usb_msg_reply(0, KS_STATUS_OK, count * sizeof (reply[0]), reply,
+                          0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_GETID: {
+            /* Report flash chip ids and part names */
+            smash_flash_id_t reply;
+            uint32_t         part1;
+            uint32_t         part2;
+
+            if (amiga_not_in_reset) {
+                usb_msg_reply(0, KS_STATUS_LOCKED, 0, NULL, 0, NULL);
+                break;
+            }
+            if (prom_get_id(&part1, &part2) != RC_SUCCESS) {
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+                break;
+            }
+            memset(&reply, 0, sizeof (reply));
+            reply.sfi_id[0] = SWAP32(part1);
+            reply.sfi_id[1] = SWAP32(part2);
+            reply.sfi_mode  = ee_mode;
+            strncpy(reply.sfi_name[0], ee_id_string(part1),
+                    sizeof (reply.sfi_name[0]) - 1);
+            strncpy(reply.sfi_name[1], ee_id_string(part2),
+                    sizeof (reply.sfi_name[1]) - 1);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_BLANK: {
+            /* Check flash range is erased */
+            uint32_t reply[2];
+            uint32_t addr;
+            uint32_t len;
+
+            if (cmd_len != 8) {
+                usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                break;
+            }
+            if (amiga_not_in_reset) {
+                usb_msg_reply(0, KS_STATUS_LOCKED, 0, NULL, 0, NULL);
+                break;
+            }
+            addr = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+            len  = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) | buf[7];
+            if (prom_blank(addr, len, &reply[0], &reply[1]) != RC_SUCCESS) {
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+                break;
+            }
+            reply[0] = SWAP32(reply[0]);
+            reply[1] = SWAP32(reply[1]);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_DERASE: {
+            /* Erase flash chip or sectors (reply when complete) */
+            uint32_t addr = 0;
+            uint32_t len  = 0;
+            uint     mode = ERASE_MODE_CHIP;
+
+            if ((cmd & KS_DERASE_CHIP) == 0) {
+                if (cmd_len != 8) {
+                    usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                addr = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) |
+                       buf[3];
+                len  = (buf[4] << 24) | (buf[5] << 16) | (buf[6] << 8) |
+                       buf[7];
+                mode = ERASE_MODE_SECTOR;
+            }
+            if (amiga_not_in_reset) {
+                usb_msg_reply(0, KS_STATUS_LOCKED, 0, NULL, 0, NULL);
+                break;
+            }
+            if (prom_erase(mode, addr, len, 0) != RC_SUCCESS)
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+            else
+                usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
+            break;
+        }
         case KS_CMD_MSG_STATE: {
             uint16_t reply[2];
             if (cmd & KS_MSG_STATE_SET) {
@@ -2371,6 +2811,15 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
                 state_usb_app = (state_usb_app & ~mask) | (state & mask);
                 expire_update_usb_app = timer_tick_plus_msec(expire);
             }
+            if (cmd & KS_MSG_STATE_NOTIFY) {
+                /* Host must renew this, as it does the app state */
+                expire_atou_notify = timer_tick_plus_msec(10000);
+                if (atou_notify == 0) {
+                    atou_notify = 1;
+                    if (!ATOU_EMPTY)
+                        atou_notify_pending = 1;  // Messages already waiting
+                }
+            }
             reply[0] = SWAP16(state_amiga_app);
             reply[1] = SWAP16(state_usb_app);
             usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
@@ -2433,9 +2882,9 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
                 break;
             }
             if ((cmd & KS_MSG_ALTBUF) == 0)
-                rc = utoa_add(raw_len, rawbuf);
+                rc = utoa_add(cmd & KS_MSG_PRIORITY, raw_len, rawbuf, 0, NULL);
             else
-                rc = atou_add(raw_len, rawbuf);
+                rc = atou_add(cmd & KS_MSG_PRIORITY, raw_len, rawbuf, 0, NULL);
 
             if (rc != 0)
                 usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
@@ -2449,12 +2898,13 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
             break;
         }
         case KS_CMD_MSG_RECEIVE: {
-            uint64_t new_expire;
-            uint     len;
-            uint     len1;
-            uint     len2;
-            uint8_t *buf1;
-            uint8_t *buf2;
+            msg_lane_t *lane;
+            uint64_t    new_expire;
+            uint        len;
+            uint        len1;
+            uint        len2;
+            uint8_t    *buf1;
+            uint8_t    *buf2;
 
             if ((((cmd & KS_MSG_ALTBUF) == 0) && (msg_lock & BIT(0))) ||
                 (((cmd & KS_MSG_ALTBUF) != 0) && (msg_lock & BIT(1)))) {
@@ -2462,43 +2912,18 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
                 break;
             }
 
-            if ((cmd & KS_MSG_ALTBUF) == 0) {
-                len = atou_next_msg_len();
-                len1 = sizeof (msg_atou) - cons_atou;
-                if (len1 > len) {
-                    /* Send data doesn't wrap */
-                    len1 = len;
-                    len2 = 0;
-                } else {
-                    /* Send data from end + beginning of circular buffer */
-                    len2 = len - len1;
-                }
-                buf1 = msg_atou + cons_atou;
-                buf2 = msg_atou;
-            } else {
-                len = utoa_next_msg_len();
-                len1 = sizeof (msg_utoa) - cons_utoa;
-                if (len1 > len) {
-                    /* Send data doesn't wrap */
-                    len1 = len;
-                    len2 = 0;
-                } else {
-                    /* Send data from end + beginning of circular buffer */
-                    len2 = len - len1;
-                }
-                buf1 = msg_utoa + cons_utoa;
-                buf2 = msg_utoa;
-            }
+            if ((cmd & KS_MSG_ALTBUF) == 0)
+                lane = atou_next_msg_len(&len);
+            else
+                lane = utoa_next_msg_len(&len);
             if (len == 0) {
                 usb_msg_reply(0, KS_STATUS_NODATA, 0, NULL, 0, NULL);
                 break;
             }
 
+            lane_msg_parts(lane, len, &buf1, &len1, &buf2, &len2);
             usb_msg_reply(KS_REPLY_RAW, 0, len1, buf1, len2, buf2);
-            if ((cmd & KS_MSG_ALTBUF) == 0)
-                cons_atou = (cons_atou + len) & (sizeof (msg_atou) - 1);
-            else
-                cons_utoa = (cons_utoa + len) & (sizeof (msg_utoa) - 1);
+            lane->ml_cons = (lane->ml_cons + len) & (lane->ml_size - 1);
 
             /* Extend state expiration when transfer in progress */
             new_expire = timer_tick_plus_msec(1000);
@@ -2529,10 +2954,14 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
                 usb_msg_reply(0, KS_STATUS_LOCKED, 0, NULL, 0, NULL);
                 break;
             }
-            if ((cmd & KS_MSG_ALTBUF) == 0)
-                cons_atou = prod_atou;  // default: flush "my" receive buffer
-            else
-                cons_utoa = prod_utoa;
+            if ((cmd & KS_MSG_ALTBUF) == 0) {
+                /* default: flush "my" receive buffer */
+                LANE_FLUSH(&lane_atou[LANE_BULK]);
+                LANE_FLUSH(&lane_atou[LANE_PRI]);
+            } else {
+                LANE_FLUSH(&lane_utoa[LANE_BULK]);
+                LANE_FLUSH(&lane_utoa[LANE_PRI]);
+            }
             usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
             break;
         case KS_CMD_CLOCK: {
@@ -2576,6 +3005,26 @@ execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
     }
 }
 
+/*
+ * msg_usb_notify() sends the USB host an unsolicited KS_CMD_MSG_NOTIFY
+ * message if the Amiga -> USB buffer has become non-empty. It must only
+ * be called between USB host commands, so that the notification is not
+ * interleaved with a reply. Notification is turned off if the host has
+ * not renewed it recently, as it may have exited without leaving service
+ * mode.
+ */
+static void
+msg_usb_notify(void)
+{
+    atou_notify_pending = 0;
+    if (timer_tick_has_elapsed(expire_atou_notify)) {
+        atou_notify = 0;
+        return;
+    }
+    if (!ATOU_EMPTY && ((msg_lock & BIT(0)) == 0))
+        usb_msg_reply(0, KS_CMD_MSG_NOTIFY, 0, NULL, 0, NULL);
+}
+
 void
 msg_usb_service(void)
 {
@@ -2592,6 +3041,8 @@ msg_usb_service(void)
             uint64_t timeout = timer_tick_plus_msec(200);
             while ((int)(ch = getchar()) == -1) {
                 main_poll();
+                if ((pos == 0) && atou_notify_pending)
+                    msg_usb_notify();
                 if (timer_tick_has_elapsed(timeout)) {
                     pos = 0;
                     break;
@@ -2604,8 +3055,10 @@ msg_usb_service(void)
         usb_msg_buffer[pos] = ch;
         switch (pos) {
             case 0:  // Magic start
-                if ((ch == 0x3) || (ch == '\n') || (ch == '\r'))
+                if ((ch == 0x3) || (ch == '\n') || (ch == '\r')) {
+                    atou_notify = 0;
                     return;  // Abort received ^C, LF, or CR
+                }
                 /* FALLTHROUGH */
             case 1:  // Magic
             case 2:  // Magic
@@ -2784,6 +3237,10 @@ msg_init(void)
     nvic_set_priority(LOG_DMA_NVIC_IRQ, 0x20);
     nvic_enable_irq(LOG_DMA_NVIC_IRQ);
 
+    /* Same priority, as both parse the capture ring */
+    nvic_set_priority(LOG_DMA_DONE_IRQ, 0x20);
+    nvic_enable_irq(LOG_DMA_DONE_IRQ);
+
     capture_mode = CAPTURE_ADDR;
     configure_oe_capture_rx(true);
 }
@@ -63,6 +63,7 @@ const char cmd_gpio_help[] =
 const char cmd_prom_help[] =
 "prom bank <cmd>         - show or set PROM bank for AmigaOS\n"
 "prom cmd <cmd> [<addr>] - send a 32-bit command to both flash chips\n"
+"prom crc <addr> <len>   - show CRC-32 of each EEPROM sector in range\n"
 "prom id                 - report EEPROM chip vendor and id\n"
 "prom erase chip|<addr>  - erase EEPROM chip or 128K sector; <len> optional\n"
 "prom log [<count>]      - show log of Amiga address accesses\n"
@@ -439,6 +440,7 @@ cmd_prom(int argc, char * const *argv)
 {
     enum {
         OP_NONE,
+        OP_CRC,
         OP_READ,
         OP_SERVICE,
         OP_WRITE,
@@ -492,6 +494,8 @@ cmd_prom(int argc, char * const *argv)
 
         prom_cmd(addr, cmd);
         return (RC_SUCCESS);
+    } else if (strcmp("crc", arg) == 0) {
+        op_mode = OP_CRC;
     } else if (strncmp(arg, "erase", 2) == 0) {
         if (argc < 2) {
             printf("error: prom erase requires either chip or "
@@ -564,6 +568,13 @@ cmd_prom(int argc, char * const *argv)
     }
 
     switch (op_mode) {
+        case OP_CRC:
+            if (argc != 3) {
+                printf("error: prom %s requires <addr> and <len>\n", arg);
+                return (RC_USER_HELP);
+            }
+            rc = prom_crc_show(addr, len);
+            break;
         case OP_READ:
             if (argc != 3) {
                 printf("error: prom %s requires <addr> and <len>\n", arg);
@@ -584,7 +595,7 @@ cmd_prom(int argc, char * const *argv)
                 printf("error: prom erase chip does not have arguments\n");
                 return (RC_USER_HELP);
             }
-            rc = prom_erase(ERASE_MODE_CHIP, 0, 0);
+            rc = prom_erase(ERASE_MODE_CHIP, 0, 0, 1);
             break;
         case OP_ERASE_SECTOR:
             printf("Sector erase %lx", addr);
@@ -596,7 +607,7 @@ cmd_prom(int argc, char * const *argv)
                        "allows optional <len>\n");
                 return (RC_USER_HELP);
             }
-            rc = prom_erase(ERASE_MODE_SECTOR, addr, len);
+            rc = prom_erase(ERASE_MODE_SECTOR, addr, len, 1);
             break;
         case OP_SERVICE:
             msg_usb_service();
@@ -25,6 +25,7 @@
 #include "gpio.h"
 
 #define DATA_CRC_INTERVAL 256
+#define PROM_WRITE_CHUNK  64  // Bytes programmed between input polls
 
 static int
 warn_amiga_not_in_reset(void)
@@ -230,7 +231,7 @@ prom_write(uint32_t addr, uint width, void *bufp)
 }
 
 rc_t
-prom_erase(uint mode, uint32_t addr, uint32_t len)
+prom_erase(uint mode, uint32_t addr, uint32_t len, int verbose)
 {
     rc_t rc;
     if (warn_amiga_not_in_reset())
@@ -239,9 +240,9 @@ prom_erase(uint mode, uint32_t addr, uint32_t len)
     ee_enable();
     gpio_setv(FLASH_OEWE_PORT, FLASH_OEWE_PIN, 1);
     if ((ee_mode == EE_MODE_32) || (ee_mode == EE_MODE_32_SWAP))
-        rc = ee_erase(mode, addr >> 2, len >> 2, 1);
+        rc = ee_erase(mode, addr >> 2, len >> 2, verbose);
     else
-        rc = ee_erase(mode, addr >> 1, len >> 1, 1);
+        rc = ee_erase(mode, addr >> 1, len >> 1, verbose);
     gpio_setv(FLASH_OEWE_PORT, FLASH_OEWE_PIN, 0);
     return (rc);
 }
@@ -256,18 +257,26 @@ prom_cmd(uint32_t addr, uint32_t cmd)
     ee_cmd(addr, cmd);
 }
 
+rc_t
+prom_get_id(uint32_t *part1, uint32_t *part2)
+{
+    if (warn_amiga_not_in_reset())
+        return (RC_BUSY);
+
+    ee_enable();
+    ee_id(part1, part2);
+    return (RC_SUCCESS);
+}
+
 rc_t
 prom_id(void)
 {
     uint32_t part1;
     uint32_t part2;
 
-    if (warn_amiga_not_in_reset())
+    if (prom_get_id(&part1, &part2) != RC_SUCCESS)
         return (RC_BUSY);
 
-    ee_enable();
-    ee_id(&part1, &part2);
-
     switch (ee_mode) {
         case EE_MODE_16_LOW:
         case EE_MODE_16_HIGH:
@@ -295,30 +304,6 @@ getchar_wait(uint pos)
     return (ch);
 }
 
-static int
-check_crc(uint32_t crc, uint spos, uint epos, bool send_rc)
-{
-    int      ch;
-    size_t   pos;
-    uint32_t compcrc;
-
-    for (pos = 0; pos < sizeof (compcrc); pos++) {
-        ch = getchar_wait(200);
-        if (ch == -1) {
-            printf("Receive timeout waiting for CRC %08lx at 0x%x\n",
-                   crc, epos);
-            return (RC_TIMEOUT);
-        }
-        ((uint8_t *)&compcrc)[pos] = ch;
-    }
-    if (crc != compcrc) {
-        printf("Received CRC %08lx doesn't match %08lx at 0x%x-0x%x\n",
-               compcrc, crc, spos, epos);
-        return (1);
-    }
-    return (0);
-}
-
 static int
 check_rc(uint pos)
 {
@@ -433,74 +418,61 @@ prom_read_binary(uint32_t addr, uint32_t len)
 /*
  * prom_write_binary() takes binary input from an application via the serial
  *                     console and writes that to the EEPROM. Every 256 bytes,
- *                     a rolling 8-bit CRC value is sent back to the host.
- *                     This is so the host knows that the data was received
- *                     correctly. Incorrectly received data will still be
- *                     written to the EEPROM.
+ *                     the host sends a rolling CRC value, and a status byte
+ *                     is sent back once that block of data is received
+ *                     correctly. The status is sent before the block is
+ *                     written, so that the host may keep several blocks in
+ *                     flight. Blocks are received into alternating buffers:
+ *                     while one block is being programmed, input which has
+ *                     already arrived for the next block is collected in the
+ *                     other. Data which fails the CRC check is not written.
  */
 rc_t
 prom_write_binary(uint32_t addr, uint32_t len)
 {
-    uint8_t  buf[128];
-    int      ch;
-    rc_t     rc;
+    /* Partial word carried from previous block, block data, and CRC */
+    __attribute__((aligned(16)))
+    uint8_t  buf[2][4 + DATA_CRC_INTERVAL + 4];
+    uint8_t *blk;
+    uint8_t *ptr;
+    uint     cur = 0;
+    uint     carry;
+    uint     rxpos = 0;     // Bytes of current block (and CRC) received
+    uint     rxlen;         // Bytes of current block
+    uint32_t waddr = addr;  // Next EEPROM address to program
+    uint32_t wend;
     uint32_t crc = 0;
-    uint32_t saddr = addr;
-    uint     crc_next = DATA_CRC_INTERVAL;
+    uint32_t compcrc;
+    uint64_t timeout;
+    rc_t     rc;
 
     if (warn_amiga_not_in_reset())
         return (RC_BUSY);
 
     ee_enable();
+    rxlen = (len < DATA_CRC_INTERVAL) ? len : DATA_CRC_INTERVAL;
     while (len > 0) {
-        uint32_t tlen    = len;
-        uint32_t rem     = addr & (sizeof (buf) - 1);
-        uint64_t timeout = timer_tick_plus_msec(1000);
-        uint32_t pos;
-        uint8_t *ptr = buf;
-
-        if (tlen > sizeof (buf) - rem)
-            tlen = sizeof (buf) - rem;
-
-        for (pos = 0; pos < tlen; pos++) {
-            while ((ch = getchar()) == -1)
-                if (timer_tick_has_elapsed(timeout)) {
-                    printf("Data receive timeout at %lx\n", addr + pos);
-                    rc = RC_TIMEOUT;
-                    goto fail;
-                }
-            timeout = timer_tick_plus_msec(1000);
-            *(ptr++) = ch;
-            crc = crc32(crc, ptr - 1, 1);
-            if (--crc_next == 0) {
-                if (check_crc(crc, saddr, addr + pos + 1, false)) {
-                    rc = RC_FAILURE;
-                    goto fail;
-                }
-                rc = RC_SUCCESS;
-                if (puts_binary(&rc, 1)) {
-                    rc = RC_TIMEOUT;
-                    goto fail;
-                }
-                crc_next = DATA_CRC_INTERVAL;
-                saddr = addr + pos + 1;
+        blk = buf[cur] + 4;
+
+        /* Finish receiving block, which may have begun during programming */
+        timeout = timer_tick_plus_msec(1000);
+        while (rxpos < rxlen + sizeof (compcrc)) {
+            uint count = getchar_buf(blk + rxpos,
+                                     rxlen + sizeof (compcrc) - rxpos);
+            if (count > 0) {
+                rxpos  += count;
+                timeout = timer_tick_plus_msec(1000);
+            } else if (timer_tick_has_elapsed(timeout)) {
+                printf("Data receive timeout at %lx\n", addr + rxpos);
+                rc = RC_TIMEOUT;
+                goto fail;
             }
         }
-        rc = prom_write(addr, tlen, buf);
-        if (rc != RC_SUCCESS) {
-fail:
-            (void) puts_binary(&rc, 1);  // Inform remote side
-            timeout = timer_tick_plus_msec(2000);
-            while (!timer_tick_has_elapsed(timeout))
-                (void) getchar();  // Discard input
-            return (rc);
-        }
-        addr += tlen;
-        len  -= tlen;
-        led_poll();  // Blink power LED if it needs to be blinked
-    }
-    if (crc_next != DATA_CRC_INTERVAL) {
-        if (check_crc(crc, saddr, addr, false)) {
+        crc = crc32(crc, blk, rxlen);
+        memcpy(&compcrc, blk + rxlen, sizeof (compcrc));
+        if (crc != compcrc) {
+            printf("Received CRC %08lx doesn't match %08lx at 0x%lx-0x%lx\n",
+                   compcrc, crc, addr, addr + rxlen);
             rc = RC_FAILURE;
             goto fail;
         }
@@ -509,6 +481,184 @@ fail:
             rc = RC_TIMEOUT;
             goto fail;
         }
+        addr += rxlen;
+        len  -= rxlen;
+        ptr   = blk + rxlen - (addr - waddr);
+
+        /*
+         * A trailing partial word is held back and programmed with the
+         * start of the next block, so that programming of each block
+         * begins on a word boundary.
+         */
+        wend  = (len == 0) ? addr : (addr & ~3);
+        carry = addr - wend;
+        cur  ^= 1;
+        memcpy(buf[cur] + 4 - carry, blk + rxlen - carry, carry);
+        blk   = buf[cur] + 4;
+        rxpos = 0;
+        rxlen = (len < DATA_CRC_INTERVAL) ? len : DATA_CRC_INTERVAL;
+
+        while (waddr < wend) {
+            uint32_t wlen = ((waddr + PROM_WRITE_CHUNK) & ~3) - waddr;
+            if (wlen > wend - waddr)
+                wlen = wend - waddr;
+            rc = prom_write(waddr, wlen, ptr);
+            if (rc != RC_SUCCESS)
+                goto fail;
+            waddr += wlen;
+            ptr   += wlen;
+
+            /* Collect input for the next block while this one programs */
+            if (len > 0)
+                rxpos += getchar_buf(blk + rxpos,
+                                     rxlen + sizeof (compcrc) - rxpos);
+            led_poll();  // Blink power LED if it needs to be blinked
+        }
+    }
+    return (RC_SUCCESS);
+
+fail:
+    (void) puts_binary(&rc, 1);  // Inform remote side
+    timeout = timer_tick_plus_msec(2000);
+    while (!timer_tick_has_elapsed(timeout))
+        (void) getchar();  // Discard input
+    return (rc);
+}
+
+/*
+ * prom_crc() computes the CRC-32 of each flash erase sector overlapping
+ *            the specified address range. The first and last entries are
+ *            trimmed to the range. On entry, count holds the number of
+ *            entries available in sc. On return, it holds the number of
+ *            entries filled. No more than PROM_SCAN_MAX_LEN bytes are
+ *            covered per call, so the caller must check the end of the
+ *            last entry to determine whether the range is complete.
+ */
+rc_t
+prom_crc(uint32_t addr, uint32_t len, smash_crc_t *sc, uint *count)
+{
+    rc_t     rc;
+    __attribute__((aligned(16)))
+    uint8_t  buf[256];
+    uint32_t part1;
+    uint32_t part2;
+    uint32_t total = 0;
+    uint     shift;
+    uint     max = *count;
+
+    *count = 0;
+    if (warn_amiga_not_in_reset())
+        return (RC_BUSY);
+
+    if ((ee_mode == EE_MODE_32) || (ee_mode == EE_MODE_32_SWAP))
+        shift = 2;
+    else
+        shift = 1;
+
+    ee_enable();
+    ee_id(&part1, &part2);
+    while ((len > 0) && (*count < max) && (total < PROM_SCAN_MAX_LEN)) {
+        uint32_t sstart;
+        uint32_t ssize;
+        uint32_t slen;
+        uint32_t crc = 0;
+
+        ee_sector_info(part1, addr >> shift, &sstart, &ssize);
+        slen = ((sstart + ssize) << shift) - addr;
+        if (slen > len)
+            slen = len;
+        sc[*count].sc_addr = addr;
+        sc[*count].sc_len  = slen;
+        total += slen;
+        len   -= slen;
+
+        while (slen > 0) {
+            uint32_t tlen = sizeof (buf);
+            if (tlen > slen)
+                tlen = slen;
+            rc = prom_read(addr, tlen, buf);
+            if (rc != RC_SUCCESS)
+                return (rc);
+            crc   = crc32(crc, buf, tlen);
+            addr += tlen;
+            slen -= tlen;
+        }
+        sc[(*count)++].sc_crc = crc;
+        led_poll();  // Blink power LED if it needs to be blinked
+    }
+    return (RC_SUCCESS);
+}
+
+/*
+ * prom_blank() checks that the flash is erased (all 0xff) over the
+ *              specified address range, stopping at the first byte which
+ *              is not erased. No more than PROM_SCAN_MAX_LEN bytes are
+ *              checked per call. On return, checked holds the number of
+ *              bytes examined and first holds the address of the first
+ *              byte not erased (0xffffffff if none).
+ */
+rc_t
+prom_blank(uint32_t addr, uint32_t len, uint32_t *checked, uint32_t *first)
+{
+    rc_t     rc;
+    __attribute__((aligned(16)))
+    uint32_t buf[64];
+    uint32_t pos = 0;
+
+    *checked = 0;
+    *first   = 0xffffffff;
+    if (len > PROM_SCAN_MAX_LEN)
+        len = PROM_SCAN_MAX_LEN;
+
+    ee_enable();
+    while (pos < len) {
+        uint32_t tlen = sizeof (buf);
+        uint     cur;
+        if (tlen > len - pos)
+            tlen = len - pos;
+        rc = prom_read(addr + pos, tlen, buf);
+        if (rc != RC_SUCCESS)
+            return (rc);
+        for (cur = 0; cur < tlen / 4; cur++)
+            if (buf[cur] != 0xffffffff)
+                break;
+        for (cur *= 4; cur < tlen; cur++) {
+            if (((uint8_t *) buf)[cur] != 0xff) {
+                *first   = addr + pos + cur;
+                *checked = pos + cur + 1;
+                return (RC_SUCCESS);
+            }
+        }
+        pos += tlen;
+        led_poll();  // Blink power LED if it needs to be blinked
+    }
+    *checked = pos;
+    return (RC_SUCCESS);
+}
+
+/*
+ * prom_crc_show() displays the CRC-32 of each flash erase sector in the
+ *                 specified address range.
+ */
+rc_t
+prom_crc_show(uint32_t addr, uint32_t len)
+{
+    smash_crc_t sc[8];
+    uint        count;
+    uint        cur;
+    rc_t        rc;
+
+    while (len > 0) {
+        count = ARRAY_SIZE(sc);
+        rc = prom_crc(addr, len, sc, &count);
+        if (rc != RC_SUCCESS)
+            return (rc);
+        for (cur = 0; cur < count; cur++) {
+            printf("%06lx %06lx %08lx\n",
+                   sc[cur].sc_addr, sc[cur].sc_len, sc[cur].sc_crc);
+            addr += sc[cur].sc_len;
+            len  -= sc[cur].sc_len;
+        }
     }
     return (RC_SUCCESS);
 }
@@ -12,13 +12,20 @@
 #ifndef _PROM_ACCESS_H
 #define _PROM_ACCESS_H
 
+#include "smash_cmd.h"
+
 rc_t prom_read(uint32_t addr, uint width, void *bufp);
 rc_t prom_write(uint32_t addr, uint width, void *bufp);
-rc_t prom_erase(uint mode, uint32_t addr, uint32_t len);
+rc_t prom_erase(uint mode, uint32_t addr, uint32_t len, int verbose);
 rc_t prom_read_binary(uint32_t addr, uint32_t len);
 rc_t prom_write_binary(uint32_t addr, uint32_t len);
+rc_t prom_crc(uint32_t addr, uint32_t len, smash_crc_t *sc, uint *count);
+rc_t prom_crc_show(uint32_t addr, uint32_t len);
+rc_t prom_blank(uint32_t addr, uint32_t len, uint32_t *checked,
+                uint32_t *first);
 void prom_cmd(uint32_t addr, uint32_t cmd);
 rc_t prom_id(void);
+rc_t prom_get_id(uint32_t *part1, uint32_t *part2);
 rc_t prom_status(void);
 rc_t prom_status_clear(void);
 rc_t prom_test(void);
@@ -29,6 +36,8 @@ void prom_mode(uint mode);
 #define ERASE_MODE_SECTOR 1
 #define ERASE_MODE_BLOCK  2
 
+#define PROM_SCAN_MAX_LEN (256 << 10)  // Max bytes per scan request
+
 #define CAPTURE_SW        0
 #define CAPTURE_ADDR      1
 #define CAPTURE_DATA_LO   2
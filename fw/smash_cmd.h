@@ -27,7 +27,11 @@
 #define KS_CMD_FLASH_ID      0x12  // Generate flash ID sequence
 #define KS_CMD_FLASH_ERASE   0x13  // Generate flash erase sequence
 #define KS_CMD_FLASH_WRITE   0x14  // Generate flash write sequence
-#define KS_CMD_FLASH_MWRITE  0x15  // Flash write multiple (not implemented)
+#define KS_CMD_FLASH_MWRITE  0x15  // Generate multiple flash write sequence
+#define KS_CMD_FLASH_CRC     0x16  // Compute CRC of each flash sector (USB)
+#define KS_CMD_FLASH_GETID   0x17  // Report flash chip ids (USB)
+#define KS_CMD_FLASH_BLANK   0x18  // Check flash range is erased (USB)
+#define KS_CMD_FLASH_DERASE  0x19  // Erase flash directly (USB)
 #define KS_CMD_BANK_INFO     0x20  // Get ROM bank information structure
 #define KS_CMD_BANK_SET      0x21  // Set bank (options in high bits)
 #define KS_CMD_BANK_MERGE    0x22  // Merge or unmerge banks
@@ -39,6 +43,8 @@
 #define KS_CMD_MSG_RECEIVE   0x33  // Receive a remote message
 #define KS_CMD_MSG_LOCK      0x34  // Lock or unlock message buffers
 #define KS_CMD_MSG_FLUSH     0x35  // Flush and discard message buffer(s)
+#define KS_CMD_MSG_NOTIFY    0x36  // Unsolicited: Amiga message pending (USB)
+#define KS_CMD_WIDE          0x80  // Amiga: payload sent as wide symbols
 
 /* Status codes returned by Kicksmash */
 #define KS_STATUS_OK       0x0000  // Success
@@ -49,12 +55,14 @@
 #define KS_STATUS_BADLEN   0x0500  // Bad message length
 #define KS_STATUS_NODATA   0x0600  // No data available
 #define KS_STATUS_LOCKED   0x0700  // Resource locked
-#define KS_STATUS_LAST_ENT 0x0800  // Fake status: must always be last + 1
+#define KS_STATUS_NOWIDE   0x0800  // KS_CMD_WIDE sent, but capture is off
+#define KS_STATUS_LAST_ENT 0x0900  // Fake status: must always be last + 1
 
 
 /* Command-specific options (upper byte of command) */
 #define KS_SET_NAME        0x0100  // Set board name
 #define KS_SET_NV          0x0200  // Set non-volatile bytes
+#define KS_SET_WIDE        0x0400  // Enable or disable wide symbol capture
 
 #define KS_GET_NV          0x0200  // Get non-volatile bytes
 
@@ -67,7 +75,11 @@
 
 #define KS_BANK_UNMERGE    0x0100  // Unmerge bank range (KS_BANK_MERGE)
 
+#define KS_DERASE_CHIP     0x0100  // Erase entire chip (KS_CMD_FLASH_DERASE)
+
 #define KS_MSG_ALTBUF      0x0100  // Perform operations on alternate buffer
+#define KS_MSG_PRIORITY    0x0200  // Send message in priority lane
+#define KS_MSG_PRI_MAX     128     // Largest payload to send with priority
 
 #define KS_MSG_UNLOCK      0x0100  // Unlock instead of lock
 
@@ -75,6 +87,17 @@
 #define KS_CLOCK_SET_IFNOT 0x0200  // Set Amiga-relative clock only if not set
 
 #define KS_MSG_STATE_SET   0x0100  // Update Amiga-side app state
+#define KS_MSG_STATE_NOTIFY 0x0200 // Enable KS_CMD_MSG_NOTIFY to USB host
+
+/* Feature bits reported in smash_id_t si_features */
+#define KS_FEATURE_MSG_NOTIFY 0x0002  // Sends KS_CMD_MSG_NOTIFY to USB host
+#define KS_FEATURE_FLASH_CRC  0x0004  // Supports KS_CMD_FLASH_CRC
+#define KS_FEATURE_FLASH_USB  0x0008  // Supports FLASH_GETID, BLANK, DERASE
+#define KS_FEATURE_FLASH_MWRITE 0x0010  // Supports KS_CMD_FLASH_MWRITE
+#define KS_FEATURE_WIDE_SYM   0x0020  // Accepts KS_CMD_WIDE payload framing
+#define KS_FEATURE_MSG_PRIORITY 0x0040  // Has KS_MSG_PRIORITY message lanes
+
+#define KS_MWRITE_MAX      64       // Max words per KS_CMD_FLASH_MWRITE
 
 #define KS_HDR_AND_CRC_LEN (8 + 2 + 2 + 4)  // Magic+Len+Cmd+CRC = 16 bytes
 
@@ -100,6 +123,28 @@
  *        CRC is over all content except magic (includes length and command).
  *        The CRC algorithm is a big endian version of the CRC hardware unit
  *        present in some STM32 processors.
+ *
+ * An Amiga sends each 16-bit value as the ROM address of a read. Kicksmash
+ * also captures ROM address lines above A15, so payload data may instead
+ * be sent as wide symbols when KS_FEATURE_WIDE_SYM is reported. A wide
+ * symbol carries 1 additional bit on 32-bit ROMs (A16) or 2 additional
+ * bits on 16-bit ROMs (A16-A17). Capture of those lines must first be
+ * enabled with KS_CMD_SET | KS_SET_WIDE, after which the Amiga indicates
+ * wide symbols by setting KS_CMD_WIDE in the transmitted command code.
+ * Only payload data is affected; magic, length, command, and CRC are
+ * always 16-bit values.
+ * Payload words are sent in groups of 16 (32-bit) or 8 (16-bit) symbols,
+ * where each group carries one more payload word than it has symbols:
+ * the extra word follows the group in the original data, and is sent
+ * least significant bits first in the additional bits of the group's
+ * symbols. Remaining words which do not fill a group are sent as 16-bit
+ * symbols. KS_CMD_WIDE is not included in the CRC, which is calculated
+ * as if the message had been sent with 16-bit symbols.
+ * Wide symbol capture is off after Kicksmash is reset, in which case a
+ * KS_CMD_WIDE message is not processed but answered with KS_STATUS_NOWIDE.
+ * The Amiga should then resend it with 16-bit symbols and negotiate again.
+ * Capturing the upper address lines needs more STM32 memory bandwidth, so
+ * Amiga software enables it only at the user's request.
  * -----------------------------------------------------------------------
  * All commands will generate a response message which is in a similar
  * format: Magic sequence, Length, Status code, additional data (optional),
@@ -197,8 +242,52 @@
  *       *This command requires participation by code running under AmigaOS
  *        to generate the correct bus addresses to sequence the flash command.
  *   KS_CMD_FLASH_MWRITE
- *        This command will set up a multiple data write sequence for the
- *        flash. It is not currently implemented.
+ *        Up to KS_MWRITE_MAX consecutive 32-bit or 16-bit values may be
+ *        written with a single command. As with KS_CMD_FLASH_WRITE, the
+ *        reply data are the unlock addresses. For each value in turn, the
+ *        Amiga program must generate reads of the unlock addresses followed
+ *        by a read of the data address to write. Kicksmash drives the
+ *        unlock and program data for all values in sequence, so the Amiga
+ *        program can not read flash status until the last value has been
+ *        written. It must instead allow time for each value to program
+ *        before starting the next, and verify the data afterward.
+ *       *This command requires participation by code running under AmigaOS
+ *        to generate the correct bus addresses to sequence the flash command.
+ *   KS_CMD_FLASH_CRC
+ *        Kicksmash will read the flash directly and compute a CRC-32 of
+ *        each erase sector in the specified address range. The command
+ *        payload is the 32-bit start address followed by the 32-bit length,
+ *        both in bytes (big endian). The reply is an array of smash_crc_t,
+ *        one per sector, where the first and last entries are trimmed to
+ *        the requested range. A reply may cover less than the requested
+ *        range, in which case the caller should issue another request
+ *        starting at the end of the last sector reported. This command is
+ *        only available from USB, and requires the Amiga to be held in
+ *        reset (KS_STATUS_LOCKED is returned otherwise).
+ *   KS_CMD_FLASH_GETID
+ *        Kicksmash will put the flash in ID mode and report the chip ids
+ *        and part names in a smash_flash_id_t structure. This command is
+ *        only available from USB, and requires the Amiga to be held in
+ *        reset.
+ *   KS_CMD_FLASH_BLANK
+ *        Kicksmash will check that the flash is erased (all 0xff) over the
+ *        specified range. The command payload is the 32-bit start address
+ *        followed by the 32-bit length, both in bytes (big endian). The
+ *        reply is two 32-bit values: the number of bytes checked and the
+ *        address of the first byte which is not erased (0xffffffff if all
+ *        checked bytes are erased). As with KS_CMD_FLASH_CRC, a single
+ *        reply may cover less than the requested range. This command is
+ *        only available from USB, and requires the Amiga to be held in
+ *        reset.
+ *   KS_CMD_FLASH_DERASE
+ *        Kicksmash will erase flash sectors directly. The command payload
+ *        is the 32-bit start address followed by the 32-bit length, both
+ *        in bytes (big endian). All sectors overlapping the range are
+ *        erased; a length of 0 erases a single sector. If KS_DERASE_CHIP
+ *        is specified, the entire chip is erased and no payload is
+ *        required. The reply is sent when the erase completes, which may
+ *        take many seconds. This command is only available from USB, and
+ *        requires the Amiga to be held in reset.
  *   KS_CMD_GET
  *        Get Kicksmash value. The following option must be specified with
  *            KS_GET_NV - Get non-volatile byte(s). The following byte
@@ -216,6 +305,10 @@
  *                        data to store (there are 32 NV cells).
  *                        NV[0] is the default bank for the switcher to choose
  *                        NV[1] is the timeout (0=infinite)
+ *            KS_SET_WIDE - Enable (non-zero) or disable (zero) capture
+ *                          of the ROM address lines needed to receive
+ *                          KS_CMD_WIDE messages. A 16-bit value follows.
+ *                          This takes effect after the reply is sent.
  *   KS_CMD_BANK_INFO
  *        ROM bank information, having structure bank_info_t, will be
  *        returned to the requester. This information includes the current
@@ -268,6 +361,9 @@
  *              uint16_t amiga_new_bits;
  *              uint16_t expire_msec;  // Time until expiration <= 65 seconds
  *        If expiration is not provided, it will default to 10 seconds.
+ *        Add KS_MSG_STATE_NOTIFY flag (USB host only) to enable
+ *        KS_CMD_MSG_NOTIFY messages until the host leaves service mode
+ *        or has not sent KS_MSG_STATE_NOTIFY again for 10 seconds.
  *   KS_CMD_MSG_INFO
  *        A structure is returned with message buffer space in use and
  *        space available for both the Amiga -> USB Host (atou)
@@ -278,9 +374,20 @@
  *              uint16_t smi_utoa_avail;
  *              uint16_t smi_app_state_amiga;
  *              uint16_t smi_app_state_usb;
+ *        The in use counts include both message lanes of a direction
+ *        (see KS_CMD_MSG_SEND). Space available is for the bulk lane.
  *   KS_CMD_MSG_SEND
  *        Any data provided, including Header and CRC, is sent to the USB host.
  *        See below for payload format.
+ *        Each direction has a bulk lane and a small priority lane. Add
+ *        KS_MSG_PRIORITY to queue the message in the priority lane, which
+ *        is delivered by KS_CMD_MSG_RECEIVE ahead of the bulk lane. Use it
+ *        only for single packet messages of no more than KS_MSG_PRI_MAX
+ *        payload bytes, as continuation packets of a larger message must
+ *        stay in order. If the priority lane is full, KS_STATUS_BADLEN is
+ *        returned and the message may be sent again without the flag.
+ *        Firmware supporting this sets KS_FEATURE_MSG_PRIORITY; older
+ *        firmware ignores the flag.
  *   KS_CMD_MSG_RECEIVE
  *        If there is data pending from the USB host, it will be returned to
  *        the Amiga in the buffer, given there is sufficient space available.
@@ -294,9 +401,17 @@
  *        If the command code includes KS_MSG_UNLOCK, then the specified
  *        lock bits will be unlocked.
  *   KS_CMD_MSG_FLUSH
- *        The receive message buffer will be flushed. For the Amiga, this
- *        is the USB-to-Amiga buffer. If KS_MSG_ALTBUF is specified, then the
- *        opposite-direction buffer will be flushed.
+ *        The receive message buffer (both lanes) will be flushed. For the
+ *        Amiga, this is the USB-to-Amiga buffer. If KS_MSG_ALTBUF is
+ *        specified, then the opposite-direction buffer will be flushed.
+ *   KS_CMD_MSG_NOTIFY
+ *        This is not a command. When enabled by KS_MSG_STATE_NOTIFY,
+ *        Kicksmash sends an unsolicited zero-length message having this
+ *        code as its status when the Amiga -> USB Host buffer becomes
+ *        non-empty. It is only sent between replies, so the USB host may
+ *        block waiting for it instead of polling with KS_CMD_MSG_INFO.
+ *        Firmware supporting this sets KS_FEATURE_MSG_NOTIFY in
+ *        si_features.
  *
  * The payload of KS_CMD_MSG_SEND is normal byte order on the Amiga side,
  * but is byte-swapped when the USB host is dealing with the data. This is
@@ -347,6 +462,19 @@ typedef struct {
     uint8_t  smi_unused[16];             // Unused space
 } smash_msg_info_t;
 
+typedef struct {
+    uint32_t sc_addr;                    // Start address (bytes)
+    uint32_t sc_len;                     // Length covered (bytes)
+    uint32_t sc_crc;                     // CRC-32 of flash contents
+} smash_crc_t;
+
+typedef struct {
+    uint32_t sfi_id[2];                  // Chip id of each flash device
+    uint8_t  sfi_mode;                   // Flash mode (0=32-bit, 1=16-bit)
+    uint8_t  sfi_unused[3];              // Unused space
+    char     sfi_name[2][16];            // Part name of each flash device
+} smash_flash_id_t;
+
 typedef struct {
     uint8_t  km_op;        // Operation to perform (KM_OP_*)
     uint8_t  km_status;    // Status reply
@@ -14,6 +14,7 @@
 #include "main.h"
 #include "uart.h"
 #include <stdbool.h>
+#include <string.h>
 #include "timer.h"
 #include "irq.h"
 #include "usb.h"
@@ -381,6 +382,52 @@ getchar(void)
     return (ch);
 }
 
+/*
+ * getchar_buf() is like getchar(), but copies as many waiting input
+ *               characters as are available, up to len, to the buffer.
+ *               It does not wait for input to arrive.
+ *
+ * @param [out] buf - Buffer for received characters.
+ * @param [in]  len - Maximum number of characters to receive.
+ *
+ * @return      The number of characters received.
+ */
+uint
+getchar_buf(void *buf, uint len)
+{
+    uint8_t *dst = buf;
+    uint     count = 0;
+    int      ch;
+
+    usb_putchar_flush();  // Ensure USB output is flushed
+    usb_poll();
+
+    while (count < len) {
+        uint prod = cons_in_rb_producer;
+        uint cons = cons_in_rb_consumer;
+        uint avail;
+
+        if (cons == prod)
+            break;  // Ring buffer empty
+        if (prod > cons)
+            avail = prod - cons;
+        else
+            avail = sizeof (cons_in_rb) - cons;  // Up to end of ring
+        if (avail > len - count)
+            avail = len - count;
+        memcpy(dst + count, cons_in_rb + cons, avail);
+        cons_in_rb_consumer = (cons + avail) % sizeof (cons_in_rb);
+        count += avail;
+    }
+    if ((count == 0) && (len > 0)) {
+        /* Let getchar() handle UART input with interrupts not working */
+        ch = getchar();
+        if (ch != -1)
+            dst[count++] = ch;
+    }
+    return (count);
+}
+
 void
 CONSOLE_IRQHandler(void)
 {
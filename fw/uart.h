@@ -48,6 +48,13 @@ int puts(const char *str);
  */
 int getchar(void);
 
+/*
+ * getchar_buf() is like getchar(), but copies as many waiting input
+ *               characters as are available, up to len, to the buffer.
+ *               The number of characters received is returned.
+ */
+uint getchar_buf(void *buf, uint len);
+
 /*
  * uart_init() initializes the serial console uart.
  */
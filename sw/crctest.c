@@ -0,0 +1,185 @@
+/*
+ * crctest
+ * -------
+ * Checks the slice-by-4 CRC-32 routines (fw/crc32.c) against the
+ * original byte-at-a-time table calculation, over a range of lengths,
+ * buffer alignments, and starting CRC values, then reports the speed
+ * of each in cycles (or nanoseconds) per byte.
+ *
+ * cc -O2 -o crctest crctest.c ../fw/crc32.c
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../fw/crc32.h"
+
+typedef unsigned int uint;
+
+#define BENCH_LEN    4096     // Buffer size for speed measurement
+#define BENCH_LOOPS  20000    // Passes over the buffer per measurement
+
+static uint32_t ref_table[256];
+static uint32_t rand_state = 1;
+
+static uint8_t
+rand_byte(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16);
+}
+
+/*
+ * ref_init() builds the normal form 0x04C11DB7 table bit by bit, which
+ * is the table fw/crc32.c used before slice-by-4.
+ */
+static void
+ref_init(void)
+{
+    uint     byte;
+    uint     bit;
+    uint32_t crc;
+
+    for (byte = 0; byte < 256; byte++) {
+        crc = byte << 24;
+        for (bit = 0; bit < 8; bit++)
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+        ref_table[byte] = crc;
+    }
+}
+
+static uint32_t
+ref_crc32(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *ptr = buf;
+
+    while (len--)
+        crc = (crc << 8) ^ ref_table[(crc >> 24) ^ *(ptr++)];
+    return (crc);
+}
+
+static uint32_t
+ref_crc32s(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *ptr = buf;
+    size_t         pos;
+
+    for (pos = 0; pos < len; pos++)
+        crc = (crc << 8) ^ ref_table[(crc >> 24) ^ ptr[pos ^ 1]];
+    return (crc);
+}
+
+static uint32_t
+ref_crc32r(uint32_t crc, const void *buf, size_t len)
+{
+    const uint8_t *ptr = (const uint8_t *) buf + len;
+
+    while (len--)
+        crc = (crc << 8) ^ ref_table[(crc >> 24) ^ *(--ptr)];
+    return (crc);
+}
+
+typedef uint32_t (crc_func_t)(uint32_t crc, const void *buf, size_t len);
+
+static const struct {
+    const char *name;
+    crc_func_t *func;
+    crc_func_t *ref;
+    uint        even;  // Length must be even (pairs are swapped)
+} crc_funcs[] = {
+    { "crc32",  crc32,  ref_crc32,  0 },
+    { "crc32s", crc32s, ref_crc32s, 1 },
+    { "crc32r", crc32r, ref_crc32r, 0 },
+};
+
+/*
+ * bench_now() returns a timestamp in CPU cycles where the cycle counter
+ * is available, otherwise in nanoseconds.
+ */
+static uint64_t
+bench_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return (__builtin_ia32_rdtsc());
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+#endif
+}
+
+static double
+bench_one(crc_func_t *func, const uint8_t *buf)
+{
+    volatile uint32_t sink;
+    uint32_t          crc = 0;
+    uint64_t          start;
+    uint              loop;
+
+    start = bench_now();
+    for (loop = 0; loop < BENCH_LOOPS; loop++)
+        crc = func(crc, buf, BENCH_LEN);
+    sink = crc;
+    (void) sink;
+    return ((double) (bench_now() - start) / BENCH_LOOPS / BENCH_LEN);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const uint32_t seed[] = { 0, 0xffffffff, 0x12345678 };
+    uint8_t *buf = malloc(BENCH_LEN + 8);
+    uint     func;
+    uint     len;
+    uint     offset;
+    uint     cur;
+    uint     fails = 0;
+
+    if (buf == NULL) {
+        printf("malloc failed\n");
+        return (1);
+    }
+    ref_init();
+    for (len = 0; len < BENCH_LEN + 8; len++)
+        buf[len] = rand_byte();
+
+    for (func = 0; func < sizeof (crc_funcs) / sizeof (crc_funcs[0]); func++) {
+        for (offset = 0; offset < 4; offset++) {
+            for (len = 0; len <= 600; len++) {
+                if (crc_funcs[func].even && (len & 1))
+                    continue;
+                for (cur = 0; cur < sizeof (seed) / sizeof (seed[0]); cur++) {
+                    uint32_t got = crc_funcs[func].func(seed[cur],
+                                                        buf + offset, len);
+                    uint32_t exp = crc_funcs[func].ref(seed[cur],
+                                                       buf + offset, len);
+                    if (got != exp) {
+                        printf("%s len=%u offset=%u seed=%08x: "
+                               "%08x != %08x\n", crc_funcs[func].name,
+                               len, offset, seed[cur], got, exp);
+                        fails++;
+                    }
+                }
+            }
+        }
+    }
+
+    for (func = 0; func < sizeof (crc_funcs) / sizeof (crc_funcs[0]); func++) {
+        printf("%-6s %6.2f %s/byte (byte table %.2f)\n",
+               crc_funcs[func].name, bench_one(crc_funcs[func].func, buf),
+#if defined(__x86_64__) || defined(__i386__)
+               "cycles",
+#else
+               "ns",
+#endif
+               bench_one(crc_funcs[func].ref, buf));
+    }
+    free(buf);
+    if (fails != 0) {
+        printf("FAIL: %u\n", fails);
+        return (1);
+    }
+    printf("PASS\n");
+    return (0);
+}
@@ -12,9 +12,11 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <assert.h>
 #include <sys/time.h>
 #ifdef __MINGW32__
 #include <sys/utime.h>
@@ -26,9 +28,15 @@ typedef unsigned int uint;
 #else
 #include <termios.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 #include <err.h>
 #include <poll.h>
 #include <sys/statvfs.h>
+#include <sys/mman.h>
+#include <setjmp.h>
+#include <sys/un.h>
+#define HAVE_MMAP
+#define HAVE_UNIX_SOCKET
 #endif
 #include <sys/file.h>
 #include <signal.h>
@@ -46,11 +54,18 @@ typedef unsigned int uint;
 #include <inttypes.h>
 #ifdef LINUX
 #include <usb.h>
+#include <sys/inotify.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#define HAVE_INOTIFY
+#define HAVE_EPOLL
+#define HAVE_DIRSCAN
 #endif
 #include <dirent.h>
 #include "../fw/crc32.h"
 #include "../fw/smash_cmd.h"
 #include "../amiga/host_cmd.h"
+#include "../amiga/sm_lz.h"
 #include "../fw/version.h"
 
 #ifdef __clang__
@@ -85,8 +100,14 @@ static const struct option long_opts[] = {
     { "all",      no_argument,       NULL, 'A' },
     { "addr",     required_argument, NULL, 'a' },
     { "bank",     required_argument, NULL, 'b' },
+    { "bench",    required_argument, NULL, 0x80 + 'b' },
+    { "benchout", required_argument, NULL, 0x80 + 'o' },
+    { "boards",   no_argument,       NULL, 0x80 + 'B' },
     { "delay",    required_argument, NULL, 'D' },
+    { "delta",    no_argument,       NULL, 0x80 + 'd' },
     { "device",   required_argument, NULL, 'd' },
+    { "dirscan",  required_argument, NULL, 0x80 + 's' },
+    { "durable",  no_argument,       NULL, 0x80 + 'D' },
     { "debugfs",  no_argument,       NULL, 0x80 + 'f' },
     { "debugmsg", no_argument,       NULL, 0x80 + 'm' },
     { "erase",    no_argument,       NULL, 'e' },
@@ -94,13 +115,18 @@ static const struct option long_opts[] = {
     { "identify", no_argument,       NULL, 'i' },
     { "help",     no_argument,       NULL, 'h' },
     { "len",      required_argument, NULL, 'l' },
+    { "metrics",  required_argument, NULL, 0x80 + 'e' },
+    { "mmap",     required_argument, NULL, 0x80 + 'M' },
     { "mount",    required_argument, NULL, 'm' },
     { "Mount",    required_argument, NULL, 'M' },
     { "read",     no_argument,       NULL, 'r' },
+    { "readahead", required_argument, NULL, 0x80 + 'r' },
     { "swap",     required_argument, NULL, 's' },
     { "term",     no_argument,       NULL, 't' },
     { "verify",   no_argument,       NULL, 'v' },
+    { "workers",  required_argument, NULL, 0x80 + 'w' },
     { "write",    no_argument,       NULL, 'w' },
+    { "writebehind", required_argument, NULL, 0x80 + 'W' },
     { "yes",      no_argument,       NULL, 'y' },
     { NULL,       no_argument,       NULL,  0  }
 };
@@ -135,9 +161,18 @@ static const char usage_text[] =
 "    -A --all                show all verify miscompares\n"
 "    -a --addr <addr>        starting EEPROM address\n"
 "    -b --bank <num>         starting EEPROM address as multiple of file size\n"
+"       --bench <test>       run benchmark (handles, flashcmd, ring,\n"
+"                            loopback, msg, flash)\n"
+"       --benchout <file>    also write --bench results as CSV or .json\n"
+"       --boards             file serve every Kicksmash board found\n"
 "    -c --clock [show|set]   show or set Kicksmash time of day clock\n"
 "    -D --delay <msec>       pacing delay between sent characters (ms)\n"
+"       --delta              with -w, only erase and write changed sectors\n"
 "    -d --device <filename>  serial device to use (e.g. /dev/ttyACM0)\n"
+"                            (repeat with -m to file serve several boards)\n"
+"       --dirscan <num>      file serve: directory scan threads (0 = off)\n"
+"       --durable            file serve: acknowledge writes only after data\n"
+"                            is written, and sync files on close\n"
 #ifdef FILE_DEBUG
 "       --debugfs            debug filesystem operations\n"
 #endif
@@ -149,11 +184,18 @@ static const char usage_text[] =
 "    -h --help               display usage\n"
 "    -i --identify           identify installed EEPROM\n"
 "    -l --len <num>          length in bytes\n"
+"       --metrics <file>     message mode: export Prometheus metrics to\n"
+"                            file, or unix:<path> to serve on a socket\n"
+"       --mmap <KB>          file serve: map read-only files of at least\n"
+"                            this size (0 = off)\n"
 "    -m --mount <vol:> <dir> file serve directory path to Amiga volume\n"
 "    -r --read <filename>    read EEPROM and write to file\n"
+"       --readahead <KB>     file serve read-ahead window (0 = off)\n"
 "    -s --swap <mode>        byte swap mode (2301, 3210, 1032, noswap=0123)\n"
 "    -v --verify <filename>  verify file matches EEPROM contents\n"
+"       --workers <num>      message mode worker threads (0 = none)\n"
 "    -w --write <filename>   read file and write to EEPROM\n"
+"       --writebehind <KB>   file serve write-behind buffer (0 = off)\n"
 "    -t --term [<command>]   operate in terminal mode (CLI) to KickSmash\n"
 "    -y --yes                answer all prompts with 'yes'\n"
 "    TERM_DEBUG=`tty`        env variable for communication debug output\n"
@@ -226,8 +268,10 @@ timespec_to_timeval(struct timeval *tv, struct timespec *ts)
 #define MODE_VERIFY    0x0010
 #define MODE_WRITE     0x0020
 #define MODE_MSG       0x0040
+#define MODE_BENCH     0x0080
 #define MODE_CLOCK_GET 0x0100
 #define MODE_CLOCK_SET 0x0200
+#define MODE_DELTA     0x0400
 
 /* XXX: Need to register USB device ID at http://pid.codes */
 #define MX_VENDOR 0x1209
@@ -240,6 +284,7 @@ timespec_to_timeval(struct timeval *tv, struct timespec *ts)
 #define ADDR_NOT_SPECIFIED        0xffffffff
 
 #define DATA_CRC_INTERVAL         256  // How often CRC is sent (bytes)
+#define DATA_CRC_WINDOW           8    // Blocks sent before awaiting status
 
 /* Enable for gdb debug */
 #undef DEBUG_CTRL_C_KILL
@@ -292,6 +337,12 @@ timespec_to_timeval(struct timeval *tv, struct timespec *ts)
 typedef unsigned int uint;
 
 static void discard_input(int timeout);
+static uint send_ks_cmd(uint cmd, void *txbuf, uint txlen, void *rxbuf,
+                        uint rxmax, uint *rxstatus, uint *rxlen, uint flags);
+static const char *smash_err(uint code);
+static void writebehind_flush_all(void);
+
+#define KS_REPLY_SLOW BIT(1)  // send_ks_cmd(): allow 100 seconds for reply
 
 typedef enum {
     RC_SUCCESS = 0,
@@ -307,6 +358,10 @@ typedef enum {
 } bool_t;
 
 typedef struct amiga_vol amiga_vol_t;
+typedef struct readahead readahead_t;
+typedef struct writebehind writebehind_t;
+typedef struct dircache dircache_t;
+typedef struct dirscan dirscan_t;
 
 typedef struct handle_ent handle_ent_t;
 typedef struct handle_ent {
@@ -317,16 +372,45 @@ typedef struct handle_ent {
     uint          he_type;     // One of HM_TYPE_*
     uint          he_mode;     // Open mode
     uint          he_count;    // Open count
+    uint          he_refs;     // References held by handle_get() callers
     uint          he_entnum;   // Volume directory entry number
     DIR          *he_dir;      // Open directory pointer
     amiga_vol_t  *he_avolume;  // Volume descriptor for this handle
     handle_ent_t *he_volume;   // Volume for this file
-    handle_ent_t *he_next;     // Next in list of all handles
+    readahead_t  *he_ra;       // Read-ahead cache (read-only files)
+    writebehind_t *he_wb;      // Write-behind buffer (files open for write)
+    dev_t         he_dev;      // Device of file (files open for write)
+    ino_t         he_ino;      // Inode of file (files open for write)
+    uint8_t      *he_map;      // Mapped file data (large read-only files)
+    off64_t       he_mapsize;  // Size of he_map
+    off64_t       he_mappos;   // Current file position when mapped
+    dircache_t   *he_dc;       // Directory cache being read or built
+    uint          he_dcpos;    // Read offset in he_dc
+    dirscan_t    *he_ds;       // Background directory scan
+    handle_ent_t *he_next;     // Next in handle pool free list
+    handle_ent_t *he_name_next; // Next in handle name index chain
+    char         *he_strmem;   // Allocated name / path storage (if any)
+    char          he_strbuf[96]; // Inline name / path storage
 } handle_ent_t;
 
-static handle_ent_t *handle_list_head = NULL;
-static handle_t      handle_unique = 0;
-static handle_t      handle_default = 0;  // Volume directory is default
+/*
+ * Handles are located through an open-addressed (linear probe) hash
+ * table keyed by handle number. A secondary index chains handles by
+ * name for volume lookup. The name index has the same number of buckets
+ * as the handle table, and both are grown together. Handle entries are
+ * carved from pool slabs and recycled through a free list.
+ *
+ * Requests run concurrently on worker threads, so an entry found by
+ * handle_get() is referenced until the request finishes. A handle freed
+ * meanwhile (by FCLOSE on another lane) is removed from the table at
+ * once, but its entry is not recycled until the last reference is gone.
+ */
+#define HANDLE_HASH_MIN    256  // Initial handle hash slots (power of 2)
+#define HANDLE_POOL_CHUNK  256  // Handle entries allocated per pool slab
+#define HANDLE_HELD_MAX    4    // References one thread may hold at once
+
+static __thread handle_ent_t *handle_held[HANDLE_HELD_MAX];
+static __thread uint          handle_held_count;
 
 #define AV_FLAG_BOOTABLE 0x01
 
@@ -339,7 +423,6 @@ typedef struct amiga_vol {
     uint          av_flags;
     int           av_bootpri;
 } amiga_vol_t;
-amiga_vol_t *amiga_vol_head = NULL;
 
 /*
  * ARRAY_SIZE() provides a count of the number of elements in an array.
@@ -349,25 +432,89 @@ amiga_vol_t *amiga_vol_head = NULL;
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(array) ((size_t) (sizeof (array) / sizeof ((array)[0])))
 #endif
-#define RX_RING_SIZE 8192
-#define TX_RING_SIZE 4096
-static volatile uint8_t rx_rb[RX_RING_SIZE];
-static volatile uint    rx_rb_producer    = 0;
-static volatile uint    rx_rb_consumer    = 0;
-static volatile uint8_t  tx_rb[TX_RING_SIZE];
-static volatile uint    tx_rb_producer = 0;
-static volatile uint    tx_rb_consumer = 0;
+#define RX_RING_SIZE  65536  // Must be a power of 2
+#define TX_RING_SIZE  16384  // Must be a power of 2
+#define USB_PKT_SIZE  64     // USB full-speed bulk packet size
+#define TX_WRITE_MAX  (USB_PKT_SIZE * 64)  // Largest single device write
+
+/*
+ * Single producer, single consumer ring buffer. The producer and consumer
+ * indexes are free-running; only the low bits are used to index rb_buf.
+ * The lock and condition variable are only taken by a side which must
+ * block (buffer empty or full) and by the opposite side to wake it.
+ */
+typedef struct {
+    uint8_t         *rb_buf;
+    uint             rb_size;
+    volatile uint    rb_producer;
+    volatile uint    rb_consumer;
+    volatile uint    rb_waiters;   // Threads blocked in ring_wait()
+    pthread_mutex_t  rb_lock;
+    pthread_cond_t   rb_cond;      // Signaled on data or space
+} ring_t;
+
+/*
+ * Per-board state. Each Kicksmash board served by this process has its
+ * own device, ring buffers, command channel, volume list, and handle
+ * namespace. Host resources such as the directory cache, read-ahead
+ * thread, and message worker threads are shared by all boards.
+ *
+ * board_cur is the board being serviced by the current thread. It starts
+ * out NULL in every thread, so a thread which acts on a board must first
+ * set it; each thread entry point which does so asserts that it is set.
+ */
+typedef struct board board_t;
+struct board {
+    board_t         *b_next;
+    uint             b_unit;              // Board number (0 = first)
+    char             b_device_name[PATH_MAX];
+    char            *b_host_device_name;
 #ifdef __MINGW32__
-static HANDLE           dev_handle        = INVALID_HANDLE_VALUE;
+    HANDLE           b_dev_handle;
 #else
-static int              dev_fd            = -1;
+    int              b_dev_fd;
+#endif
+    bool_t           b_rx_throttled;      // Input paused: rx ring full
+    pthread_t        b_msg_thread;        // Message mode service thread
+    ring_t           b_rx_ring;           // Device receive ring buffer
+    ring_t           b_tx_ring;           // Device transmit ring buffer
+    uint8_t          b_rx_buf[RX_RING_SIZE];
+    uint8_t          b_tx_buf[TX_RING_SIZE];
+    uint16_t         b_ks_features;       // si_features (KS_FEATURE_*)
+    bool_t           b_ks_features_valid; // b_ks_features was queried
+    bool_t           b_ks_in_service;     // In "prom service" mode
+    volatile uint    b_msg_notify;        // KS_CMD_MSG_NOTIFY not yet seen
+    pthread_mutex_t  b_ks_cmd_lock;       // Serializes command / reply
+    pthread_mutex_t  b_send_msg_lock;     // Keeps reply packets together
+    uint16_t         b_app_state_send[2];
+    amiga_vol_t     *b_vol_head;          // Exported volumes
+    handle_ent_t   **b_handle_hash;       // Indexed by he_handle
+    handle_ent_t   **b_handle_name_hash;  // Indexed by he_name
+    uint             b_handle_hash_size;  // Slots (power of 2)
+    uint             b_handle_hash_bits;  // log2(b_handle_hash_size)
+    uint             b_handle_count;      // Handles in use
+    handle_ent_t    *b_handle_pool_free;  // Free handle entries
+    handle_t         b_handle_unique;
+    handle_t         b_handle_default;    // Volume directory is default
+    pthread_mutex_t  b_handle_lock;       // Handle table lock
+    uint64_t         b_serial_rx;         // Bytes read from device
+    uint64_t         b_serial_tx;         // Bytes written to device
+    smash_msg_info_t b_msg_info;          // Last KS_CMD_MSG_INFO sample
+    bool_t           b_msg_info_valid;    // b_msg_info was sampled
+};
+
+static board_t           board_first;
+static board_t          *board_head  = &board_first;
+static uint              board_count = 1;
+static __thread board_t *board_cur;
+
+static uint    tx_write_max = TX_WRITE_MAX;
+#ifndef __MINGW32__
 static int              got_terminfo      = 0;
 static struct termios   saved_term;  // good terminal settings
 #endif
 static int              running           = 1;
 static uint             ic_delay          = 0;  // Pacing delay (ms)
-static char             device_name[PATH_MAX];
-static char            *host_device_name  = device_name;
 static bool             terminal_mode     = FALSE;
 static bool             force_yes         = FALSE;
 static uint             swapmode          = SWAPMODE_AUTO;
@@ -672,25 +819,176 @@ is_same_path(const char *path1, const char *path2)
 #endif
 
 /*
- * rx_rb_put() stores a next character in the device receive ring buffer.
+ * ring_used() returns the number of bytes waiting in a ring buffer.
+ */
+static inline uint
+ring_used(const ring_t *rb)
+{
+    return (rb->rb_producer - rb->rb_consumer);
+}
+
+/*
+ * ring_space() returns the number of bytes which may be added to a ring
+ *              buffer before it is completely full.
+ */
+static inline uint
+ring_space(const ring_t *rb)
+{
+    return (rb->rb_size - (rb->rb_producer - rb->rb_consumer));
+}
+
+/*
+ * ring_wake() wakes any thread blocked in ring_wait() on the specified
+ *             ring buffer. The lock is only taken when there is a waiter.
+ *
+ * @param [in]  rb - The ring buffer.
+ */
+static void
+ring_wake(ring_t *rb)
+{
+    __sync_synchronize();  // Index update must be visible before the check
+    if (rb->rb_waiters != 0) {
+        pthread_mutex_lock(&rb->rb_lock);
+        pthread_cond_broadcast(&rb->rb_cond);
+        pthread_mutex_unlock(&rb->rb_lock);
+    }
+}
+
+/*
+ * ring_put() copies as much of the specified buffer as will fit into a
+ *            ring buffer. Only the producer side may call this function.
  *
- * @param [in]  ch - The character to store in the device receive ring buffer.
+ * @param [in]  rb  - The ring buffer.
+ * @param [in]  buf - Data to store.
+ * @param [in]  len - Number of bytes to store.
  *
- * @return      0 = Success.
- * @return      1 = Failure (ring buffer is full).
+ * @return      Number of bytes stored (0 = ring buffer is full).
  */
-static int
-rx_rb_put(int ch)
+static uint
+ring_put(ring_t *rb, const void *buf, uint len)
 {
-    uint new_prod = (rx_rb_producer + 1) % sizeof (rx_rb);
+    uint prod   = rb->rb_producer;
+    uint offset = prod & (rb->rb_size - 1);
+    uint space  = ring_space(rb);
+    uint len1;
 
-    if (new_prod == rx_rb_consumer)
-        return (1);  // Discard input because ring buffer is full
+    if (len > space)
+        len = space;
+    if (len == 0)
+        return (0);
 
-    rx_rb[rx_rb_producer] = (uint8_t) ch;
+    len1 = rb->rb_size - offset;
+    if (len1 > len)
+        len1 = len;
+    memcpy(rb->rb_buf + offset, buf, len1);
+    if (len > len1)
+        memcpy(rb->rb_buf, (const uint8_t *) buf + len1, len - len1);
     __sync_synchronize();  // Memory barrier required here on ARM
-    rx_rb_producer = new_prod;
-    return (0);
+    rb->rb_producer = prod + len;
+    ring_wake(rb);
+    return (len);
+}
+
+/*
+ * ring_get() copies up to the specified number of bytes out of a ring
+ *            buffer. Only the consumer side may call this function.
+ *
+ * @param [in]  rb  - The ring buffer.
+ * @param [out] buf - Buffer to receive data.
+ * @param [in]  len - Maximum number of bytes to retrieve.
+ *
+ * @return      Number of bytes retrieved (0 = ring buffer is empty).
+ */
+static uint
+ring_get(ring_t *rb, void *buf, uint len)
+{
+    uint cons   = rb->rb_consumer;
+    uint offset = cons & (rb->rb_size - 1);
+    uint used   = ring_used(rb);
+    uint len1;
+
+    if (len > used)
+        len = used;
+    if (len == 0)
+        return (0);
+
+    __sync_synchronize();  // Data must not be read before the index
+    len1 = rb->rb_size - offset;
+    if (len1 > len)
+        len1 = len;
+    memcpy(buf, rb->rb_buf + offset, len1);
+    if (len > len1)
+        memcpy((uint8_t *) buf + len1, rb->rb_buf, len - len1);
+    __sync_synchronize();
+    rb->rb_consumer = cons + len;
+    ring_wake(rb);
+    return (len);
+}
+
+/*
+ * ring_deadline() converts a relative timeout in milliseconds to the
+ *                 absolute time used by pthread_cond_timedwait().
+ *
+ * @param [out] ts   - The absolute time.
+ * @param [in]  msec - Milliseconds from now.
+ */
+static void
+ring_deadline(struct timespec *ts, int msec)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ts->tv_sec  = tv.tv_sec + msec / 1000;
+    ts->tv_nsec = tv.tv_usec * 1000 + (msec % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+/*
+ * ring_wait() blocks until a ring buffer has data available or, if
+ *             for_space is set, until it has space available.
+ *
+ * @param [in]  rb        - The ring buffer.
+ * @param [in]  for_space - TRUE to wait for space rather than for data.
+ * @param [in]  msec      - Maximum time to wait (negative = forever).
+ *
+ * @return      0 = Timeout.
+ * @return      1 = Data or space available.
+ */
+static int
+ring_wait(ring_t *rb, bool_t for_space, int msec)
+{
+    struct timespec ts;
+    int             rc = 0;
+    int             wrc = 0;
+
+    if (msec >= 0)
+        ring_deadline(&ts, msec);
+
+    pthread_mutex_lock(&rb->rb_lock);
+    __sync_fetch_and_add(&rb->rb_waiters, 1);  // Full barrier
+    while (1) {
+        if (for_space) {
+            if (ring_space(rb) != 0) {
+                rc = 1;
+                break;
+            }
+        } else if (ring_used(rb) != 0) {
+            rc = 1;
+            break;
+        }
+        if (wrc != 0)
+            break;  // Timeout
+        if (msec < 0)
+            pthread_cond_wait(&rb->rb_cond, &rb->rb_lock);
+        else
+            wrc = pthread_cond_timedwait(&rb->rb_cond, &rb->rb_lock, &ts);
+    }
+    __sync_fetch_and_sub(&rb->rb_waiters, 1);
+    pthread_mutex_unlock(&rb->rb_lock);
+    return (rc);
 }
 
 /*
@@ -705,15 +1003,70 @@ rx_rb_put(int ch)
 static int
 rx_rb_get(void)
 {
-    int ch;
+    uint8_t byte;
 
-    if (rx_rb_consumer == rx_rb_producer)
+    if (ring_get(&board_cur->b_rx_ring, &byte, 1) == 0)
         return (-1);  // Ring buffer empty
+    return (byte);
+}
 
-    ch = rx_rb[rx_rb_consumer];
-    __sync_synchronize();
-    rx_rb_consumer = (rx_rb_consumer + 1) % sizeof (rx_rb);
-    return (ch);
+/*
+ * msg_notify_post() records that Kicksmash sent KS_CMD_MSG_NOTIFY and
+ *                   wakes run_message_mode() if it is in msg_notify_wait().
+ *                   The notification may be received by whichever thread
+ *                   is collecting a command reply, so it is kept in a flag
+ *                   which only msg_notify_wait() clears.
+ */
+static void
+msg_notify_post(void)
+{
+    board_cur->b_msg_notify = 1;
+    ring_wake(&board_cur->b_rx_ring);
+}
+
+/*
+ * msg_notify_wait() waits up to the specified number of milliseconds for
+ *                   a KS_CMD_MSG_NOTIFY, which it then consumes. It also
+ *                   returns when data arrives in the device receive ring
+ *                   buffer, as that may be a notification which no other
+ *                   thread is waiting to receive.
+ *
+ * @param  [in]  msec - Maximum time to wait.
+ */
+static void
+msg_notify_wait(int msec)
+{
+    ring_t         *rb = &board_cur->b_rx_ring;
+    struct timespec ts;
+    int             wrc = 0;
+
+    ring_deadline(&ts, msec);
+    pthread_mutex_lock(&rb->rb_lock);
+    __sync_fetch_and_add(&rb->rb_waiters, 1);  // Full barrier
+    while ((board_cur->b_msg_notify == 0) && (ring_used(rb) == 0) &&
+           (wrc == 0)) {
+        wrc = pthread_cond_timedwait(&rb->rb_cond, &rb->rb_lock, &ts);
+    }
+    __sync_fetch_and_sub(&rb->rb_waiters, 1);
+    pthread_mutex_unlock(&rb->rb_lock);
+    board_cur->b_msg_notify = 0;
+}
+
+/*
+ * rx_rb_wait() waits up to the specified number of milliseconds for data
+ *              to arrive in the device receive ring buffer. It returns
+ *              immediately if the ring buffer is not empty.
+ *
+ * @param  [in]  msec - Maximum time to wait.
+ * @return       0 = Timeout.
+ * @return       1 = Data arrived.
+ */
+static int
+rx_rb_wait(int msec)
+{
+    if (ring_used(&board_cur->b_rx_ring) != 0)
+        return (1);
+    return (ring_wait(&board_cur->b_rx_ring, FALSE, msec));
 }
 
 /*
@@ -727,38 +1080,36 @@ rx_rb_get(void)
 static int
 tx_rb_put(int ch)
 {
-    uint new_prod = (tx_rb_producer + 1) % sizeof (tx_rb);
-
-    if (new_prod == tx_rb_consumer)
-        return (1);  // Discard input because ring buffer is full
-
-    tx_rb[tx_rb_producer] = (uint8_t) ch;
-    __sync_synchronize();
-    tx_rb_producer = new_prod;
-    return (0);
+    uint8_t byte = (uint8_t) ch;
+    return (ring_put(&board_cur->b_tx_ring, &byte, 1) == 0);
 }
 
 /*
- * tx_rb_get() returns the next character to be sent to the remote device.
- *             A value of -1 is returned if there are no characters waiting
- *             to be received in the tty input ring buffer.
+ * tx_rb_put_all() stores a block of data to be sent to the remote device,
+ *                 blocking while the transmit ring buffer is full.
  *
- * @param  [in]  None.
- * @return       The next input character.
- * @return       -1 = No input character is pending.
+ * @param [in]  buf  - Data to send.
+ * @param [in]  len  - Number of bytes to send.
+ * @param [in]  msec - Maximum time to wait for the writer to make space.
+ *
+ * @return      Number of bytes stored (less than len only on timeout).
  */
-static int
-tx_rb_get(void)
+static size_t
+tx_rb_put_all(const void *buf, size_t len, int msec)
 {
-    int ch;
-
-    if (tx_rb_consumer == tx_rb_producer)
-        return (-1);  // Ring buffer empty
+    const uint8_t *data = (const uint8_t *) buf;
+    size_t         pos  = 0;
 
-    ch = tx_rb[tx_rb_consumer];
-    __sync_synchronize();
-    tx_rb_consumer = (tx_rb_consumer + 1) % sizeof (tx_rb);
-    return (ch);
+    while (pos < len) {
+        size_t count = len - pos;
+        if (count > TX_RING_SIZE)
+            count = TX_RING_SIZE;
+        count = ring_put(&board_cur->b_tx_ring, data + pos, count);
+        if ((count == 0) && (ring_wait(&board_cur->b_tx_ring, TRUE, msec) == 0))
+            break;  // Timeout
+        pos += count;
+    }
+    return (pos);
 }
 
 /*
@@ -768,13 +1119,12 @@ tx_rb_get(void)
  *               already full.
  *
  * @param  [in]  None.
- * @return       Count of space remaining in the ring buffer (9=Full).
+ * @return       Count of space remaining in the ring buffer (0=Full).
  */
 static uint
 tx_rb_space(void)
 {
-    uint diff = tx_rb_consumer - tx_rb_producer;
-    return (diff + sizeof (tx_rb) - 1) % sizeof (tx_rb);
+    return (ring_space(&board_cur->b_tx_ring));
 }
 
 /*
@@ -788,12 +1138,108 @@ tx_rb_space(void)
 static bool_t
 tx_rb_flushed(void)
 {
-    if (tx_rb_consumer == tx_rb_producer)
+    if (ring_used(&board_cur->b_tx_ring) == 0)
         return (TRUE);   // Ring buffer empty
     else
         return (FALSE);  // Ring buffer has output pending
 }
 
+/*
+ * ring_init() prepares an empty ring buffer using the specified storage.
+ *
+ * @param [out] rb   - The ring buffer.
+ * @param [in]  buf  - Ring buffer storage.
+ * @param [in]  size - Size of storage (must be a power of 2).
+ */
+static void
+ring_init(ring_t *rb, uint8_t *buf, uint size)
+{
+    memset(rb, 0, sizeof (*rb));
+    rb->rb_buf  = buf;
+    rb->rb_size = size;
+    pthread_mutex_init(&rb->rb_lock, NULL);
+    pthread_cond_init(&rb->rb_cond, NULL);
+}
+
+/*
+ * board_init() initializes the per-board state of a Kicksmash board.
+ *
+ * @param [out] board - The board.
+ * @param [in]  unit  - Board number.
+ */
+static void
+board_init(board_t *board, uint unit)
+{
+    memset(board, 0, sizeof (*board));
+    board->b_unit = unit;
+    board->b_host_device_name = board->b_device_name;
+#ifdef __MINGW32__
+    board->b_dev_handle = INVALID_HANDLE_VALUE;
+#else
+    board->b_dev_fd = -1;
+#endif
+    ring_init(&board->b_rx_ring, board->b_rx_buf, RX_RING_SIZE);
+    ring_init(&board->b_tx_ring, board->b_tx_buf, TX_RING_SIZE);
+    pthread_mutex_init(&board->b_ks_cmd_lock, NULL);
+    pthread_mutex_init(&board->b_send_msg_lock, NULL);
+    pthread_mutex_init(&board->b_handle_lock, NULL);
+}
+
+/*
+ * board_new() adds another Kicksmash board to the end of the board list.
+ *
+ * @param [in]  name - Device path of the board.
+ *
+ * @return      The new board.
+ */
+static board_t *
+board_new(const char *name)
+{
+    board_t *board = malloc(sizeof (*board));
+    board_t *prev;
+
+    if (board == NULL)
+        err(EXIT_FAILURE, "Could not allocate board");
+    board_init(board, board_count++);
+    snprintf(board->b_device_name, sizeof (board->b_device_name), "%s", name);
+    for (prev = board_head; prev->b_next != NULL; prev = prev->b_next)
+        ;
+    prev->b_next = board;
+    return (board);
+}
+
+/*
+ * board_get_by_name() returns the board using the specified device, which
+ *                     may have been named by a different path.
+ *
+ * @param [in]  name - Device path of the board.
+ *
+ * @return      The board, or NULL if no board uses that device.
+ */
+static board_t *
+board_get_by_name(const char *name)
+{
+    board_t *board;
+    char    *rname = realpath(name, NULL);
+
+    for (board = board_head; board != NULL; board = board->b_next) {
+        char *bname;
+        bool_t match;
+
+        if (strcmp(board->b_device_name, name) == 0)
+            break;
+        if ((rname == NULL) ||
+            ((bname = realpath(board->b_device_name, NULL)) == NULL))
+            continue;
+        match = (strcmp(bname, rname) == 0);
+        free(bname);
+        if (match)
+            break;  // Same device by another path (e.g. /dev/serial/by-id)
+    }
+    free(rname);
+    return (board);
+}
+
 #ifdef __MINGW32__
 #include <windows.h>
 static void
@@ -886,6 +1332,14 @@ calc_timeout_msec(struct timeval *tv_timeout, int msec)
     tv_timeout->tv_usec %= 1000000;
 }
 
+static uint64_t
+bench_usec(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((uint64_t) tv.tv_sec * 1000000 + tv.tv_usec);
+}
+
 /*
  * send_ll_bin() sends a binary block of data to the remote programmer.
  *
@@ -895,28 +1349,47 @@ calc_timeout_msec(struct timeval *tv_timeout, int msec)
 static int
 send_ll_bin(const void *buf, size_t len)
 {
-    int timeout_count = 0;
-    const uint8_t *data = (const uint8_t *)buf;
-    size_t pos = 0;
-    struct timeval tv_timeout;
-    calc_timeout_msec(&tv_timeout, 500);
+    size_t pos = tx_rb_put_all(buf, len, 500);
 
-    while (pos < len) {
-        if (tx_rb_put(*data)) {
-            if (time_has_elapsed(&tv_timeout)) {
-                printf("Send timeout at 0x%zx\n", pos);
-                return (1);  // Timeout
-            }
-            printf("-\n"); fflush(stdout);  // XXX: shouldn't happen
-            timeout_count++;
-            continue;        // Try again
+    if (pos < len) {
+        printf("Send timeout at 0x%zx\n", pos);
+        return (1);  // Timeout
+    }
+    return (0);
+}
+
+/*
+ * send_ll_bin_swap16() sends a binary block of data to the remote
+ * programmer, swapping odd and even bytes on the way into the transmit
+ * ring. An odd length is rounded up, with a zero pad byte.
+ *
+ * @param  [in] data  - Data to send to the programmer.
+ * @param  [in] len   - Number of bytes to send (before rounding up).
+ */
+static int
+send_ll_bin_swap16(const void *buf, size_t len)
+{
+    const uint8_t *data = (const uint8_t *)buf;
+    size_t pos;
+    size_t len_roundup = (len + 1) & ~1;
+    uint8_t chunk[1024];
+
+    for (pos = 0; pos < len_roundup; pos += sizeof (chunk)) {
+        size_t clen = len_roundup - pos;
+        size_t cur;
+        size_t sent;
+
+        if (clen > sizeof (chunk))
+            clen = sizeof (chunk);
+        for (cur = 0; cur < clen; cur++) {
+            size_t src = (pos + cur) ^ 1;
+            chunk[cur] = (src < len) ? data[src] : 0;
         }
-        if (timeout_count) {
-            calc_timeout_msec(&tv_timeout, 500);
-            timeout_count = 0;
+        sent = tx_rb_put_all(chunk, clen, 500);
+        if (sent < clen) {
+            printf("Send timeout at 0x%zx\n", pos + sent);
+            return (1);  // Timeout
         }
-        data++;
-        pos++;
     }
     return (0);
 }
@@ -945,11 +1418,11 @@ config_dev(void)
     /* Get the current DCB, and adjust to our liking */
     memset(&port, 0, sizeof (port));
     port.DCBlength = sizeof (port);
-    if (GetCommState(dev_handle, &port) == 0)
+    if (GetCommState(board_cur->b_dev_handle, &port) == 0)
         system_error("getting comm state");
     if (BuildCommDCB("baud=115200 parity=n data=8 stop=1", &port) == 0)
         system_error("building comm DCB");
-    if (!SetCommState(dev_handle, &port))
+    if (!SetCommState(board_cur->b_dev_handle, &port))
         system_error("adjusting port settings");
 
     /* Set short timeouts on the COM port */
@@ -958,13 +1431,13 @@ config_dev(void)
     timeouts.ReadTotalTimeoutConstant = 0;
     timeouts.WriteTotalTimeoutMultiplier = 0;
     timeouts.WriteTotalTimeoutConstant = 10;
-    if (!SetCommTimeouts(dev_handle, &timeouts))
+    if (!SetCommTimeouts(board_cur->b_dev_handle, &timeouts))
         system_error("setting port time-outs.");
 
-    if (!EscapeCommFunction(dev_handle, CLRDTR))
+    if (!EscapeCommFunction(board_cur->b_dev_handle, CLRDTR))
         system_error("clearing DTR");
     Sleep(200);
-    if (!EscapeCommFunction(dev_handle, SETDTR))
+    if (!EscapeCommFunction(board_cur->b_dev_handle, SETDTR))
         system_error("setting DTR");
 
     return (RC_SUCCESS);
@@ -976,19 +1449,19 @@ config_dev(int fd)
     struct termios tty;
 
     if (flock(fd, LOCK_EX | LOCK_NB) < 0)
-        warnx("Failed to get exclusive lock on %s", device_name);
+        warnx("Failed to get exclusive lock on %s", board_cur->b_device_name);
 
 #ifdef OSX
     /* Disable non-blocking */
     if (fcntl(fd, F_SETFL, 0) < 0)
-        warnx("Failed to enable blocking on %s", device_name);
+        warnx("Failed to enable blocking on %s", board_cur->b_device_name);
 #endif
 
     (void) memset(&tty, 0, sizeof (tty));
 
     if (tcgetattr(fd, &tty) != 0) {
         /* Failed to get terminal information */
-        warn("Failed to get tty info for %s", device_name);
+        warn("Failed to get tty info for %s", board_cur->b_device_name);
         close(fd);
         return (RC_FAILURE);
     }
@@ -1001,7 +1474,7 @@ config_dev(int fd)
 
     if (cfsetispeed(&tty, B115200) ||
         cfsetospeed(&tty, B115200)) {
-        warn("failed to set %s speed to 115200 BPS", device_name);
+        warn("failed to set %s speed to 115200 BPS", board_cur->b_device_name);
         close(fd);
         return (RC_FAILURE);
     }
@@ -1048,7 +1521,7 @@ config_dev(int fd)
            tty.c_cc[0], tty.c_cc[1], tty.c_cc[2], tty.c_cc[3]);
 #endif
     if (tcsetattr(fd, TCSANOW, &tty)) {
-        warn("failed to set %s attributes", device_name);
+        warn("failed to set %s attributes", board_cur->b_device_name);
         close(fd);
         return (RC_FAILURE);
     }
@@ -1071,13 +1544,13 @@ reopen_dev(void)
     time_t        now       = time(NULL);
     bool_t        printed   = FALSE;
 
-    if (dev_handle != INVALID_HANDLE_VALUE) {
-        CloseHandle(dev_handle);
-        dev_handle = INVALID_HANDLE_VALUE;
+    if (board_cur->b_dev_handle != INVALID_HANDLE_VALUE) {
+        CloseHandle(board_cur->b_dev_handle);
+        board_cur->b_dev_handle = INVALID_HANDLE_VALUE;
     }
     if (now - last_time > 5) {
         printed = TRUE;
-        printf("\n<< Closed %s >>", device_name);
+        printf("\n<< Closed %s >>", board_cur->b_device_name);
         fflush(stdout);
     }
 top:
@@ -1085,21 +1558,21 @@ top:
         if (running == 0)
             return;
         time_delay_msec(400);
-        dev_handle = CreateFile(host_device_name,
+        board_cur->b_dev_handle = CreateFile(board_cur->b_host_device_name,
                                 GENERIC_READ | GENERIC_WRITE,
                                 0,
                                 NULL,
                                 OPEN_EXISTING,
                                 0,
                                 NULL);
-    } while (dev_handle == INVALID_HANDLE_VALUE);
+    } while (board_cur->b_dev_handle == INVALID_HANDLE_VALUE);
 
     if (running == 0)
         return;
 
     if (config_dev() != RC_SUCCESS) {
-        CloseHandle(dev_handle);
-        dev_handle = INVALID_HANDLE_VALUE;
+        CloseHandle(board_cur->b_dev_handle);
+        board_cur->b_dev_handle = INVALID_HANDLE_VALUE;
         goto top;
     }
 
@@ -1107,7 +1580,7 @@ top:
     if (now - last_time > 5) {
         if (printed == FALSE)
             printf("\n");
-        printf("\r<< Reopened %s >>\n", device_name);
+        printf("\r<< Reopened %s >>\n", board_cur->b_device_name);
     }
     last_time = now;
 }
@@ -1115,7 +1588,7 @@ top:
 static void
 reopen_dev(void)
 {
-    int           temp      = dev_fd;
+    int           temp      = board_cur->b_dev_fd;
     static time_t last_time = 0;
     time_t        now       = time(NULL);
     bool_t        printed   = FALSE;
@@ -1125,15 +1598,16 @@ reopen_dev(void)
     oflags |= O_NONBLOCK;
 #endif
 
-    dev_fd = -1;
+    board_cur->b_dev_fd = -1;
     if (temp != -1) {
         if (flock(temp, LOCK_UN | LOCK_NB) < 0)
-            warnx("Failed to release exclusive lock on %s", device_name);
+            warnx("Failed to release exclusive lock on %s",
+                  board_cur->b_device_name);
         close(temp);
     }
     if (now - last_time > 5) {
         printed = TRUE;
-        printf("\n<< Closed %s >>", device_name);
+        printf("\n<< Closed %s >>", board_cur->b_device_name);
         fflush(stdout);
     }
 top:
@@ -1141,7 +1615,8 @@ top:
         if (running == 0)
             return;
         time_delay_msec(400);
-    } while ((temp = open(host_device_name, oflags | O_RDWR)) == -1);
+    } while ((temp = open(board_cur->b_host_device_name,
+                          oflags | O_RDWR)) == -1);
 
     if (config_dev(temp) != RC_SUCCESS) {
         close(temp);
@@ -1149,37 +1624,29 @@ top:
     }
 
     /* Hand off the new I/O fd */
-    dev_fd = temp;
+    board_cur->b_dev_fd = temp;
 
     now = time(NULL);
     if (now - last_time > 5) {
         if (printed == FALSE)
             printf("\n");
-        printf("\r<< Reopened %s >>\n", device_name);
+        printf("\r<< Reopened %s >>\n", board_cur->b_device_name);
     }
     last_time = now;
 }
 #endif
 
+static FILE *serial_log_fp  = NULL;  // TERM_DEBUG communication log
+static uint  serial_log_hex = 0;
+
 /*
- * th_serial_reader() is a thread to read from serial port and store it in
- *                    a circular buffer.  The buffer's contents are retrieved
- *                    asynchronously by another thread.
- *
- * @param [in]  arg - Unused argument.
- *
- * @return      NULL pointer (unused)
- *
- * @see         serial_in_snapshot(), serial_in_count(), serial_in_advance(),
- *              serial_in_flush()
+ * serial_log_open() opens the communication debug log, if requested by
+ *                   the TERM_DEBUG environment variable.
  */
-static void *
-th_serial_reader(void *arg)
+static void
+serial_log_open(void)
 {
     const char *log_file;
-    FILE       *log_fp = NULL;
-    uint        log_hex = 0;
-    uint8_t     buf[128];
 
     if ((log_file = getenv("TERM_DEBUG")) != NULL) {
         /*
@@ -1188,88 +1655,255 @@ th_serial_reader(void *arg)
          *     TERM_DEBUG=/dev/pts/4 hostsmash -t
          *     TERM_DEBUG=/tmp/term_debug hostsmash -t -d /dev/ttyACM0
          */
-        log_fp = fopen(log_file, "wb");
-        if (log_fp == NULL)
+        serial_log_fp = fopen(log_file, "wb");
+        if (serial_log_fp == NULL)
             warn("Unable to open %s for log", log_file);
-        log_hex = (getenv("TERM_DEBUG_HEX") != NULL);
+        serial_log_hex = (getenv("TERM_DEBUG_HEX") != NULL);
     }
-    while (running) {
-#ifdef __MINGW32__
-        DWORD len;
-        while (ReadFile(dev_handle, buf, sizeof (buf), &len, NULL))
-#else
-        ssize_t len;
-        while ((len = read(dev_fd, buf, sizeof (buf))) >= 0)
-#endif
-        {
-            if (len == 0) {
-#if defined(USE_NON_BLOCKING_TTY) || defined(__MINGW32__)
-                /* No input available */
-                time_delay_msec(10);
-                continue;
-#else
-                /* Error reading */
-                break;
-#endif
+}
+
+/*
+ * serial_rx_input() delivers data read from the current board's device
+ *                   to the receive ring buffer (or to the terminal in
+ *                   terminal mode). It blocks while the ring is full.
+ *
+ * @param [in]  buf - Data read from the device.
+ * @param [in]  len - Number of bytes read.
+ */
+static void
+serial_rx_input(const uint8_t *buf, uint len)
+{
+    board_cur->b_serial_rx += len;
+    if (terminal_mode) {
+        fwrite(buf, len, 1, stdout);
+        fflush(stdout);
+    } else {
+        uint pos = 0;
+        while (pos < len) {
+            pos += ring_put(&board_cur->b_rx_ring, buf + pos, len - pos);
+            if ((pos < len) &&
+                (ring_wait(&board_cur->b_rx_ring, TRUE, 1000) == 0)) {
+                /* Consumer has stalled; keep waiting for space */
+                printf("RX ring buffer overflow\n");
             }
             if (running == 0)
                 break;
-
-            if (terminal_mode) {
-                fwrite(buf, len, 1, stdout);
-                fflush(stdout);
-            } else {
-                uint pos;
-                for (pos = 0; pos < len; pos++) {
-                    while (rx_rb_put(buf[pos]) == 1) {
-                        time_delay_msec(1);
-                        printf("RX ring buffer overflow\n");
-                        if (running == 0)
-                            break;
-                    }
-                    if (running == 0)
-                        break;
-                }
-            }
-            if (log_fp != NULL) {
-                if (log_hex) {
-                    uint pos;
-                    fprintf(log_fp, " ");
-                    for (pos = 0; pos < len; pos++)
-                        fprintf(log_fp, " %02x", buf[pos]);
-                    fprintf(log_fp, "\"");
-                    for (pos = 0; pos < len; pos++) {
-                        char ch = buf[pos];
-                        if ((ch <= ' ') || (ch > '~') || (ch == '"'))
-                            ch = '_';
-                        fprintf(log_fp, "%c", ch);
-                    }
-                    fprintf(log_fp, "\"");
-                } else {
-                    fwrite(buf, len, 1, log_fp);
-                }
-                fflush(log_fp);
+        }
+    }
+    if (serial_log_fp != NULL) {
+        if (serial_log_hex) {
+            uint pos;
+            fprintf(serial_log_fp, " ");
+            for (pos = 0; pos < len; pos++)
+                fprintf(serial_log_fp, " %02x", buf[pos]);
+            fprintf(serial_log_fp, "\"");
+            for (pos = 0; pos < len; pos++) {
+                char ch = buf[pos];
+                if ((ch <= ' ') || (ch > '~') || (ch == '"'))
+                    ch = '_';
+                fprintf(serial_log_fp, "%c", ch);
             }
+            fprintf(serial_log_fp, "\"");
+        } else {
+            fwrite(buf, len, 1, serial_log_fp);
         }
-        if (running == 0)
-            break;
-        reopen_dev();
+        fflush(serial_log_fp);
     }
-    printf("not running\n");
+}
 
-    if (log_fp != NULL)
-        fclose(log_fp);
-    return (NULL);
+#ifdef HAVE_EPOLL
+static int serial_epfd = -1;  // Device input of all boards
+
+/*
+ * serial_poll_add() adds the current board's device to the set polled
+ *                   by th_serial_poller().
+ */
+static void
+serial_poll_add(void)
+{
+    struct epoll_event ev;
+
+    ev.events = EPOLLIN;
+    ev.data.ptr = board_cur;
+    if (epoll_ctl(serial_epfd, EPOLL_CTL_ADD, board_cur->b_dev_fd, &ev) != 0)
+        warn("Failed to poll %s", board_cur->b_device_name);
 }
 
 /*
- * th_serial_writer() is a thread to read from the tty input ring buffer and
+ * th_serial_reopen() is a short-lived thread which waits for a board's
+ *                    device to reappear, so that the other boards are
+ *                    still serviced while it is missing.
+ *
+ * @param [in]  arg - The board.
+ *
+ * @return      NULL pointer (unused)
+ */
+static void *
+th_serial_reopen(void *arg)
+{
+    board_cur = arg;
+    assert(board_cur != NULL);
+    reopen_dev();
+    if (running)
+        serial_poll_add();
+    return (NULL);
+}
+
+/*
+ * th_serial_poller() is a thread which reads from the devices of all
+ *                    boards, storing received data in each board's
+ *                    receive ring buffer. A board whose ring buffer stays
+ *                    full is not polled until its consumer catches up.
+ *
+ * @param [in]  arg - Unused argument.
+ *
+ * @return      NULL pointer (unused)
+ */
+static void *
+th_serial_poller(void *arg)
+{
+    struct epoll_event ev[16];
+    uint8_t            buf[4096];
+    uint               throttled = 0;
+    int                count;
+    int                cur;
+
+    while (running) {
+        count = epoll_wait(serial_epfd, ev, ARRAY_SIZE(ev),
+                           throttled ? 10 : 1000);
+        if (throttled != 0) {
+            board_t *board;
+            for (board = board_head; board != NULL; board = board->b_next) {
+                if (!board->b_rx_throttled ||
+                    (ring_space(&board->b_rx_ring) == 0))
+                    continue;
+                ev[0].events = EPOLLIN;
+                ev[0].data.ptr = board;
+                (void) epoll_ctl(serial_epfd, EPOLL_CTL_MOD,
+                                 board->b_dev_fd, &ev[0]);
+                board->b_rx_throttled = FALSE;
+                throttled--;
+            }
+        }
+        for (cur = 0; cur < count; cur++) {
+            uint    space;
+            ssize_t len;
+
+            board_cur = ev[cur].data.ptr;
+            space = ring_space(&board_cur->b_rx_ring);
+            if ((space == 0) && !terminal_mode &&
+                ring_wait(&board_cur->b_rx_ring, TRUE, 10)) {
+                /* Consumer caught up without holding up other boards */
+                space = ring_space(&board_cur->b_rx_ring);
+            }
+            if (terminal_mode || (space > sizeof (buf)))
+                space = sizeof (buf);
+            if (space == 0) {
+                /* Consumer has stalled; stop polling until it makes space */
+                struct epoll_event pause;
+                pause.events = 0;
+                pause.data.ptr = board_cur;
+                (void) epoll_ctl(serial_epfd, EPOLL_CTL_MOD,
+                                 board_cur->b_dev_fd, &pause);
+                board_cur->b_rx_throttled = TRUE;
+                throttled++;
+                continue;
+            }
+            len = read(board_cur->b_dev_fd, buf, space);
+            if (len > 0) {
+                serial_rx_input(buf, len);
+                continue;
+            }
+            if ((len < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+                continue;
+            if ((len == 0) && !(ev[cur].events & (EPOLLHUP | EPOLLERR)))
+                continue;  // No input available
+
+            /* Device went away; wait for it in a separate thread */
+            if (running) {
+                pthread_attr_t thread_attr;
+                pthread_t      thread_id;
+
+                (void) epoll_ctl(serial_epfd, EPOLL_CTL_DEL,
+                                 board_cur->b_dev_fd, NULL);
+                if (board_cur->b_rx_throttled) {
+                    board_cur->b_rx_throttled = FALSE;
+                    throttled--;
+                }
+                pthread_attr_init(&thread_attr);
+                pthread_attr_setdetachstate(&thread_attr,
+                                            PTHREAD_CREATE_DETACHED);
+                if (pthread_create(&thread_id, &thread_attr,
+                                   th_serial_reopen, board_cur))
+                    warn("failed to create %s reopen thread",
+                         board_cur->b_device_name);
+            }
+        }
+    }
+    return (NULL);
+}
+#else /* !HAVE_EPOLL */
+
+/*
+ * th_serial_reader() is a thread to read from serial port and store it in
+ *                    a circular buffer.  The buffer's contents are retrieved
+ *                    asynchronously by another thread. There is one reader
+ *                    thread per board.
+ *
+ * @param [in]  arg - The board.
+ *
+ * @return      NULL pointer (unused)
+ *
+ * @see         serial_in_snapshot(), serial_in_count(), serial_in_advance(),
+ *              serial_in_flush()
+ */
+static void *
+th_serial_reader(void *arg)
+{
+    uint8_t buf[4096];
+
+    board_cur = arg;
+    assert(board_cur != NULL);
+    while (running) {
+#ifdef __MINGW32__
+        DWORD len;
+        while (ReadFile(board_cur->b_dev_handle, buf, sizeof (buf), &len, NULL))
+#else
+        ssize_t len;
+        while ((len = read(board_cur->b_dev_fd, buf, sizeof (buf))) >= 0)
+#endif
+        {
+            if (len == 0) {
+#if defined(USE_NON_BLOCKING_TTY) || defined(__MINGW32__)
+                /* No input available */
+                time_delay_msec(10);
+                continue;
+#else
+                /* Error reading */
+                break;
+#endif
+            }
+            if (running == 0)
+                break;
+            serial_rx_input(buf, len);
+        }
+        if (running == 0)
+            break;
+        reopen_dev();
+    }
+    printf("not running\n");
+    return (NULL);
+}
+#endif /* !HAVE_EPOLL */
+
+/*
+ * th_serial_writer() is a thread to read from the tty input ring buffer and
  *                    write data to the serial port.  The separation of tty
  *                    input from serial writes allows the program to still be
  *                    responsive to user interaction even when blocked on
- *                    serial writes.
+ *                    serial writes. There is one writer thread per board.
  *
- * @param [in]  arg - Unused argument.
+ * @param [in]  arg - The board.
  *
  * @return      NULL pointer (unused)
  *
@@ -1279,63 +1913,68 @@ th_serial_reader(void *arg)
 static void *
 th_serial_writer(void *arg)
 {
-    int ch;
-    uint pos = 0;
-    char lbuf[64];
+    uint8_t lbuf[TX_WRITE_MAX];
+    uint    pos = 0;   // Bytes held in lbuf
+    uint    sent = 0;  // Bytes of lbuf already written to the device
 
+    board_cur = arg;
+    assert(board_cur != NULL);
     while (1) {
-        ch = tx_rb_get();
-        if (ch >= 0)
-            lbuf[pos++] = ch;
-        if (((ch < 0) && (pos > 0)) ||
-             (pos >= sizeof (lbuf)) || (ic_delay != 0)) {
-#ifdef __MINGW32__
-            DWORD count;
-            if (dev_handle == INVALID_HANDLE_VALUE) {
-                time_delay_msec(500);
-                if (pos >= sizeof (lbuf))
-                    pos--;
+        if (sent == pos) {
+            uint avail = ring_used(&board_cur->b_tx_ring);
+            if (avail == 0) {
+                if (!running)
+                    break;
+                ring_wait(&board_cur->b_tx_ring, FALSE, 100);
                 continue;
             }
-            if (WriteFile(dev_handle, lbuf, pos, &count, NULL) == 0) {
-                /* Wait for reader thread to close / reopen */
-                time_delay_msec(500);
-                if (pos >= sizeof (lbuf))
-                    pos--;
-                continue;
+            if (ic_delay != 0) {
+                avail = 1;  // Inter-character pacing delay was specified
+            } else {
+                /*
+                 * Coalesce as many whole USB packets as are available
+                 * into a single write. A partial packet is only sent by
+                 * itself when nothing else is pending.
+                 */
+                if (avail > tx_write_max)
+                    avail = tx_write_max;
+                if (avail > USB_PKT_SIZE)
+                    avail &= ~(USB_PKT_SIZE - 1);
             }
+            pos = ring_get(&board_cur->b_tx_ring, lbuf, avail);
+            sent = 0;
+        }
+#ifdef __MINGW32__
+        DWORD count;
+        if ((board_cur->b_dev_handle == INVALID_HANDLE_VALUE) ||
+            (WriteFile(board_cur->b_dev_handle, lbuf + sent, pos - sent, &count,
+                       NULL) == 0)) {
+            /* Wait for reader thread to close / reopen */
+            time_delay_msec(500);
+            continue;
+        }
 #else
-            ssize_t count;
-            if (dev_fd == -1) {
-                time_delay_msec(500);
-                if (pos >= sizeof (lbuf))
-                    pos--;
-                continue;
-            }
-            if ((count = write(dev_fd, lbuf, pos)) < 0) {
-                /* Wait for reader thread to close / reopen */
-                time_delay_msec(500);
-                if (pos >= sizeof (lbuf))
-                    pos--;
+        ssize_t count;
+        if ((board_cur->b_dev_fd == -1) ||
+            ((count = write(board_cur->b_dev_fd, lbuf + sent,
+                            pos - sent)) < 0)) {
+            if ((board_cur->b_dev_fd != -1) && (errno == EAGAIN)) {
+                time_delay_msec(1);  // Non-blocking device is full
                 continue;
             }
+            /* Wait for reader thread to close / reopen */
+            time_delay_msec(500);
+            continue;
+        }
 #endif
-            if (ic_delay) {
-                /* Inter-character pacing delay was specified */
-                time_delay_msec(ic_delay);
-            }
-
 #ifdef DEBUG_TRANSFER
-            printf(">%02x\n", lbuf[0]);
+        printf(">%02x\n", lbuf[sent]);
 #endif
-            if (count < pos) {
-                printf("sent only %ld of %u\n", (long) count, pos);
-            }
-            pos = 0;
-        } else if (ch < 0) {
-            time_delay_msec(10);
-            if (!running)
-                break;
+        sent += count;
+        board_cur->b_serial_tx += count;
+        if (ic_delay) {
+            /* Inter-character pacing delay was specified */
+            time_delay_msec(ic_delay);
         }
     }
     return (NULL);
@@ -1352,7 +1991,7 @@ serial_open(bool_t verbose)
 {
 #ifdef __MINGW32__
     /* Open the COM port */
-    dev_handle = CreateFile(host_device_name,
+    board_cur->b_dev_handle = CreateFile(board_cur->b_host_device_name,
                             GENERIC_READ | GENERIC_WRITE,
                             0,
                             NULL,
@@ -1360,14 +1999,14 @@ serial_open(bool_t verbose)
                             0,
                             NULL);
 
-    if (dev_handle == INVALID_HANDLE_VALUE) {
-        warnx("Failed to open %s", device_name);
+    if (board_cur->b_dev_handle == INVALID_HANDLE_VALUE) {
+        warnx("Failed to open %s", board_cur->b_device_name);
         system_error("");
         return (RC_FAILURE);
     }
 
     if (config_dev()) {
-        CloseHandle(dev_handle);
+        CloseHandle(board_cur->b_dev_handle);
         return (RC_FAILURE);
     }
     return (RC_SUCCESS);
@@ -1379,19 +2018,20 @@ serial_open(bool_t verbose)
 #endif
 
     /* First verify the file exists */
-    dev_fd = open(host_device_name, oflags | O_RDONLY);
-    if (dev_fd == -1) {
-        warn("Failed to open %s for read", device_name);
+    board_cur->b_dev_fd = open(board_cur->b_host_device_name,
+                               oflags | O_RDONLY);
+    if (board_cur->b_dev_fd == -1) {
+        warn("Failed to open %s for read", board_cur->b_device_name);
         return (RC_FAILURE);
     }
-    close(dev_fd);
+    close(board_cur->b_dev_fd);
 
-    dev_fd = open(host_device_name, oflags | O_RDWR);
-    if (dev_fd == -1) {
-        warn("Failed to open %s for write", device_name);
+    board_cur->b_dev_fd = open(board_cur->b_host_device_name, oflags | O_RDWR);
+    if (board_cur->b_dev_fd == -1) {
+        warn("Failed to open %s for write", board_cur->b_device_name);
         return (RC_FAILURE);
     }
-    return (config_dev(dev_fd));
+    return (config_dev(board_cur->b_dev_fd));
 #endif
 }
 
@@ -1408,6 +2048,7 @@ serial_open(bool_t verbose)
 static void
 at_exit_func(void)
 {
+    writebehind_flush_all();
 #ifndef __MINGW32__
     if (got_terminfo) {
         got_terminfo = 0;
@@ -1442,21 +2083,43 @@ sig_exit(int sig)
 #endif
 
 /*
- * create_threads() sets up the communication threads with the programmer.
+ * create_threads() sets up the communication threads with the programmer
+ *                  of the current board. Device input for all boards is
+ *                  handled by a single poller thread, where supported.
  */
 static void
 create_threads(void)
 {
     pthread_attr_t thread_attr;
     pthread_t      thread_id;
+    static bool_t  started = FALSE;
 
-    /* Create thread */
     pthread_attr_init(&thread_attr);
     pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
-    if (pthread_create(&thread_id, &thread_attr, th_serial_reader, NULL))
-        err(EXIT_FAILURE, "failed to create %s reader thread", device_name);
-    if (pthread_create(&thread_id, &thread_attr, th_serial_writer, NULL))
-        err(EXIT_FAILURE, "failed to create %s writer thread", device_name);
+    if (started == FALSE) {
+        started = TRUE;
+        serial_log_open();
+#ifdef HAVE_EPOLL
+        serial_epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (serial_epfd == -1)
+            err(EXIT_FAILURE, "failed to create device poll set");
+        if (pthread_create(&thread_id, &thread_attr, th_serial_poller, NULL))
+            err(EXIT_FAILURE, "failed to create device poller thread");
+#endif
+    }
+
+    /* Create threads */
+#ifdef HAVE_EPOLL
+    serial_poll_add();
+#else
+    if (pthread_create(&thread_id, &thread_attr, th_serial_reader,
+                       board_cur))
+        err(EXIT_FAILURE, "failed to create %s reader thread",
+            board_cur->b_device_name);
+#endif
+    if (pthread_create(&thread_id, &thread_attr, th_serial_writer, board_cur))
+        err(EXIT_FAILURE, "failed to create %s writer thread",
+            board_cur->b_device_name);
 }
 
 /*
@@ -1481,8 +2144,9 @@ receive_ll(void *buf, size_t buflen, int timeout, bool exact_bytes)
     calc_timeout_msec(&tv_timeout, 500);
 
     while (received < buflen) {
-        int ch = rx_rb_get();
-        if (ch == -1) {
+        uint count = ring_get(&board_cur->b_rx_ring, data + received,
+                              buflen - received);
+        if (count == 0) {
             if (time_has_elapsed(&tv_timeout)) {
                 if (exact_bytes && ((timeout > 50) || (received == 0))) {
                     printf("Receive timeout (%d ms): got %d of %zu bytes\n",
@@ -1491,14 +2155,14 @@ receive_ll(void *buf, size_t buflen, int timeout, bool exact_bytes)
                 return (received);
             }
             timeout_count++;
+            rx_rb_wait(10);
             continue;
         }
         if (timeout_count) {
             calc_timeout_msec(&tv_timeout, 500);
             timeout_count = 0;
         }
-        *(data++) = ch;
-        received++;
+        received += count;
     }
     return (received);
 }
@@ -1662,18 +2326,10 @@ receive_ll_crc(void *buf, size_t buflen)
 static int
 send_ll_str(const char *cmd)
 {
-    int timeout_count = 0;
-    while (*cmd != '\0') {
-        if (tx_rb_put(*cmd)) {
-            time_delay_msec(1);
-            if (timeout_count++ >= 1000) {
-                return (1);  // Timeout
-            }
-        } else {
-            timeout_count = 0;
-            cmd++;
-        }
-    }
+    size_t len = strlen(cmd);
+
+    if (tx_rb_put_all(cmd, len, 1000) < len)
+        return (1);  // Timeout
     return (0);
 }
 
@@ -1693,7 +2349,7 @@ discard_input(int timeout)
     while (!time_has_elapsed(&tv_timeout)) {
         int ch = rx_rb_get();
         if (ch == -1) {
-            time_delay_msec(1);
+            rx_rb_wait(1);
             continue;
         }
     }
@@ -1726,16 +2382,19 @@ discard_input(int timeout)
  *
  * As the remote side receives data bytes, it will send status for every
  * 256 bytes of data received. The sender will continue sending while
- * waiting for the status to arrive, another 128 bytes. In this way,
- * the data transport is not throttled by turn-around time, but is still
- * throttled by how fast the programmer can actually write to the EEPROM.
+ * waiting for the status to arrive, up to DATA_CRC_WINDOW blocks. The
+ * programmer sends status for a block before writing it to the EEPROM,
+ * so the window keeps its input buffer full while it programs. In this
+ * way, the data transport is not throttled by turn-around time, but is
+ * still throttled by how fast the programmer can actually write to the
+ * EEPROM. The window must fit in the programmer's 4K input buffer.
  */
 static int
 send_ll_crc(const uint8_t *data, size_t len)
 {
     uint     pos = 0;
     uint32_t crc = 0;
-    uint32_t cap_pos[2];
+    uint32_t cap_pos[DATA_CRC_WINDOW];
     uint     cap_count = 0;
     uint     cap_prod  = 0;
     uint     cap_cons  = 0;
@@ -1821,7 +2480,7 @@ wait_for_text(const char *str, int timeout)
     while (*ptr != '\0') {
         ch = rx_rb_get();
         if (ch == -1) {
-            time_delay_msec(1);
+            rx_rb_wait(1);
             if (++timeout_count >= timeout) {
                 return (1);
             }
@@ -1849,6 +2508,7 @@ wait_for_text(const char *str, int timeout)
 static int
 send_cmd(const char *cmd)
 {
+    board_cur->b_ks_in_service = FALSE;     // Newline below exits service mode
     send_ll_str("\025");       // ^U  (delete any command text)
     discard_input(50);         // Wait for buffered output to arrive
     send_ll_str("\n");         // ^M  (request new command prompt)
@@ -2113,6 +2773,244 @@ unrecognized:
     }
 }
 
+/*
+ * ks_service_enter() puts Kicksmash in USB message service mode, if it is
+ *                    not already there, so that binary KS commands may be
+ *                    sent. Any command sent with send_cmd() will exit
+ *                    service mode.
+ *
+ * @return       Kicksmash features (KS_FEATURE_*), or 0 on failure.
+ */
+static uint
+ks_service_enter(void)
+{
+    if (!board_cur->b_ks_in_service) {
+        if (send_cmd("prom service"))
+            return (0);  // send_cmd() reported "timeout" in this case
+        board_cur->b_ks_in_service = TRUE;
+    }
+    if (!board_cur->b_ks_features_valid) {
+        smash_id_t id;
+        uint       status;
+        if ((send_ks_cmd(KS_CMD_ID, NULL, 0, &id, sizeof (id),
+                         &status, NULL, 0) != 0) ||
+            (status != KS_STATUS_OK)) {
+            return (0);
+        }
+        board_cur->b_ks_features = SWAP16(id.si_features);
+        board_cur->b_ks_features_valid = TRUE;
+    }
+    return (board_cur->b_ks_features);
+}
+
+/*
+ * ks_flash_cmd() sends a binary flash command having an address and length
+ *                payload to Kicksmash, which must already be in service
+ *                mode.
+ *
+ * @param  [in]  cmd    - KS_CMD_FLASH_* command and options.
+ * @param  [in]  addr   - Flash address (bytes).
+ * @param  [in]  len    - Length (bytes).
+ * @param  [out] rxbuf  - Reply buffer.
+ * @param  [in]  rxmax  - Size of reply buffer.
+ * @param  [out] rxlen  - Length of reply data.
+ * @param  [in]  flags  - Reply flags (KS_REPLY_SLOW).
+ * @return       0 - Success.
+ * @return       1 - Failure (reported to the user).
+ */
+static int
+ks_flash_cmd(uint cmd, uint addr, uint len, void *rxbuf, uint rxmax,
+             uint *rxlen, uint flags)
+{
+    uint32_t req[2];
+    uint     status;
+    uint     rc;
+
+    req[0] = SWAP32(addr);
+    req[1] = SWAP32(len);
+    rc = send_ks_cmd(cmd, req, sizeof (req), rxbuf, rxmax, &status, rxlen,
+                     flags);
+    if (rc != 0) {
+        printf("KS command %x failed: %d (%s)\n", cmd, rc, smash_err(rc));
+        return (1);
+    }
+    if (status == KS_STATUS_LOCKED) {
+        printf("Fail: Amiga is not in reset\n");
+        return (1);
+    }
+    if (status != KS_STATUS_OK) {
+        printf("KS command %x failure: %d (%s)\n",
+               cmd, status, smash_err(status));
+        return (1);
+    }
+    return (0);
+}
+
+/*
+ * ks_flash_getid() requests the flash chip ids from Kicksmash using the
+ *                  binary command channel.
+ *
+ * @param  [out] fid - Flash id information (host byte order).
+ * @return       0 - Success.
+ * @return       1 - Failure (reported to the user).
+ */
+static int
+ks_flash_getid(smash_flash_id_t *fid)
+{
+    uint rxlen = 0;
+
+    if (ks_flash_cmd(KS_CMD_FLASH_GETID, 0, 0, fid, sizeof (*fid),
+                     &rxlen, 0))
+        return (1);
+    if (rxlen < sizeof (*fid)) {
+        printf("Short flash id reply (%u bytes)\n", rxlen);
+        return (1);
+    }
+    fid->sfi_id[0] = SWAP32(fid->sfi_id[0]);
+    fid->sfi_id[1] = SWAP32(fid->sfi_id[1]);
+    fid->sfi_name[0][sizeof (fid->sfi_name[0]) - 1] = '\0';
+    fid->sfi_name[1][sizeof (fid->sfi_name[1]) - 1] = '\0';
+    return (0);
+}
+
+/*
+ * ks_flash_id_known() returns TRUE if all flash parts in use for the
+ *                     current mode have been recognized by Kicksmash.
+ */
+static bool_t
+ks_flash_id_known(const smash_flash_id_t *fid)
+{
+    if (strcmp(fid->sfi_name[0], "Unknown") == 0)
+        return (FALSE);
+    if (((fid->sfi_mode == 0) || (fid->sfi_mode == 4)) &&
+        (strcmp(fid->sfi_name[1], "Unknown") == 0)) {
+        return (FALSE);
+    }
+    return (TRUE);
+}
+
+/*
+ * eeprom_erase_cmd() sends an erase command to the programmer and waits
+ *                    for it to complete, displaying progress output.
+ *
+ * @param  [in]  cmd   - The "prom erase" command to send.
+ * @return       0 - Erase successful.
+ * @return       1 - Erase failed.
+ */
+static int
+eeprom_erase_cmd(const char *cmd)
+{
+    int  rxcount;
+    char cmd_output[1024];
+    int  count;
+    int  no_data;
+
+    if (send_cmd(cmd))
+        return (1);  // send_cmd() reported "timeout" in this case
+
+    no_data = 0;
+    for (count = 0; count < 1000; count++) {  // 100 seconds max
+        if (recv_output(cmd_output, sizeof (cmd_output), &rxcount, 100))
+            return (1); // "timeout" was reported in this case
+        if (rxcount == 0) {
+            if (no_data++ == 40) {
+                printf("Receive timeout\n");
+                return (1);  // No output for 4 seconds
+            }
+        } else {
+            no_data = 0;
+            printf("%.*s", rxcount, cmd_output);
+            fflush(stdout);
+            if ((strstr(cmd_output, "FAIL") != NULL) ||
+                (strstr(cmd_output, "Invalid>") != NULL)) {
+                return (1);
+            }
+            if (strstr(cmd_output, "CMD>") != NULL) {
+                /* Normal end */
+                break;
+            }
+        }
+    }
+    return (0);
+}
+
+/*
+ * eeprom_erase_range() erases all sectors overlapping the specified range
+ *                      without prompting the user.
+ *
+ * @param  [in]  addr  - The EEPROM starting address to erase.
+ * @param  [in]  len   - The length (in bytes) to erase.
+ * @return       0 - Erase successful.
+ * @return       1 - Erase failed.
+ */
+static int
+eeprom_erase_range(uint addr, uint len)
+{
+    char cmd[64];
+
+    if (ks_service_enter() & KS_FEATURE_FLASH_USB) {
+        return (ks_flash_cmd(KS_CMD_FLASH_DERASE, addr, len, NULL, 0, NULL,
+                             KS_REPLY_SLOW));
+    }
+    snprintf(cmd, sizeof (cmd), "prom erase %x %x", addr, len);
+    return (eeprom_erase_cmd(cmd));
+}
+
+/*
+ * eeprom_erase_bin() is eeprom_erase() using the binary command channel.
+ *
+ * @param  [in]  addr  - The EEPROM starting address to erase.
+ *                       ADDR_NOT_SPECIFIED will cause the entire chip to
+ *                       be erased.
+ * @param  [in]  len   - The length (in bytes) to erase. A value of
+ *                       EEPROM_SIZE_NOT_SPECIFIED will cause a single
+ *                       sector to be erased.
+ * @return       0 - Erase successful.
+ * @return       1 - Erase failed.
+ */
+static int
+eeprom_erase_bin(uint addr, uint len)
+{
+    smash_flash_id_t fid;
+    char             prompt[80];
+    uint64_t         start;
+    uint64_t         usec;
+    uint             cmd = KS_CMD_FLASH_DERASE;
+
+    if (ks_flash_getid(&fid))
+        return (1);
+    if (!ks_flash_id_known(&fid)) {
+        printf("Device ID failed: %08x %08x %s %s\n",
+               fid.sfi_id[0], fid.sfi_id[1],
+               fid.sfi_name[0], fid.sfi_name[1]);
+        return (1);
+    }
+
+    if (addr == ADDR_NOT_SPECIFIED) {
+        sprintf(prompt, "Erase entire EEPROM");
+        cmd |= KS_DERASE_CHIP;
+        addr = 0;
+        len  = 0;
+    } else if (len == EEPROM_SIZE_NOT_SPECIFIED) {
+        sprintf(prompt, "Erase sector at 0x%x", addr);
+        len = 0;
+    } else {
+        sprintf(prompt, "Erase sector(s) from 0x%x to 0x%x", addr, addr + len);
+    }
+    if (are_you_sure(prompt) == false)
+        return (1);
+
+    printf("Erasing...");
+    fflush(stdout);
+    start = bench_usec();
+    if (ks_flash_cmd(cmd, addr, len, NULL, 0, NULL, KS_REPLY_SLOW))
+        return (1);
+    usec = bench_usec() - start;
+    printf(" Done %u.%03u sec\n",
+           (uint) (usec / 1000000), (uint) (usec % 1000000) / 1000);
+    return (0);
+}
+
 /*
  * eeprom_erase() sends a command to the programmer to erase a sector,
  *                a range of sectors, or the entire EEPROM.
@@ -2133,8 +3031,6 @@ eeprom_erase(uint bank, uint addr, uint len)
     int  rxcount;
     char cmd_output[1024];
     char cmd[64];
-    int  count;
-    int  no_data;
     char prompt[80];
 
     if (bank != BANK_NOT_SPECIFIED) {
@@ -2143,6 +3039,9 @@ eeprom_erase(uint bank, uint addr, uint len)
         addr += bank * EEPROM_BANK_SIZE_DEFAULT;
     }
 
+    if (ks_service_enter() & KS_FEATURE_FLASH_USB)
+        return (eeprom_erase_bin(addr, len));
+
     snprintf(cmd, sizeof (cmd) - 1, "prom id");
     if (send_cmd(cmd))
         return (1);  // "timeout" was reported in this case
@@ -2176,37 +3075,51 @@ eeprom_erase(uint bank, uint addr, uint len)
         return (1);
     cmd[sizeof (cmd) - 1] = '\0';
 
-    if (send_cmd(cmd))
-        return (1);  // send_cmd() reported "timeout" in this case
+    return (eeprom_erase_cmd(cmd));
+}
 
-    no_data = 0;
-    for (count = 0; count < 1000; count++) {  // 100 seconds max
-        if (recv_output(cmd_output, sizeof (cmd_output), &rxcount, 100))
-            return (1); // "timeout" was reported in this case
-        if (rxcount == 0) {
-            if (no_data++ == 40) {
-                printf("Receive timeout\n");
-                return (1);  // No output for 4 seconds
-            }
-        } else {
-            no_data = 0;
-            printf("%.*s", rxcount, cmd_output);
-            fflush(stdout);
-            if ((strstr(cmd_output, "FAIL") != NULL) ||
-                (strstr(cmd_output, "Invalid>") != NULL)) {
-                return (1);
-            }
-            if (strstr(cmd_output, "CMD>") != NULL) {
-                /* Normal end */
-                break;
-            }
+/*
+ * eeprom_not_erased_bin() checks whether an EEPROM area has been erased,
+ *                         using the binary command channel.
+ *
+ * @return       0 - Area is erased.
+ * @return       1 - Area is not erased.
+ * @return      -1 - Communication failure.
+ */
+static int
+eeprom_not_erased_bin(uint addr, uint len)
+{
+    uint32_t reply[2];
+    uint     rxlen;
+
+    while (len > 0) {
+        uint checked;
+        if (ks_flash_cmd(KS_CMD_FLASH_BLANK, addr, len, reply,
+                         sizeof (reply), &rxlen, 0) ||
+            (rxlen != sizeof (reply))) {
+            return (-1);
         }
+        checked = SWAP32(reply[0]);
+        if (SWAP32(reply[1]) != 0xffffffff)
+            return (1);  // Value not erased
+        if ((checked == 0) || (checked > len))
+            return (-1);
+        addr += checked;
+        len  -= checked;
     }
     return (0);
 }
 
+/*
+ * eeprom_not_erased_text() checks whether an EEPROM area has been erased,
+ *                          using CLI commands.
+ *
+ * @return       0 - Area is erased.
+ * @return       1 - Area is not erased.
+ * @return      -1 - Communication failure.
+ */
 static int
-eeprom_not_erased(uint bank, uint addr, uint len)
+eeprom_not_erased_text(uint addr, uint len)
 {
     int  pos = 0;
     int  spos;
@@ -2218,14 +3131,6 @@ eeprom_not_erased(uint bank, uint addr, uint len)
     uint value;
     uint paddr;
 
-    if (len > 0x8000)
-        printf("Verifying EEPROM area has been erased\n");
-    if (bank != BANK_NOT_SPECIFIED) {
-        if (addr == ADDR_NOT_SPECIFIED)
-            addr = 0;
-        addr += bank * EEPROM_BANK_SIZE_DEFAULT;
-    }
-
     /* Manually check the first 32 bytes */
     if (complen > 0x20)
         complen = 0x20;
@@ -2283,6 +3188,21 @@ eeprom_not_erased(uint bank, uint addr, uint len)
     return (0);
 }
 
+static int
+eeprom_not_erased(uint bank, uint addr, uint len)
+{
+    if (len > 0x8000)
+        printf("Verifying EEPROM area has been erased\n");
+    if (bank != BANK_NOT_SPECIFIED) {
+        if (addr == ADDR_NOT_SPECIFIED)
+            addr = 0;
+        addr += bank * EEPROM_BANK_SIZE_DEFAULT;
+    }
+    if (ks_service_enter() & KS_FEATURE_FLASH_USB)
+        return (eeprom_not_erased_bin(addr, len));
+    return (eeprom_not_erased_text(addr, len));
+}
+
 
 /*
  * eeprom_id() sends a command to the programmer to request the EEPROM id.
@@ -2296,6 +3216,19 @@ eeprom_id(void)
 {
     char cmd_output[100];
     int  rxcount;
+
+    if (ks_service_enter() & KS_FEATURE_FLASH_USB) {
+        smash_flash_id_t fid;
+        if (ks_flash_getid(&fid))
+            return;
+        if ((fid.sfi_mode == 0) || (fid.sfi_mode == 4)) {
+            printf("%08x %08x %s %s\n", fid.sfi_id[0], fid.sfi_id[1],
+                   fid.sfi_name[0], fid.sfi_name[1]);
+        } else {
+            printf("%08x %s\n", fid.sfi_id[0], fid.sfi_name[0]);
+        }
+        return;
+    }
     if (send_cmd("prom id"))
         return; // "timeout" was reported in this case
     if (recv_output(cmd_output, sizeof (cmd_output), &rxcount, 80))
@@ -2506,41 +3439,85 @@ show_fail_range(const uint8_t *filebuf, const uint8_t *eebuf, uint len,
 
 
 /*
- * eeprom_verify() reads an image from the eeprom and compares it against
- *                 a file on disk. Differences are reported for the user.
+ * eeprom_sector_crcs() requests the CRC-32 of each flash sector in the
+ *                      specified range from Kicksmash. The returned array
+ *                      must be freed by the caller.
  *
- * @param  [in]  filename        - The file to compare EEPROM contents against.
  * @param  [in]  addr            - The EEPROM starting address.
- * @param  [in]  len             - The length to compare.
- * @param  [in]  miscompares_max - Specifies the maximum number of miscompares
- *                                 to verbosely report.
- * @return       0 - Verify successful.
- * @return       1 - Verify failed.
- * @exit         EXIT_FAILURE - The program will terminate on file access error.
+ * @param  [in]  len             - The length to compute.
+ * @param  [out] count           - The number of sectors returned.
+ * @return       Array of sector CRCs (host byte order) or NULL if the
+ *               firmware does not support KS_CMD_FLASH_CRC or failed.
  */
-static int
-eeprom_verify(const uint8_t *filebuf, uint addr, uint len, uint miscompares_max)
+static smash_crc_t *
+eeprom_sector_crcs(uint addr, uint len, uint *count)
 {
-    uint8_t    *eebuf;
-    char        cmd[64];
-    int         rxcount;
-    int         pos;
-    int         first_fail_pos = -1;
-    uint        miscompares = 0;
+    smash_crc_t *sc = NULL;
+    smash_crc_t  reply[64];
+    uint         scount = 0;
+    uint         rxlen;
+    uint         cur;
+
+    *count = 0;
+    if ((ks_service_enter() & KS_FEATURE_FLASH_CRC) == 0)
+        return (NULL);
 
-    eebuf = malloc(len + 4);
+    while (len > 0) {
+        uint rcount;
+        smash_crc_t *nsc;
+
+        if (ks_flash_cmd(KS_CMD_FLASH_CRC, addr, len, reply, sizeof (reply),
+                         &rxlen, 0))
+            goto fail;
+        rcount = rxlen / sizeof (reply[0]);
+        if (rcount == 0)
+            goto fail;
+        nsc = realloc(sc, (scount + rcount) * sizeof (*sc));
+        if (nsc == NULL)
+            goto fail;
+        sc = nsc;
+        for (cur = 0; cur < rcount; cur++) {
+            smash_crc_t *ent = &sc[scount++];
+            ent->sc_addr = SWAP32(reply[cur].sc_addr);
+            ent->sc_len  = SWAP32(reply[cur].sc_len);
+            ent->sc_crc  = SWAP32(reply[cur].sc_crc);
+            if ((ent->sc_addr != addr) || (ent->sc_len > len) ||
+                (ent->sc_len == 0))
+                goto fail;  // Reply does not match request
+            addr += ent->sc_len;
+            len  -= ent->sc_len;
+        }
+    }
+    *count = scount;
+    return (sc);
+
+fail:
+    free(sc);
+    return (NULL);
+}
+
+/*
+ * eeprom_read_range() reads part of the eeprom into the specified buffer.
+ *
+ * @param  [out] eebuf           - Buffer to hold EEPROM contents.
+ * @param  [in]  addr            - The EEPROM starting address.
+ * @param  [in]  len             - The length to read.
+ * @return       0 - Read successful.
+ * @return       1 - Read failed.
+ */
+static int
+eeprom_read_range(uint8_t *eebuf, uint addr, uint len)
+{
+    char cmd[64];
+    int  rxcount;
 
     snprintf(cmd, sizeof (cmd) - 1, "prom read %x %x", addr, len);
     cmd[sizeof (cmd) - 1] = '\0';
-    if (send_cmd(cmd)) {
-        /* "timeout" was reported in this case */
-fail_verify_read:
-        free(eebuf);
-        return (1);
-    }
+    if (send_cmd(cmd))
+        return (1);  // "timeout" was reported in this case
     rxcount = receive_ll_crc(eebuf, len);
     if (rxcount <= 0)
-        goto fail_verify_read; // "timeout" was reported in this case
+        return (1);  // "timeout" was reported in this case
     if (rxcount < len) {
         const char *str = (const char *) eebuf + rxcount - 11;
         if ((strncmp(str, "FAILURE", 8) == 0) ||
@@ -2549,29 +3526,50 @@ fail_verify_read:
             printf("Read %.11s\n", eebuf + rxcount);
         }
         printf("Only read 0x%x bytes of expected 0x%x\n", rxcount, len);
-        goto fail_verify_read;
+        return (1);
     }
+    return (0);
+}
 
-    /* Compare two buffers */
-    for (pos = 0; pos < len; pos++) {
+/*
+ * eeprom_compare() compares a range of EEPROM and file contents, reporting
+ *                  differences for the user.
+ *
+ * @param  [in]  filebuf         - File data to compare.
+ * @param  [in]  eebuf           - EEPROM data to compare.
+ * @param  [in]  addr            - Base address of EEPROM contents.
+ * @param  [in]  start           - Starting offset to compare.
+ * @param  [in]  end             - Ending offset (exclusive) to compare.
+ * @param  [in]  miscompares_max - Maximum number of miscompares to report.
+ * @param  [io]  miscompares     - Running count of miscompares.
+ * @return       None.
+ */
+static void
+eeprom_compare(const uint8_t *filebuf, const uint8_t *eebuf, uint addr,
+               uint start, uint end, uint miscompares_max, uint *miscompares)
+{
+    int pos;
+    int first_fail_pos = -1;
+
+    for (pos = start; pos < end; pos++) {
         if (eebuf[pos] != filebuf[pos]) {
-            miscompares++;
+            (*miscompares)++;
             if (first_fail_pos == -1)
                 first_fail_pos = pos;
-            if (miscompares == miscompares_max) {
+            if (*miscompares == miscompares_max) {
                 /* Report now and only count futher miscompares */
                 show_fail_range(filebuf, eebuf, pos - first_fail_pos + 1,
                                 addr, first_fail_pos, miscompares_max);
                 first_fail_pos = -1;
             }
         } else {
-            if ((pos < len - 1) &&
+            if ((pos < end - 1) &&
                 (eebuf[pos + 1] != filebuf[pos + 1])) {
                 /* Consider single byte matches part of failure range */
                 continue;
             }
             if (first_fail_pos != -1) {
-                if (miscompares < miscompares_max) {
+                if (*miscompares < miscompares_max) {
                     /* Report previous range */
                     show_fail_range(filebuf, eebuf, pos - first_fail_pos,
                                     addr, first_fail_pos, miscompares_max);
@@ -2580,11 +3578,91 @@ fail_verify_read:
             }
         }
     }
-    if ((first_fail_pos != -1) && (miscompares < miscompares_max)) {
+    if ((first_fail_pos != -1) && (*miscompares < miscompares_max)) {
         /* Report final range not previously reported */
         show_fail_range(filebuf, eebuf, pos - first_fail_pos, addr,
                         first_fail_pos, miscompares_max);
     }
+}
+
+/*
+ * eeprom_verify() compares an image in the eeprom against a file on disk.
+ *                 If the firmware supports it, CRCs of each flash sector
+ *                 are first compared, and only mismatching sectors are
+ *                 read back. Differences are reported for the user.
+ *
+ * @param  [in]  filename        - The file to compare EEPROM contents against.
+ * @param  [in]  addr            - The EEPROM starting address.
+ * @param  [in]  len             - The length to compare.
+ * @param  [in]  miscompares_max - Specifies the maximum number of miscompares
+ *                                 to verbosely report.
+ * @return       0 - Verify successful.
+ * @return       1 - Verify failed.
+ * @exit         EXIT_FAILURE - The program will terminate on file access error.
+ */
+static int
+eeprom_verify(const uint8_t *filebuf, uint addr, uint len, uint miscompares_max)
+{
+    uint8_t     *eebuf;
+    smash_crc_t *sc;
+    uint         sc_count;
+    uint         cur;
+    uint         miscompares = 0;
+
+    eebuf = malloc(len + 4);
+    if (eebuf == NULL)
+        errx(EXIT_FAILURE, "Could not allocate %u bytes", len);
+
+    sc = eeprom_sector_crcs(addr, len, &sc_count);
+    if (sc == NULL) {
+        /* Firmware CRC not available; read back everything */
+        if (eeprom_read_range(eebuf, addr, len)) {
+fail_verify_read:
+            free(sc);
+            free(eebuf);
+            return (1);
+        }
+        eeprom_compare(filebuf, eebuf, addr, 0, len, miscompares_max,
+                       &miscompares);
+    } else {
+        uint bad_sectors = 0;
+
+        /* Replace each sector CRC with 1 (matches file) or 0 (differs) */
+        for (cur = 0; cur < sc_count; cur++) {
+            uint off = sc[cur].sc_addr - addr;
+            if (crc32(0, filebuf + off, sc[cur].sc_len) != sc[cur].sc_crc) {
+                sc[cur].sc_crc = 0;
+                bad_sectors++;
+            } else {
+                sc[cur].sc_crc = 1;
+            }
+        }
+        if (bad_sectors != 0)
+            printf("%u of %u sectors differ by CRC\n", bad_sectors, sc_count);
+
+        /* Read back runs of mismatching sectors for a detailed diff */
+        for (cur = 0; cur < sc_count; cur++) {
+            uint off;
+            uint rlen;
+            if (sc[cur].sc_crc != 0)
+                continue;
+            off  = sc[cur].sc_addr - addr;
+            rlen = sc[cur].sc_len;
+            while ((cur + 1 < sc_count) && (sc[cur + 1].sc_crc == 0))
+                rlen += sc[++cur].sc_len;
+
+            if (eeprom_read_range(eebuf + off, addr + off, rlen))
+                goto fail_verify_read;
+            eeprom_compare(filebuf, eebuf, addr, off, off + rlen,
+                           miscompares_max, &miscompares);
+        }
+        if ((bad_sectors != 0) && (miscompares == 0)) {
+            /* CRC mismatch, but data matched on read back */
+            printf("Sector CRC mismatch without data miscompare\n");
+            miscompares++;
+        }
+        free(sc);
+    }
     free(eebuf);
     if (miscompares) {
         printf("%u miscompares\n", miscompares);
@@ -2595,6 +3673,89 @@ fail_verify_read:
     }
 }
 
+/*
+ * eeprom_write_delta() writes an image to the eeprom, but only erases and
+ *                      programs the flash sectors whose contents differ
+ *                      from the image. Sector CRCs are provided by
+ *                      Kicksmash. Sectors which are already erased are
+ *                      programmed without first being erased. As with
+ *                      eeprom_erase(), a sector only partially covered by
+ *                      the range is erased in full.
+ *
+ * @param  [in]  filebuf         - The file content to write.
+ * @param  [in]  addr            - The EEPROM starting address.
+ * @param  [in]  len             - The length to write.
+ * @return       0 - Write successful.
+ * @return       1 - Write failed.
+ */
+static uint
+eeprom_write_delta(const uint8_t *filebuf, uint addr, uint len)
+{
+    smash_crc_t *sc;
+    uint8_t     *ffbuf = NULL;
+    uint         sc_count;
+    uint         cur;
+    uint         diff_count = 0;
+    uint         diff_bytes = 0;
+    uint         rc = 0;
+
+    sc = eeprom_sector_crcs(addr, len, &sc_count);
+    if (sc == NULL) {
+        printf("Kicksmash does not support sector CRC; "
+               "erasing and writing entire range\n");
+        if (eeprom_erase_range(addr, len))
+            return (1);
+        return (eeprom_write(filebuf, addr, len));
+    }
+
+    for (cur = 0; cur < sc_count; cur++) {
+        uint off = sc[cur].sc_addr - addr;
+        if (crc32(0, filebuf + off, sc[cur].sc_len) != sc[cur].sc_crc) {
+            diff_count++;
+            diff_bytes += sc[cur].sc_len;
+        } else {
+            sc[cur].sc_len = 0;  // Sector matches: nothing to do
+        }
+    }
+    if (diff_count == 0) {
+        printf("EEPROM already matches image (%u sectors)\n", sc_count);
+        free(sc);
+        return (0);
+    }
+    printf("%u of %u sectors differ (0x%x of 0x%x bytes)\n",
+           diff_count, sc_count, diff_bytes, len);
+
+    for (cur = 0; cur < sc_count; cur++) {
+        uint off;
+        uint slen = sc[cur].sc_len;
+        uint8_t *nbuf;
+
+        if (slen == 0)
+            continue;
+        off = sc[cur].sc_addr - addr;
+
+        /* Compare against the CRC of an erased sector of the same size */
+        nbuf = realloc(ffbuf, slen);
+        if (nbuf == NULL)
+            errx(EXIT_FAILURE, "Could not allocate %u bytes", slen);
+        ffbuf = nbuf;
+        memset(ffbuf, 0xff, slen);
+        if (crc32(0, ffbuf, slen) != sc[cur].sc_crc) {
+            if (eeprom_erase_range(sc[cur].sc_addr, slen)) {
+                rc = 1;
+                break;
+            }
+        }
+        if (eeprom_write(filebuf + off, addr + off, slen) != 0) {
+            rc = 1;
+            break;
+        }
+    }
+    free(ffbuf);
+    free(sc);
+    return (rc);
+}
+
 /*
  * amiga_is_in_reset
  * -----------------
@@ -2635,7 +3796,8 @@ reset_amiga(int hold)
  *                     command line.
  *
  * @param  [in]  None.
- * @global [in]  device_name[] is the path to the device which was opened.
+ * @global [in]  board_cur->b_device_name[] is the path to the device
+ *                which was opened.
  * @return       None.
  */
 static void
@@ -2669,7 +3831,7 @@ run_terminal_mode(void)
         if (!SetConsoleMode(ihandle, mode))
             system_error("setting input mode");
 
-        printf("<< Type ^X to exit.  Opened %s >>\n", device_name);
+        printf("<< Type ^X to exit.  Opened %s >>\n", board_cur->b_device_name);
     }
 
     while (running) {
@@ -2764,7 +3926,7 @@ run_terminal_mode(void)
         if (ioctl(fileno(stdin), FIONBIO, &enable))  // Set input non-blocking
             warn("FIONBIO failed for stdin");
 #endif
-        printf("<< Type ^X to exit.  Opened %s >>\n", device_name);
+        printf("<< Type ^X to exit.  Opened %s >>\n", board_cur->b_device_name);
     }
 
     while (running) {
@@ -2822,14 +3984,46 @@ run_terminal_mode(void)
 
 #define LINUX_BY_ID_DIR "/dev/serial/by-id"
 
+#if defined(LINUX) || defined(OSX)
+static void volume_copy(board_t *to, board_t *from);
+
+/*
+ * board_add_found() adds a board for a programmer located by
+ *                   find_mx_programmer(), unless that device is already
+ *                   in use by a board. The first board takes the device
+ *                   if it was not specified with -d. Other boards serve
+ *                   the same volumes as the first board.
+ *
+ * @param  [in]  path - Path to the serial interface of the programmer.
+ */
+static void
+board_add_found(const char *path)
+{
+    board_t *board;
+
+    if (board_get_by_name(path) != NULL)
+        return;  // Already specified with -d
+    if (board_first.b_device_name[0] == '\0') {
+        snprintf(board_first.b_device_name,
+                 sizeof (board_first.b_device_name), "%s", path);
+    } else {
+        board = board_new(path);
+        volume_copy(board, &board_first);
+    }
+    printf("Using %s\n", path);
+}
+#endif
+
 /*
  * find_mx_programmer() will attempt to locate tty device associated with USB
  *                      connection of the MX25F1615 programmer. If found, it
- *                      will update the device_name[] global with the file
- *                      path to the serial interface.
+ *                      will update the current board's b_device_name[] with
+ *                      the file path to the serial interface. If all is
+ *                      specified, a board is added for every programmer found.
  *
- * @param  [in]  None.
- * @global [out] device_name[] is the located path of the programmer (if found).
+ * @param  [in]  all - Add all programmers rather than just the first.
+ * @global [out] board_cur->b_device_name[] is the located path of the
+ *               programmer (if found).
  * @return       None.
  *
  * OS-specific implementation notes are below
@@ -2885,7 +4079,7 @@ run_terminal_mode(void)
  *          anything. Well, at least with Wine it fails to find anything.
  */
 static void
-find_mx_programmer(void)
+find_mx_programmer(bool_t all)
 {
 #ifdef LINUX
     /*
@@ -2900,10 +4094,16 @@ find_mx_programmer(void)
     while ((dent = readdir(dirp)) != NULL) {
         if ((strstr(dent->d_name, "MX29F1615") != 0) ||
             (strstr(dent->d_name, "KickSmash") != 0)) {
-            snprintf(device_name, sizeof (device_name), "%s/%s",
+            char path[PATH_MAX];
+            snprintf(path, sizeof (path), "%s/%s",
                      LINUX_BY_ID_DIR, dent->d_name);
+            if (all) {
+                board_add_found(path);
+                continue;
+            }
+            strcpy(board_cur->b_device_name, path);
             closedir(dirp);
-            printf("Using %s\n", device_name);
+            printf("Using %s\n", board_cur->b_device_name);
             return;
         }
     }
@@ -2930,9 +4130,14 @@ find_mx_programmer(void)
                     eptr = strchr(ptr, '"');
                     if (eptr != NULL)
                         *eptr = '\0';
-                    strncpy(device_name, ptr, sizeof (device_name) - 1);
-                    device_name[sizeof (device_name) - 1] = '\0';
-                    printf("Using %s\n", device_name);
+                    if (all) {
+                        board_add_found(ptr);
+                        saw_programmer = FALSE;
+                        continue;
+                    }
+                    snprintf(board_cur->b_device_name,
+                             sizeof (board_cur->b_device_name), "%s", ptr);
+                    printf("Using %s\n", board_cur->b_device_name);
                     return;
                 }
                 printf("%.80s\n", buf);
@@ -2953,22 +4158,23 @@ find_mx_programmer(void)
     char portname[32];
     for (port = 1; port < MAX_COM_PORT; port++) {
         sprintf(portname, "\\\\.\\com%u", port);
-        HANDLE dev_handle = CreateFile(portname, GENERIC_READ | GENERIC_WRITE,
-                                       0, NULL, OPEN_EXISTING, 0, NULL);
+        HANDLE port_handle = CreateFile(portname,
+                                        GENERIC_READ | GENERIC_WRITE,
+                                        0, NULL, OPEN_EXISTING, 0, NULL);
 
-        if (dev_handle == INVALID_HANDLE_VALUE)
+        if (port_handle == INVALID_HANDLE_VALUE)
             continue;
 
         if (found++ == 0)
             printf("Available ports:");
 
         printf(" COM%u", port);
-        CloseHandle(dev_handle);
+        CloseHandle(port_handle);
     }
     if (found)
         printf("\n");
     if (port < MAX_COM_PORT)
-        strcpy(device_name, portname);
+        strcpy(board_cur->b_device_name, portname);
 #endif
 }
 
@@ -2984,7 +4190,7 @@ wait_for_tx_writer(void)
 {
     int count = 0;
 
-    while (tx_rb_consumer != tx_rb_producer)
+    while (tx_rb_flushed() == FALSE)
         if (count++ > 100)
             break;
         else
@@ -2995,110 +4201,387 @@ static void
 show_handle_count(const char *prefix)
 {
 #ifdef DEBUG_HANDLE_COUNT
-    handle_ent_t *cur;
-    uint count = 0;
-    for (cur = handle_list_head; cur != NULL; cur = cur->he_next)
-        count++;
-    fsprintf("%s: handle count=%u\n", prefix, count);
+    fsprintf("%s: handle count=%u\n", prefix, board_cur->b_handle_count);
 #endif
 }
 
-static handle_ent_t *
-handle_new(const char *name, const char *path, handle_ent_t *parent,
-           uint type, uint mode)
+/*
+ * handle_hash_slot() returns the preferred handle table slot for the
+ *                    specified handle (Fibonacci hash).
+ */
+static inline uint
+handle_hash_slot(handle_t handle)
 {
-    handle_t handle;
-    handle_ent_t *node = malloc(sizeof (*node));
-    if (node == NULL) {
-        fsprintf("alloc %zu bytes failed\n", sizeof (*node));
-        return (0);
-    }
-    memset(node, 0, sizeof (*node));
-    handle = ++handle_unique;
+    return ((uint32_t) (handle * 2654435761U) >>
+            (32 - board_cur->b_handle_hash_bits));
+}
 
-    node->he_handle  = handle;
-    node->he_name    = strdup(name);
-    node->he_path    = strdup(path);
-    node->he_type    = type;
-    node->he_mode    = mode;
-    node->he_count   = 1;
-    node->he_entnum  = 0;
-    node->he_dir     = NULL;
-    node->he_next    = handle_list_head;
-    handle_list_head = node;
+/*
+ * handle_name_slot() returns the name index bucket for the specified
+ *                    name (FNV-1a hash).
+ */
+static inline uint
+handle_name_slot(const char *name)
+{
+    uint32_t hash = 2166136261U;
 
-    if (type == HM_TYPE_VOLUME) {
-        node->he_volume  = node;  // This is the root of the volume
-        node->he_avolume = NULL;  // Will be assigned later?
-    } else if (parent != NULL) {
-        /* Parent can be NULL if referencing the Volume Directory */
-        node->he_volume  = parent->he_volume;
-        node->he_avolume = parent->he_avolume;
+    while (*name != '\0') {
+        hash ^= (uint8_t) *(name++);
+        hash *= 16777619U;
     }
-    show_handle_count("New");
-    return (node);
+    return (hash & (board_cur->b_handle_hash_size - 1));
 }
 
 static void
-handle_free(handle_t handle)
+handle_hash_insert(handle_ent_t *node)
 {
-    handle_ent_t *parent = NULL;
-    handle_ent_t *node;
-    for (node = handle_list_head; node != NULL; node = node->he_next) {
-        if (node->he_handle == handle) {
-            node->he_count--;
-            if (node->he_count != 0)
-                return;
-            if (parent == NULL)
-                handle_list_head = node->he_next;
-            else
-                parent->he_next = node->he_next;
-            free(node->he_path);
-            free(node->he_name);
-            free(node);
-            show_handle_count("Free");
+    uint mask = board_cur->b_handle_hash_size - 1;
+    uint slot = handle_hash_slot(node->he_handle);
+
+    while (board_cur->b_handle_hash[slot] != NULL)
+        slot = (slot + 1) & mask;
+    board_cur->b_handle_hash[slot] = node;
+}
+
+static void
+handle_name_insert(handle_ent_t *node)
+{
+    uint slot = handle_name_slot(node->he_name);
+
+    /* Newest entry first, so that it will be found first by name */
+    node->he_name_next = board_cur->b_handle_name_hash[slot];
+    board_cur->b_handle_name_hash[slot] = node;
+}
+
+static void
+handle_name_remove(handle_ent_t *node)
+{
+    uint           slot = handle_name_slot(node->he_name);
+    handle_ent_t **prev = &board_cur->b_handle_name_hash[slot];
+
+    for (; *prev != NULL; prev = &(*prev)->he_name_next) {
+        if (*prev == node) {
+            *prev = node->he_name_next;
             return;
         }
-        parent = node;
     }
-    fsprintf("Failed to find %x in handle list for free\n", handle);
 }
 
-static handle_ent_t *
-handle_get(handle_t handle)
+/*
+ * handle_hash_grow() doubles the size of the handle table and name index,
+ *                    re-inserting all active handles. Handles are
+ *                    re-inserted in reverse order of the name chains so
+ *                    that newest-first order by name is preserved.
+ */
+static void
+handle_hash_grow(void)
 {
-    handle_ent_t *node;
-    if (handle == 0xffffffff)  // default can be specified with -M switch
-        handle = handle_default;
-    if (handle == 0)
-        return (NULL);
-    for (node = handle_list_head; node != NULL; node = node->he_next)
-        if (node->he_handle == handle)
-            return (node);
-    fsprintf("Failed to find %x in handle list\n", handle);
-    return (NULL);
+    board_t       *board = board_cur;
+    handle_ent_t **old_hash = board->b_handle_hash;
+    handle_ent_t **old_name_hash = board->b_handle_name_hash;
+    uint           old_size = board->b_handle_hash_size;
+    uint           slot;
+
+    if (board->b_handle_hash_size == 0) {
+        board->b_handle_hash_size = HANDLE_HASH_MIN;
+        board->b_handle_hash_bits = 0;
+        while ((1U << board->b_handle_hash_bits) < HANDLE_HASH_MIN)
+            board->b_handle_hash_bits++;
+    } else {
+        board->b_handle_hash_size *= 2;
+        board->b_handle_hash_bits++;
+    }
+    board->b_handle_hash = calloc(board->b_handle_hash_size,
+                                  sizeof (*board->b_handle_hash));
+    board->b_handle_name_hash = calloc(board->b_handle_hash_size,
+                                       sizeof (*board->b_handle_name_hash));
+    if ((board->b_handle_hash == NULL) || (board->b_handle_name_hash == NULL))
+        errx(EXIT_FAILURE, "Could not allocate %u entry handle table",
+             board->b_handle_hash_size);
+
+    for (slot = 0; slot < old_size; slot++)
+        if (old_hash[slot] != NULL)
+            handle_hash_insert(old_hash[slot]);
+
+    for (slot = 0; slot < old_size; slot++) {
+        handle_ent_t *rev = NULL;
+        handle_ent_t *node;
+        handle_ent_t *next;
+
+        /* Reverse the chain, then push so newest ends up first again */
+        for (node = old_name_hash[slot]; node != NULL; node = next) {
+            next = node->he_name_next;
+            node->he_name_next = rev;
+            rev = node;
+        }
+        for (node = rev; node != NULL; node = next) {
+            next = node->he_name_next;
+            handle_name_insert(node);
+        }
+    }
+    free(old_hash);
+    free(old_name_hash);
 }
 
+/*
+ * handle_pool_get() returns a zeroed handle entry from the pool, allocating
+ *                   a new slab of entries when the free list is empty.
+ *                   Slabs are never returned to the system.
+ */
 static handle_ent_t *
-handle_get_name(const char *name)
+handle_pool_get(void)
 {
     handle_ent_t *node;
-    for (node = handle_list_head; node != NULL; node = node->he_next)
-        if ((node->he_name != NULL) && (strcmp(node->he_name, name) == 0))
-            return (node);
-    fsprintf("Failed to find \"%s\" in handle list\n", name);
-    return (NULL);
+
+    if (board_cur->b_handle_pool_free == NULL) {
+        handle_ent_t *slab = malloc(HANDLE_POOL_CHUNK * sizeof (*slab));
+        uint          cur;
+        if (slab == NULL) {
+            fsprintf("alloc %zu bytes failed\n",
+                     HANDLE_POOL_CHUNK * sizeof (*slab));
+            return (NULL);
+        }
+        for (cur = 0; cur < HANDLE_POOL_CHUNK; cur++) {
+            slab[cur].he_next = board_cur->b_handle_pool_free;
+            board_cur->b_handle_pool_free = &slab[cur];
+        }
+    }
+    node = board_cur->b_handle_pool_free;
+    board_cur->b_handle_pool_free = node->he_next;
+    memset(node, 0, offsetof(handle_ent_t, he_strbuf));
+    return (node);
 }
 
-#if 0
 static void
-handle_list_show(void)
+handle_pool_put(handle_ent_t *node)
 {
-    char *type;
-    handle_ent_t *node;
+    if (node->he_strmem != NULL)
+        free(node->he_strmem);
+    node->he_next = board_cur->b_handle_pool_free;
+    board_cur->b_handle_pool_free = node;
+}
+
+/*
+ * handle_hash_find() returns the table slot holding the specified handle,
+ *                    or -1 if the handle is not present.
+ */
+static int
+handle_hash_find(handle_t handle)
+{
+    uint mask = board_cur->b_handle_hash_size - 1;
+    uint slot;
+
+    if (board_cur->b_handle_hash_size == 0)
+        return (-1);
+    for (slot = handle_hash_slot(handle);
+         board_cur->b_handle_hash[slot] != NULL; slot = (slot + 1) & mask) {
+        if (board_cur->b_handle_hash[slot]->he_handle == handle)
+            return (slot);
+    }
+    return (-1);
+}
+
+static handle_ent_t *
+handle_new(const char *name, const char *path, handle_ent_t *parent,
+           uint type, uint mode)
+{
+    handle_t handle;
+    size_t   nlen = strlen(name) + 1;
+    size_t   plen = strlen(path) + 1;
+    char    *str;
+    handle_ent_t *node;
+
+    pthread_mutex_lock(&board_cur->b_handle_lock);
+    node = handle_pool_get();
+    if (node == NULL) {
+        pthread_mutex_unlock(&board_cur->b_handle_lock);
+        return (0);
+    }
+
+    /* Name and path share inline storage when they fit */
+    if (nlen + plen <= sizeof (node->he_strbuf)) {
+        str = node->he_strbuf;
+    } else {
+        str = node->he_strmem = malloc(nlen + plen);
+        if (str == NULL) {
+            fsprintf("alloc %zu bytes failed\n", nlen + plen);
+            handle_pool_put(node);
+            pthread_mutex_unlock(&board_cur->b_handle_lock);
+            return (0);
+        }
+    }
+    memcpy(str, name, nlen);
+    memcpy(str + nlen, path, plen);
+
+    if ((board_cur->b_handle_count + 1) * 2 > board_cur->b_handle_hash_size)
+        handle_hash_grow();  // Keep load factor at or below 50%
+
+    /* Skip 0 (invalid) and any handle still in use after wrap */
+    do {
+        handle = ++board_cur->b_handle_unique;
+    } while ((handle == 0) || (handle == 0xffffffff) ||
+             (handle_hash_find(handle) >= 0));
+
+    node->he_handle  = handle;
+    node->he_name    = str;
+    node->he_path    = str + nlen;
+    node->he_type    = type;
+    node->he_mode    = mode;
+    node->he_count   = 1;
+    node->he_entnum  = 0;
+    node->he_dir     = NULL;
+    handle_hash_insert(node);
+    handle_name_insert(node);
+    board_cur->b_handle_count++;
+
+    if (type == HM_TYPE_VOLUME) {
+        node->he_volume  = node;  // This is the root of the volume
+        node->he_avolume = NULL;  // Will be assigned later?
+    } else if (parent != NULL) {
+        /* Parent can be NULL if referencing the Volume Directory */
+        node->he_volume  = parent->he_volume;
+        node->he_avolume = parent->he_avolume;
+    }
+    show_handle_count("New");
+    pthread_mutex_unlock(&board_cur->b_handle_lock);
+    return (node);
+}
+
+static void
+handle_free(handle_t handle)
+{
+    handle_ent_t *node;
+    uint mask = board_cur->b_handle_hash_size - 1;
+    uint hole;
+    uint slot;
+    int  found;
+
+    pthread_mutex_lock(&board_cur->b_handle_lock);
+    found = handle_hash_find(handle);
+    if (found < 0) {
+        pthread_mutex_unlock(&board_cur->b_handle_lock);
+        fsprintf("Failed to find %x in handle list for free\n", handle);
+        return;
+    }
+    node = board_cur->b_handle_hash[found];
+    node->he_count--;
+    if (node->he_count != 0) {
+        pthread_mutex_unlock(&board_cur->b_handle_lock);
+        return;
+    }
+
+    /*
+     * Backward-shift deletion: move following entries of the probe run
+     * up into the hole, unless their preferred slot lies cyclically
+     * between the hole and their current position.
+     */
+    hole = found;
+    board_cur->b_handle_hash[hole] = NULL;
+    for (slot = (hole + 1) & mask; board_cur->b_handle_hash[slot] != NULL;
+         slot = (slot + 1) & mask) {
+        uint want = handle_hash_slot(board_cur->b_handle_hash[slot]->he_handle);
+        if ((hole <= slot) ? ((hole < want) && (want <= slot)) :
+                             ((hole < want) || (want <= slot))) {
+            continue;
+        }
+        board_cur->b_handle_hash[hole] = board_cur->b_handle_hash[slot];
+        board_cur->b_handle_hash[slot] = NULL;
+        hole = slot;
+    }
+    handle_name_remove(node);
+    board_cur->b_handle_count--;
+    if (node->he_refs == 0)
+        handle_pool_put(node);  // Otherwise recycled by handle_release()
+    show_handle_count("Free");
+    pthread_mutex_unlock(&board_cur->b_handle_lock);
+}
+
+/*
+ * handle_get() returns the entry for the specified handle, or NULL if the
+ *              handle is not present. The entry is referenced by the
+ *              calling thread until it calls handle_release().
+ */
+static handle_ent_t *
+handle_get(handle_t handle)
+{
+    handle_ent_t *node = NULL;
+    int slot;
+    if (handle == 0xffffffff)  // default can be specified with -M switch
+        handle = board_cur->b_handle_default;
+    if (handle == 0)
+        return (NULL);
+    pthread_mutex_lock(&board_cur->b_handle_lock);
+    slot = handle_hash_find(handle);
+    if ((slot >= 0) && (handle_held_count < HANDLE_HELD_MAX)) {
+        node = board_cur->b_handle_hash[slot];
+        node->he_refs++;
+        handle_held[handle_held_count++] = node;
+    } else if (slot >= 0) {
+        fsprintf("Too many handle references held for %x\n", handle);
+        pthread_mutex_unlock(&board_cur->b_handle_lock);
+        return (NULL);
+    }
+    pthread_mutex_unlock(&board_cur->b_handle_lock);
+    if (node != NULL)
+        return (node);
+    fsprintf("Failed to find %x in handle list\n", handle);
+    return (NULL);
+}
+
+/*
+ * handle_release() drops the references taken by this thread's handle_get()
+ *                  calls, back to the specified number held. An entry which
+ *                  was freed while referenced is recycled here.
+ *
+ * @param [in]  keep - Number of references to keep.
+ */
+static void
+handle_release(uint keep)
+{
+    handle_ent_t *node;
+
+    if (handle_held_count <= keep)
+        return;
+    pthread_mutex_lock(&board_cur->b_handle_lock);
+    while (handle_held_count > keep) {
+        node = handle_held[--handle_held_count];
+        if ((--node->he_refs == 0) && (node->he_count == 0))
+            handle_pool_put(node);
+    }
+    pthread_mutex_unlock(&board_cur->b_handle_lock);
+}
+
+static handle_ent_t *
+handle_get_name(const char *name)
+{
+    handle_ent_t *node = NULL;
+    pthread_mutex_lock(&board_cur->b_handle_lock);
+    if (board_cur->b_handle_hash_size != 0) {
+        for (node = board_cur->b_handle_name_hash[handle_name_slot(name)];
+             node != NULL; node = node->he_name_next) {
+            if (strcmp(node->he_name, name) == 0)
+                break;
+        }
+    }
+    pthread_mutex_unlock(&board_cur->b_handle_lock);
+    if (node != NULL)
+        return (node);
+    fsprintf("Failed to find \"%s\" in handle list\n", name);
+    return (NULL);
+}
+
+#if 0
+static void
+handle_list_show(void)
+{
+    char *type;
+    handle_ent_t *node;
+    uint slot;
     fsprintf("    Type Handle FD D Path               APath              "
              "HPath\n");
-    for (node = handle_list_head; node != NULL; node = node->he_next) {
+    for (slot = 0; slot < board_cur->b_handle_hash_size; slot++) {
+        if ((node = board_cur->b_handle_hash[slot]) == NULL)
+            continue;
         switch (node->he_type) {
             default:
             case HM_TYPE_UNKNOWN:
@@ -3142,11 +4625,52 @@ handle_list_show(void)
 }
 #endif
 
+/*
+ * volume_new() adds a volume to be served to the current board.
+ *
+ * @param [in]  volume_name - Amiga volume name, including the colon.
+ * @param [in]  local_path  - Host directory path of the volume.
+ * @param [in]  flags       - Volume flags (AV_FLAG_*).
+ * @param [in]  bootpri     - Boot priority (if AV_FLAG_BOOTABLE).
+ * @param [in]  is_default  - Volume is the default parent handle.
+ */
 static void
-volume_add(const char *volume_name, const char *local_path, uint is_default)
+volume_new(const char *volume_name, const char *local_path, uint flags,
+           int bootpri, uint is_default)
 {
     handle_ent_t *handle;
     amiga_vol_t  *node = malloc(sizeof (amiga_vol_t));
+
+    if (node == NULL)
+        errx(EXIT_FAILURE, "Could not allocate volume %s", volume_name);
+    handle = handle_new(volume_name, "", NULL, HM_TYPE_VOLUME, HM_MODE_READ);
+
+    node->av_volume    = strdup(volume_name);
+    node->av_path      = local_path;
+    node->av_realpath  = realpath(local_path, NULL);
+    node->av_handle    = handle;
+    node->av_next      = board_cur->b_vol_head;
+    node->av_flags     = flags;
+    node->av_bootpri   = bootpri;
+    board_cur->b_vol_head     = node;
+
+    handle->he_avolume = node;
+    handle->he_volume  = handle;  // This is the volume's root handle
+
+    if (is_default) {
+        /*
+         * This is the optional default parent handle when the Amiga
+         * specifies a handle of 0xffffffff.
+         */
+        board_cur->b_handle_default = handle->he_handle;
+    }
+
+    fsprintf("add volume %s = %s\n", volume_name, local_path);
+}
+
+static void
+volume_add(const char *volume_name, const char *local_path, uint is_default)
+{
     char *vpos;
     char volnamebuf[128];
     uint volnamelen = strlen(volume_name);
@@ -3201,37 +4725,48 @@ volume_add(const char *volume_name, const char *local_path, uint is_default)
         volnamebuf[volnamelen++] = ':';
         volnamebuf[volnamelen] = '\0';
     }
+    volume_new(volnamebuf, local_path, flags, bootpri, is_default);
+}
 
-    handle = handle_new(volnamebuf, "", NULL, HM_TYPE_VOLUME, HM_MODE_READ);
-
-    node->av_volume    = strdup(volnamebuf);
-    node->av_path      = local_path;
-    node->av_realpath  = realpath(local_path, NULL);
-    node->av_handle    = handle;
-    node->av_next      = amiga_vol_head;
-    node->av_flags     = flags;
-    node->av_bootpri   = bootpri;
-    amiga_vol_head     = node;
-
-    handle->he_avolume = node;
-    handle->he_volume  = handle;  // This is the volume's root handle
+#if defined(LINUX) || defined(OSX)
+/*
+ * volume_copy() adds the volumes served to one board to another board.
+ *               Each volume gets a new handle in the other board's
+ *               handle namespace.
+ *
+ * @param [in]  to   - Board to receive the volumes.
+ * @param [in]  from - Board whose volumes are copied.
+ */
+static void
+volume_copy(board_t *to, board_t *from)
+{
+    board_t     *saved = board_cur;
+    amiga_vol_t *node;
+    amiga_vol_t *prev = NULL;
 
-    if (is_default) {
-        /*
-         * This is the optional default parent handle when the Amiga
-         * specifies a handle of 0xffffffff.
-         */
-        handle_default = handle->he_handle;
-    }
+    if (from->b_vol_head == NULL)
+        return;
 
-    fsprintf("add volume %s = %s\n", volnamebuf, local_path);
+    /* Volumes are listed newest first; add them oldest first */
+    board_cur = to;
+    do {
+        for (node = from->b_vol_head; node->av_next != prev;
+             node = node->av_next)
+            ;
+        volume_new(node->av_volume, node->av_path, node->av_flags,
+                   node->av_bootpri,
+                   node->av_handle->he_handle == from->b_handle_default);
+        prev = node;
+    } while (prev != from->b_vol_head);
+    board_cur = saved;
 }
+#endif
 
 static amiga_vol_t *
 volume_get_by_handle(handle_ent_t *handle)
 {
     amiga_vol_t *node;
-    for (node = amiga_vol_head; node != NULL; node = node->av_next)
+    for (node = board_cur->b_vol_head; node != NULL; node = node->av_next)
         if (node->av_handle == handle)
             return (node);
     fsprintf("Could not locate handle %x in volume list\n", handle->he_handle);
@@ -3243,7 +4778,7 @@ volume_get_by_index(uint index)
 {
     amiga_vol_t *node;
     uint count = 0;
-    for (node = amiga_vol_head; node != NULL; node = node->av_next)
+    for (node = board_cur->b_vol_head; node != NULL; node = node->av_next)
         if (count++ == index)
             return (node);
     return (NULL);
@@ -3255,7 +4790,7 @@ volume_get_by_path(const char *path, uint partial)
     amiga_vol_t *node;
     uint         len;
 
-    for (node = amiga_vol_head; node != NULL; node = node->av_next) {
+    for (node = board_cur->b_vol_head; node != NULL; node = node->av_next) {
         if (partial) {
             len = strlen(node->av_path);
             if ((strncmp(node->av_path, path, len) == 0) &&
@@ -3305,6 +4840,8 @@ smash_err(uint code)
             return ("KS reports no data available");
         case KS_STATUS_LOCKED:
             return ("KS reports resource locked");
+        case KS_STATUS_NOWIDE:
+            return ("KS reports wide symbols off");
         case MSG_STATUS_FAILURE:
             return ("Failure");
         case MSG_STATUS_NO_REPLY:
@@ -3387,6 +4924,40 @@ send_ks_cmd_core(uint cmd, uint len, void *buf)
     return (MSG_STATUS_SUCCESS);
 }
 
+/*
+ * send_ks_cmd_swap_core() sends a command whose payload is the
+ * concatenation of two buffers in host byte order. Each is byte-swapped
+ * as it is copied into the transmit ring, so the caller's buffers are
+ * neither modified nor staged. The CRC of the swapped payload, as
+ * crc32s() would compute it, is the plain crc32() of the unswapped data.
+ * The length of the first buffer must be even.
+ */
+static uint
+send_ks_cmd_swap_core(uint cmd, const void *buf1, uint len1,
+                      const void *buf2, uint len2)
+{
+    uint32_t crc;
+    uint16_t txlen = len1 + len2;
+    uint16_t txcmd = cmd;
+
+    crc = crc32r(0, &txlen, 2);
+    crc = crc32r(crc, &txcmd, 2);
+    crc = crc32(crc, buf1, len1);
+    crc = crc32(crc, buf2, len2);
+    crc = (crc << 16) | (crc >> 16);  // Convert to match Amiga format
+
+    if (send_ll_bin(&sm_magic, sizeof (sm_magic)) ||
+        send_ll_bin(&txlen, sizeof (txlen)) ||
+        send_ll_bin(&txcmd, sizeof (txcmd))) {
+        return (MSG_STATUS_FAILURE);
+    }
+    if (send_ll_bin_swap16(buf1, len1) || send_ll_bin_swap16(buf2, len2))
+        return (MSG_STATUS_FAILURE);
+    if (send_ll_bin(&crc, sizeof (crc)))
+        return (MSG_STATUS_FAILURE);
+    return (MSG_STATUS_SUCCESS);
+}
+
 /*
  * cmd=8 l=0000 CRC 2608edb8
  *     0204 1017 0119 0117 0000 0008 2608 edb8
@@ -3406,7 +4977,7 @@ recv_ks_reply_core(void *buf, uint buflen, uint flags,
     uint     pos = 0;
     uint32_t crc = 0;
     uint8_t *bufp = (uint8_t *)buf;
-    const uint timeout = 500;
+    const uint timeout = (flags & KS_REPLY_SLOW) ? 100000 : 500;
     uint32_t crc_rx = 0;
     int timeout_count = 0;
     uint8_t  localbuf[4096];
@@ -3463,8 +5034,7 @@ recv_ks_reply_core(void *buf, uint buflen, uint flags,
 #endif
                 return (MSG_STATUS_NO_REPLY);
             }
-            time_delay_msec(1);
-            sched_yield();
+            rx_rb_wait(1);
             continue;
         }
         if (flags & BIT(0)) {
@@ -3533,6 +5103,18 @@ recv_ks_reply_core(void *buf, uint buflen, uint flags,
                 if (pos == len_roundup + KS_MSG_HEADER_LEN + 3) {
                     /* Last byte of CRC */
 
+                    if ((status == KS_CMD_MSG_NOTIFY) && (len == 0)) {
+                        /*
+                         * Unsolicited notification that an Amiga message
+                         * is pending. Pass it on to run_message_mode()
+                         * and keep waiting for the actual reply.
+                         */
+                        msg_notify_post();
+                        pos = 0;
+                        crc_rx = 0;
+                        break;
+                    }
+
                     if (flags & BIT(0)) {
                         /* Raw data receive */
                         if (pos >= buflen) {
@@ -3587,10 +5169,29 @@ send_ks_cmd(uint cmd, void *txbuf, uint txlen, void *rxbuf, uint rxmax,
             uint *rxstatus, uint *rxlen, uint flags)
 {
     uint rc;
+    pthread_mutex_lock(&board_cur->b_ks_cmd_lock);
     rc = send_ks_cmd_core(cmd, txlen, txbuf);
-    if (rc != 0)
-        return (rc);
-    return (recv_ks_reply_core(rxbuf, rxmax, flags, rxstatus, rxlen));
+    if (rc == 0)
+        rc = recv_ks_reply_core(rxbuf, rxmax, flags, rxstatus, rxlen);
+    pthread_mutex_unlock(&board_cur->b_ks_cmd_lock);
+    return (rc);
+}
+
+/*
+ * send_ks_cmd_swap() is send_ks_cmd() for a two part payload which is
+ * byte-swapped in transit. See send_ks_cmd_swap_core().
+ */
+static uint
+send_ks_cmd_swap(uint cmd, const void *buf1, uint len1,
+                 const void *buf2, uint len2, uint *rxstatus)
+{
+    uint rc;
+    pthread_mutex_lock(&board_cur->b_ks_cmd_lock);
+    rc = send_ks_cmd_swap_core(cmd, buf1, len1, buf2, len2);
+    if (rc == 0)
+        rc = recv_ks_reply_core(NULL, 0, 0, rxstatus, NULL);
+    pthread_mutex_unlock(&board_cur->b_ks_cmd_lock);
+    return (rc);
 }
 
 static void
@@ -3608,6 +5209,8 @@ show_ks_inquiry(void)
         printf("KS message failure: %d (%s)\n", status, smash_err(status));
         return;
     }
+    board_cur->b_ks_features = SWAP16(id.si_features);
+    board_cur->b_ks_features_valid = TRUE;
 
     printf("  Kicksmash %u.%u built %02u%02u-%02u-%02u %02u:%02u:%02u\n",
            SWAP16(id.si_ks_version[0]), SWAP16(id.si_ks_version[1]),
@@ -3652,90 +5255,197 @@ mem16_swap(void *buf, uint len)
 #define SEND_MSG_MAX 2000
 
 /*
- * send_msg
- * --------
- * Sends a message to the remote Amiga
+ * A KM_OP_BATCH request is executed by running each of its requests
+ * through the normal handlers with batch_capture set for the worker
+ * thread. Replies are then appended to the capture buffer instead of
+ * being sent to the Amiga.
+ */
+typedef struct {
+    uint8_t *bc_buf;    // Captured reply entries
+    uint     bc_len;    // Bytes used in bc_buf
+    uint     bc_size;   // Size of bc_buf
+    uint     bc_count;  // Number of captured replies
+} batch_capture_t;
+
+static __thread batch_capture_t *batch_capture;
+
+/*
+ * batch_capture_add() appends a reply message to the current batch
+ * reply as a hm_batch_ent_t entry.
  */
 static uint
-send_msg(void *buf, uint len, uint *status)
+batch_capture_add(batch_capture_t *bc, const void *hdr, uint hdrlen,
+                  const void *data, uint datalen)
+{
+    hm_batch_ent_t *ent;
+    uint            len = hdrlen + datalen;
+    uint            entlen = sizeof (*ent) + ((len + 3) & ~3);
+
+    if (len > 0xffff)
+        return (MSG_STATUS_BAD_LENGTH);
+    if (bc->bc_len + entlen > bc->bc_size) {
+        uint     nsize = bc->bc_size * 2 + entlen;
+        uint8_t *nbuf = realloc(bc->bc_buf, nsize);
+        if (nbuf == NULL)
+            return (MSG_STATUS_FAILURE);
+        bc->bc_buf = nbuf;
+        bc->bc_size = nsize;
+    }
+    ent = (hm_batch_ent_t *) (bc->bc_buf + bc->bc_len);
+    ent->hmb_len = SWAP16(len);
+    ent->hmb_flags = 0;
+    memcpy(ent + 1, hdr, hdrlen);
+    memcpy((uint8_t *) (ent + 1) + hdrlen, data, datalen);
+    memset((uint8_t *) (ent + 1) + len, 0, entlen - sizeof (*ent) - len);
+    bc->bc_len += entlen;
+    bc->bc_count++;
+    return (MSG_STATUS_SUCCESS);
+}
+
+#define SEND_MSG_SPACE_MSEC 2000  // Maximum wait for Amiga to free space
+
+/*
+ * send_msg_part() sends a single packet of a message to the remote Amiga.
+ * When the Amiga has several requests outstanding, their replies may
+ * momentarily fill the USB-to-Amiga buffer (KS_STATUS_BADLEN). The
+ * packet is then retried until the Amiga has collected enough of them.
+ */
+static uint
+send_msg_part(const void *hdr, uint hdrlen, const void *data, uint datalen,
+              uint *status)
+{
+    uint rc;
+    uint waited = 0;
+
+    while (1) {
+        rc = send_ks_cmd_swap(KS_CMD_MSG_SEND, hdr, hdrlen, data, datalen,
+                              status);
+        if ((rc != 0) || (*status != KS_STATUS_BADLEN))
+            return (rc);
+        if (waited++ >= SEND_MSG_SPACE_MSEC) {
+            printf("Send timeout waiting for len=%x buffer\n",
+                   hdrlen + datalen);
+            return (RC_TIMEOUT);
+        }
+        time_delay_msec(1);
+    }
+}
+
+/*
+ * send_msg_parts
+ * --------------
+ * Sends a message to the remote Amiga, where the message is a header
+ * followed by a separate data buffer (which may be file data mapped
+ * directly from the host filesystem). Each packet is byte-swapped in a
+ * single pass as it is copied into the transmit ring, and neither buffer
+ * is modified. The header length must be even and at least the size of
+ * km_msg_hdr_t. A message which fits in a single short packet is sent
+ * in the Kicksmash priority lane when there is room, so that it is not
+ * delayed behind file data.
+ */
+static uint
+send_msg_parts(const void *hdr, uint hdrlen, const void *data, uint datalen,
+               uint *status)
 {
     uint rc;
-    uint8_t msgbuf[SEND_MSG_MAX];
-    uint sendlen = len;
+    uint sendlen;
     uint bodylen;
     uint pos;
-    uint bodylen_rounded;
 
-    mem16_swap(buf, len);
-    if (sendlen > SEND_MSG_MAX)
-        sendlen = SEND_MSG_MAX;
-    rc = send_ks_cmd(KS_CMD_MSG_SEND, buf, sendlen, NULL, 0, status, NULL, 0);
-    if (rc == 0) {
-        pos = sendlen;
-        if (pos < len) {
-            /*
-             * Remaining payload will be sent as additional messages,
-             * waiting for sufficient space available before each one.
-             * Need to repeat a minimal header for each additional packet.
-             */
-            memcpy(msgbuf, buf, sizeof (km_msg_hdr_t));
-            bodylen = pos - sizeof (km_msg_hdr_t);
+    if (batch_capture != NULL) {
+        /* Reply to a request within a KM_OP_BATCH */
+        *status = 0;
+        return (batch_capture_add(batch_capture, hdr, hdrlen, data, datalen));
+    }
+
+    pthread_mutex_lock(&board_cur->b_send_msg_lock);
+    sendlen = datalen;
+    if (sendlen > SEND_MSG_MAX - hdrlen)
+        sendlen = SEND_MSG_MAX - hdrlen;
+    if (hdrlen + datalen <= KS_MSG_PRI_MAX) {
+        /* Short reply queued ahead of bulk data waiting for the Amiga */
+        rc = send_ks_cmd_swap(KS_CMD_MSG_SEND | KS_MSG_PRIORITY, hdr, hdrlen,
+                              data, sendlen, status);
+        if ((rc == 0) && (*status == KS_STATUS_BADLEN)) {
+            /* Firmware without a priority lane; use the bulk lane */
+            rc = send_msg_part(hdr, hdrlen, data, sendlen, status);
         }
-        while (pos < len) {
-            if (bodylen > len - pos)
-                bodylen = len - pos;
-            bodylen_rounded = (bodylen + 1) & ~1;
-            memcpy(msgbuf + sizeof (km_msg_hdr_t),
-                   (uint8_t *)buf + pos, bodylen_rounded);
-            sendlen = bodylen + sizeof (km_msg_hdr_t);
+    } else {
+        rc = send_msg_part(hdr, hdrlen, data, sendlen, status);
+    }
+    pos = sendlen;
+
+    /*
+     * Remaining payload will be sent as additional messages, each
+     * repeating a minimal header.
+     */
+    bodylen = SEND_MSG_MAX - sizeof (km_msg_hdr_t);
+    while ((rc == 0) && (pos < datalen)) {
+        if (bodylen > datalen - pos)
+            bodylen = datalen - pos;
 
 #undef DO_REMOTE_SPACE_CHECK
 #ifdef DO_REMOTE_SPACE_CHECK
-            /*
-             * The check for space significantly impacts file send time
-             * (dropping from ~85 KB/sec to ~60 KB/sec. It is not really
-             * needed based on the current protocol, so it is skipped.
-             */
-            uint timeout = 100;
-            do {
-                /* Wait for space */
-                smash_msg_info_t mi;
-                rc = send_ks_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi),
-                                 status, NULL, 0);
-                mi.smi_utoa_avail = SWAP16(mi.smi_utoa_avail);
-                if (mi.smi_utoa_avail >= sendlen)
-                    break;
-                time_delay_msec(1);
-            } while (timeout--);
-
-            if (timeout == 0) {
-                printf("Send timeout waiting for len=%x buffer at %x of %x\n",
-                       sendlen, pos - SEND_MSG_MAX, len - SEND_MSG_MAX);
-                rc = RC_TIMEOUT;
-                break;
-            }
-#endif
-            rc = send_ks_cmd(KS_CMD_MSG_SEND, msgbuf, sendlen, NULL, 0,
+        /*
+         * The check for space significantly impacts file send time
+         * (dropping from ~85 KB/sec to ~60 KB/sec. It is not really
+         * needed based on the current protocol, so it is skipped.
+         */
+        uint timeout = 100;
+        sendlen = bodylen + sizeof (km_msg_hdr_t);
+        do {
+            /* Wait for space */
+            smash_msg_info_t mi;
+            rc = send_ks_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi),
                              status, NULL, 0);
-            if (rc != 0) {
-                printf("send msg failed at %x of %x\n", pos, len);
+            mi.smi_utoa_avail = SWAP16(mi.smi_utoa_avail);
+            if (mi.smi_utoa_avail >= sendlen)
                 break;
-            }
-            pos += bodylen;
+            time_delay_msec(1);
+        } while (timeout--);
+
+        if (timeout == 0) {
+            printf("Send timeout waiting for len=%x buffer at %x of %x\n",
+                   sendlen, pos, datalen);
+            rc = RC_TIMEOUT;
+            break;
+        }
+#endif
+        rc = send_msg_part(hdr, sizeof (km_msg_hdr_t),
+                           (const uint8_t *)data + pos, bodylen, status);
+        if (rc != 0) {
+            printf("send msg failed at %x of %x\n", pos, datalen);
+            break;
+        }
+        pos += bodylen;
 #undef DEBUG_SEND_MSG
 #ifdef DEBUG_SEND_MSG
-            printf("send %x (body=%x) pos=%x of %x\n",
-                   sendlen, bodylen, pos, len);
+        printf("send %x (body=%x) pos=%x of %x\n",
+               bodylen + sizeof (km_msg_hdr_t), bodylen, pos, datalen);
 #endif
-        }
     }
-
-    mem16_swap(buf, len);
+    pthread_mutex_unlock(&board_cur->b_send_msg_lock);
     return (rc);
 }
 
 /*
- * recv_msg
+ * send_msg
+ * --------
+ * Sends a message to the remote Amiga
+ */
+static uint
+send_msg(void *buf, uint len, uint *status)
+{
+    uint hdrlen = sizeof (km_msg_hdr_t);
+
+    if (len < hdrlen)
+        hdrlen = len & ~1;
+    return (send_msg_parts(buf, hdrlen, (uint8_t *)buf + hdrlen,
+                           len - hdrlen, status));
+}
+
+/*
+ * recv_msg
  * --------
  * Receives a message from the remote Amiga
  */
@@ -3750,15 +5460,72 @@ recv_msg(void *buf, uint bufsize, uint *rx_status, uint *rx_len)
     return (rc);
 }
 
-static uint16_t app_state_send[2];
+static void msg_dispatch_passed(uint status, uint8_t *rxdata, uint rxlen);
+
+/*
+ * recv_msg_cont
+ * -------------
+ * Receives the continuation packets of a multi-packet message from the
+ * remote Amiga, appending their payload to the specified buffer until
+ * the total length has been reached. A short message with a different
+ * tag may arrive in between, as priority lane messages are delivered
+ * first; it is dispatched as a new request (see msg_dispatch_passed()).
+ */
+static uint
+recv_msg_cont(uint16_t tag, uint8_t *buf, uint pos, uint len, uint *status)
+{
+    uint8_t  rxdata[4096];
+    uint8_t *ndata = (uint8_t *) ((km_msg_hdr_t *) rxdata + 1);
+    uint     rxlen;
+    uint     timeout = 0;
+    uint     rc = RC_SUCCESS;
+
+    while (pos < len) {
+        /* Full buffer: a priority message may arrive instead of data */
+        rc = recv_msg(rxdata, sizeof (rxdata), status, &rxlen);
+        if (rc != RC_SUCCESS)
+            break;
+        if (rxlen == 0) {
+            if (++timeout < 20)
+                continue;
+            fsprintf("msg %04x data timeout at pos=%x\n", tag, pos);
+            rc = RC_FAILURE;
+            break;
+        }
+        timeout = 0;
+        if (rxlen >= sizeof (km_msg_hdr_t))
+            rxlen -= sizeof (km_msg_hdr_t);
+        else
+            rxlen = 0;
+        if (((km_msg_hdr_t *)rxdata)->km_tag != tag) {
+            if (rxlen + sizeof (km_msg_hdr_t) <= KS_MSG_PRI_MAX) {
+                /* Priority lane message passed this one */
+                msg_dispatch_passed(*status, rxdata,
+                                    rxlen + sizeof (km_msg_hdr_t));
+                continue;
+            }
+            fsprintf("tag mismatch: %04x != expected %04x\n",
+                     ((km_msg_hdr_t *)rxdata)->km_tag, tag);
+            rc = RC_FAILURE;
+            break;
+        }
+        if (rxlen > len - pos)
+            rxlen = len - pos;  // Only the continuation payload is clamped
+        memcpy(buf + pos, ndata, rxlen);
+        pos += rxlen;
+    }
+    return (rc);
+}
 
 static uint
 keep_app_state(void)
 {
     uint status;
     uint rc;
-    rc = send_ks_cmd(KS_CMD_MSG_STATE | KS_MSG_STATE_SET, app_state_send,
-                     sizeof (app_state_send), NULL, 0, &status, NULL, 0);
+    rc = send_ks_cmd(KS_CMD_MSG_STATE | KS_MSG_STATE_SET | KS_MSG_STATE_NOTIFY,
+                     board_cur->b_app_state_send,
+                     sizeof (board_cur->b_app_state_send), NULL, 0,
+                     &status, NULL, 0);
     if (rc != 0) {
         printf("KS send message failed: %d (%s)\n", rc, smash_err(rc));
         return (rc);
@@ -3777,8 +5544,9 @@ get_localtime(time_t rawtime)
 #ifdef __MINGW32__
     return (rawtime);
 #else
-    struct tm *ptm = localtime(&rawtime);
-    return (rawtime + ptm->tm_gmtoff);
+    struct tm tm;
+    localtime_r(&rawtime, &tm);
+    return (rawtime + tm.tm_gmtoff);
 #endif
 }
 
@@ -3793,8 +5561,9 @@ get_utctime(time_t rawtime)
 #ifdef __MINGW32__
     return (rawtime);
 #else
-    struct tm *ptm = localtime(&rawtime);
-    return (rawtime - ptm->tm_gmtoff);
+    struct tm tm;
+    localtime_r(&rawtime, &tm);
+    return (rawtime - tm.tm_gmtoff);
 #endif
 }
 
@@ -4015,6 +5784,292 @@ merge_amiga_paths(const char *base, const char *append)
     return (strdup(pathbuf));
 }
 
+/*
+ * Path resolution cache
+ *
+ * Every open, create, delete, and rename resolves an Amiga name relative
+ * to a parent handle and builds the host path from it, and link handling
+ * converts host directories to real paths with realpath(), which walks
+ * every element of the path. Both results are cached in a hash table kept
+ * in least-recently-used order. An Amiga name entry is keyed by board,
+ * parent handle, and name, as each board has its own handle numbers. It
+ * holds the resolved parent handle, Amiga relative path, and host path.
+ * A real path entry is keyed by host directory path.
+ *
+ * Handle numbers are not reused while handles remain open; an entry whose
+ * resolved parent handle has since closed is discarded on lookup. Entries
+ * at or below a host path are discarded when hostsmash renames or deletes
+ * the path, and when inotify reports the path changed in a directory
+ * watched by the directory cache.
+ */
+#define PATHCACHE_MAX     1024  // Maximum cached paths
+#define PATHCACHE_BUCKETS 1024  // Hash buckets (power of 2)
+
+typedef struct pathcache pathcache_t;
+struct pathcache {
+    pathcache_t *pc_hnext;     // Next in hash bucket
+    pathcache_t *pc_newer;     // More recently used entry
+    pathcache_t *pc_older;     // Less recently used entry
+    uint32_t     pc_hash;      // Hash of key
+    uint8_t      pc_real;      // Key is a host path for realpath()
+    uint         pc_unit;      // Board of parent handle (0 for real path)
+    handle_t     pc_phandle;   // Parent handle of Amiga name
+    handle_t     pc_rhandle;   // Resolved parent handle (0 = volume dir)
+    char        *pc_name;      // Amiga name or host directory path (key)
+    char        *pc_apath;     // Resolved Amiga relative path
+    char        *pc_hpath;     // Host path, or real path
+};
+
+static pathcache_t    *pathcache_bucket[PATHCACHE_BUCKETS];
+static pathcache_t    *pathcache_newest = NULL;
+static pathcache_t    *pathcache_oldest = NULL;
+static uint            pathcache_count  = 0;
+static pthread_mutex_t pathcache_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+pathcache_hash(uint real, uint unit, handle_t phandle, const char *name)
+{
+    uint32_t hash = (2166136261U ^ real) * 16777619U;
+
+    hash = (hash ^ unit) * 16777619U;
+    hash = (hash ^ phandle) * 16777619U;
+    while (*name != '\0') {
+        hash ^= (uint8_t) *(name++);
+        hash *= 16777619U;
+    }
+    return (hash);
+}
+
+/*
+ * pathcache_remove() unlinks and frees a cache entry. The caller must
+ * hold pathcache_lock.
+ */
+static void
+pathcache_remove(pathcache_t *pc)
+{
+    pathcache_t **prev;
+
+    prev = &pathcache_bucket[pc->pc_hash & (PATHCACHE_BUCKETS - 1)];
+    for (; *prev != NULL; prev = &(*prev)->pc_hnext) {
+        if (*prev == pc) {
+            *prev = pc->pc_hnext;
+            break;
+        }
+    }
+    if (pc->pc_newer != NULL)
+        pc->pc_newer->pc_older = pc->pc_older;
+    else
+        pathcache_newest = pc->pc_older;
+    if (pc->pc_older != NULL)
+        pc->pc_older->pc_newer = pc->pc_newer;
+    else
+        pathcache_oldest = pc->pc_newer;
+    pathcache_count--;
+
+    free(pc->pc_name);
+    free(pc->pc_apath);
+    free(pc->pc_hpath);
+    free(pc);
+}
+
+/*
+ * pathcache_find() returns the cache entry for the specified key, making
+ * it the most recently used. The caller must hold pathcache_lock.
+ */
+static pathcache_t *
+pathcache_find(uint real, uint unit, handle_t phandle, const char *name,
+               uint32_t hash)
+{
+    pathcache_t *pc;
+
+    for (pc = pathcache_bucket[hash & (PATHCACHE_BUCKETS - 1)]; pc != NULL;
+         pc = pc->pc_hnext) {
+        if ((pc->pc_hash == hash) && (pc->pc_real == real) &&
+            (pc->pc_unit == unit) && (pc->pc_phandle == phandle) &&
+            (strcmp(pc->pc_name, name) == 0))
+            break;
+    }
+    if ((pc == NULL) || (pc == pathcache_newest))
+        return (pc);
+
+    /* Move to most recently used */
+    pc->pc_newer->pc_older = pc->pc_older;
+    if (pc->pc_older != NULL)
+        pc->pc_older->pc_newer = pc->pc_newer;
+    else
+        pathcache_oldest = pc->pc_newer;
+    pc->pc_older = pathcache_newest;
+    pc->pc_newer = NULL;
+    pathcache_newest->pc_newer = pc;
+    pathcache_newest = pc;
+    return (pc);
+}
+
+/*
+ * pathcache_add() caches a copy of a resolved path, evicting the least
+ * recently used entry when the cache is full.
+ */
+static void
+pathcache_add(uint real, uint unit, handle_t phandle, const char *name,
+              handle_t rhandle, const char *apath, const char *hpath)
+{
+    uint32_t     hash = pathcache_hash(real, unit, phandle, name);
+    pathcache_t *pc;
+    uint         slot = hash & (PATHCACHE_BUCKETS - 1);
+
+    pthread_mutex_lock(&pathcache_lock);
+    if (pathcache_find(real, unit, phandle, name, hash) != NULL)
+        goto add_done;  // Another worker resolved the same path
+    if ((pathcache_count >= PATHCACHE_MAX) && (pathcache_oldest != NULL))
+        pathcache_remove(pathcache_oldest);
+
+    pc = calloc(1, sizeof (*pc));
+    if (pc == NULL)
+        goto add_done;
+    pc->pc_hash    = hash;
+    pc->pc_real    = real;
+    pc->pc_unit    = unit;
+    pc->pc_phandle = phandle;
+    pc->pc_rhandle = rhandle;
+    pc->pc_name    = strdup(name);
+    pc->pc_apath   = (apath != NULL) ? strdup(apath) : NULL;
+    pc->pc_hpath   = (hpath != NULL) ? strdup(hpath) : NULL;
+
+    pc->pc_hnext = pathcache_bucket[slot];
+    pathcache_bucket[slot] = pc;
+    pc->pc_older = pathcache_newest;
+    if (pathcache_newest != NULL)
+        pathcache_newest->pc_newer = pc;
+    else
+        pathcache_oldest = pc;
+    pathcache_newest = pc;
+    pathcache_count++;
+add_done:
+    pthread_mutex_unlock(&pathcache_lock);
+}
+
+/*
+ * path_within() returns TRUE if path is dir or is located below dir.
+ */
+static bool_t
+path_within(const char *path, const char *dir, size_t dlen)
+{
+    if ((dlen == 0) || (strncmp(path, dir, dlen) != 0))
+        return (FALSE);
+    return ((path[dlen] == '\0') || (path[dlen] == '/') ||
+            (dir[dlen - 1] == '/'));
+}
+
+/*
+ * pathcache_invalidate() discards cached paths at or below the specified
+ * host path. A NULL path discards everything.
+ */
+static void
+pathcache_invalidate(const char *path)
+{
+    pathcache_t *pc;
+    pathcache_t *next;
+    size_t       plen = (path != NULL) ? strlen(path) : 0;
+
+    pthread_mutex_lock(&pathcache_lock);
+    for (pc = pathcache_newest; pc != NULL; pc = next) {
+        next = pc->pc_older;
+        if ((path == NULL) ||
+            ((pc->pc_hpath != NULL) &&
+             path_within(pc->pc_hpath, path, plen)) ||
+            (pc->pc_real && path_within(pc->pc_name, path, plen))) {
+            pathcache_remove(pc);
+        }
+    }
+    pthread_mutex_unlock(&pathcache_lock);
+}
+
+/*
+ * make_amiga_host_path() resolves an Amiga name relative to a parent
+ * handle, as make_amiga_relpath() does, and also provides the host path.
+ *
+ * @param [io]  parent    - Parent handle, updated to the resolved parent
+ *                          (NULL for the volume directory).
+ * @param [in]  name      - Amiga name to resolve.
+ * @param [out] host_path - Allocated host path, or NULL for the volume
+ *                          directory.
+ *
+ * @return      Allocated Amiga relative path, or NULL if the name could
+ *              not be resolved.
+ */
+static char *
+make_amiga_host_path(handle_ent_t **parent, const char *name,
+                     char **host_path)
+{
+    handle_t      phandle = (*parent != NULL) ? (*parent)->he_handle : 0;
+    uint          unit = board_cur->b_unit;
+    uint32_t      hash = pathcache_hash(0, unit, phandle, name);
+    pathcache_t  *pc;
+    handle_ent_t *rparent = NULL;
+    char         *apath;
+
+    pthread_mutex_lock(&pathcache_lock);
+    pc = pathcache_find(0, unit, phandle, name, hash);
+    if ((pc != NULL) && (pc->pc_rhandle != 0)) {
+        int slot;
+        pthread_mutex_lock(&board_cur->b_handle_lock);
+        slot = handle_hash_find(pc->pc_rhandle);
+        if (slot >= 0)
+            rparent = board_cur->b_handle_hash[slot];
+        pthread_mutex_unlock(&board_cur->b_handle_lock);
+        if (rparent == NULL) {
+            /* Resolved parent has closed */
+            pathcache_remove(pc);
+            pc = NULL;
+        }
+    }
+    if (pc != NULL) {
+        *parent = rparent;
+        apath = strdup(pc->pc_apath);
+        *host_path = (pc->pc_hpath != NULL) ? strdup(pc->pc_hpath) : NULL;
+        pthread_mutex_unlock(&pathcache_lock);
+        return (apath);
+    }
+    pthread_mutex_unlock(&pathcache_lock);
+
+    *host_path = NULL;
+    apath = make_amiga_relpath(parent, name);
+    if (apath == NULL)
+        return (NULL);
+    if (*parent != NULL)
+        *host_path = make_host_path((*parent)->he_avolume, apath);
+    pathcache_add(0, unit, phandle, name,
+                  (*parent != NULL) ? (*parent)->he_handle : 0,
+                  apath, *host_path);
+    return (apath);
+}
+
+/*
+ * pathcache_realpath() is realpath() of an existing host path, answered
+ * from the cache when possible.
+ */
+static char *
+pathcache_realpath(const char *path)
+{
+    uint32_t     hash = pathcache_hash(1, 0, 0, path);
+    pathcache_t *pc;
+    char        *rp;
+
+    pthread_mutex_lock(&pathcache_lock);
+    pc = pathcache_find(1, 0, 0, path, hash);
+    if (pc != NULL) {
+        rp = strdup(pc->pc_hpath);
+        pthread_mutex_unlock(&pathcache_lock);
+        return (rp);
+    }
+    pthread_mutex_unlock(&pathcache_lock);
+
+    rp = realpath(path, NULL);
+    if (rp != NULL)
+        pathcache_add(1, 0, 0, path, 0, NULL, rp);
+    return (rp);
+}
+
 static void
 convert_host_path_to_amiga_path(char *path)
 {
@@ -4060,7 +6115,7 @@ realpath_parent(char *path)
             return (strdup(path));
 
         *eptr = '\0';
-        rp = realpath(path, NULL);
+        rp = pathcache_realpath(path);
         *eptr = '/';
     } while (rp == NULL);
 
@@ -4412,1946 +6467,5421 @@ amiga_perms_from_str(const char *aperms)
     return (mask);
 }
 
-static uint
-errno_to_km_status(void)
+/*
+ * Read-ahead cache
+ *
+ * Files opened read-only get a per-handle cache of file data. Once an
+ * Amiga handle has issued RA_SEQ_TRIGGER reads which each start where the
+ * previous one ended, a background thread prefetches up to readahead_window
+ * bytes beyond the current position so that the next KM_OP_FREAD can be
+ * answered from memory. The cache covers file offsets
+ * [ra_start, ra_start + ra_len). While a prefetch is outstanding (ra_busy),
+ * only the prefetch thread may change ra_start, ra_len, or ra_buf beyond
+ * ra_len. The file descriptor offset is not used for reads from a cached
+ * handle, so ra_pos is the current file position.
+ *
+ * All caches are kept on a list with the identity of their file. When a
+ * handle writes or truncates a file, the cached data of every read-ahead
+ * handle on that file is discarded (see readahead_invalidate()).
+ */
+#ifdef __MINGW32__
+#define READAHEAD_DEFAULT_KB 0    // No pread(); read-ahead is off by default
+#else
+#define READAHEAD_DEFAULT_KB 128  // Default prefetch window (KB)
+#endif
+#define RA_SEQ_TRIGGER       2    // Sequential reads before prefetch starts
+
+struct readahead {
+    pthread_mutex_t ra_lock;
+    pthread_cond_t  ra_cond;      // Signaled when a prefetch completes
+    readahead_t    *ra_qnext;     // Next in prefetch queue
+    readahead_t    *ra_next_ra;   // Next in list of all read-ahead caches
+    dev_t           ra_dev;       // Device of cached file
+    ino_t           ra_ino;       // Inode of cached file
+    uint8_t        *ra_buf;       // Cached file data
+    uint            ra_size;      // Size of ra_buf (prefetch window)
+    uint            ra_len;       // Valid bytes in ra_buf
+    off64_t         ra_start;     // File offset of ra_buf[0]
+    off64_t         ra_pos;       // Current file position
+    off64_t         ra_next;      // Expected offset of a sequential read
+    uint            ra_seq;       // Count of sequential reads
+    int             ra_fd;        // File to prefetch from
+    uint8_t         ra_busy;      // Prefetch queued or in progress
+    uint8_t         ra_eof;       // Prefetch reached end of file
+    uint8_t         ra_stale;     // File changed during prefetch; discard
+    uint            ra_hits;      // Reads satisfied from cache
+    uint            ra_misses;    // Reads which required a file read
+};
+
+static uint            readahead_window = READAHEAD_DEFAULT_KB << 10;
+static uint            readahead_hits;      // Total reads from cache
+static uint            readahead_misses;    // Total reads not from cache
+static readahead_t    *readahead_q_head;    // Prefetch queue
+static readahead_t    *readahead_q_tail;
+static pthread_mutex_t readahead_q_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  readahead_q_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t  readahead_once   = PTHREAD_ONCE_INIT;
+static readahead_t    *readahead_head;      // All read-ahead caches
+static pthread_mutex_t readahead_lock   = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef __MINGW32__
+static ssize_t
+pread(int fd, void *buf, size_t len, off64_t offset)
 {
-    switch (errno) {
-        case EACCES:
-        case EBUSY:
-        case EFAULT:
-        case EPERM:
-        case EROFS:
-            return (KM_STATUS_PERM);
-        case EBADF:
-        case EINVAL:
-        case EISDIR:
-            return (KM_STATUS_INVALID);
-        case EEXIST:
-            return (KM_STATUS_EXIST);
-        case ENOENT:
-            return (KM_STATUS_NOEXIST);
-        case ENOTEMPTY:
-            return (KM_STATUS_NOTEMPTY);
-        default:
-            fsprintf("errno=%d\n", errno);
-            return (KM_STATUS_FAIL);
-    }
+    if (lseek64(fd, offset, SEEK_SET) < 0)
+        return (-1);
+    return (read(fd, buf, len));
 }
+#endif
 
-static uint
-sm_unknown(km_msg_hdr_t *km, uint *status)
+/*
+ * th_readahead() is a thread which services prefetch requests for all
+ * read-ahead handles.
+ */
+static void *
+th_readahead(void *arg)
 {
-    fsprintf("KS unexpected op %x\n", km->km_op);
-    km->km_status = KM_STATUS_UNKCMD;
-    km->km_op |= KM_OP_REPLY;
-    return (send_msg(km, sizeof (*km), status));
+    readahead_t *ra;
+    off64_t      off;
+    uint         space;
+    ssize_t      rc;
+
+    while (1) {
+        pthread_mutex_lock(&readahead_q_lock);
+        while (readahead_q_head == NULL)
+            pthread_cond_wait(&readahead_q_cond, &readahead_q_lock);
+        ra = readahead_q_head;
+        readahead_q_head = ra->ra_qnext;
+        if (readahead_q_head == NULL)
+            readahead_q_tail = NULL;
+        pthread_mutex_unlock(&readahead_q_lock);
+
+        /* Region beyond ra_len is owned by this thread while ra_busy */
+        off = ra->ra_start + ra->ra_len;
+        space = ra->ra_size - ra->ra_len;
+        rc = pread(ra->ra_fd, ra->ra_buf + ra->ra_len, space, off);
+
+        pthread_mutex_lock(&ra->ra_lock);
+        if (ra->ra_stale) {
+            /* File was written during the prefetch */
+            ra->ra_stale = 0;
+            ra->ra_len = 0;
+        } else {
+            if (rc > 0)
+                ra->ra_len += rc;
+            if (rc < (ssize_t) space)
+                ra->ra_eof = 1;  // Also stop prefetching on read error
+        }
+        ra->ra_busy = 0;
+        pthread_cond_broadcast(&ra->ra_cond);
+        pthread_mutex_unlock(&ra->ra_lock);
+    }
+    return (NULL);
 }
 
-static uint
-sm_null(km_msg_hdr_t *km, uint *status)
+static void
+readahead_thread_start(void)
 {
-    km->km_status = KM_STATUS_OK;
-    km->km_op |= KM_OP_REPLY;
-    return (send_msg(km, sizeof (*km), status));
+    pthread_attr_t thread_attr;
+    pthread_t      thread_id;
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread_id, &thread_attr, th_readahead, NULL))
+        err(EXIT_FAILURE, "failed to create read-ahead thread");
 }
 
-static uint
-sm_loopback(km_msg_hdr_t *km, uint8_t *rxdata, uint rxlen, uint *status)
+/*
+ * readahead_new() attaches a read-ahead cache to a file handle, if
+ * read-ahead is enabled.
+ */
+static void
+readahead_new(handle_ent_t *handle)
 {
-    /* Need to send back reply */
-    km->km_status = KM_STATUS_OK;
-    km->km_op |= KM_OP_REPLY;
-#if 0
-    fsprintf("lb l=%x s=%04x data=%02x %02x\n",
-             rxlen, status, rxdata[0], rxdata[1]);
-#endif
-    return (send_msg(rxdata, rxlen, status));
+    readahead_t *ra;
+    struct stat  st;
+
+    if ((readahead_window == 0) || (fstat(handle->he_fd, &st) != 0))
+        return;
+    ra = calloc(1, sizeof (*ra));
+    if (ra == NULL)
+        return;
+    ra->ra_buf = malloc(readahead_window);
+    if (ra->ra_buf == NULL) {
+        free(ra);
+        return;
+    }
+    pthread_once(&readahead_once, readahead_thread_start);
+    pthread_mutex_init(&ra->ra_lock, NULL);
+    pthread_cond_init(&ra->ra_cond, NULL);
+    ra->ra_size = readahead_window;
+    ra->ra_fd = handle->he_fd;
+    ra->ra_dev = st.st_dev;
+    ra->ra_ino = st.st_ino;
+    handle->he_ra = ra;
+
+    pthread_mutex_lock(&readahead_lock);
+    ra->ra_next_ra = readahead_head;
+    readahead_head = ra;
+    pthread_mutex_unlock(&readahead_lock);
 }
 
-static uint
-sm_id(km_msg_hdr_t *km, uint *status)
+/*
+ * readahead_free() releases the read-ahead cache of a file handle after
+ * any outstanding prefetch has completed.
+ */
+static void
+readahead_free(handle_ent_t *handle)
 {
-    smash_id_t *reply = (smash_id_t *) (km + 1);
-    uint temp[3];
-    int  pos = 0;
+    readahead_t  *ra = handle->he_ra;
+    readahead_t **prev;
 
-    km->km_status = KM_STATUS_OK;
-    km->km_op |= KM_OP_REPLY;
-    memset(reply, 0, sizeof (*reply));
-    sscanf(version_str + 8, "%u.%u%n", &temp[0], &temp[1], &pos);
-    reply->si_ks_version[0] = SWAP16(temp[0]);
-    reply->si_ks_version[1] = SWAP16(temp[1]);
-    if (pos == 0)
-        pos = 18;
-    else
-        pos += 8 + 7;
-    sscanf(version_str + pos, "%04u-%02u-%02u",
-           &temp[0], &temp[1], &temp[2]);
-    reply->si_ks_date[0] = temp[0] / 100;
-    reply->si_ks_date[1] = temp[0] % 100;
-    reply->si_ks_date[2] = temp[1];
-    reply->si_ks_date[3] = temp[2];
-    pos += 11;
-    sscanf(version_str + pos, "%02u:%02u:%02u",
-           &temp[0], &temp[1], &temp[2]);
-    reply->si_ks_time[0] = temp[0];
-    reply->si_ks_time[1] = temp[1];
-    reply->si_ks_time[2] = temp[2];
-    reply->si_ks_time[3] = 0;
-    strcpy(reply->si_serial, "-");           // MAC address here?
-    reply->si_rev      = SWAP16(0x0001);     // Protocol version 0.1
-    reply->si_features = SWAP16(0x0001);     // Features
-    reply->si_usbid    = SWAP32(0x12091610); // IP address here?
-    reply->si_mode     = 0xff;
-    gethostname(reply->si_name, sizeof (reply->si_name));
-    reply->si_name[sizeof (reply->si_name) - 1] = '\0';
-    memset(reply->si_unused, 0, sizeof (reply->si_unused));
-    return (send_msg(km, sizeof (*km) + sizeof (*reply), status));
+    if (ra == NULL)
+        return;
+    pthread_mutex_lock(&readahead_lock);
+    for (prev = &readahead_head; *prev != NULL; prev = &(*prev)->ra_next_ra) {
+        if (*prev == ra) {
+            *prev = ra->ra_next_ra;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&readahead_lock);
+
+    pthread_mutex_lock(&ra->ra_lock);
+    while (ra->ra_busy)
+        pthread_cond_wait(&ra->ra_cond, &ra->ra_lock);
+    pthread_mutex_unlock(&ra->ra_lock);
+
+    fsprintf("readahead %s: hits=%u misses=%u (total hits=%u misses=%u)\n",
+             handle->he_name, ra->ra_hits, ra->ra_misses,
+             readahead_hits, readahead_misses);
+    pthread_mutex_destroy(&ra->ra_lock);
+    pthread_cond_destroy(&ra->ra_cond);
+    free(ra->ra_buf);
+    free(ra);
+    handle->he_ra = NULL;
 }
 
-static uint
-sm_fopen(hm_fopenhandle_t *hm, uint *status)
+/*
+ * readahead_invalidate() discards the cached data of all read-ahead
+ * handles on a file which has just been written or truncated. A prefetch
+ * in progress is discarded when it completes.
+ *
+ * @param [in] dev - Device of the changed file.
+ * @param [in] ino - Inode of the changed file.
+ */
+static void
+readahead_invalidate(dev_t dev, ino_t ino)
 {
-    char         *hm_name = (char *)(hm + 1);
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    handle_ent_t *handle;
-    char         *host_path = NULL;
-    char         *name = NULL;
-    uint16_t      hm_type;
-    uint16_t      hm_mode = SWAP16(hm->hm_mode);
-    uint          oflags;
-    int           fd;
-    struct stat   st;
+    readahead_t *ra;
 
-    fsprintf("fopen(%s %x) in %x\n", hm_name, hm_mode, hm->hm_handle);
+    pthread_mutex_lock(&readahead_lock);
+    for (ra = readahead_head; ra != NULL; ra = ra->ra_next_ra) {
+        if ((ra->ra_ino != ino) || (ra->ra_dev != dev))
+            continue;
+        pthread_mutex_lock(&ra->ra_lock);
+        if (ra->ra_busy)
+            ra->ra_stale = 1;
+        else
+            ra->ra_len = 0;
+        ra->ra_eof = 0;
+        pthread_mutex_unlock(&ra->ra_lock);
+    }
+    pthread_mutex_unlock(&readahead_lock);
+}
 
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-
-#ifdef FOPEN_DEBUG
-    fsprintf("parent handle=%x type=%x path=%s\n",
-             hm->hm_handle, phandle ? phandle->he_type: 0,
-             phandle ? phandle->he_name : NULL);
-#endif
-    if ((hm_name[0] == '\0') && (hm_mode == 0)) {
-        /* Special case -- want to reopen handle with same mode */
-//      hm_mode = phandle->he_mode;
-        hm_mode = HM_MODE_READ;
-        // XXX: I'm not sure this is enough because for the new file,
-        //      phandle could end up being a file, and this might break
-        //      future reopens. Need to test that.
-    }
-    if ((name = make_amiga_relpath(&phandle, hm_name)) == NULL) {
-        fsprintf("fopen(%s) relative path failed\n", hm_name);
-reply_open_fail:
-        if (name != NULL)
-            free(name);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_NOEXIST;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
+/*
+ * readahead_seek() sets the current file position of a read-ahead handle.
+ * Cached data is kept, as the new position may still fall within it.
+ */
+static void
+readahead_seek(readahead_t *ra, off64_t pos)
+{
+    pthread_mutex_lock(&ra->ra_lock);
+    ra->ra_pos = pos;
+    ra->ra_eof = 0;
+    pthread_mutex_unlock(&ra->ra_lock);
+}
 
-    if (phandle == NULL) {
-        /* Opening the volume directory */
-        if ((hm_mode & HM_MODE_READ) == 0) {
-            fsprintf("Did not open volume directory for read (%x)\n",
-                     hm_mode);
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_open_fail;
-        }
-        hm->hm_type = SWAP16(HM_TYPE_DIR);
+/*
+ * readahead_schedule() queues a prefetch beyond the current position if
+ * the handle is being read sequentially and less than half of the window
+ * remains cached. The caller must hold ra_lock.
+ */
+static void
+readahead_schedule(readahead_t *ra)
+{
+    off64_t end = ra->ra_start + ra->ra_len;
 
-        handle = handle_new(name, "", NULL, HM_TYPE_VOLDIR, hm_mode);
-        /* Volume directory has no he_volume or he_avolume pointers */
-        free(name);
-        goto open_success;
+    if ((ra->ra_seq < RA_SEQ_TRIGGER) || ra->ra_busy || ra->ra_eof)
+        return;
+    if ((ra->ra_pos >= ra->ra_start) && (ra->ra_pos <= end)) {
+        if (end - ra->ra_pos >= ra->ra_size / 2)
+            return;  // Enough already cached
+        /* Discard data before the current position */
+        ra->ra_len = end - ra->ra_pos;
+        memmove(ra->ra_buf, ra->ra_buf + (ra->ra_pos - ra->ra_start),
+                ra->ra_len);
+    } else {
+        ra->ra_len = 0;
     }
-    host_path = make_host_path(phandle->he_avolume, name);
+    ra->ra_start = ra->ra_pos;
+    ra->ra_busy = 1;
 
-    fsprintf("host_path=%s\n", host_path);
+    pthread_mutex_lock(&readahead_q_lock);
+    ra->ra_qnext = NULL;
+    if (readahead_q_tail == NULL)
+        readahead_q_head = ra;
+    else
+        readahead_q_tail->ra_qnext = ra;
+    readahead_q_tail = ra;
+    pthread_cond_signal(&readahead_q_cond);
+    pthread_mutex_unlock(&readahead_q_lock);
+}
 
-    hm_type = SWAP16(hm->hm_type);
-    if (hm_mode & HM_MODE_READ) {
-        /* File is opened for read; attempt to figure out file type */
-        if (hm_mode & HM_MODE_NOFOLLOW) {
-            if (lstat(host_path, &st) != 0) {
-                fsprintf("fopen(%s) lstat fail errno=%d\n", host_path, errno);
-                goto reply_open_fail;
-            }
+/*
+ * readahead_read() reads from the current file position of a read-ahead
+ * handle, using cached data where available. It has the same return
+ * value semantics as read().
+ */
+static ssize_t
+readahead_read(readahead_t *ra, void *buf, uint len)
+{
+    uint8_t *dst = buf;
+    uint     got = 0;
+    ssize_t  rc = 0;
+
+    pthread_mutex_lock(&ra->ra_lock);
+    if (ra->ra_pos == ra->ra_next)
+        ra->ra_seq++;
+    else
+        ra->ra_seq = 0;
+
+    while (got < len) {
+        off64_t end = ra->ra_start + ra->ra_len;
+        if ((ra->ra_pos >= ra->ra_start) && (ra->ra_pos < end)) {
+            uint avail = end - ra->ra_pos;
+            if (avail > len - got)
+                avail = len - got;
+            memcpy(dst + got, ra->ra_buf + (ra->ra_pos - ra->ra_start),
+                   avail);
+            got += avail;
+            ra->ra_pos += avail;
+        } else if (ra->ra_busy && (ra->ra_pos == end)) {
+            /* Requested data is being prefetched now */
+            pthread_cond_wait(&ra->ra_cond, &ra->ra_lock);
         } else {
-            if (stat(host_path, &st) != 0) {
-                fsprintf("fopen(%s) stat fail errno=%d\n", host_path, errno);
-                goto reply_open_fail;
-            }
+            break;
         }
-        hm_type = st_mode_to_hm_type(st.st_mode);
-        hm->hm_type = SWAP16(hm_type);
     }
+    if (got == len) {
+        ra->ra_hits++;
+        __sync_fetch_and_add(&readahead_hits, 1);
+    } else {
+        ra->ra_misses++;
+        __sync_fetch_and_add(&readahead_misses, 1);
+        rc = pread(ra->ra_fd, dst + got, len - got, ra->ra_pos);
+        if (rc > 0)
+            ra->ra_pos += rc;
+    }
+    ra->ra_next = ra->ra_pos;
+    readahead_schedule(ra);
+    pthread_mutex_unlock(&ra->ra_lock);
 
-    if ((hm_mode & HM_MODE_LINK) ||
-        (hm_mode & HM_MODE_DIR)) {
-        /*
-         * Special open mode which returns directory or link target
-         * information for a single file.
-         */
-        if ((hm_mode & HM_MODE_RDWR) != HM_MODE_READ) {
-            fsprintf("Did not open dirent %s for read (%x)\n",
-                     host_path, hm_mode);
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_open_fail;
-        }
-        fsprintf("handle_new name='%s' hm_name='%s' host_path='%s'\n",
-                 name, hm_name, host_path);
-        handle = handle_new(name, host_path, phandle, hm_type, hm_mode);
-        fsprintf("dirmode phandle %x handle %x avolume=%s name=%s\n",
-                 (phandle != NULL) ? phandle->he_handle : 0,
-                 handle->he_handle,
-                 (handle->he_avolume != NULL) ? handle->he_avolume->av_volume :
-                 "(NULL)", name);
-        free(name);
-        goto open_success;
-    } else if (hm_type == HM_TYPE_DIR) {
-        DIR *dir;
-        if ((hm_mode & ~HM_MODE_DIR) != HM_MODE_READ) {
-            fsprintf("Did not open dir %s for read (%x)\n",
-                     host_path, hm_mode);
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_open_fail;
-        }
-        dir = opendir(host_path);
-        if (dir == NULL) {
-            fsprintf("opendir(%s) failed\n", host_path);
-            goto reply_open_fail;
-        }
+    if ((rc < 0) && (got == 0))
+        return (rc);
+    return (got + ((rc > 0) ? rc : 0));
+}
 
-        handle = handle_new(name, "", phandle, hm_type, hm_mode);
-        handle->he_dir = dir;
-        fsprintf("  opendir(%s \"%s\") = %x %p\n",
-                 host_path, name, handle->he_handle, (void *) dir);
-        free(name);
-        goto open_success;
-    }
-    switch (hm_mode & HM_MODE_RDWR) {
-        case HM_MODE_READ:
-            oflags = O_RDONLY;
-            break;
-        case HM_MODE_WRITE:
-            oflags = O_WRONLY;
-            break;
-        case HM_MODE_RDWR:
-            oflags = O_RDWR;
-            break;
-        default:
-            oflags = 0;
-            break;
-    }
-    if (hm_mode & HM_MODE_APPEND)
-        oflags |= O_APPEND;
-    if (hm_mode & HM_MODE_CREATE)
-        oflags |= O_CREAT;
-    if (hm_mode & HM_MODE_TRUNC)
-        oflags |= O_TRUNC;
+/*
+ * Write-behind buffer
+ *
+ * Files opened for writing get a per-handle buffer which coalesces
+ * sequential KM_OP_FWRITE data into large host writes. Buffered data
+ * always begins at the file descriptor offset, so it is written with
+ * write(), after which the offset is correct again. Anything which uses
+ * the descriptor offset or observes file contents or size (read, seek,
+ * close, open or stat of any file, directory reads, and setting a file
+ * date) first writes buffered data. A background thread writes buffers
+ * which have been idle for WB_IDLE_MSEC. Each flush ends on a multiple
+ * of the buffer size in the file, so a long sequential write reaches the
+ * host as aligned blocks.
+ *
+ * A write is acknowledged once its data is buffered. An error writing
+ * buffered data is reported to the Amiga by the next write, seek, read,
+ * or close of the handle. In durable mode (--durable), there is no
+ * buffering: each write is acknowledged only after its data has been
+ * written to the file, and files are synced to storage on close.
+ */
+#define WRITEBEHIND_DEFAULT_KB 256  // Default write-behind buffer (KB)
+#define WB_IDLE_MSEC           200  // Idle time before buffer is written
+
+struct writebehind {
+    pthread_mutex_t wb_lock;
+    writebehind_t  *wb_next;      // Next in list of all write-behind buffers
+    uint8_t        *wb_buf;       // Buffered write data
+    uint            wb_size;      // Size of wb_buf
+    uint            wb_len;       // Valid bytes in wb_buf
+    uint            wb_limit;     // Flush when wb_len reaches this
+    int             wb_fd;        // File to write
+    dev_t           wb_dev;       // Device of file, for readahead_invalidate()
+    ino_t           wb_ino;       // Inode of file
+    int             wb_errno;     // Unreported error of a flush (0 = none)
+    uint64_t        wb_time;      // Time data was last buffered (usec)
+    uint            wb_writes;    // Writes which were buffered
+    uint            wb_flushes;   // Host writes of buffered data
+};
 
-    if (oflags & O_CREAT) {
-        uint32_t aperms = SWAP32(hm->hm_aperms);
-        uint mode = host_perms_from_amiga(aperms);
-        fsprintf("O_CREAT %s oflags=%x mode=%x\n", host_path, oflags, mode);
-        fd = open(host_path, oflags, mode);
-    } else {
-        fd = open(host_path, oflags);
-        if ((fd == -1) && (oflags & HM_MODE_WRITE)) {
-            fd = open(host_path, oflags | O_CREAT, 0777);
+static uint            writebehind_size = WRITEBEHIND_DEFAULT_KB << 10;
+static bool_t          writebehind_durable = FALSE;
+static writebehind_t  *writebehind_head;   // All write-behind buffers
+static pthread_mutex_t writebehind_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  writebehind_once = PTHREAD_ONCE_INIT;
+
+/*
+ * writebehind_flush_locked() writes all buffered data of a write-behind
+ * buffer. The caller must hold wb_lock.
+ *
+ * @return      0 - Success.
+ * @return     -1 - Write failed; buffered data is discarded and errno set.
+ */
+static int
+writebehind_flush_locked(writebehind_t *wb)
+{
+    uint    pos = 0;
+    ssize_t rc;
+
+    while (pos < wb->wb_len) {
+        rc = write(wb->wb_fd, wb->wb_buf + pos, wb->wb_len - pos);
+        if (rc <= 0) {
+            if ((rc < 0) && (errno == EINTR))
+                continue;
+            if (rc == 0)
+                errno = ENOSPC;
+            wb->wb_len = 0;
+            return (-1);
         }
+        pos += rc;
     }
-    if (fd == -1) {
-        fsprintf("File open %s fail: %d\n", host_path, errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_open_fail;
+    if (wb->wb_len > 0) {
+        wb->wb_flushes++;
+        readahead_invalidate(wb->wb_dev, wb->wb_ino);
     }
+    wb->wb_len = 0;
+    return (0);
+}
 
-    handle = handle_new(name, "", phandle, hm_type, hm_mode);
-    handle->he_fd = fd;
-    free(name);
-
-open_success:
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    hm->hm_handle = handle->he_handle;
-    hm->hm_mode   = 0;
-    fsprintf("  handle=%x\n", hm->hm_handle);
-    return (send_msg(hm, sizeof (*hm), status));
+/*
+ * writebehind_flush() writes all buffered data of a write-behind buffer.
+ * A failure is kept to be reported by the next operation on the handle.
+ */
+static void
+writebehind_flush(writebehind_t *wb)
+{
+    pthread_mutex_lock(&wb->wb_lock);
+    if ((writebehind_flush_locked(wb) != 0) && (wb->wb_errno == 0))
+        wb->wb_errno = errno;
+    pthread_mutex_unlock(&wb->wb_lock);
 }
 
-static uint
-sm_fclose(hm_fopenhandle_t *hm, uint *status)
+/*
+ * writebehind_flush_all() writes the buffered data of all handles.
+ */
+static void
+writebehind_flush_all(void)
 {
-    handle_ent_t *handle = handle_get(hm->hm_handle);
+    writebehind_t *wb;
 
-    if (handle == NULL) {
-        fsprintf("Handle %x not open for close\n", hm->hm_handle);
-        hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
+    pthread_mutex_lock(&writebehind_lock);
+    for (wb = writebehind_head; wb != NULL; wb = wb->wb_next)
+        if (wb->wb_len > 0)
+            writebehind_flush(wb);
+    pthread_mutex_unlock(&writebehind_lock);
+}
 
-#define DEBUG_CLOSE
-#ifdef DEBUG_CLOSE
-    fsprintf("fclose(%x): ", hm->hm_handle);
-#endif
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
+/*
+ * th_writebehind() is a thread which writes buffers that have not been
+ * added to for WB_IDLE_MSEC.
+ */
+static void *
+th_writebehind(void *arg)
+{
+    writebehind_t *wb;
+    uint64_t       now;
 
-    if (handle->he_mode & HM_MODE_LINK) {
-#ifdef DEBUG_CLOSE
-        fsprintf("close readlink '%s'\n", handle->he_name);
-#endif
-        goto sm_fclose_end;
-    }
-    if (handle->he_mode & HM_MODE_DIR) {
-#ifdef DEBUG_CLOSE
-        fsprintf("close STAT '%s'\n", handle->he_name);
-#endif
-        goto sm_fclose_end;
-    }
-    switch (handle->he_type) {
-        case HM_TYPE_VOLDIR:
-#ifdef DEBUG_CLOSE
-            fsprintf("close volume directory\n");
-#endif
-            break;
-        case HM_TYPE_VOLUME:
-#ifdef DEBUG_CLOSE
-            fsprintf("close volume '%s'\n", handle->he_name);
-#endif
-            break;
-        case HM_TYPE_DIR:
-            if (handle->he_dir == NULL) {
-                fsprintf("BUG: attempt close of NULL dir: %s\n",
-                         handle->he_name);
-                break;
+    while (1) {
+        time_delay_msec(WB_IDLE_MSEC / 2);
+        now = bench_usec();
+        pthread_mutex_lock(&writebehind_lock);
+        for (wb = writebehind_head; wb != NULL; wb = wb->wb_next) {
+            if ((wb->wb_len > 0) &&
+                (now - wb->wb_time >= WB_IDLE_MSEC * 1000)) {
+                writebehind_flush(wb);
             }
-#ifdef DEBUG_CLOSE
-            fsprintf("close dir %p\n", (void *) handle->he_dir);
-#endif
-            if (handle->he_dir != NULL)
-                closedir(handle->he_dir);
-            break;
-        default:
-#ifdef DEBUG_CLOSE
-            fsprintf("close file '%s'\n", handle->he_name);
-#endif
-            close(handle->he_fd);
-            break;
+        }
+        pthread_mutex_unlock(&writebehind_lock);
     }
-sm_fclose_end:
-    handle_free(hm->hm_handle);
-    return (send_msg(hm, sizeof (*hm), status));
+    return (NULL);
 }
 
-static uint64_t
-get_fs_size(const char *path, uint64_t *used, uint *blksize)
+static void
+writebehind_thread_start(void)
 {
-    struct statvfs buf;
-    statvfs(path, &buf);
-    *used = buf.f_blocks - buf.f_bavail;
-    *blksize = buf.f_bsize;
-#ifdef DEBUG_STATVFS
-    fsprintf("statvfs path='%s' blks=%u used=%u blksize=%u\n",
-             path, (uint) buf.f_blocks, (uint) *used, (uint) *blksize);
-#endif
-    return (buf.f_blocks);
+    pthread_attr_t thread_attr;
+    pthread_t      thread_id;
+
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread_id, &thread_attr, th_writebehind, NULL))
+        err(EXIT_FAILURE, "failed to create write-behind thread");
 }
 
-static uint
-sm_fread(hm_freadwrite_t *hm, uint *status)
+/*
+ * writebehind_new() attaches a write-behind buffer to a file handle, if
+ * write-behind is enabled.
+ */
+static void
+writebehind_new(handle_ent_t *handle)
 {
-    hm_freadwrite_t *hmr;
-    uint             rc;
-    uint             pos;
-    uint             len;
-    uint             hm_length = SWAP32(hm->hm_length);
-    uint             hm_flag = SWAP16(hm->hm_flag);
-    handle_ent_t    *handle = handle_get(hm->hm_handle);
-    uint             pathlen = 0;
-    char             pathbuf[2048];
-
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    writebehind_t *wb;
 
-    fsprintf("fread(%x, l=%x)\n", hm->hm_handle, hm_length);
-    if (handle == NULL) {
-        fsprintf("handle get %x failed\n", hm->hm_handle);
-reply_read_fail:
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
-    if ((handle->he_mode & HM_MODE_READ) == 0) {
-        fsprintf("%s not opened for read mode: %x\n",
-                 handle->he_name, handle->he_mode);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_read_fail;
+    if ((writebehind_size == 0) || writebehind_durable)
+        return;
+    wb = calloc(1, sizeof (*wb));
+    if (wb == NULL)
+        return;
+    wb->wb_buf = malloc(writebehind_size);
+    if (wb->wb_buf == NULL) {
+        free(wb);
+        return;
     }
+    pthread_once(&writebehind_once, writebehind_thread_start);
+    pthread_mutex_init(&wb->wb_lock, NULL);
+    wb->wb_size = writebehind_size;
+    wb->wb_fd = handle->he_fd;
+    wb->wb_dev = handle->he_dev;
+    wb->wb_ino = handle->he_ino;
+    handle->he_wb = wb;
+
+    pthread_mutex_lock(&writebehind_lock);
+    wb->wb_next = writebehind_head;
+    writebehind_head = wb;
+    pthread_mutex_unlock(&writebehind_lock);
+}
 
-    if (handle->he_type == HM_TYPE_VOLDIR) {
-        if (hm_flag & HM_FLAG_SEEK0)
-            handle->he_entnum = 0;
-#ifdef DEBUG_READ
-        fsprintf("VOLDIR %s\n", handle->he_name);
-#endif
-        goto dir_read_common;
-    } else if (handle->he_type == HM_TYPE_DIR) {
-#ifdef DEBUG_READ
-        fsprintf("DIR %s\n", handle->he_name);
-#endif
-        if (hm_flag & HM_FLAG_SEEK0) {
-            if (handle->he_dir != NULL)
-                rewinddir(handle->he_dir);
+/*
+ * writebehind_sync() writes any buffered data of a file handle.
+ *
+ * @return      0 - Success.
+ * @return     -1 - This or an earlier write of buffered data failed
+ *                  (errno is set).
+ */
+static int
+writebehind_sync(handle_ent_t *handle)
+{
+    writebehind_t *wb = handle->he_wb;
+    int            rc;
+
+    if (wb == NULL)
+        return (0);
+    pthread_mutex_lock(&wb->wb_lock);
+    rc = writebehind_flush_locked(wb);
+    if (wb->wb_errno != 0) {
+        errno = wb->wb_errno;
+        wb->wb_errno = 0;
+        rc = -1;
+    }
+    pthread_mutex_unlock(&wb->wb_lock);
+    return (rc);
+}
+
+/*
+ * writebehind_free() writes any buffered data of a file handle and then
+ * releases its write-behind buffer.
+ *
+ * @return      0 - Success.
+ * @return     -1 - Buffered data could not be written (errno is set).
+ */
+static int
+writebehind_free(handle_ent_t *handle)
+{
+    writebehind_t  *wb = handle->he_wb;
+    writebehind_t **prev;
+    int             rc;
+
+    if (wb == NULL)
+        return (0);
+    pthread_mutex_lock(&writebehind_lock);
+    for (prev = &writebehind_head; *prev != NULL; prev = &(*prev)->wb_next) {
+        if (*prev == wb) {
+            *prev = wb->wb_next;
+            break;
         }
-        goto dir_read_common;
-    } else if (handle->he_mode & HM_MODE_DIR) {
-        if (hm_flag & HM_FLAG_SEEK0)
-            handle->he_entnum = 0;
-#ifdef DEBUG_READ
-        fsprintf("STAT %s\n", handle->he_name);
-#endif
-dir_read_common:
-        pathlen = strlen(handle->he_name);
-        if (pathlen > sizeof (pathbuf) - 257) {
-            fsprintf("Path too long: %u bytes\n", pathlen);
-            goto reply_read_fail;
+    }
+    pthread_mutex_unlock(&writebehind_lock);
+
+    rc = writebehind_sync(handle);
+    fsprintf("writebehind %s: writes=%u host writes=%u\n",
+             handle->he_name, wb->wb_writes, wb->wb_flushes);
+    pthread_mutex_destroy(&wb->wb_lock);
+    free(wb->wb_buf);
+    free(wb);
+    handle->he_wb = NULL;
+    return (rc);
+}
+
+/*
+ * writebehind_write() adds data at the current file position of a
+ * write-behind handle. It has the same return value semantics as write().
+ */
+static ssize_t
+writebehind_write(writebehind_t *wb, const void *buf, uint len)
+{
+    const uint8_t *src = buf;
+    uint           pos = 0;
+    ssize_t        rc = len;
+
+    pthread_mutex_lock(&wb->wb_lock);
+    if (wb->wb_errno != 0) {
+        errno = wb->wb_errno;
+        wb->wb_errno = 0;
+        pthread_mutex_unlock(&wb->wb_lock);
+        return (-1);
+    }
+    while (pos < len) {
+        uint count;
+
+        if (wb->wb_len == 0) {
+            /* End this buffer on a multiple of the buffer size in the file */
+            off64_t off = lseek64(wb->wb_fd, 0, SEEK_CUR);
+            wb->wb_limit = wb->wb_size;
+            if (off > 0)
+                wb->wb_limit -= off % wb->wb_size;
         }
-        strcpy(pathbuf, handle->he_name);
-        if ((handle->he_mode & HM_MODE_DIR) &&
-            (handle->he_type != HM_TYPE_VOLDIR)) {
-            char *sname = pathbuf;
-            /* Trim file name from path */
-            while (*sname != '\0')
-                sname++;
-            for (sname--; sname > pathbuf; sname--)
-                if (*sname == '/')
-                    break;
-                else
-                    *sname = '\0';
-            pathlen = strlen(pathbuf);
-        } else if ((pathlen > 1) && (pathbuf[pathlen - 1] != '/')) {
-            pathbuf[pathlen++] = '/';  // Append trailing slash
-            pathbuf[pathlen] = '\0';
+        count = wb->wb_limit - wb->wb_len;
+        if (count > len - pos)
+            count = len - pos;
+        memcpy(wb->wb_buf + wb->wb_len, src + pos, count);
+        wb->wb_len += count;
+        pos += count;
+        if ((wb->wb_len == wb->wb_limit) &&
+            (writebehind_flush_locked(wb) != 0)) {
+            rc = -1;
+            break;
         }
-#ifdef DEBUG_READ
-        fsprintf("STAT pathbuf=%s\n", pathbuf);
-#endif
     }
+    wb->wb_writes++;
+    wb->wb_time = bench_usec();
+    pthread_mutex_unlock(&wb->wb_lock);
+    return (rc);
+}
 
-    /*
-     * Allocate buffer larger than requested. This is to accommodate
-     * the specific case of short read where a single directory entry
-     * is desired.
-     */
-    hmr = malloc(sizeof (*hmr) + hm_length + 256);
-    pos = 0;
-    rc = 0;
-    while (pos < hm_length) {
-        uint8_t *ndata = ((uint8_t *)(hmr + 1)) + pos;
-        len = hm_length - pos;
-        if (handle->he_mode & HM_MODE_LINK) {
-            char  lbuf[PATH_MAX];
-            char *path;
-            int   llen;
+/*
+ * Directory cache
+ *
+ * The encoded hm_fdirent_t stream of a directory is captured while a
+ * handle reads the directory from its first entry to the end. Later reads
+ * of the same directory from the beginning are then answered by copying
+ * from the captured stream. Each cached directory has an inotify watch;
+ * any change to the directory or to a file in it discards the cache
+ * entry. Handles already reading an entry keep their snapshot until they
+ * rewind or close. Without inotify, nothing is cached.
+ *
+ * Entries are kept in most-recently-used order. An entry is either being
+ * built (dc_ready == 0, owned by one handle) or ready. Stale or evicted
+ * entries leave the list and are freed when their last reader releases
+ * them.
+ */
+#define DIRCACHE_MAX        64    // Maximum cached directories
+#define HANDLE_IS_DIRSTREAM(h) (((h)->he_type == HM_TYPE_DIR) && \
+                                (((h)->he_mode & (HM_MODE_DIR | \
+                                                  HM_MODE_LINK)) == 0))
+#define DIRCACHE_MAX_BYTES  (1 << 20)  // Largest directory stream to cache
+
+struct dircache {
+    dircache_t *dc_next;      // Next in MRU list
+    char       *dc_path;      // Host path of directory
+    uint8_t    *dc_buf;       // Encoded dirent stream
+    uint        dc_len;       // Bytes in dc_buf
+    uint        dc_size;      // Allocated size of dc_buf
+    uint        dc_refcnt;    // Handles referencing this entry
+    int         dc_wd;        // inotify watch descriptor
+    uint8_t     dc_ready;     // Stream is complete
+    uint8_t     dc_listed;    // Entry is on dircache_head list
+};
 
-            fsprintf("readlink %s\n", handle->he_path);
-            llen = readlink(handle->he_path, lbuf, sizeof (lbuf) - 1);
-            if (llen == -1) {
-                fsprintf("readlink %s failed\n", handle->he_path);
-                llen = 0;
-            }
-            lbuf[llen] = '\0';
-            path = host_to_amiga_path(handle->he_path, handle->he_name, lbuf);
+static dircache_t     *dircache_head  = NULL;
+static uint            dircache_count = 0;
+static int             dircache_ifd   = -1;  // inotify fd (-1 = no cache)
+static pthread_mutex_t dircache_lock  = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  dircache_once  = PTHREAD_ONCE_INIT;
 
-            llen = strlen(path) + 1;
-            memcpy(ndata, path, llen);
-            free(path);
+static void
+dircache_init(void)
+{
+#ifdef HAVE_INOTIFY
+    dircache_ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (dircache_ifd < 0)
+        fsprintf("inotify unavailable: directory cache disabled\n");
+#endif
+}
 
-            pos += llen;
+/*
+ * dircache_unlist() removes an entry from the MRU list and frees it if no
+ * handle references it. The caller must hold dircache_lock.
+ */
+static void
+dircache_unlist(dircache_t *dc)
+{
+    dircache_t **prev;
+    dircache_t  *cur;
+
+    for (prev = &dircache_head; (cur = *prev) != NULL; prev = &cur->dc_next) {
+        if (cur == dc) {
+            *prev = dc->dc_next;
+            dircache_count--;
             break;
-        } else if ((handle->he_type == HM_TYPE_DIR) ||
-                   (handle->he_type == HM_TYPE_VOLDIR) ||
-                   (handle->he_mode & HM_MODE_DIR)) {
-            struct dirent *dp;
-            char *nptr;
-            uint nlen;
-            uint hmd_type;
-            uint he_mode = handle->he_mode;
-            uint32_t size_hi = 0;
-            uint32_t size_lo = 0;
-            uint32_t amiga_perms;
-            struct stat st;
-            static struct dirent ldp;
-            hm_fdirent_t *hm_dirent = (hm_fdirent_t *)ndata;
-            uint maxlen = hm_length - pos;
-            char *host_path = NULL;
-            char d_name[256];
-            uint d_type = 0;
+        }
+    }
+    dc->dc_listed = 0;
 
-            if (pos > hm_length)  // Safeguard
-                maxlen = 0;
-            if ((sizeof (*hm_dirent) +
-                 sizeof (d_name) + 2 > maxlen) && (pos > 0)) {
-                /*
-                 * Next entry might not fit, so stop here.
-                 *
-                 * Note this only applies to subsequent directory entries.
-                 * At least one dirent will always be retrieved. The caller
-                 * to sm_fread() can * acquire a single dirent by
-                 * requesting a small buffer, for example the size of
-                 * hm_fdirent_t, and will get that including an untruncated
-                 * filename. This might seem bad (buffer overrun), but it
-                 * isn't because the receiving Amiga code will land data in
-                 * an oversized buffer.
-                 */
-                rc = 0;
-#ifdef DEBUG_READ
-                fsprintf("No space for next dirent %lu %u\n",
-                         sizeof (*dp), maxlen);
+#ifdef HAVE_INOTIFY
+    /* Remove the watch unless another listed entry shares it */
+    for (cur = dircache_head; cur != NULL; cur = cur->dc_next)
+        if (cur->dc_wd == dc->dc_wd)
+            break;
+    if ((cur == NULL) && (dc->dc_wd >= 0))
+        inotify_rm_watch(dircache_ifd, dc->dc_wd);
 #endif
-                break;
-            }
+    dc->dc_wd = -1;
 
-            memset(hm_dirent, 0, sizeof (*hm_dirent)); // wipe the dirent
+    if (dc->dc_refcnt == 0) {
+        free(dc->dc_path);
+        free(dc->dc_buf);
+        free(dc);
+    }
+}
 
-            if (handle->he_type == HM_TYPE_VOLDIR) {
-                amiga_vol_t *vol;
+#ifdef HAVE_INOTIFY
+/* Events which may change where paths in the directory lead */
+#define PATHCACHE_IN_EVENTS (IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                             IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO)
 
-                vol = volume_get_by_index(handle->he_entnum);
-                if (vol == NULL) {
-                    dp = NULL;
-                } else {
-                    dp = &ldp;
-                    d_type = DT_DIR;
-                    strcpy(d_name, vol->av_volume);
-                    if (handle->he_mode & HM_MODE_DIR) {
-                        if (handle->he_entnum == 0) {
-                            strcpy(d_name, "Volume Directory");
-                        } else {
-                            dp = NULL;
-                        }
-                    }
-                }
-            } else if (handle->he_mode & HM_MODE_DIR) {
-                /* This mode is to STAT a single file */
-                if (handle->he_entnum != 0) {
-                    dp = NULL;
-                } else {
-                    const char *sname;
+/*
+ * dircache_invalidate_path() discards cached path resolutions affected by
+ * an inotify event in a cached directory.
+ */
+static void
+dircache_invalidate_path(dircache_t *dc, struct inotify_event *ev)
+{
+    char *path;
 
-                    handle->he_entnum++;
-                    if ((handle->he_name[0] == '\0') ||
-                        ((handle->he_name[0] == '.') &&
-                         (handle->he_name[1] == '\0'))) {
-                        /* Volume root */
-                        sname = handle->he_avolume->av_volume;
-                        handle->he_type = HM_TYPE_VOLUME;
-                        hmd_type = HM_TYPE_VOLUME;
-                    } else {
-                        /* Find name following directory path */
-                        sname = handle->he_name;
+    if ((ev->len == 0) || (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+        pathcache_invalidate(dc->dc_path);
+        return;
+    }
+    path = merge_host_paths(dc->dc_path, ev->name);
+    if (path == NULL)
+        return;
+    pathcache_invalidate(path);
+    free(path);
+}
+#endif
 
-                        while (*sname != '\0')
-                            sname++;
-                        if ((sname > handle->he_name) &&
-                            (sname[-1] == '/')) {
-                            /* Name is before trailing slash */
-                            sname--;
-                        }
-                        for (sname--; sname > handle->he_name; sname--)
-                            if (sname[-1] == '/')
-                                break;
-                    }
-                    dp = &ldp;
-                    d_type = DT_REG;
-                    dp->d_ino = 0;
-                    strcpy(d_name, sname);
+/*
+ * dircache_drain() processes pending inotify events, discarding entries
+ * for directories which have changed. The caller must hold dircache_lock.
+ */
+static void
+dircache_drain(void)
+{
+#ifdef HAVE_INOTIFY
+    char     buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t  len;
+    ssize_t  off;
+
+    while ((len = read(dircache_ifd, buf, sizeof (buf))) > 0) {
+        for (off = 0; off < len; ) {
+            struct inotify_event *ev = (struct inotify_event *) (buf + off);
+            dircache_t *dc;
+            dircache_t *next;
+
+            if (ev->mask & IN_Q_OVERFLOW)
+                pathcache_invalidate(NULL);
+            for (dc = dircache_head; dc != NULL; dc = next) {
+                next = dc->dc_next;
+                if ((ev->mask & IN_Q_OVERFLOW) || (dc->dc_wd == ev->wd)) {
+                    if (ev->mask & PATHCACHE_IN_EVENTS)
+                        dircache_invalidate_path(dc, ev);
+                    dircache_unlist(dc);
                 }
-            } else {
-                uint skip = 0;
-                do {
-                    if (handle->he_dir == NULL) {
-                        printf("NULL dir handle for %x\n", handle->he_handle);
-                        dp = NULL;
-                    } else {
-                        dp = readdir(handle->he_dir);
-                    }
-                    skip = 0;
-                    if (dp != NULL) {
-                        char *end;
-                        strcpy(d_name, dp->d_name);
+            }
+            off += sizeof (*ev) + ev->len;
+        }
+    }
+#endif
+}
+
+/*
+ * dircache_release() drops a handle's reference to its directory cache
+ * entry. An entry still being built is discarded.
+ */
+static void
+dircache_release(handle_ent_t *handle)
+{
+    dircache_t *dc = handle->he_dc;
+
+    if (dc == NULL)
+        return;
+    handle->he_dc = NULL;
+    handle->he_dcpos = 0;
+
+    pthread_mutex_lock(&dircache_lock);
+    dc->dc_refcnt--;
+    if (dc->dc_listed) {
+        if (dc->dc_ready == 0)
+            dircache_unlist(dc);  // Abandoned build
+    } else if (dc->dc_refcnt == 0) {
+        free(dc->dc_path);
+        free(dc->dc_buf);
+        free(dc);
+    }
+    pthread_mutex_unlock(&dircache_lock);
+}
+
+/*
+ * dircache_attach() is called when a handle starts reading a directory
+ * from its first entry. The handle either gets a ready cache entry for
+ * the directory, or a new entry to build as it reads.
+ */
+static void
+dircache_attach(handle_ent_t *handle, const char *path)
+{
+    dircache_t **prev;
+    dircache_t  *dc;
+
+    pthread_once(&dircache_once, dircache_init);
+    if (dircache_ifd < 0)
+        return;
+
+    pthread_mutex_lock(&dircache_lock);
+    dircache_drain();
+    for (prev = &dircache_head; (dc = *prev) != NULL; prev = &dc->dc_next) {
+        if (dc->dc_ready && (strcmp(dc->dc_path, path) == 0)) {
+            /* Move to front of MRU list */
+            *prev = dc->dc_next;
+            dc->dc_next = dircache_head;
+            dircache_head = dc;
+            dc->dc_refcnt++;
+            handle->he_dc = dc;
+            handle->he_dcpos = 0;
+            pthread_mutex_unlock(&dircache_lock);
+            return;
+        }
+    }
+
+    /* Not cached: build a new entry while this handle reads */
+    dc = calloc(1, sizeof (*dc));
+    if (dc != NULL)
+        dc->dc_path = strdup(path);
+    if ((dc == NULL) || (dc->dc_path == NULL)) {
+        free(dc);
+        pthread_mutex_unlock(&dircache_lock);
+        return;
+    }
+#ifdef HAVE_INOTIFY
+    /* Watch before reading, so changes during the build are seen */
+    dc->dc_wd = inotify_add_watch(dircache_ifd, path,
+                                  IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE |
+                                  IN_DELETE | IN_DELETE_SELF | IN_MODIFY |
+                                  IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO);
+#else
+    dc->dc_wd = -1;
+#endif
+    if (dc->dc_wd < 0) {
+        fsprintf("inotify watch %s failed\n", path);
+        free(dc->dc_path);
+        free(dc);
+        pthread_mutex_unlock(&dircache_lock);
+        return;
+    }
+    if (dircache_count >= DIRCACHE_MAX) {
+        /* Evict least recently used entry */
+        dircache_t *last = dircache_head;
+        while (last->dc_next != NULL)
+            last = last->dc_next;
+        dircache_unlist(last);
+    }
+    dc->dc_refcnt = 1;
+    dc->dc_listed = 1;
+    dc->dc_next = dircache_head;
+    dircache_head = dc;
+    dircache_count++;
+    handle->he_dc = dc;
+    handle->he_dcpos = 0;
+    pthread_mutex_unlock(&dircache_lock);
+}
+
+/*
+ * dircache_append() adds an encoded dirent to the entry being built by a
+ * handle. The build is abandoned if the stream grows too large.
+ */
+static void
+dircache_append(handle_ent_t *handle, const void *ent, uint len)
+{
+    dircache_t *dc = handle->he_dc;
+
+    if ((dc == NULL) || dc->dc_ready)
+        return;
+    if ((len > sizeof (hm_fdirent_t) + 258) ||
+        (dc->dc_len + len > DIRCACHE_MAX_BYTES)) {
+        dircache_release(handle);
+        return;
+    }
+    if (dc->dc_len + len > dc->dc_size) {
+        uint     nsize = (dc->dc_size == 0) ? 4096 : dc->dc_size * 2;
+        uint8_t *nbuf;
+        while (nsize < dc->dc_len + len)
+            nsize *= 2;
+        nbuf = realloc(dc->dc_buf, nsize);
+        if (nbuf == NULL) {
+            dircache_release(handle);
+            return;
+        }
+        dc->dc_buf = nbuf;
+        dc->dc_size = nsize;
+    }
+    memcpy(dc->dc_buf + dc->dc_len, ent, len);
+    dc->dc_len += len;
+}
+
+/*
+ * dircache_publish() makes the entry built by a handle available to other
+ * readers once the end of the directory has been reached, provided the
+ * directory did not change during the build.
+ */
+static void
+dircache_publish(handle_ent_t *handle)
+{
+    dircache_t *dc = handle->he_dc;
+    dircache_t *cur;
+    dircache_t *next;
+
+    if ((dc == NULL) || dc->dc_ready)
+        return;
+    pthread_mutex_lock(&dircache_lock);
+    dircache_drain();
+    if (dc->dc_listed) {
+        /* Otherwise the directory changed while it was being read */
+        dc->dc_ready = 1;
+        for (cur = dircache_head; cur != NULL; cur = next) {
+            next = cur->dc_next;
+            if ((cur != dc) && (strcmp(cur->dc_path, dc->dc_path) == 0))
+                dircache_unlist(cur);  // Older copy
+        }
+    }
+    pthread_mutex_unlock(&dircache_lock);
+    dircache_release(handle);
+}
+
+/*
+ * dircache_read() copies whole dirents from a ready cache entry. As with
+ * uncached reads, at least one dirent is returned, and further dirents
+ * are only added while a maximum size dirent would still fit.
+ *
+ * @return Bytes copied.
+ */
+static uint
+dircache_read(handle_ent_t *handle, uint8_t *buf, uint maxlen, uint *rc)
+{
+    dircache_t *dc = handle->he_dc;
+    uint        pos = 0;
+
+    while (handle->he_dcpos < dc->dc_len) {
+        hm_fdirent_t *ent = (hm_fdirent_t *) (dc->dc_buf + handle->he_dcpos);
+        uint          len = sizeof (*ent) + SWAP16(ent->hmd_elen);
+
+        if ((pos > 0) && (sizeof (*ent) + 256 + 2 > maxlen - pos)) {
+            *rc = KM_STATUS_OK;
+            return (pos);
+        }
+        memcpy(buf + pos, ent, len);
+        pos += len;
+        handle->he_dcpos += len;
+        handle->he_entnum++;
+        if (pos >= maxlen) {
+            *rc = KM_STATUS_OK;
+            return (pos);
+        }
+    }
+    *rc = KM_STATUS_EOF;
+    return (pos);
+}
+
+/*
+ * d_type_to_hm_type() converts a host directory entry type to HM_TYPE_*.
+ */
+static uint
+d_type_to_hm_type(uint d_type)
+{
+    switch (d_type) {
+        default:
+        case DT_UNKNOWN:
+            return (HM_TYPE_UNKNOWN);
+        case DT_FIFO:
+            return (HM_TYPE_FIFO);
+        case DT_CHR:
+            return (HM_TYPE_CDEV);
+        case DT_DIR:
+            return (HM_TYPE_DIR);
+        case DT_BLK:
+            return (HM_TYPE_BDEV);
+        case DT_REG:
+            return (HM_TYPE_FILE);
+        case DT_LNK:
+            return (HM_TYPE_LINK);
+        case DT_SOCK:
+            return (HM_TYPE_SOCKET);
+        case DT_WHT:
+            return (HM_TYPE_WHTOUT);
+    }
+}
+
+/*
+ * dirent_fill_stat() fills the fields of an encoded dirent which come from
+ * the host file's status. If check_uaem is set, Amiga protection bits are
+ * taken from the file's UAE .uaem companion file, when there is one.
+ *
+ * @param [io]  hm_dirent   - Dirent being encoded.
+ * @param [io]  st          - Host file status.
+ * @param [in]  host_path   - Host path of the file.
+ * @param [in]  check_uaem  - Look for a .uaem file.
+ * @param [out] size_hi     - Upper 32 bits of file size.
+ * @param [out] size_lo     - Lower 32 bits of file size.
+ * @param [out] hmd_type    - HM_TYPE_* of the file.
+ * @param [out] amiga_perms - Amiga protection bits.
+ */
+static void
+dirent_fill_stat(hm_fdirent_t *hm_dirent, struct stat *st,
+                 const char *host_path, uint check_uaem, uint32_t *size_hi,
+                 uint32_t *size_lo, uint *hmd_type, uint32_t *amiga_perms)
+{
+    uint32_t time_a;
+    uint32_t time_c;
+    uint32_t time_m;
+    char *host_path_uaem;
+
+    /* UAE support: check for .uaem file */
+    host_path_uaem = check_uaem ? malloc(strlen(host_path) + 6) : NULL;
+    if (host_path_uaem != NULL) {
+        FILE *fp;
+        strcpy(host_path_uaem, host_path);
+        strcat(host_path_uaem, ".uaem");
+        if ((fp = fopen(host_path_uaem, "r")) != NULL) {
+            char f_perms[16];
+            char f_date[12];
+            char f_time[12];
+            if (fscanf(fp, "%15s %11s %11s", f_perms, f_date, f_time) == 3) {
+                uint32_t perms;
+                fsprintf("%s UAEM perms=%s\n", host_path_uaem, f_perms);
+                perms = amiga_perms_from_str(f_perms);
+                if (perms != 0xffffffff) {
+                    st->st_mode = (st->st_mode & S_IFMT) |
+                                  host_perms_from_amiga(perms);
+                }
+            }
+            fclose(fp);
+        }
+        free(host_path_uaem);
+    }
+
+    time_a = get_localtime(st->st_atime);
+    time_c = get_localtime(st->st_ctime);
+    time_m = get_localtime(st->st_mtime);
+    hm_dirent->hmd_atime = SWAP32(time_a);
+    hm_dirent->hmd_ctime = SWAP32(time_c);
+    hm_dirent->hmd_mtime = SWAP32(time_m);
 #ifdef __MINGW32__
-                        d_type = DT_UNKNOWN;
+    uint blksize = 1 << 20;
+    hm_dirent->hmd_blksize = SWAP32(blksize);
+    hm_dirent->hmd_blks = SWAP32(st->st_size / blksize);
 #else
-                        d_type = dp->d_type;
+    hm_dirent->hmd_blksize = SWAP32(st->st_blksize);
+    hm_dirent->hmd_blks = SWAP32(st->st_blocks);
 #endif
+    hm_dirent->hmd_ouid = SWAP32(st->st_uid);
+    hm_dirent->hmd_ogid = SWAP32(st->st_gid);
+    hm_dirent->hmd_mode = SWAP32(st->st_mode);
+
+    *size_hi = ((uint64_t) st->st_size) >> 32;
+    *size_lo = (uint32_t) st->st_size;
+    *hmd_type = st_mode_to_hm_type(st->st_mode);
+    *amiga_perms = amiga_perms_from_host(st->st_mode);
+}
 
-                        /* Skip .uaem files */
-                        end = d_name + strlen(d_name);
-                        if (((end - d_name) >= 6) &&
-                            (strcmp(end - 5, ".uaem") == 0)) {
-                            skip = 1;
-                        }
+/*
+ * dirent_finish() completes an encoded dirent with its type, size, and
+ * name. The comment which follows the name holds the Amiga form of the
+ * link target for symbolic links, and is empty otherwise.
+ *
+ * @return Length of the name and comment (hmd_elen).
+ */
+static uint
+dirent_finish(hm_fdirent_t *hm_dirent, const char *d_name, uint32_t ino,
+              uint hmd_type, uint32_t size_hi, uint32_t size_lo,
+              uint32_t amiga_perms, char *host_path, char *amiga_name)
+{
+    char *nptr;
+    uint  nlen;
+
+    hm_dirent->hmd_aperms  = SWAP32(amiga_perms);
+    hm_dirent->hmd_type    = SWAP16(hmd_type);
+    hm_dirent->hmd_ino     = SWAP32(ino);
+    hm_dirent->hmd_size_hi = SWAP32(size_hi);
+    hm_dirent->hmd_size_lo = SWAP32(size_lo);
+    hm_dirent->hmd_rsvd[0] = 0;
+    hm_dirent->hmd_rsvd[1] = 0;
+
+    nptr = (char *) (hm_dirent + 1);
+    nlen = strlen(d_name) + 1;  // Include NIL
+    memcpy(nptr, d_name, nlen);
+    if (hmd_type == HM_TYPE_LINK) {
+        char  lbuf[PATH_MAX];
+        char *path;
+        int   llen;
+        llen = readlink(host_path, lbuf, sizeof (lbuf) - 1);
+        if (llen == -1) {
+            fsprintf("readlink %s failed\n", host_path);
+            llen = 0;
+        }
+        lbuf[llen] = '\0';
+        path = host_to_amiga_path(host_path, amiga_name, lbuf);
+
+        /* Fill comment with link information */
+        llen = strlen(path) + 1;
+        memcpy(nptr + nlen, path, llen);
+        free(path);
+
+        nlen += llen;
+    } else {
+        nptr[nlen++] = '\0';            // Comment NIL
+    }
+    if (nlen & 1)
+        nptr[nlen++] = '\0';            // Round up
+#ifdef DEBUG_READ
+    fsprintf("dirent %u %s\n", nlen, nptr);
+#endif
+    hm_dirent->hmd_elen = SWAP16(nlen);
+    return (nlen);
+}
+
+/*
+ * Directory scanner
+ *
+ * When a directory stream handle is read from its first entry and the
+ * directory is not in the directory cache, a scanner thread encodes the
+ * whole directory. Names are read in bulk with getdents64() and then
+ * stat'd in batches of DIRSCAN_BATCH with statx() relative to the open
+ * directory, avoiding a path lookup per entry. With more than one scan
+ * thread, helper threads share the statx() calls of each batch. Encoded
+ * dirents are appended to ds_buf as each batch completes, so replies to
+ * KM_OP_FREAD are sent while the rest of the directory is still being
+ * scanned. The scanner stays at most DIRSCAN_AHEAD bytes ahead of the
+ * reader.
+ *
+ * Since all names are known before entries are encoded, a .uaem file is
+ * only opened for entries which have one.
+ */
+#ifdef HAVE_DIRSCAN
+#define DIRSCAN_DEFAULT     1          // Default scan threads
+#else
+#define DIRSCAN_DEFAULT     0
+#endif
+#define DIRSCAN_THREADS_MAX 16         // Maximum scan threads per directory
+#define DIRSCAN_BATCH       64         // Entries stat'd together
+#define DIRSCAN_AHEAD       (1 << 20)  // Encoded bytes buffered for reader
+#define DIRSCAN_ENT_MAX     (sizeof (hm_fdirent_t) + 256 + 2 + PATH_MAX)
+
+static uint dirscan_threads = DIRSCAN_DEFAULT;
 
 #define IS_DOT(x)     (((x)[0] == '.') && ((x)[1] == '\0'))
 #define IS_DOT_DOT(x) (((x)[0] == '.') && ((x)[1] == '.') && ((x)[2] == '\0'))
-                        /* Skip . and .. files */
-                        if (IS_DOT(d_name) || IS_DOT_DOT(d_name)) {
-                            skip = 1;
-                        }
-                    }
-                } while (skip);
-                he_mode |= HM_MODE_NOFOLLOW;
+
+#ifdef HAVE_DIRSCAN
+typedef struct {
+    uint         de_name;     // Offset of name in ds_names
+    uint         de_type;     // Host d_type
+    uint64_t     de_ino;      // Inode number
+    int          de_rc;       // statx() result
+    struct statx de_stx;      // File status
+} dirscan_ent_t;
+
+struct dirscan {
+    pthread_mutex_t ds_lock;
+    pthread_cond_t  ds_cond;       // Data encoded, consumed, or abort
+    pthread_cond_t  ds_work_cond;  // Batch ready for helper threads
+    pthread_t       ds_thread;     // Scanner thread
+    board_t        *ds_board;      // Board of the handle (volume lookup)
+    pthread_t       ds_helpers[DIRSCAN_THREADS_MAX];
+    uint            ds_nhelpers;   // Helper threads started
+    int             ds_fd;         // Open directory
+    char           *ds_path;       // Host path of directory
+    char           *ds_aname;      // Amiga path of directory (he_name)
+    char           *ds_names;      // All entry names, NIL terminated
+    uint            ds_names_len;
+    uint            ds_names_size;
+    dirscan_ent_t  *ds_ents;       // All entries, in getdents64() order
+    uint            ds_ents_count;
+    uint            ds_ents_size;
+    char          **ds_uaem;       // Sorted names having a .uaem file
+    uint            ds_uaem_count;
+    uint            ds_batch_gen;  // Incremented for each batch
+    uint            ds_batch_next; // Next entry to stat in batch
+    uint            ds_batch_end;  // End of current batch
+    uint            ds_batch_busy; // Entries being stat'd by helpers
+    uint8_t        *ds_buf;        // Encoded dirent stream
+    uint            ds_len;        // Bytes encoded in ds_buf
+    uint            ds_size;       // Allocated size of ds_buf
+    uint            ds_pos;        // Reader position in ds_buf
+    uint8_t         ds_done;       // Scan is complete
+    uint8_t         ds_failed;     // Scan stopped early (read or memory)
+    uint8_t         ds_abort;      // Handle closed or rewound
+};
+
+static int
+dirscan_compare_names(const void *a, const void *b)
+{
+    return (strcmp(*(char * const *) a, *(char * const *) b));
+}
+
+/*
+ * dirscan_names() reads all names in the directory with getdents64().
+ * Hidden UAE .uaem files, ".", and ".." are omitted, as with readdir().
+ *
+ * @return 0 on success, -1 on read or allocation failure.
+ */
+static int
+dirscan_names(dirscan_t *ds)
+{
+    char  buf[32768] __attribute__((aligned(8)));
+    char *end;
+    uint  uaem_size = 0;
+    uint  cur;
+    long  len;
+
+    while ((len = syscall(SYS_getdents64, ds->ds_fd, buf, sizeof (buf))) > 0) {
+        long off;
+        for (off = 0; off < len; ) {
+            struct dirent64 *dp = (struct dirent64 *) (buf + off);
+            uint nlen = strlen(dp->d_name);
+
+            off += dp->d_reclen;
+            if (IS_DOT(dp->d_name) || IS_DOT_DOT(dp->d_name))
+                continue;
+            if (ds->ds_names_len + nlen + 1 > ds->ds_names_size) {
+                uint  nsize = ds->ds_names_size ? ds->ds_names_size * 2 :
+                                                  16384;
+                char *nbuf = realloc(ds->ds_names, nsize);
+                if (nbuf == NULL)
+                    return (-1);
+                ds->ds_names = nbuf;
+                ds->ds_names_size = nsize;
             }
-            if (dp == NULL) {
-                rc = KM_STATUS_EOF;  // end of directory
-                break;
+            end = ds->ds_names + ds->ds_names_len;
+            memcpy(end, dp->d_name, nlen + 1);
+
+            if ((nlen >= 6) && (strcmp(end + nlen - 5, ".uaem") == 0)) {
+                /* Skip .uaem files, but remember which names have them */
+                if (ds->ds_uaem_count == uaem_size) {
+                    uint    nsize = uaem_size ? uaem_size * 2 : 64;
+                    char  **nuaem = realloc(ds->ds_uaem,
+                                            nsize * sizeof (*nuaem));
+                    if (nuaem == NULL)
+                        return (-1);
+                    ds->ds_uaem = nuaem;
+                    uaem_size = nsize;
+                }
+                end[nlen - 5] = '\0';
+                ds->ds_uaem[ds->ds_uaem_count++] =
+                                        (char *) (uintptr_t) ds->ds_names_len;
+                ds->ds_names_len += nlen - 4;
+                continue;
             }
-            strcpy(pathbuf + pathlen, d_name);
-            switch (d_type) {
-                default:
-                case DT_UNKNOWN:
-                    hmd_type = HM_TYPE_UNKNOWN;
-                    break;
-                case DT_FIFO:
-                    hmd_type = HM_TYPE_FIFO;
-                    break;
-                case DT_CHR:
-                    hmd_type = HM_TYPE_CDEV;
-                    break;
-                case DT_DIR:
-                    hmd_type = HM_TYPE_DIR;
-                    break;
-                case DT_BLK:
-                    hmd_type = HM_TYPE_BDEV;
-                    break;
-                case DT_REG:
-                    hmd_type = HM_TYPE_FILE;
-                    break;
-                case DT_LNK:
-                    hmd_type = HM_TYPE_LINK;
-                    break;
-                case DT_SOCK:
-                    hmd_type = HM_TYPE_SOCKET;
-                    break;
-                case DT_WHT:
-                    hmd_type = HM_TYPE_WHTOUT;
-                    break;
+            if (ds->ds_ents_count == ds->ds_ents_size) {
+                uint           nsize = ds->ds_ents_size ?
+                                       ds->ds_ents_size * 2 : 256;
+                dirscan_ent_t *nents = realloc(ds->ds_ents,
+                                               nsize * sizeof (*nents));
+                if (nents == NULL)
+                    return (-1);
+                ds->ds_ents = nents;
+                ds->ds_ents_size = nsize;
             }
+            ds->ds_ents[ds->ds_ents_count].de_name = ds->ds_names_len;
+            ds->ds_ents[ds->ds_ents_count].de_type = dp->d_type;
+            ds->ds_ents[ds->ds_ents_count].de_ino  = dp->d_ino;
+            ds->ds_ents_count++;
+            ds->ds_names_len += nlen + 1;
+        }
+        if (ds->ds_abort)
+            return (-1);
+    }
+    if (len < 0) {
+        fsprintf("getdents64 %s failed: %d\n", ds->ds_path, errno);
+        return (-1);
+    }
 
-            if ((handle->he_type == HM_TYPE_VOLDIR) ||
-                (handle->he_type == HM_TYPE_VOLUME)) {
-                amiga_vol_t *vol;
-                uint64_t    fs_size;
-                uint64_t    fs_used;
-                uint        fs_blksize;
-                const char *path;
-                time_t      utctime = time(NULL);
-                time_t      time_a  = get_localtime(utctime);
-                hmd_type = HM_TYPE_VOLDIR;
-                hm_dirent->hmd_atime = SWAP32(time_a);
-                hm_dirent->hmd_ctime = SWAP32(time_a);
-                hm_dirent->hmd_mtime = SWAP32(time_a);
-                hm_dirent->hmd_mode = SWAP32(S_IFDIR|S_IRUSR|S_IWUSR|S_IXUSR);
+    /* Names buffer is final, so offsets may now become pointers */
+    for (cur = 0; cur < ds->ds_uaem_count; cur++)
+        ds->ds_uaem[cur] = ds->ds_names + (uintptr_t) ds->ds_uaem[cur];
+    qsort(ds->ds_uaem, ds->ds_uaem_count, sizeof (*ds->ds_uaem),
+          dirscan_compare_names);
+    return (0);
+}
 
-                if (handle->he_type == HM_TYPE_VOLUME) {
-                    hmd_type = HM_TYPE_VOLUME;
-                    vol = handle->he_avolume;
-                } else {
-                    hmd_type = HM_TYPE_VOLDIR;
-                    vol = volume_get_by_index(handle->he_entnum);
-                    handle->he_entnum++;
-                }
-                if (vol == NULL)
-                    path = ".";
-                else
-                    path = vol->av_path;
+/*
+ * dirscan_stat_one() stats the next unclaimed entry of the current batch.
+ * The caller must hold ds_lock, which is dropped during the statx() call.
+ *
+ * @return FALSE if the batch has no unclaimed entries.
+ */
+static int
+dirscan_stat_one(dirscan_t *ds)
+{
+    dirscan_ent_t *de;
+
+    if (ds->ds_abort || (ds->ds_batch_next >= ds->ds_batch_end))
+        return (FALSE);
+    de = &ds->ds_ents[ds->ds_batch_next++];
+    ds->ds_batch_busy++;
+    pthread_mutex_unlock(&ds->ds_lock);
+    de->de_rc = statx(ds->ds_fd, ds->ds_names + de->de_name,
+                      AT_SYMLINK_NOFOLLOW,
+                      STATX_TYPE | STATX_MODE | STATX_UID | STATX_GID |
+                      STATX_ATIME | STATX_MTIME | STATX_CTIME |
+                      STATX_SIZE | STATX_BLOCKS, &de->de_stx);
+    pthread_mutex_lock(&ds->ds_lock);
+    if ((--ds->ds_batch_busy == 0) &&
+        (ds->ds_batch_next >= ds->ds_batch_end))
+        pthread_cond_broadcast(&ds->ds_cond);
+    return (TRUE);
+}
 
-                fs_size = get_fs_size(path, &fs_used, &fs_blksize);
-                size_lo = (uint32_t) fs_used;
-                hm_dirent->hmd_blksize = SWAP32(fs_blksize);
-                hm_dirent->hmd_blks    = SWAP32(size_lo);
-                if (vol == NULL) {
-                    hm_dirent->hmd_ino   = 0;
-                    hm_dirent->hmd_nlink = 1;
-                } else {
-                    hm_dirent->hmd_ino   = vol->av_flags;
-                    hm_dirent->hmd_nlink = vol->av_bootpri;
-                }
-                size_hi = (uint32_t) (fs_size >> 32);
-                size_lo = (uint32_t) fs_size;
+/*
+ * th_dirscan_helper() is a thread which shares the statx() calls of each
+ * batch with the scanner thread.
+ */
+static void *
+th_dirscan_helper(void *arg)
+{
+    dirscan_t *ds  = arg;
+    uint       gen = 0;
+
+    pthread_mutex_lock(&ds->ds_lock);
+    while (!ds->ds_abort && !ds->ds_done) {
+        if (gen == ds->ds_batch_gen) {
+            pthread_cond_wait(&ds->ds_work_cond, &ds->ds_lock);
+            continue;
+        }
+        gen = ds->ds_batch_gen;
+        while (dirscan_stat_one(ds))
+            ;
+    }
+    pthread_mutex_unlock(&ds->ds_lock);
+    return (NULL);
+}
+
+/*
+ * dirscan_encode() encodes one scanned entry, as sm_fread() would encode
+ * it from readdir() and lstat().
+ *
+ * @return Encoded dirent length, or 0 if the entry could not be encoded.
+ */
+static uint
+dirscan_encode(dirscan_t *ds, dirscan_ent_t *de, hm_fdirent_t *hm_dirent)
+{
+    const char *d_name = ds->ds_names + de->de_name;
+    char       *host_path;
+    uint        hmd_type = d_type_to_hm_type(de->de_type);
+    uint32_t    size_hi = 0;
+    uint32_t    size_lo = 0;
+    uint32_t    amiga_perms = FIBF_OTR_READ | FIBF_GRP_READ;
+    uint        nlen;
+
+    host_path = merge_host_paths(ds->ds_path, d_name);
+    if (host_path == NULL)
+        return (0);
+    memset(hm_dirent, 0, sizeof (*hm_dirent));
+    if (de->de_rc == 0) {
+        struct statx *stx = &de->de_stx;
+        struct stat   st;
+        uint          check_uaem;
+
+        memset(&st, 0, sizeof (st));
+        st.st_mode    = stx->stx_mode;
+        st.st_uid     = stx->stx_uid;
+        st.st_gid     = stx->stx_gid;
+        st.st_size    = stx->stx_size;
+        st.st_blksize = stx->stx_blksize;
+        st.st_blocks  = stx->stx_blocks;
+        st.st_atime   = stx->stx_atime.tv_sec;
+        st.st_mtime   = stx->stx_mtime.tv_sec;
+        st.st_ctime   = stx->stx_ctime.tv_sec;
+        check_uaem = (ds->ds_uaem_count != 0) &&
+                     (bsearch(&d_name, ds->ds_uaem, ds->ds_uaem_count,
+                              sizeof (*ds->ds_uaem),
+                              dirscan_compare_names) != NULL);
+        dirent_fill_stat(hm_dirent, &st, host_path, check_uaem, &size_hi,
+                         &size_lo, &hmd_type, &amiga_perms);
+    } else {
+        fsprintf("lstat %s failed\n", host_path);
+    }
+    nlen = dirent_finish(hm_dirent, d_name, de->de_ino, hmd_type, size_hi,
+                         size_lo, amiga_perms, host_path, ds->ds_aname);
+    free(host_path);
+    return (sizeof (*hm_dirent) + nlen);
+}
+
+/*
+ * dirscan_append() adds an encoded dirent to the stream, waiting while the
+ * reader is DIRSCAN_AHEAD bytes behind. The caller must hold ds_lock.
+ *
+ * @return 0 on success, -1 on abort or allocation failure.
+ */
+static int
+dirscan_append(dirscan_t *ds, const void *ent, uint len)
+{
+    while (!ds->ds_abort && (ds->ds_len - ds->ds_pos >= DIRSCAN_AHEAD))
+        pthread_cond_wait(&ds->ds_cond, &ds->ds_lock);
+    if (ds->ds_abort)
+        return (-1);
+    if (ds->ds_pos >= ds->ds_size / 2) {
+        /* Discard what the reader has consumed */
+        memmove(ds->ds_buf, ds->ds_buf + ds->ds_pos, ds->ds_len - ds->ds_pos);
+        ds->ds_len -= ds->ds_pos;
+        ds->ds_pos = 0;
+    }
+    if (ds->ds_len + len > ds->ds_size) {
+        uint     nsize = ds->ds_size ? ds->ds_size * 2 : 16384;
+        uint8_t *nbuf;
+        while (nsize < ds->ds_len + len)
+            nsize *= 2;
+        nbuf = realloc(ds->ds_buf, nsize);
+        if (nbuf == NULL)
+            return (-1);
+        ds->ds_buf = nbuf;
+        ds->ds_size = nsize;
+    }
+    memcpy(ds->ds_buf + ds->ds_len, ent, len);
+    ds->ds_len += len;
+    return (0);
+}
+
+/*
+ * th_dirscan() is the scanner thread of a directory stream handle.
+ */
+static void *
+th_dirscan(void *arg)
+{
+    dirscan_t    *ds = arg;
+    hm_fdirent_t *ent = malloc(DIRSCAN_ENT_MAX);
+    uint          start;
+    uint          cur;
+
+    board_cur = ds->ds_board;  // Entries are encoded with its volume names
+    assert(board_cur != NULL);
+    if ((ent == NULL) || (dirscan_names(ds) != 0)) {
+        ds->ds_failed = 1;
+        goto scan_done;
+    }
+
+    pthread_mutex_lock(&ds->ds_lock);
+    for (cur = 1; (cur < dirscan_threads) &&
+                  (ds->ds_ents_count > DIRSCAN_BATCH); cur++) {
+        if (pthread_create(&ds->ds_helpers[ds->ds_nhelpers], NULL,
+                           th_dirscan_helper, ds) == 0)
+            ds->ds_nhelpers++;
+    }
+    for (start = 0; !ds->ds_abort && !ds->ds_failed &&
+                    (start < ds->ds_ents_count); start = ds->ds_batch_end) {
+        /* Stat the batch, with help from helper threads */
+        ds->ds_batch_next = start;
+        ds->ds_batch_end = start + DIRSCAN_BATCH;
+        if (ds->ds_batch_end > ds->ds_ents_count)
+            ds->ds_batch_end = ds->ds_ents_count;
+        ds->ds_batch_gen++;
+        if (ds->ds_nhelpers != 0)
+            pthread_cond_broadcast(&ds->ds_work_cond);
+        while (dirscan_stat_one(ds))
+            ;
+        while (!ds->ds_abort && (ds->ds_batch_busy != 0))
+            pthread_cond_wait(&ds->ds_cond, &ds->ds_lock);
+
+        /* Encode the batch */
+        for (cur = start; !ds->ds_abort && !ds->ds_failed &&
+                          (cur < ds->ds_batch_end); cur++) {
+            uint len;
+            pthread_mutex_unlock(&ds->ds_lock);
+            len = dirscan_encode(ds, &ds->ds_ents[cur], ent);
+            pthread_mutex_lock(&ds->ds_lock);
+            if ((len != 0) && (dirscan_append(ds, ent, len) != 0) &&
+                !ds->ds_abort) {
+                ds->ds_failed = 1;
+            }
+        }
+        pthread_cond_broadcast(&ds->ds_cond);
+    }
+    pthread_mutex_unlock(&ds->ds_lock);
+
+scan_done:
+    free(ent);
+    pthread_mutex_lock(&ds->ds_lock);
+    ds->ds_done = 1;
+    pthread_cond_broadcast(&ds->ds_cond);
+    pthread_cond_broadcast(&ds->ds_work_cond);
+    pthread_mutex_unlock(&ds->ds_lock);
+    for (cur = 0; cur < ds->ds_nhelpers; cur++)
+        pthread_join(ds->ds_helpers[cur], NULL);
+    return (NULL);
+}
+#endif /* HAVE_DIRSCAN */
+
+/*
+ * dirscan_free() stops a handle's directory scan and frees it.
+ */
+static void
+dirscan_free(handle_ent_t *handle)
+{
+#ifdef HAVE_DIRSCAN
+    dirscan_t *ds = handle->he_ds;
+
+    if (ds == NULL)
+        return;
+    handle->he_ds = NULL;
+    pthread_mutex_lock(&ds->ds_lock);
+    ds->ds_abort = 1;
+    pthread_cond_broadcast(&ds->ds_cond);
+    pthread_cond_broadcast(&ds->ds_work_cond);
+    pthread_mutex_unlock(&ds->ds_lock);
+    pthread_join(ds->ds_thread, NULL);
+    close(ds->ds_fd);
+    pthread_mutex_destroy(&ds->ds_lock);
+    pthread_cond_destroy(&ds->ds_cond);
+    pthread_cond_destroy(&ds->ds_work_cond);
+    free(ds->ds_path);
+    free(ds->ds_aname);
+    free(ds->ds_names);
+    free(ds->ds_ents);
+    free(ds->ds_uaem);
+    free(ds->ds_buf);
+    free(ds);
+#else
+    (void) handle;
+#endif
+}
+
+/*
+ * dirscan_start() starts scanning a directory for a handle which is about
+ * to read it from the first entry. Without a scanner, the handle reads
+ * the directory with readdir() instead.
+ */
+static void
+dirscan_start(handle_ent_t *handle, const char *host_path)
+{
+#ifdef HAVE_DIRSCAN
+    dirscan_t *ds;
+
+    if (dirscan_threads == 0)
+        return;
+    ds = calloc(1, sizeof (*ds));
+    if (ds == NULL)
+        return;
+    ds->ds_board = board_cur;
+    ds->ds_path = strdup(host_path);
+    ds->ds_aname = strdup(handle->he_name);
+    ds->ds_fd = open(host_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ((ds->ds_path == NULL) || (ds->ds_aname == NULL) || (ds->ds_fd < 0))
+        goto start_fail;
+    pthread_mutex_init(&ds->ds_lock, NULL);
+    pthread_cond_init(&ds->ds_cond, NULL);
+    pthread_cond_init(&ds->ds_work_cond, NULL);
+    if (pthread_create(&ds->ds_thread, NULL, th_dirscan, ds) != 0) {
+        pthread_mutex_destroy(&ds->ds_lock);
+        pthread_cond_destroy(&ds->ds_cond);
+        pthread_cond_destroy(&ds->ds_work_cond);
+start_fail:
+        fsprintf("dirscan %s failed\n", host_path);
+        if (ds->ds_fd >= 0)
+            close(ds->ds_fd);
+        free(ds->ds_path);
+        free(ds->ds_aname);
+        free(ds);
+        return;
+    }
+    handle->he_ds = ds;
+#else
+    (void) handle;
+    (void) host_path;
+#endif
+}
+
+/*
+ * dirscan_read() copies whole dirents from a handle's directory scan. It
+ * waits for at least one dirent (or the end of the directory), then
+ * returns what has been encoded so far, under the same size rules as
+ * dircache_read(). Copied dirents are also added to the directory cache
+ * entry the handle is building.
+ *
+ * @return Bytes copied.
+ */
+static uint
+dirscan_read(handle_ent_t *handle, uint8_t *buf, uint maxlen, uint *rc)
+{
+    uint pos = 0;
+#ifdef HAVE_DIRSCAN
+    dirscan_t *ds = handle->he_ds;
+    uint       done;
+    uint       failed;
+    uint       cur;
+
+    pthread_mutex_lock(&ds->ds_lock);
+    while ((ds->ds_pos == ds->ds_len) && !ds->ds_done)
+        pthread_cond_wait(&ds->ds_cond, &ds->ds_lock);
+    while (ds->ds_pos < ds->ds_len) {
+        hm_fdirent_t *ent = (hm_fdirent_t *) (ds->ds_buf + ds->ds_pos);
+        uint          len = sizeof (*ent) + SWAP16(ent->hmd_elen);
+
+        if ((pos > 0) && (sizeof (*ent) + 256 + 2 > maxlen - pos))
+            break;
+        memcpy(buf + pos, ent, len);
+        pos += len;
+        ds->ds_pos += len;
+        if (pos >= maxlen)
+            break;
+    }
+    done = ds->ds_done && (ds->ds_pos == ds->ds_len);
+    failed = ds->ds_failed;
+    pthread_cond_broadcast(&ds->ds_cond);
+    pthread_mutex_unlock(&ds->ds_lock);
+
+    for (cur = 0; cur < pos; ) {
+        hm_fdirent_t *ent = (hm_fdirent_t *) (buf + cur);
+        uint          len = sizeof (*ent) + SWAP16(ent->hmd_elen);
+        handle->he_entnum++;
+        dircache_append(handle, ent, len);
+        cur += len;
+    }
+    if (done) {
+        /* An incomplete scan must not be cached */
+        *rc = KM_STATUS_EOF;
+        if (failed)
+            dircache_release(handle);
+        else
+            dircache_publish(handle);
+        return (pos);
+    }
+#else
+    (void) handle;
+    (void) buf;
+    (void) maxlen;
+#endif
+    *rc = KM_STATUS_OK;
+    return (pos);
+}
+
+/*
+ * Mapped file reads
+ *
+ * Files opened read-only which are at least filemap_min bytes are mapped
+ * into memory, and KM_OP_FREAD replies are sent directly from the mapped
+ * pages. Such handles do not use the read-ahead cache (the kernel's page
+ * cache read-ahead applies instead), and he_mappos is the current file
+ * position. The file size is checked before each read, so a file which
+ * has grown is remapped and one which has shrunk is not read beyond its
+ * new end. Another process may still truncate the file between that check
+ * and the access, which raises SIGBUS; data is therefore copied out of
+ * the mapping by filemap_copy(), which turns the fault into a read error.
+ */
+#ifdef HAVE_MMAP
+#define FILEMAP_DEFAULT_KB 64  // Minimum size of a mapped file (KB)
+#else
+#define FILEMAP_DEFAULT_KB 0
+#endif
+
+static uint filemap_min = FILEMAP_DEFAULT_KB << 10;
+#ifdef HAVE_MMAP
+static __thread sigjmp_buf *filemap_fault;  // Set during filemap_copy()
+
+/*
+ * filemap_sigbus() handles SIGBUS. A fault in filemap_copy() resumes there;
+ *                  any other fault terminates the process as it would have.
+ */
+static void
+filemap_sigbus(int sig)
+{
+    if (filemap_fault != NULL)
+        siglongjmp(*filemap_fault, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+#endif
+
+/*
+ * filemap_copy() copies data out of a file mapping.
+ *
+ * @return 0 on success, or -1 if the pages are no longer backed by the
+ *         file (it was truncated).
+ */
+static int
+filemap_copy(uint8_t *dst, const uint8_t *src, uint len)
+{
+#ifdef HAVE_MMAP
+    sigjmp_buf jmp;
+
+    if (sigsetjmp(jmp, 1) != 0) {
+        filemap_fault = NULL;
+        return (-1);
+    }
+    filemap_fault = &jmp;
+    memcpy(dst, src, len);
+    filemap_fault = NULL;
+    return (0);
+#else
+    (void) dst;
+    (void) src;
+    (void) len;
+    return (-1);
+#endif
+}
+
+/*
+ * filemap_new() maps a regular file which was opened read-only.
+ *
+ * @return TRUE if the file was mapped.
+ */
+static int
+filemap_new(handle_ent_t *handle)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    void       *map;
+
+    if ((filemap_min == 0) || (fstat(handle->he_fd, &st) != 0) ||
+        !S_ISREG(st.st_mode) || (st.st_size < (off64_t) filemap_min) ||
+        ((uint64_t) st.st_size > SIZE_MAX)) {
+        return (FALSE);
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, handle->he_fd, 0);
+    if (map == MAP_FAILED) {
+        fsprintf("mmap %s failed: %d\n", handle->he_name, errno);
+        return (FALSE);
+    }
+    (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+    handle->he_map = map;
+    handle->he_mapsize = st.st_size;
+    handle->he_mappos = 0;
+    return (TRUE);
+#else
+    (void) handle;
+    return (FALSE);
+#endif
+}
+
+/*
+ * filemap_free() unmaps a file handle's data.
+ */
+static void
+filemap_free(handle_ent_t *handle)
+{
+#ifdef HAVE_MMAP
+    if (handle->he_map == NULL)
+        return;
+    munmap(handle->he_map, handle->he_mapsize);
+    handle->he_map = NULL;
+    handle->he_mapsize = 0;
+#else
+    (void) handle;
+#endif
+}
+
+/*
+ * filemap_avail() returns the number of bytes which may be read from the
+ * mapped file at the current position, after checking for a change in
+ * the file's size.
+ */
+static uint
+filemap_avail(handle_ent_t *handle, uint maxlen)
+{
+#ifdef HAVE_MMAP
+    struct stat st;
+    off64_t     end = handle->he_mapsize;
+
+    if (fstat(handle->he_fd, &st) == 0) {
+        if ((st.st_size > handle->he_mapsize) &&
+            ((uint64_t) st.st_size <= SIZE_MAX)) {
+            /* File has grown */
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+                             handle->he_fd, 0);
+            if (map != MAP_FAILED) {
+                munmap(handle->he_map, handle->he_mapsize);
+                (void) madvise(map, st.st_size, MADV_SEQUENTIAL);
+                handle->he_map = map;
+                handle->he_mapsize = st.st_size;
+            }
+            end = handle->he_mapsize;
+        } else if (st.st_size < end) {
+            end = st.st_size;  // File has shrunk
+        }
+    }
+    if (handle->he_mappos >= end)
+        return (0);
+    if (end - handle->he_mappos < maxlen)
+        maxlen = end - handle->he_mappos;
+    return (maxlen);
+#else
+    (void) handle;
+    (void) maxlen;
+    return (0);
+#endif
+}
+
+/*
+ * sm_fread_send() sends a KM_OP_FREAD reply header and its data. If the
+ * request allows it (HM_FLAG_COMPRESS), the data is sent compressed
+ * when that makes it smaller. Chunks which do not compress are sent
+ * stored.
+ *
+ * @param [io] hmr     - Reply header; hm_length and hm_flag are filled in.
+ * @param [in] data    - File data to send.
+ * @param [in] len     - Length of file data.
+ * @param [in] hm_flag - Flags from the KM_OP_FREAD request.
+ * @param [out] status - KS status of the send.
+ */
+static uint
+sm_fread_send(hm_freadwrite_t *hmr, const uint8_t *data, uint len,
+              uint hm_flag, uint *status)
+{
+    hmr->hm_length = SWAP32(len);
+    hmr->hm_flag = 0;
+    if ((hm_flag & HM_FLAG_COMPRESS) && (len >= SM_LZ_MIN_LEN)) {
+        uint16_t hashtab[SM_LZ_HASH_SIZE];
+        uint     zmax = SM_LZ_PACK_MAX(len);
+        uint8_t *zbuf = malloc(zmax);
+        uint     zlen;
+        uint     rc;
+
+        if (zbuf != NULL) {
+            zlen = sm_lz_pack(data, len, zbuf, zmax, hashtab);
+            if (zlen != 0) {
+#ifdef DEBUG_READ
+                fsprintf("read %u bytes compressed to %u\n", len, zlen);
+#endif
+                hmr->hm_length = SWAP32(zlen);
+                hmr->hm_flag = SWAP16(HM_FLAG_COMPRESS);
+                rc = send_msg_parts(hmr, sizeof (*hmr), zbuf, zlen, status);
+                free(zbuf);
+                return (rc);
+            }
+            free(zbuf);
+        }
+    }
+    return (send_msg_parts(hmr, sizeof (*hmr), data, len, status));
+}
+
+/*
+ * sm_fread_map() sends the reply to a KM_OP_FREAD request for a mapped
+ * file, with the data copied from the mapping.
+ */
+static uint
+sm_fread_map(hm_freadwrite_t *hm, handle_ent_t *handle, uint hm_length,
+             uint hm_flag, uint *status)
+{
+    hm_freadwrite_t hmr;
+    uint8_t        *data;
+    uint            len;
+    uint            rc;
+
+    if (hm_flag & HM_FLAG_SEEK0)
+        handle->he_mappos = 0;
+    len = filemap_avail(handle, hm_length);
+#ifdef DEBUG_READ
+    fsprintf("read %u bytes from map %s\n", len, handle->he_name);
+#endif
+
+    hmr.hm_hdr.km_op = hm->hm_hdr.km_op;
+    hmr.hm_hdr.km_status = (len < hm_length) ? KM_STATUS_EOF : KM_STATUS_OK;
+    hmr.hm_hdr.km_tag = hm->hm_hdr.km_tag;
+    hmr.hm_handle = hm->hm_handle;
+    hmr.hm_unused = 0;
+
+    data = malloc(len + 1);
+    if ((data == NULL) ||
+        (filemap_copy(data, handle->he_map + handle->he_mappos, len) != 0)) {
+        fsprintf("read from map %s failed\n", handle->he_name);
+        free(data);
+        hmr.hm_hdr.km_status = KM_STATUS_FAIL;
+        hmr.hm_length = 0;
+        hmr.hm_flag = 0;
+        return (send_msg(&hmr, sizeof (hmr), status));
+    }
+    handle->he_mappos += len;
+    rc = sm_fread_send(&hmr, data, len, hm_flag, status);
+    free(data);
+    return (rc);
+}
+
+static uint
+errno_to_km_status(void)
+{
+    switch (errno) {
+        case EACCES:
+        case EBUSY:
+        case EFAULT:
+        case EPERM:
+        case EROFS:
+            return (KM_STATUS_PERM);
+        case EBADF:
+        case EINVAL:
+        case EISDIR:
+            return (KM_STATUS_INVALID);
+        case EEXIST:
+            return (KM_STATUS_EXIST);
+        case ENOENT:
+            return (KM_STATUS_NOEXIST);
+        case ENOTEMPTY:
+            return (KM_STATUS_NOTEMPTY);
+        default:
+            fsprintf("errno=%d\n", errno);
+            return (KM_STATUS_FAIL);
+    }
+}
+
+static uint
+sm_unknown(km_msg_hdr_t *km, uint *status)
+{
+    fsprintf("KS unexpected op %x\n", km->km_op);
+    km->km_status = KM_STATUS_UNKCMD;
+    km->km_op |= KM_OP_REPLY;
+    return (send_msg(km, sizeof (*km), status));
+}
+
+static uint
+sm_null(km_msg_hdr_t *km, uint *status)
+{
+    km->km_status = KM_STATUS_OK;
+    km->km_op |= KM_OP_REPLY;
+    return (send_msg(km, sizeof (*km), status));
+}
+
+static uint
+sm_loopback(km_msg_hdr_t *km, uint8_t *rxdata, uint rxlen, uint *status)
+{
+    /* Need to send back reply */
+    km->km_status = KM_STATUS_OK;
+    km->km_op |= KM_OP_REPLY;
+#if 0
+    fsprintf("lb l=%x s=%04x data=%02x %02x\n",
+             rxlen, status, rxdata[0], rxdata[1]);
+#endif
+    return (send_msg(rxdata, rxlen, status));
+}
+
+static uint
+sm_id(km_msg_hdr_t *km, uint *status)
+{
+    smash_id_t *reply = (smash_id_t *) (km + 1);
+    uint temp[3];
+    int  pos = 0;
+
+    km->km_status = KM_STATUS_OK;
+    km->km_op |= KM_OP_REPLY;
+    memset(reply, 0, sizeof (*reply));
+    sscanf(version_str + 8, "%u.%u%n", &temp[0], &temp[1], &pos);
+    reply->si_ks_version[0] = SWAP16(temp[0]);
+    reply->si_ks_version[1] = SWAP16(temp[1]);
+    if (pos == 0)
+        pos = 18;
+    else
+        pos += 8 + 7;
+    sscanf(version_str + pos, "%04u-%02u-%02u",
+           &temp[0], &temp[1], &temp[2]);
+    reply->si_ks_date[0] = temp[0] / 100;
+    reply->si_ks_date[1] = temp[0] % 100;
+    reply->si_ks_date[2] = temp[1];
+    reply->si_ks_date[3] = temp[2];
+    pos += 11;
+    sscanf(version_str + pos, "%02u:%02u:%02u",
+           &temp[0], &temp[1], &temp[2]);
+    reply->si_ks_time[0] = temp[0];
+    reply->si_ks_time[1] = temp[1];
+    reply->si_ks_time[2] = temp[2];
+    reply->si_ks_time[3] = 0;
+    strcpy(reply->si_serial, "-");           // MAC address here?
+    reply->si_rev      = SWAP16(0x0001);     // Protocol version 0.1
+    reply->si_features = SWAP16(0x0001 | HM_FEATURE_COMPRESS);
+    reply->si_usbid    = SWAP32(0x12091610); // IP address here?
+    reply->si_mode     = 0xff;
+    gethostname(reply->si_name, sizeof (reply->si_name));
+    reply->si_name[sizeof (reply->si_name) - 1] = '\0';
+    memset(reply->si_unused, 0, sizeof (reply->si_unused));
+    return (send_msg(km, sizeof (*km) + sizeof (*reply), status));
+}
+
+static uint
+sm_fopen(hm_fopenhandle_t *hm, uint *status)
+{
+    char         *hm_name = (char *)(hm + 1);
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    handle_ent_t *handle;
+    char         *host_path = NULL;
+    char         *name = NULL;
+    uint16_t      hm_type;
+    uint16_t      hm_mode = SWAP16(hm->hm_mode);
+    uint          oflags;
+    int           fd;
+    struct stat   st;
+
+    fsprintf("fopen(%s %x) in %x\n", hm_name, hm_mode, hm->hm_handle);
+
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    writebehind_flush_all();  // Open may stat or truncate a buffered file
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+
+#ifdef FOPEN_DEBUG
+    fsprintf("parent handle=%x type=%x path=%s\n",
+             hm->hm_handle, phandle ? phandle->he_type: 0,
+             phandle ? phandle->he_name : NULL);
+#endif
+    if ((hm_name[0] == '\0') && (hm_mode == 0)) {
+        /* Special case -- want to reopen handle with same mode */
+//      hm_mode = phandle->he_mode;
+        hm_mode = HM_MODE_READ;
+        // XXX: I'm not sure this is enough because for the new file,
+        //      phandle could end up being a file, and this might break
+        //      future reopens. Need to test that.
+    }
+    if ((name = make_amiga_host_path(&phandle, hm_name, &host_path)) == NULL) {
+        fsprintf("fopen(%s) relative path failed\n", hm_name);
+reply_open_fail:
+        if (name != NULL)
+            free(name);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_NOEXIST;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Opening the volume directory */
+        if ((hm_mode & HM_MODE_READ) == 0) {
+            fsprintf("Did not open volume directory for read (%x)\n",
+                     hm_mode);
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_open_fail;
+        }
+        hm->hm_type = SWAP16(HM_TYPE_DIR);
+
+        handle = handle_new(name, "", NULL, HM_TYPE_VOLDIR, hm_mode);
+        /* Volume directory has no he_volume or he_avolume pointers */
+        free(name);
+        goto open_success;
+    }
+
+    fsprintf("host_path=%s\n", host_path);
+
+    hm_type = SWAP16(hm->hm_type);
+    if (hm_mode & HM_MODE_READ) {
+        /* File is opened for read; attempt to figure out file type */
+        if (hm_mode & HM_MODE_NOFOLLOW) {
+            if (lstat(host_path, &st) != 0) {
+                fsprintf("fopen(%s) lstat fail errno=%d\n", host_path, errno);
+                goto reply_open_fail;
+            }
+        } else {
+            if (stat(host_path, &st) != 0) {
+                fsprintf("fopen(%s) stat fail errno=%d\n", host_path, errno);
+                goto reply_open_fail;
+            }
+        }
+        hm_type = st_mode_to_hm_type(st.st_mode);
+        hm->hm_type = SWAP16(hm_type);
+    }
+
+    if ((hm_mode & HM_MODE_LINK) ||
+        (hm_mode & HM_MODE_DIR)) {
+        /*
+         * Special open mode which returns directory or link target
+         * information for a single file.
+         */
+        if ((hm_mode & HM_MODE_RDWR) != HM_MODE_READ) {
+            fsprintf("Did not open dirent %s for read (%x)\n",
+                     host_path, hm_mode);
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_open_fail;
+        }
+        fsprintf("handle_new name='%s' hm_name='%s' host_path='%s'\n",
+                 name, hm_name, host_path);
+        handle = handle_new(name, host_path, phandle, hm_type, hm_mode);
+        fsprintf("dirmode phandle %x handle %x avolume=%s name=%s\n",
+                 (phandle != NULL) ? phandle->he_handle : 0,
+                 handle->he_handle,
+                 (handle->he_avolume != NULL) ? handle->he_avolume->av_volume :
+                 "(NULL)", name);
+        free(name);
+        goto open_success;
+    } else if (hm_type == HM_TYPE_DIR) {
+        DIR *dir;
+        if ((hm_mode & ~HM_MODE_DIR) != HM_MODE_READ) {
+            fsprintf("Did not open dir %s for read (%x)\n",
+                     host_path, hm_mode);
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_open_fail;
+        }
+        dir = opendir(host_path);
+        if (dir == NULL) {
+            fsprintf("opendir(%s) failed\n", host_path);
+            goto reply_open_fail;
+        }
+
+        handle = handle_new(name, "", phandle, hm_type, hm_mode);
+        handle->he_dir = dir;
+        fsprintf("  opendir(%s \"%s\") = %x %p\n",
+                 host_path, name, handle->he_handle, (void *) dir);
+        free(name);
+        goto open_success;
+    }
+    switch (hm_mode & HM_MODE_RDWR) {
+        case HM_MODE_READ:
+            oflags = O_RDONLY;
+            break;
+        case HM_MODE_WRITE:
+            oflags = O_WRONLY;
+            break;
+        case HM_MODE_RDWR:
+            oflags = O_RDWR;
+            break;
+        default:
+            oflags = 0;
+            break;
+    }
+    if (hm_mode & HM_MODE_APPEND)
+        oflags |= O_APPEND;
+    if (hm_mode & HM_MODE_CREATE)
+        oflags |= O_CREAT;
+    if (hm_mode & HM_MODE_TRUNC)
+        oflags |= O_TRUNC;
+
+    if (oflags & O_CREAT) {
+        uint32_t aperms = SWAP32(hm->hm_aperms);
+        uint mode = host_perms_from_amiga(aperms);
+        fsprintf("O_CREAT %s oflags=%x mode=%x\n", host_path, oflags, mode);
+        fd = open(host_path, oflags, mode);
+    } else {
+        fd = open(host_path, oflags);
+        if ((fd == -1) && (oflags & HM_MODE_WRITE)) {
+            fd = open(host_path, oflags | O_CREAT, 0777);
+        }
+    }
+    if (fd == -1) {
+        fsprintf("File open %s fail: %d\n", host_path, errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_open_fail;
+    }
+
+    handle = handle_new(name, "", phandle, hm_type, hm_mode);
+    handle->he_fd = fd;
+    if (hm_mode & HM_MODE_WRITE) {
+        struct stat st;
+        if (fstat(fd, &st) == 0) {
+            handle->he_dev = st.st_dev;
+            handle->he_ino = st.st_ino;
+            if (oflags & O_TRUNC)
+                readahead_invalidate(st.st_dev, st.st_ino);
+        }
+    }
+    if (((hm_mode & HM_MODE_RDWR) == HM_MODE_READ) && !filemap_new(handle))
+        readahead_new(handle);
+    else if ((hm_mode & HM_MODE_WRITE) && (hm_type == HM_TYPE_FILE))
+        writebehind_new(handle);
+    free(name);
+
+open_success:
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    hm->hm_handle = handle->he_handle;
+    hm->hm_mode   = 0;
+    fsprintf("  handle=%x\n", hm->hm_handle);
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fclose(hm_fopenhandle_t *hm, uint *status)
+{
+    handle_ent_t *handle = handle_get(hm->hm_handle);
+
+    if (handle == NULL) {
+        fsprintf("Handle %x not open for close\n", hm->hm_handle);
+        hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+#define DEBUG_CLOSE
+#ifdef DEBUG_CLOSE
+    fsprintf("fclose(%x): ", hm->hm_handle);
+#endif
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+
+    if (handle->he_mode & HM_MODE_LINK) {
+#ifdef DEBUG_CLOSE
+        fsprintf("close readlink '%s'\n", handle->he_name);
+#endif
+        goto sm_fclose_end;
+    }
+    if (handle->he_mode & HM_MODE_DIR) {
+#ifdef DEBUG_CLOSE
+        fsprintf("close STAT '%s'\n", handle->he_name);
+#endif
+        goto sm_fclose_end;
+    }
+    switch (handle->he_type) {
+        case HM_TYPE_VOLDIR:
+#ifdef DEBUG_CLOSE
+            fsprintf("close volume directory\n");
+#endif
+            break;
+        case HM_TYPE_VOLUME:
+#ifdef DEBUG_CLOSE
+            fsprintf("close volume '%s'\n", handle->he_name);
+#endif
+            break;
+        case HM_TYPE_DIR:
+            if (handle->he_dir == NULL) {
+                fsprintf("BUG: attempt close of NULL dir: %s\n",
+                         handle->he_name);
+                break;
+            }
+#ifdef DEBUG_CLOSE
+            fsprintf("close dir %p\n", (void *) handle->he_dir);
+#endif
+            if (handle->he_dir != NULL)
+                closedir(handle->he_dir);
+            dircache_release(handle);
+            dirscan_free(handle);
+            break;
+        default:
+#ifdef DEBUG_CLOSE
+            fsprintf("close file '%s'\n", handle->he_name);
+#endif
+            readahead_free(handle);
+            filemap_free(handle);
+            if (writebehind_free(handle) != 0) {
+                fsprintf("write-behind of %s failed: %d\n",
+                         handle->he_name, errno);
+                hm->hm_hdr.km_status = errno_to_km_status();
+            }
+#ifndef __MINGW32__
+            if (writebehind_durable && (handle->he_mode & HM_MODE_WRITE) &&
+                (fsync(handle->he_fd) != 0) &&
+                (hm->hm_hdr.km_status == KM_STATUS_OK)) {
+                hm->hm_hdr.km_status = errno_to_km_status();
+            }
+#endif
+            close(handle->he_fd);
+            break;
+    }
+sm_fclose_end:
+    handle_free(hm->hm_handle);
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint64_t
+get_fs_size(const char *path, uint64_t *used, uint *blksize)
+{
+    struct statvfs buf;
+    statvfs(path, &buf);
+    *used = buf.f_blocks - buf.f_bavail;
+    *blksize = buf.f_bsize;
+#ifdef DEBUG_STATVFS
+    fsprintf("statvfs path='%s' blks=%u used=%u blksize=%u\n",
+             path, (uint) buf.f_blocks, (uint) *used, (uint) *blksize);
+#endif
+    return (buf.f_blocks);
+}
+
+static uint
+sm_fread(hm_freadwrite_t *hm, uint *status)
+{
+    hm_freadwrite_t *hmr;
+    uint             rc;
+    uint             pos;
+    uint             len;
+    uint             hm_length = SWAP32(hm->hm_length);
+    uint             hm_flag = SWAP16(hm->hm_flag);
+    handle_ent_t    *handle = handle_get(hm->hm_handle);
+    uint             pathlen = 0;
+    char             pathbuf[2048];
+
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+
+    fsprintf("fread(%x, l=%x)\n", hm->hm_handle, hm_length);
+    if (handle == NULL) {
+        fsprintf("handle get %x failed\n", hm->hm_handle);
+reply_read_fail:
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+    if ((handle->he_mode & HM_MODE_READ) == 0) {
+        fsprintf("%s not opened for read mode: %x\n",
+                 handle->he_name, handle->he_mode);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_read_fail;
+    }
+
+    if (handle->he_type == HM_TYPE_VOLDIR) {
+        if (hm_flag & HM_FLAG_SEEK0)
+            handle->he_entnum = 0;
+#ifdef DEBUG_READ
+        fsprintf("VOLDIR %s\n", handle->he_name);
+#endif
+        goto dir_read_common;
+    } else if (handle->he_type == HM_TYPE_DIR) {
+#ifdef DEBUG_READ
+        fsprintf("DIR %s\n", handle->he_name);
+#endif
+        if (hm_flag & HM_FLAG_SEEK0) {
+            if (handle->he_dir != NULL)
+                rewinddir(handle->he_dir);
+            dircache_release(handle);
+            dirscan_free(handle);
+            handle->he_entnum = 0;
+        }
+        if (HANDLE_IS_DIRSTREAM(handle) && (handle->he_dc == NULL) &&
+            (handle->he_ds == NULL) && (handle->he_entnum == 0) &&
+            (handle->he_avolume != NULL)) {
+            char *host_path = make_host_path(handle->he_avolume,
+                                             handle->he_name);
+            if (host_path != NULL) {
+                dircache_attach(handle, host_path);
+                if ((handle->he_dc == NULL) || !handle->he_dc->dc_ready)
+                    dirscan_start(handle, host_path);
+                free(host_path);
+            }
+        }
+        goto dir_read_common;
+    } else if (handle->he_mode & HM_MODE_DIR) {
+        if (hm_flag & HM_FLAG_SEEK0)
+            handle->he_entnum = 0;
+#ifdef DEBUG_READ
+        fsprintf("STAT %s\n", handle->he_name);
+#endif
+dir_read_common:
+        writebehind_flush_all();  // Sizes reported must include buffered data
+        pathlen = strlen(handle->he_name);
+        if (pathlen > sizeof (pathbuf) - 257) {
+            fsprintf("Path too long: %u bytes\n", pathlen);
+            goto reply_read_fail;
+        }
+        strcpy(pathbuf, handle->he_name);
+        if ((handle->he_mode & HM_MODE_DIR) &&
+            (handle->he_type != HM_TYPE_VOLDIR)) {
+            char *sname = pathbuf;
+            /* Trim file name from path */
+            while (*sname != '\0')
+                sname++;
+            for (sname--; sname > pathbuf; sname--)
+                if (*sname == '/')
+                    break;
+                else
+                    *sname = '\0';
+            pathlen = strlen(pathbuf);
+        } else if ((pathlen > 1) && (pathbuf[pathlen - 1] != '/')) {
+            pathbuf[pathlen++] = '/';  // Append trailing slash
+            pathbuf[pathlen] = '\0';
+        }
+#ifdef DEBUG_READ
+        fsprintf("STAT pathbuf=%s\n", pathbuf);
+#endif
+    }
+
+    if (handle->he_map != NULL)
+        return (sm_fread_map(hm, handle, hm_length, hm_flag, status));
+
+    /*
+     * Allocate buffer larger than requested. This is to accommodate
+     * the specific case of short read where a single directory entry
+     * is desired.
+     */
+    hmr = malloc(sizeof (*hmr) + hm_length + 256);
+    pos = 0;
+    rc = 0;
+    if ((handle->he_dc != NULL) && handle->he_dc->dc_ready) {
+        /* Directory stream is cached */
+        pos = dircache_read(handle, (uint8_t *) (hmr + 1), hm_length, &rc);
+        goto read_done;
+    }
+    if (handle->he_ds != NULL) {
+        /* Directory is being scanned in the background */
+        pos = dirscan_read(handle, (uint8_t *) (hmr + 1), hm_length, &rc);
+        goto read_done;
+    }
+    while (pos < hm_length) {
+        uint8_t *ndata = ((uint8_t *)(hmr + 1)) + pos;
+        len = hm_length - pos;
+        if (handle->he_mode & HM_MODE_LINK) {
+            char  lbuf[PATH_MAX];
+            char *path;
+            int   llen;
+
+            fsprintf("readlink %s\n", handle->he_path);
+            llen = readlink(handle->he_path, lbuf, sizeof (lbuf) - 1);
+            if (llen == -1) {
+                fsprintf("readlink %s failed\n", handle->he_path);
+                llen = 0;
+            }
+            lbuf[llen] = '\0';
+            path = host_to_amiga_path(handle->he_path, handle->he_name, lbuf);
+
+            llen = strlen(path) + 1;
+            memcpy(ndata, path, llen);
+            free(path);
+
+            pos += llen;
+            break;
+        } else if ((handle->he_type == HM_TYPE_DIR) ||
+                   (handle->he_type == HM_TYPE_VOLDIR) ||
+                   (handle->he_mode & HM_MODE_DIR)) {
+            struct dirent *dp;
+            uint nlen;
+            uint hmd_type;
+            uint he_mode = handle->he_mode;
+            uint32_t size_hi = 0;
+            uint32_t size_lo = 0;
+            uint32_t amiga_perms;
+            struct stat st;
+            struct dirent ldp;
+            hm_fdirent_t *hm_dirent = (hm_fdirent_t *)ndata;
+            uint maxlen = hm_length - pos;
+            char *host_path = NULL;
+            char d_name[256];
+            uint d_type = 0;
+
+            if (pos > hm_length)  // Safeguard
+                maxlen = 0;
+            if ((sizeof (*hm_dirent) +
+                 sizeof (d_name) + 2 > maxlen) && (pos > 0)) {
+                /*
+                 * Next entry might not fit, so stop here.
+                 *
+                 * Note this only applies to subsequent directory entries.
+                 * At least one dirent will always be retrieved. The caller
+                 * to sm_fread() can * acquire a single dirent by
+                 * requesting a small buffer, for example the size of
+                 * hm_fdirent_t, and will get that including an untruncated
+                 * filename. This might seem bad (buffer overrun), but it
+                 * isn't because the receiving Amiga code will land data in
+                 * an oversized buffer.
+                 */
+                rc = 0;
+#ifdef DEBUG_READ
+                fsprintf("No space for next dirent %lu %u\n",
+                         sizeof (*dp), maxlen);
+#endif
+                break;
+            }
+
+            memset(hm_dirent, 0, sizeof (*hm_dirent)); // wipe the dirent
+
+            if (handle->he_type == HM_TYPE_VOLDIR) {
+                amiga_vol_t *vol;
+
+                vol = volume_get_by_index(handle->he_entnum);
+                if (vol == NULL) {
+                    dp = NULL;
+                } else {
+                    dp = &ldp;
+                    d_type = DT_DIR;
+                    strcpy(d_name, vol->av_volume);
+                    if (handle->he_mode & HM_MODE_DIR) {
+                        if (handle->he_entnum == 0) {
+                            strcpy(d_name, "Volume Directory");
+                        } else {
+                            dp = NULL;
+                        }
+                    }
+                }
+            } else if (handle->he_mode & HM_MODE_DIR) {
+                /* This mode is to STAT a single file */
+                if (handle->he_entnum != 0) {
+                    dp = NULL;
+                } else {
+                    const char *sname;
+
+                    handle->he_entnum++;
+                    if ((handle->he_name[0] == '\0') ||
+                        ((handle->he_name[0] == '.') &&
+                         (handle->he_name[1] == '\0'))) {
+                        /* Volume root */
+                        sname = handle->he_avolume->av_volume;
+                        handle->he_type = HM_TYPE_VOLUME;
+                        hmd_type = HM_TYPE_VOLUME;
+                    } else {
+                        /* Find name following directory path */
+                        sname = handle->he_name;
+
+                        while (*sname != '\0')
+                            sname++;
+                        if ((sname > handle->he_name) &&
+                            (sname[-1] == '/')) {
+                            /* Name is before trailing slash */
+                            sname--;
+                        }
+                        for (sname--; sname > handle->he_name; sname--)
+                            if (sname[-1] == '/')
+                                break;
+                    }
+                    dp = &ldp;
+                    d_type = DT_REG;
+                    dp->d_ino = 0;
+                    strcpy(d_name, sname);
+                }
+            } else {
+                uint skip = 0;
+                do {
+                    if (handle->he_dir == NULL) {
+                        printf("NULL dir handle for %x\n", handle->he_handle);
+                        dp = NULL;
+                    } else {
+                        dp = readdir(handle->he_dir);
+                    }
+                    skip = 0;
+                    if (dp != NULL) {
+                        char *end;
+                        strcpy(d_name, dp->d_name);
+#ifdef __MINGW32__
+                        d_type = DT_UNKNOWN;
+#else
+                        d_type = dp->d_type;
+#endif
+
+                        /* Skip .uaem files */
+                        end = d_name + strlen(d_name);
+                        if (((end - d_name) >= 6) &&
+                            (strcmp(end - 5, ".uaem") == 0)) {
+                            skip = 1;
+                        }
+
+                        /* Skip . and .. files */
+                        if (IS_DOT(d_name) || IS_DOT_DOT(d_name)) {
+                            skip = 1;
+                        }
+                    }
+                } while (skip);
+                he_mode |= HM_MODE_NOFOLLOW;
+            }
+            if (dp == NULL) {
+                rc = KM_STATUS_EOF;  // end of directory
+                dircache_publish(handle);
+                break;
+            }
+            strcpy(pathbuf + pathlen, d_name);
+            hmd_type = d_type_to_hm_type(d_type);
+
+            if ((handle->he_type == HM_TYPE_VOLDIR) ||
+                (handle->he_type == HM_TYPE_VOLUME)) {
+                amiga_vol_t *vol;
+                uint64_t    fs_size;
+                uint64_t    fs_used;
+                uint        fs_blksize;
+                const char *path;
+                time_t      utctime = time(NULL);
+                time_t      time_a  = get_localtime(utctime);
+                hmd_type = HM_TYPE_VOLDIR;
+                hm_dirent->hmd_atime = SWAP32(time_a);
+                hm_dirent->hmd_ctime = SWAP32(time_a);
+                hm_dirent->hmd_mtime = SWAP32(time_a);
+                hm_dirent->hmd_mode = SWAP32(S_IFDIR|S_IRUSR|S_IWUSR|S_IXUSR);
+
+                if (handle->he_type == HM_TYPE_VOLUME) {
+                    hmd_type = HM_TYPE_VOLUME;
+                    vol = handle->he_avolume;
+                } else {
+                    hmd_type = HM_TYPE_VOLDIR;
+                    vol = volume_get_by_index(handle->he_entnum);
+                    handle->he_entnum++;
+                }
+                if (vol == NULL)
+                    path = ".";
+                else
+                    path = vol->av_path;
+
+                fs_size = get_fs_size(path, &fs_used, &fs_blksize);
+                size_lo = (uint32_t) fs_used;
+                hm_dirent->hmd_blksize = SWAP32(fs_blksize);
+                hm_dirent->hmd_blks    = SWAP32(size_lo);
+                if (vol == NULL) {
+                    hm_dirent->hmd_ino   = 0;
+                    hm_dirent->hmd_nlink = 1;
+                } else {
+                    hm_dirent->hmd_ino   = vol->av_flags;
+                    hm_dirent->hmd_nlink = vol->av_bootpri;
+                }
+                size_hi = (uint32_t) (fs_size >> 32);
+                size_lo = (uint32_t) fs_size;
+
+                hmd_type = HM_TYPE_VOLUME;
+                amiga_perms = amiga_perms_from_host(0444);  // read-only
+            } else {
+                /* he_avolume is NULL for the Volume Directory */
+                amiga_vol_t *avol = handle->he_avolume;
+                if (avol == NULL) {
+                    fsprintf("BUG: handle=%x he_avolume is NULL\n",
+                             handle->he_handle);
+                    dircache_release(handle);
+                    break;
+                }
+                host_path = make_host_path(avol, handle->he_name);
+                if ((handle->he_mode & HM_MODE_DIR) == 0) {
+                    char *temp_path = host_path;
+                    host_path = merge_host_paths(temp_path, d_name);
+                    free(temp_path);
+                }
+
+                if (lstat(host_path, &st) == 0) {
+                    if (((he_mode & HM_MODE_NOFOLLOW) == 0) &&
+                        (stat(host_path, &st) != 0)) {
+                        /* Just use the result of previous lstat */
+                        fsprintf("stat %s failed\n", host_path);
+                    }
+                    dirent_fill_stat(hm_dirent, &st, host_path, TRUE,
+                                     &size_hi, &size_lo, &hmd_type,
+                                     &amiga_perms);
+                } else {
+                    fsprintf("lstat %s failed\n", host_path);
+                    size_hi = 0;
+                    size_lo = 0;
+                    amiga_perms = FIBF_OTR_READ | FIBF_GRP_READ;
+                }
+            }
+
+            nlen = dirent_finish(hm_dirent, d_name, dp->d_ino, hmd_type,
+                                 size_hi, size_lo, amiga_perms, host_path,
+                                 handle->he_name);
+            if (HANDLE_IS_DIRSTREAM(handle)) {
+                handle->he_entnum++;
+                dircache_append(handle, hm_dirent, sizeof (*hm_dirent) + nlen);
+            }
+            pos += sizeof (*hm_dirent) + nlen;
+            if (host_path != NULL)
+                free(host_path);
+        } else {
+            /* Regular file */
+            if (writebehind_sync(handle) != 0) {
+                rc = errno_to_km_status();
+                break;
+            }
+            if (hm_flag & HM_FLAG_SEEK0) {
+                hm_flag &= ~HM_FLAG_SEEK0;
+                if (handle->he_ra != NULL)
+                    readahead_seek(handle->he_ra, 0);
+                else
+                    (void) lseek64(handle->he_fd, 0, SEEK_SET);
+            }
+
+            if (handle->he_ra != NULL)
+                rc = readahead_read(handle->he_ra, ndata, len);
+            else
+                rc = read(handle->he_fd, ndata, len);
+#ifdef DEBUG_READ
+            fsprintf("read %d bytes from fd=%d %s\n",
+                     rc, handle->he_fd, handle->he_name);
+#endif
+            if (rc <= 0) {
+                if (rc == 0) {
+                    rc = KM_STATUS_EOF;
+                } else {
+                    rc = errno_to_km_status();
+                }
+                break;
+            }
+            pos += rc;
+            rc = 0;
+        }
+    }
+read_done:
+    if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
+        fsprintf("Returning odd rc=%d\n", rc);
+
+    hmr->hm_hdr.km_op = hm->hm_hdr.km_op;
+    hmr->hm_hdr.km_status = rc;
+    hmr->hm_hdr.km_tag = hm->hm_hdr.km_tag;
+    hmr->hm_handle = hm->hm_handle;
+    hmr->hm_unused = 0;
+#ifdef DEBUG_READ_DATA
+    dump_memory(hmr, sizeof (*hmr) + pos, VALUE_UNASSIGNED);
+#endif
+    rc = sm_fread_send(hmr, (uint8_t *) (hmr + 1), pos, hm_flag, status);
+    free(hmr);
+    return (rc);
+}
+
+/*
+ * sm_fwrite_host() writes data at the current position of a file handle,
+ * through its write-behind buffer if it has one.
+ */
+static int
+sm_fwrite_host(handle_ent_t *handle, const void *data, uint len)
+{
+    int rc;
+
+    if (handle->he_wb != NULL)
+        return (writebehind_write(handle->he_wb, data, len));
+    rc = write(handle->he_fd, data, len);
+    if (rc > 0)
+        readahead_invalidate(handle->he_dev, handle->he_ino);
+    return (rc);
+}
+
+/*
+ * sm_fwrite_data() writes the data of a KM_OP_FWRITE request to a file,
+ * first unpacking it if it was sent compressed (HM_FLAG_COMPRESS).
+ *
+ * @param [in] handle  - Open file.
+ * @param [in] data    - Write data, as sent.
+ * @param [in] len     - Length of write data, as sent.
+ * @param [in] hm_flag - Flags from the KM_OP_FWRITE request.
+ *
+ * @return      Number of bytes written, or -1 with errno set on failure.
+ */
+static int
+sm_fwrite_data(handle_ent_t *handle, const uint8_t *data, uint len,
+               uint hm_flag)
+{
+    uint8_t *ubuf;
+    int32_t  ulen;
+    int      rc;
+
+    if ((hm_flag & HM_FLAG_COMPRESS) == 0)
+        return (sm_fwrite_host(handle, data, len));
+
+    ulen = sm_lz_unpacked_len(data, len);
+    if (ulen < 0)
+        goto corrupt;
+    ubuf = malloc(ulen + 1);
+    if (ubuf == NULL) {
+        errno = ENOMEM;
+        return (-1);
+    }
+    if (sm_lz_unpack(data, len, ubuf, ulen) != ulen) {
+        free(ubuf);
+        goto corrupt;
+    }
+    fsprintf("fwrite unpacked %u bytes to %d\n", len, ulen);
+    rc = sm_fwrite_host(handle, ubuf, ulen);
+    free(ubuf);
+    return (rc);
+
+corrupt:
+    fsprintf("fwrite: corrupt compressed data from Amiga\n");
+    errno = EINVAL;
+    return (-1);
+}
+
+static uint
+sm_fwrite(hm_freadwrite_t *hm, uint rxlen, uint *status)
+{
+    uint             rc;
+    int              wrc = -1;
+    uint             hm_length = SWAP32(hm->hm_length);
+    uint             hm_flag   = SWAP16(hm->hm_flag);
+    handle_ent_t    *handle    = handle_get(hm->hm_handle);
+    uint8_t         *ndata     = (uint8_t *)(hm + 1);
+
+    fsprintf("fwrite(%x, l=%x)\n", hm->hm_handle, hm_length);
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+
+    if (handle == NULL) {
+        fsprintf("handle get %x failed\n", hm->hm_handle);
+reply_write_fail:
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+    if ((handle->he_mode & HM_MODE_WRITE) == 0) {
+        fsprintf("%s not opened for write mode: %x\n",
+                 handle->he_name, handle->he_mode);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_write_fail;
+    }
+    if ((handle->he_type == HM_TYPE_DIR) ||
+        (handle->he_type == HM_TYPE_VOLDIR) ||
+        (handle->he_mode & HM_MODE_DIR)) {
+        fsprintf("Can't write to directory\n");
+        /*
+         * XXX: Writing a file's dirent could be used as a method to
+         *      change atime, ctime, mtime, aperms, ouid, ogid, and
+         *      maybe even allow rename.
+         *      Maybe require a field which specifies which other
+         *      fields are to be updated.
+         */
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_write_fail;
+    }
+
+    if (rxlen >= sizeof (hm_freadwrite_t))
+        rxlen -= sizeof (hm_freadwrite_t);
+    else
+        rxlen = 0;
+
+    if (rxlen < hm_length) {
+        /* More data pending */
+        uint8_t *rdata = malloc(hm_length + sizeof (km_msg_hdr_t));
+
+        if (rdata == NULL) {
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+            return (send_msg(hm, sizeof (*hm), status));
+        }
+        memcpy(rdata, ndata, rxlen);
+        rc = recv_msg_cont(hm->hm_hdr.km_tag, rdata, rxlen, hm_length, status);
+        if (rc == RC_SUCCESS) {
+            if (hm_flag & HM_FLAG_SEEK0) {
+                hm_flag &= ~HM_FLAG_SEEK0;
+                if (writebehind_sync(handle) == 0)
+                    (void) lseek64(handle->he_fd, 0, SEEK_SET);
+                else
+                    hm_length = 0;  // Report failed write of buffered data
+            }
+            if (hm_length != 0)
+                wrc = sm_fwrite_data(handle, rdata, hm_length, hm_flag);
+        } else {
+            errno = EIO;
+        }
+        free(rdata);
+    } else {
+        wrc = sm_fwrite_data(handle, ndata, hm_length, hm_flag);
+    }
+    if (wrc < 0) {
+        fsprintf("write rc=%d errno=%d\n", wrc, errno);
+        rc = errno_to_km_status();
+    } else {
+        rc = KM_STATUS_OK;
+    }
+
+    hm->hm_hdr.km_status = rc;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fseek(hm_fseek_t *hm, uint *status)
+{
+    handle_ent_t *handle = handle_get(hm->hm_handle);
+
+    fsprintf("fseek(%x, o=%"PRIx64" from=%d)\n", hm->hm_handle,
+             ((uint64_t) hm->hm_off_hi << 32) | hm->hm_off_lo, hm->hm_seek);
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    if (handle == NULL) {
+        fsprintf("handle get %x failed\n", hm->hm_handle);
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+    if ((handle->he_type == HM_TYPE_VOLDIR) ||
+        (handle->he_mode & HM_MODE_DIR)) {
+        /* Can rewind volume dir or file stat */
+        hm->hm_old_hi = 0;
+        hm->hm_old_lo = SWAP32(handle->he_entnum);
+        handle->he_entnum = 0;  // Can only rewind volume dir pointer
+    } else if (handle->he_type == HM_TYPE_DIR) {
+        /* Can only rewind dir */
+        if (handle->he_dir != NULL)
+            rewinddir(handle->he_dir);
+        dircache_release(handle);
+        dirscan_free(handle);
+        hm->hm_old_hi = 0;
+        hm->hm_old_lo = SWAP32(handle->he_entnum);
+        handle->he_entnum = 0;
+    } else if (handle->he_type == HM_TYPE_FILE) {
+        uint32_t hi = SWAP32(hm->hm_off_hi);
+        uint32_t lo = SWAP32(hm->hm_off_lo);
+        int seek_mode = hm->hm_seek;
+        off64_t oldpos;
+        off64_t offset = ((uint64_t) hi << 32) | lo;
+        off64_t newpos;
+        int whence;
+
+        switch (seek_mode) {
+            default:
+                fsprintf("Unknown seek mode (%d)\n", seek_mode);
+                hm->hm_hdr.km_status = KM_STATUS_INVALID;
+                goto reply_seek;
+            case SEEK_OFFSET_BEGINNING:
+                whence = SEEK_SET;
+                break;
+            case SEEK_OFFSET_CURRENT:
+                whence = SEEK_CUR;
+                break;
+            case SEEK_OFFSET_END:
+                whence = SEEK_END;
+                break;
+        }
+
+        if (writebehind_sync(handle) != 0) {
+            hm->hm_hdr.km_status = errno_to_km_status();
+            goto reply_seek;
+        }
+
+        /* Cached and mapped reads bypass the descriptor offset */
+        if (handle->he_ra != NULL)
+            (void) lseek64(handle->he_fd, handle->he_ra->ra_pos, SEEK_SET);
+        else if (handle->he_map != NULL)
+            (void) lseek64(handle->he_fd, handle->he_mappos, SEEK_SET);
+        oldpos = lseek64(handle->he_fd, 0, SEEK_CUR);
+        newpos = lseek64(handle->he_fd, offset, whence);
+        if ((newpos >= 0) && (handle->he_ra != NULL))
+            readahead_seek(handle->he_ra, newpos);
+        if ((newpos >= 0) && (handle->he_map != NULL))
+            handle->he_mappos = newpos;
+        if (newpos < 0) {
+            /* Seek failed */
+            fsprintf("Seek %x to %jd (%u) failed\n",
+                     hm->hm_handle, (intmax_t)offset, whence);
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        } else {
+            hi = newpos >> 32;
+            lo = (uint32_t) newpos;
+            hm->hm_off_hi = SWAP32(hi);
+            hm->hm_off_lo = SWAP32(lo);
+            hi = oldpos >> 32;
+            lo = (uint32_t) oldpos;
+            hm->hm_old_hi = SWAP32(hi);
+            hm->hm_old_lo = SWAP32(lo);
+        }
+    } else {
+        fsprintf("Can't seek in file type %x\n", handle->he_type);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+    }
+reply_seek:
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fcreate(hm_fopenhandle_t *hm, uint *status)
+{
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    char         *hm_name = (char *)(hm + 1);
+    uint32_t      aperms  = SWAP32(hm->hm_aperms);
+    uint32_t      umode   = host_perms_from_amiga(aperms);
+    uint          hm_type = SWAP16(hm->hm_type);
+    uint          dev     = SWAP16(hm->hm_mode);
+    uint          ftype;
+    char         *host_path = NULL;
+    char         *name = NULL;
+
+    fsprintf("fcreate(%s) type=%x perms=%x umode=%x in %x\n",
+             hm_name, hm_type, hm->hm_mode, umode, hm->hm_handle);
+
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+
+    if ((name = make_amiga_host_path(&phandle, hm_name, &host_path)) == NULL) {
+        fsprintf("fcreate(%s) relative path failed\n", hm_name);
+reply_create_fail:
+        if (name != NULL)
+            free(name);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Can't create the volume directory */
+        fsprintf("Can't create the volume directory\n");
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_create_fail;
+    }
+    free(name);
+    name = NULL;
+
+    fsprintf("host path=%s\n", host_path);
+    switch (hm_type) {
+        case HM_TYPE_FILE:   // Regular file
+            ftype = S_IFREG;
+create_node:
+#ifdef __MINGW32__
+            (void) ftype;
+            (void) dev;
+            printf("mknod() not supported in Windows\n");
+#else
+            if (mknod(host_path, ftype | umode, dev)) {
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_create_fail;
+            }
+#endif
+            break;
+        case HM_TYPE_DIR:    // Directory
+            if (mkdir(host_path, umode)) {
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_create_fail;
+            }
+            break;
+#ifdef ALLOW_CREATE_LINK
+        case HM_TYPE_LINK: {   // Symbolic (soft) link
+            uint  hm_name_len = strlen(hm_name) + 1;
+            char *lname = hm_name + hm_name_len;
+            char *relname;
+            relname = amiga_link_to_host_path(phandle, lname, host_path);
+
+            if (symlink(relname, host_path)) {
+                fsprintf("symlink: %s -> %s failed: %d\n",
+                         host_path, lname, errno);
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_create_fail;
+            }
+            if (relname != NULL)
+                free(relname);
+            break;
+        }
+        case HM_TYPE_HLINK: {  // Hard link
+            uint  hm_name_len = strlen(hm_name) + 1;
+            char *lname = hm_name + hm_name_len;
+            char *relname;
+
+            relname = amiga_link_to_host_path(phandle, lname, host_path);
+            if (link(lname, host_path)) {
+                fsprintf("hard link %s -> %s failed: %d\n",
+                         host_path, lname, errno);
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_create_fail;
+            }
+            if (relname != NULL)
+                free(relname);
+            break;
+        }
+#endif /* ALLOW_CREATE_LINK */
+        case HM_TYPE_BDEV:   // Block device
+            ftype = S_IFBLK;
+            goto create_node;
+        case HM_TYPE_CDEV:   // Block device
+            ftype = S_IFCHR;
+            goto create_node;
+        case HM_TYPE_FIFO:   // FIFO
+            ftype = S_IFIFO;
+            goto create_node;
+#ifndef __MINGW32__
+        case HM_TYPE_SOCKET: // Socket
+            ftype = S_IFSOCK;
+            goto create_node;
+#endif
+        case HM_TYPE_WHTOUT: // Whiteout entry
+        case HM_TYPE_VOLUME: // Disk volume
+        case HM_TYPE_VOLDIR: // Volume directory
+        default:
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            break;
+    }
+
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fdelete(hm_fhandle_t *hm, uint *status)
+{
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    char         *hm_name = (char *)(hm + 1);
+    char         *host_path = NULL;
+    char         *name = NULL;
+    struct stat   st;
+
+    fsprintf("fdelete(%s) in %x\n", hm_name, hm->hm_handle);
+
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+
+    if ((name = make_amiga_host_path(&phandle, hm_name, &host_path)) == NULL) {
+        fsprintf("fdelete(%s) relative path failed\n", hm_name);
+reply_delete_fail:
+        if (host_path != NULL)
+            free(host_path);
+        if (name != NULL)
+            free(name);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Can't delete the volume directory */
+        fsprintf("Can't delete the volume directory\n");
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_delete_fail;
+    }
+
+    if (lstat(host_path, &st) != 0) {
+        fsprintf("fdelete(%s) stat fail errno=%d\n", host_path, errno);
+        goto reply_delete_fail;
+    }
+    switch (st.st_mode & S_IFMT) {
+        case S_IFDIR:
+            /* Use rmdir() */
+            if (volume_get_by_path(host_path, 0) != NULL) {
+                fsprintf("fdelete(%s) can't remove a volume\n", host_path);
+                hm->hm_hdr.km_status = KM_STATUS_PERM;
+                goto reply_delete_fail;
+            }
+            if (rmdir(host_path)) {
+                /* Failed */
+                fsprintf("rmdir(%s) failed: %d\n", host_path, errno);
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_delete_fail;
+            }
+            break;
+        default:
+        case S_IFBLK:   // Block device
+        case S_IFCHR:   // Character device
+        case S_IFIFO:   // FIFO (Pipe)
+        case S_IFREG:   // Regular file
+#ifndef __MINGW32__
+        case S_IFLNK:   // Symlink
+        case S_IFSOCK:  // Socket
+#endif
+            /* Use unlink() */
+            if (unlink(host_path)) {
+                fsprintf("unlink(%s) failed: %d\n", host_path, errno);
+                hm->hm_hdr.km_status = errno_to_km_status();
+                goto reply_delete_fail;
+            }
+            break;
+    }
+    pathcache_invalidate(host_path);
+    free(name);
+    free(host_path);
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_frename(hm_frename_t *hm, uint *status)
+{
+    handle_ent_t *phandle_old  = handle_get(hm->hm_shandle);
+    handle_ent_t *phandle_new  = handle_get(hm->hm_dhandle);
+    char         *name_old     = (char *)(hm + 1);
+    uint          len_old_name = strlen(name_old) + 1;
+    char         *name_new     = name_old + len_old_name;
+    char         *path_old     = NULL;
+    char         *path_new     = NULL;
+    char         *apath_old    = NULL;
+    char         *apath_new    = NULL;
+
+    fsprintf("frename(%s to %s) in %x to %x\n",
+             name_old, name_new, hm->hm_shandle, hm->hm_dhandle);
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+
+    apath_old = make_amiga_host_path(&phandle_old, name_old, &path_old);
+    if (apath_old == NULL) {
+        fsprintf("frename(%s) relative path failed\n", name_old);
+reply_rename_fail:
+        if (apath_old != NULL)
+            free(apath_old);
+        if (apath_new != NULL)
+            free(apath_new);
+        if (path_old != NULL)
+            free(path_old);
+        if (path_new != NULL)
+            free(path_new);
+        hm->hm_shandle = 0;
+        hm->hm_dhandle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle_old == NULL) {
+        /* Can't rename the volume directory */
+        fsprintf("frename(%s) Can't rename the volume directory\n", name_old);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_rename_fail;
+    }
+
+    apath_new = make_amiga_host_path(&phandle_new, name_new, &path_new);
+    if (apath_new == NULL) {
+        fsprintf("frename(%s) relative path failed\n", name_new);
+        goto reply_rename_fail;
+    }
+
+    if (phandle_new == NULL) {
+        /* Can't rename the volume directory */
+        fsprintf("frename(%s) Can't rename to the volume directory\n",
+                 name_new);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_rename_fail;
+    }
+
+    if (volume_get_by_path(path_old, 0) != NULL) {
+        fsprintf("frename(%s) can't rename a volume\n", path_old);
+        hm->hm_hdr.km_status = KM_STATUS_PERM;
+        goto reply_rename_fail;
+    }
+    if (volume_get_by_path(path_new, 0) != NULL) {
+        fsprintf("frename(%s) can't rename to a volume\n", path_new);
+        hm->hm_hdr.km_status = KM_STATUS_PERM;
+        goto reply_rename_fail;
+    }
+    if (rename(path_old, path_new)) {
+        fsprintf("rename %s to %s failed\n", path_old, path_new);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_rename_fail;
+    }
+    pathcache_invalidate(path_old);
+    pathcache_invalidate(path_new);
+    free(path_old);
+    free(path_new);
+    free(apath_old);
+    free(apath_new);
+
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fpath(hm_fhandle_t *hm, uint *status)
+{
+    /* Resolve handle to Amiga-specific path */
+    hm_fhandle_t *hmr;
+    handle_ent_t *handle = handle_get(hm->hm_handle);
+    char         *pathbuf;
+    char          pathlen;
+    uint          rc;
+
+    fsprintf("fpath(%x)\n", hm->hm_handle);
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    if (handle == NULL) {
+        /* Volume directory */
+        pathbuf = strdup("::");
+    } else {
+        amiga_vol_t *vol = NULL;
+        handle_ent_t *volhandle = handle->he_volume;
+
+        if (volhandle != NULL)
+            vol = volume_get_by_handle(volhandle);
+
+        if (vol != NULL) {
+            pathbuf = merge_amiga_paths(vol->av_volume, handle->he_name);
+        } else {
+            pathbuf = strdup(handle->he_name);
+        }
+    }
+
+    fsprintf("pathbuf=%s\n", pathbuf);
+    pathlen = strlen(pathbuf) + 1;
+    hmr = malloc(sizeof (*hmr) + pathlen + 1);
+    memcpy(hmr, hm, sizeof (*hmr));
+    strcpy((char *) (hmr + 1), pathbuf);
+    ((char *) hmr)[sizeof (*hmr) + pathlen] = '\0';  // unaligned data end init
+
+    rc = send_msg(hmr, sizeof (*hmr) + pathlen, status);
+    free(pathbuf);
+    free(hmr);
+    return (rc);
+}
+
+
+static uint
+sm_fsetdate(hm_fsetdate_t *hm, uint *status)
+{
+    /* Resolve handle to Amiga-specific path */
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    char         *name    = (char *)(hm + 1);
+    char         *path    = NULL;
+    char         *apath;
+    uint8_t       which   = hm->hm_which;
+    uint32_t      sec     = SWAP32(hm->hm_time);
+    uint32_t      nsec    = SWAP32(hm->hm_time_ns);
+    uint32_t      utcsec  = get_utctime(sec);
+    struct stat   statbuf;
+
+    fsprintf("fsetdate(%s %u %u.%u)\n", name, which, utcsec, nsec);
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    writebehind_flush_all();  // Later writes would change the new mtime
+
+    if ((apath = make_amiga_host_path(&phandle, name, &path)) == NULL) {
+        fsprintf("fsetdate(%s) relative path failed\n", name);
+reply_setdate_fail:
+        if (apath != NULL)
+            free(apath);
+        if (path != NULL)
+            free(path);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Can't set perms on the volume directory */
+        fsprintf("fsetdate(%s) can't set dateer of the volume directory\n",
+                 name);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_setdate_fail;
+    }
+
+    if (volume_get_by_path(path, 0) != NULL) {
+        fsprintf("fsetdate(%s) can't set owner of a volume\n", path);
+        hm->hm_hdr.km_status = KM_STATUS_PERM;
+        goto reply_setdate_fail;
+    }
+
+    if (lstat(path, &statbuf)) {
+        fsprintf("lstat fail: %d\n", errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setdate_fail;
+    }
+
+#ifdef __MINGW32__
+    struct _utimbuf times;
+    times.actime  = statbuf.st_atime;  // last access time
+    times.modtime = statbuf.st_mtime;  // last modification time
+
+    switch (which) {
+        case 0: // Set the modify date/time
+            times.modtime = (((uint64_t) utcsec) << 32) | nsec;
+            break;
+        case 1: // Get the modify date/time
+            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_ctime >> 32));
+            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_ctime);
+            goto reply_setdate_good;
+        case 2: // Set the change date/time
+            /* Not sure how to set this one */
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+        case 3: // Get the change date/time
+            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_ctime >> 32));
+            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_ctime);
+            goto reply_setdate_good;
+        case 4: // Set the access date/time
+            times.actime = (((uint64_t) utcsec) << 32) | nsec;
+            break;
+        case 5: // Get the access date/time
+            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_atime >> 32));
+            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_atime);
+            goto reply_setdate_good;
+        default:
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+    }
+
+    if (_utime(path, &times)) {
+        fsprintf("utimesat fail: %d\n", errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setdate_fail;
+    }
+#elif defined (OSX)
+    /* MacOS */
+    struct timeval times[2];
+    timespec_to_timeval(&times[0], &statbuf.st_atimespec);  // last access time
+    timespec_to_timeval(&times[1], &statbuf.st_ctimespec);  // last modify time
+
+    switch (which) {
+        case 0: // Set the modify date/time
+            times[1].tv_sec  = utcsec;
+            times[1].tv_usec = nsec / 1000;
+            break;
+        case 1: // Get the modify date/time
+            hm->hm_time    = SWAP32(statbuf.st_ctimespec.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_ctimespec.tv_nsec);
+            goto reply_setdate_good;
+        case 2: // Set the change date/time
+            /* Not sure how to set this one */
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+        case 3: // Get the change date/time
+            hm->hm_time    = SWAP32(statbuf.st_ctimespec.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_ctimespec.tv_nsec);
+            goto reply_setdate_good;
+        case 4: // Set the access date/time
+            times[0].tv_sec  = utcsec;
+            times[0].tv_usec = nsec / 1000;
+            break;
+        case 5: // Get the access date/time
+            hm->hm_time    = SWAP32(statbuf.st_atimespec.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_atimespec.tv_nsec);
+            goto reply_setdate_good;
+        default:
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+    }
+    if (utimes(path, times)) {
+        fsprintf("utimes fail: %d\n", errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setdate_fail;
+    }
+#else
+    /* Linux */
+    struct timespec times[2];
+    times[0] = statbuf.st_atim;  // last access time
+    times[1] = statbuf.st_ctim;  // last modification time
+
+    switch (which) {
+        case 0: // Set the modify date/time
+            times[1].tv_sec  = utcsec;
+            times[1].tv_nsec = nsec;
+            break;
+        case 1: // Get the modify date/time
+            hm->hm_time    = SWAP32(statbuf.st_ctim.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_ctim.tv_nsec);
+            goto reply_setdate_good;
+        case 2: // Set the change date/time
+            /* Not sure how to set this one */
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+        case 3: // Get the change date/time
+            hm->hm_time    = SWAP32(statbuf.st_ctim.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_ctim.tv_nsec);
+            goto reply_setdate_good;
+        case 4: // Set the access date/time
+            times[0].tv_sec  = utcsec;
+            times[0].tv_nsec = nsec;
+            break;
+        case 5: // Get the access date/time
+            hm->hm_time    = SWAP32(statbuf.st_atim.tv_sec);
+            hm->hm_time_ns = SWAP32(statbuf.st_atim.tv_nsec);
+            goto reply_setdate_good;
+        default:
+            hm->hm_hdr.km_status = KM_STATUS_INVALID;
+            goto reply_setdate_fail;
+    }
+    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW)) {
+        fsprintf("utimesat fail: %d\n", errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setdate_fail;
+    }
+#endif
+
+reply_setdate_good:
+    free(apath);
+    free(path);
+
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fsetown(hm_fsetown_t *hm, uint *status)
+{
+    /* Resolve handle to Amiga-specific path */
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    char         *name    = (char *)(hm + 1);
+    char         *path    = NULL;
+    char         *apath;
+    uint32_t      oid = SWAP32(hm->hm_oid);
+    uint32_t      gid = SWAP32(hm->hm_gid);
+
+    fsprintf("fsetown(%s %d %d)\n", name, oid, gid);
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+
+    if ((apath = make_amiga_host_path(&phandle, name, &path)) == NULL) {
+        fsprintf("fsetown(%s) relative path failed\n", name);
+reply_setown_fail:
+        if (apath != NULL)
+            free(apath);
+        if (path != NULL)
+            free(path);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Can't set perms on the volume directory */
+        fsprintf("fsetown(%s) can't set owner of the volume directory\n",
+                 name);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_setown_fail;
+    }
+
+    if (volume_get_by_path(path, 0) != NULL) {
+        fsprintf("fsetown(%s) can't set owner of a volume\n", path);
+        hm->hm_hdr.km_status = KM_STATUS_PERM;
+        goto reply_setown_fail;
+    }
+
+#ifdef __MINGW32__
+    hm->hm_hdr.km_status = KM_STATUS_PERM;
+    goto reply_setown_fail;
+#else
+    if (chown(path, oid, gid)) {
+        fsprintf("chown fail: %d\n", errno);
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setown_fail;
+    }
+#endif
+
+    free(apath);
+    free(path);
+
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+static uint
+sm_fsetprotect(hm_fopenhandle_t *hm, uint *status)
+{
+    /* Resolve handle to Amiga-specific path */
+    handle_ent_t *phandle = handle_get(hm->hm_handle);
+    char         *name    = (char *)(hm + 1);
+    char         *path    = NULL;
+    char         *apath;
+    uint32_t      aperms = SWAP32(hm->hm_aperms);
+    uint          uperms;
+
+    fsprintf("fsetprotect(%s %x)\n", name, aperms);
+    hm->hm_hdr.km_op |= KM_OP_REPLY;
+
+    if ((apath = make_amiga_host_path(&phandle, name, &path)) == NULL) {
+        fsprintf("fsetprotect(%s) relative path failed\n", name);
+reply_setprotect_fail:
+        if (path != NULL)
+            free(path);
+        if (apath != NULL)
+            free(apath);
+        hm->hm_handle = 0;
+        if (hm->hm_hdr.km_status == KM_STATUS_OK)
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+        return (send_msg(hm, sizeof (*hm), status));
+    }
+
+    if (phandle == NULL) {
+        /* Can't set perms on the volume directory */
+        fsprintf("fsetprotect(%s) can't set perms on the volume directory\n",
+                 name);
+        hm->hm_hdr.km_status = KM_STATUS_INVALID;
+        goto reply_setprotect_fail;
+    }
+
+    if (volume_get_by_path(path, 0) != NULL) {
+        fsprintf("fsetprotect(%s) can't set perms on a volume\n", path);
+        hm->hm_hdr.km_status = KM_STATUS_PERM;
+        goto reply_setprotect_fail;
+    }
+    uperms = host_perms_from_amiga(aperms);
+    fsprintf("uperms=%x %o\n", uperms, uperms);
+
+    if (chmod(path, uperms)) {
+        fsprintf("chmod fail\n");
+        hm->hm_hdr.km_status = errno_to_km_status();
+        goto reply_setprotect_fail;
+    }
+
+    free(apath);
+    free(path);
+
+    hm->hm_hdr.km_status = KM_STATUS_OK;
+    return (send_msg(hm, sizeof (*hm), status));
+}
+
+/*
+ * Message mode metrics
+ *
+ * Every Amiga request is counted by operation, with a histogram of the
+ * time taken to handle it and send its reply. Message mode samples the
+ * Kicksmash message buffer use of each board (KS_CMD_MSG_INFO) every
+ * METRICS_SAMPLE_MSEC, and the serial threads count the bytes moved to
+ * and from each board. With --metrics, a thread exports all of these in
+ * Prometheus text format every METRICS_EXPORT_MSEC by replacing a file
+ * (suitable for the node exporter textfile collector). If the path is
+ * given as "unix:<path>", each connection to that Unix socket is instead
+ * answered with the current metrics.
+ */
+#define METRICS_SAMPLE_MSEC 1000
+#define METRICS_EXPORT_MSEC 5000
+#define METRICS_OPS         0x80  // Ops without KM_OP_REPLY
+#define METRICS_BUCKETS     12
+
+static const uint metrics_bucket_usec[METRICS_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+    1000000
+};
+
+typedef struct {
+    uint64_t mo_count;                     // Requests handled
+    uint64_t mo_fail;                      // Replies which failed to send
+    uint64_t mo_bytes;                     // Request bytes received
+    uint64_t mo_usec;                      // Total handling time
+    uint64_t mo_bucket[METRICS_BUCKETS];   // Requests within bucket time
+} metrics_op_t;
+
+static metrics_op_t    metrics_op[METRICS_OPS];  // Indexed by KM_OP_*
+static char           *metrics_path = NULL;      // --metrics destination
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t  metrics_once = PTHREAD_ONCE_INIT;
+
+/*
+ * metrics_op_name() returns the metrics label of a KM_OP_* operation.
+ * buf must have room for an unknown operation's name.
+ */
+static const char *
+metrics_op_name(uint op, char *buf)
+{
+    switch (op) {
+        case KM_OP_NULL:      return ("null");
+        case KM_OP_NOP:       return ("nop");
+        case KM_OP_ID:        return ("id");
+        case KM_OP_LOOPBACK:  return ("loopback");
+        case KM_OP_FOPEN:     return ("fopen");
+        case KM_OP_FCLOSE:    return ("fclose");
+        case KM_OP_FREAD:     return ("fread");
+        case KM_OP_FWRITE:    return ("fwrite");
+        case KM_OP_FSEEK:     return ("fseek");
+        case KM_OP_FCREATE:   return ("fcreate");
+        case KM_OP_FDELETE:   return ("fdelete");
+        case KM_OP_FRENAME:   return ("frename");
+        case KM_OP_FPATH:     return ("fpath");
+        case KM_OP_FSETPERMS: return ("fsetperms");
+        case KM_OP_FSETOWN:   return ("fsetown");
+        case KM_OP_FSETDATE:  return ("fsetdate");
+        case KM_OP_BATCH:     return ("batch");
+        default:
+            sprintf(buf, "op_%02x", op);
+            return (buf);
+    }
+}
+
+/*
+ * metrics_op_done() records a request which has been handled.
+ *
+ * @param [in]  op   - KM_OP_* of the request.
+ * @param [in]  len  - Length of the request message.
+ * @param [in]  usec - Time taken to handle the request.
+ * @param [in]  rc   - Result of sending the reply (0 = success).
+ */
+static void
+metrics_op_done(uint op, uint len, uint64_t usec, uint rc)
+{
+    metrics_op_t *mo;
+    uint          cur;
+
+    if ((metrics_path == NULL) || (op >= METRICS_OPS))
+        return;
+    mo = &metrics_op[op];
+    pthread_mutex_lock(&metrics_lock);
+    mo->mo_count++;
+    mo->mo_bytes += len;
+    mo->mo_usec += usec;
+    if (rc != 0)
+        mo->mo_fail++;
+    for (cur = 0; cur < METRICS_BUCKETS; cur++)
+        if (usec <= metrics_bucket_usec[cur])
+            mo->mo_bucket[cur]++;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/*
+ * metrics_sample() records the Kicksmash message buffer use of the
+ * current board.
+ */
+static void
+metrics_sample(void)
+{
+    smash_msg_info_t mi;
+    uint             status;
 
-                hmd_type = HM_TYPE_VOLUME;
-                amiga_perms = amiga_perms_from_host(0444);  // read-only
-            } else {
-                /* he_avolume is NULL for the Volume Directory */
-                amiga_vol_t *avol = handle->he_avolume;
-                if (avol == NULL) {
-                    fsprintf("BUG: handle=%x he_avolume is NULL\n",
-                             handle->he_handle);
-                    break;
-                }
-                host_path = make_host_path(avol, handle->he_name);
-                if ((handle->he_mode & HM_MODE_DIR) == 0) {
-                    char *temp_path = host_path;
-                    host_path = merge_host_paths(temp_path, d_name);
-                    free(temp_path);
-                }
+    if ((send_ks_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi),
+                     &status, NULL, 0) != 0) || (status != KS_STATUS_OK))
+        return;
+    pthread_mutex_lock(&metrics_lock);
+    board_cur->b_msg_info = mi;
+    board_cur->b_msg_info_valid = TRUE;
+    pthread_mutex_unlock(&metrics_lock);
+}
 
-                if (lstat(host_path, &st) == 0) {
-                    uint32_t time_a;
-                    uint32_t time_c;
-                    uint32_t time_m;
-                    char *host_path_uaem;
+/*
+ * metrics_write() writes all metrics in Prometheus text format.
+ */
+static void
+metrics_write(FILE *fp)
+{
+    board_t    *board;
+    const char *name;
+    char        buf[8];
+    uint        op;
+    uint        cur;
+
+    pthread_mutex_lock(&metrics_lock);
+    fprintf(fp, "# HELP hostsmash_requests_total "
+                "Amiga requests handled.\n"
+                "# TYPE hostsmash_requests_total counter\n");
+    for (op = 0; op < METRICS_OPS; op++) {
+        if (metrics_op[op].mo_count == 0)
+            continue;
+        fprintf(fp, "hostsmash_requests_total{op=\"%s\"} %" PRIu64 "\n",
+                metrics_op_name(op, buf), metrics_op[op].mo_count);
+    }
 
-                    if (((he_mode & HM_MODE_NOFOLLOW) == 0) &&
-                        (stat(host_path, &st) != 0)) {
-                        /* Just use the result of previous lstat */
-                        fsprintf("stat %s failed\n", host_path);
-                    }
+    fprintf(fp, "# HELP hostsmash_request_failures_total "
+                "Amiga requests whose reply could not be sent.\n"
+                "# TYPE hostsmash_request_failures_total counter\n");
+    for (op = 0; op < METRICS_OPS; op++) {
+        if (metrics_op[op].mo_count == 0)
+            continue;
+        fprintf(fp, "hostsmash_request_failures_total{op=\"%s\"} "
+                "%" PRIu64 "\n", metrics_op_name(op, buf),
+                metrics_op[op].mo_fail);
+    }
 
-                    /* UAE support: check for .uaem file */
-                    host_path_uaem = malloc(strlen(host_path) + 6);
-                    if (host_path_uaem != NULL) {
-                        FILE *fp;
-                        strcpy(host_path_uaem, host_path);
-                        strcat(host_path_uaem, ".uaem");
-                        if ((fp = fopen(host_path_uaem, "r")) != NULL) {
-                            char f_perms[16];
-                            char f_date[12];
-                            char f_time[12];
-                            if (fscanf(fp, "%s %s %s",
-                                       f_perms, f_date, f_time) == 3) {
-                                fsprintf("%s UAEM perms=%s\n",
-                                         host_path_uaem, f_perms);
-                                amiga_perms = amiga_perms_from_str(f_perms);
-                                if (amiga_perms != 0xffffffff) {
-                                    st.st_mode = (st.st_mode & S_IFMT) |
-                                             host_perms_from_amiga(amiga_perms);
-                                }
-                            }
-                            fclose(fp);
-                        }
-                        free(host_path_uaem);
-                    }
+    fprintf(fp, "# HELP hostsmash_request_bytes_total "
+                "Bytes of Amiga request messages.\n"
+                "# TYPE hostsmash_request_bytes_total counter\n");
+    for (op = 0; op < METRICS_OPS; op++) {
+        if (metrics_op[op].mo_count == 0)
+            continue;
+        fprintf(fp, "hostsmash_request_bytes_total{op=\"%s\"} "
+                "%" PRIu64 "\n", metrics_op_name(op, buf),
+                metrics_op[op].mo_bytes);
+    }
 
-                    time_a = get_localtime(st.st_atime);
-                    time_c = get_localtime(st.st_ctime);
-                    time_m = get_localtime(st.st_mtime);
-                    hm_dirent->hmd_atime = SWAP32(time_a);
-                    hm_dirent->hmd_ctime = SWAP32(time_c);
-                    hm_dirent->hmd_mtime = SWAP32(time_m);
-#ifdef __MINGW32__
-                    uint blksize = 1 << 20;
-                    hm_dirent->hmd_blksize = SWAP32(blksize);
-                    hm_dirent->hmd_blks = SWAP32(st.st_size / blksize);
-#else
-                    hm_dirent->hmd_blksize = SWAP32(st.st_blksize);
-                    hm_dirent->hmd_blks = SWAP32(st.st_blocks);
-#endif
-                    hm_dirent->hmd_ouid = SWAP32(st.st_uid);
-                    hm_dirent->hmd_ogid = SWAP32(st.st_gid);
-                    hm_dirent->hmd_mode = SWAP32(st.st_mode);
+    fprintf(fp, "# HELP hostsmash_request_seconds "
+                "Time to handle an Amiga request and send its reply.\n"
+                "# TYPE hostsmash_request_seconds histogram\n");
+    for (op = 0; op < METRICS_OPS; op++) {
+        metrics_op_t *mo = &metrics_op[op];
 
-                    size_hi = ((uint64_t) st.st_size) >> 32;
-                    size_lo = (uint32_t) st.st_size;
-                    hmd_type = st_mode_to_hm_type(st.st_mode);
-                    amiga_perms = amiga_perms_from_host(st.st_mode);
-                } else {
-                    fsprintf("lstat %s failed\n", host_path);
-                    size_hi = 0;
-                    size_lo = 0;
-                    amiga_perms = FIBF_OTR_READ | FIBF_GRP_READ;
-                }
-            }
+        if (mo->mo_count == 0)
+            continue;
+        name = metrics_op_name(op, buf);
+        for (cur = 0; cur < METRICS_BUCKETS; cur++) {
+            fprintf(fp, "hostsmash_request_seconds_bucket"
+                    "{op=\"%s\",le=\"%g\"} %" PRIu64 "\n", name,
+                    metrics_bucket_usec[cur] / 1e6, mo->mo_bucket[cur]);
+        }
+        fprintf(fp, "hostsmash_request_seconds_bucket"
+                "{op=\"%s\",le=\"+Inf\"} %" PRIu64 "\n"
+                "hostsmash_request_seconds_sum{op=\"%s\"} %.6f\n"
+                "hostsmash_request_seconds_count{op=\"%s\"} %" PRIu64 "\n",
+                name, mo->mo_count, name, mo->mo_usec / 1e6,
+                name, mo->mo_count);
+    }
+
+    fprintf(fp, "# HELP hostsmash_serial_bytes_total "
+                "Bytes moved over the Kicksmash serial link.\n"
+                "# TYPE hostsmash_serial_bytes_total counter\n");
+    for (board = board_head; board != NULL; board = board->b_next) {
+        fprintf(fp, "hostsmash_serial_bytes_total{board=\"%u\",dir=\"in\"} "
+                "%" PRIu64 "\n", board->b_unit, board->b_serial_rx);
+        fprintf(fp, "hostsmash_serial_bytes_total{board=\"%u\",dir=\"out\"} "
+                "%" PRIu64 "\n", board->b_unit, board->b_serial_tx);
+    }
+
+    fprintf(fp, "# HELP hostsmash_msg_buffer_bytes "
+                "Kicksmash message buffer use when last sampled.\n"
+                "# TYPE hostsmash_msg_buffer_bytes gauge\n");
+    for (board = board_head; board != NULL; board = board->b_next) {
+        smash_msg_info_t *mi = &board->b_msg_info;
+        const char       *fmt = "hostsmash_msg_buffer_bytes"
+                                "{board=\"%u\",buf=\"%s\",state=\"%s\"} %u\n";
+
+        if (!board->b_msg_info_valid)
+            continue;
+        fprintf(fp, fmt, board->b_unit, "atou", "inuse",
+                SWAP16(mi->smi_atou_inuse));
+        fprintf(fp, fmt, board->b_unit, "atou", "avail",
+                SWAP16(mi->smi_atou_avail));
+        fprintf(fp, fmt, board->b_unit, "utoa", "inuse",
+                SWAP16(mi->smi_utoa_inuse));
+        fprintf(fp, fmt, board->b_unit, "utoa", "avail",
+                SWAP16(mi->smi_utoa_avail));
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
 
-            hm_dirent->hmd_aperms  = SWAP32(amiga_perms);
-            hm_dirent->hmd_type    = SWAP16(hmd_type);
-            hm_dirent->hmd_ino     = SWAP32(dp->d_ino);
-            hm_dirent->hmd_size_hi = SWAP32(size_hi);
-            hm_dirent->hmd_size_lo = SWAP32(size_lo);
-            hm_dirent->hmd_rsvd[0] = 0;
-            hm_dirent->hmd_rsvd[1] = 0;
-
-            nptr = (char *) (hm_dirent + 1);
-            nlen = strlen(d_name) + 1;  // Include NIL
-            memcpy(nptr, d_name, nlen);
-            if (hmd_type == HM_TYPE_LINK) {
-                char  lbuf[PATH_MAX];
-                char *path;
-                int   llen;
-                llen = readlink(host_path, lbuf, sizeof (lbuf) - 1);
-                if (llen == -1) {
-                    fsprintf("readlink %s failed\n", host_path);
-                    llen = 0;
-                }
-                lbuf[llen] = '\0';
-                path = host_to_amiga_path(host_path, handle->he_name, lbuf);
+/*
+ * metrics_export_file() replaces the metrics file with current metrics.
+ * A temporary file is renamed over it so readers never see a partial
+ * file.
+ */
+static void
+metrics_export_file(void)
+{
+    char  tmp[PATH_MAX];
+    FILE *fp;
 
-                /* Fill comment with link information */
-                llen = strlen(path) + 1;
-                memcpy(nptr + nlen, path, llen);
-                free(path);
+    snprintf(tmp, sizeof (tmp), "%s.tmp", metrics_path);
+    fp = fopen(tmp, "w");
+    if (fp == NULL) {
+        warn("Failed to create %s", tmp);
+        return;
+    }
+    metrics_write(fp);
+    if (fclose(fp) != 0) {
+        warn("Failed to write %s", tmp);
+        return;
+    }
+    if (rename(tmp, metrics_path) != 0)
+        warn("Failed to rename %s to %s", tmp, metrics_path);
+}
 
-                nlen += llen;
-            } else {
-                nptr[nlen++] = '\0';            // Comment NIL
-            }
-            if (nlen & 1)
-                nptr[nlen++] = '\0';            // Round up
-#ifdef DEBUG_READ
-            fsprintf("dirent %u %s\n", nlen, nptr);
+#ifdef HAVE_UNIX_SOCKET
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0  // SO_NOSIGPIPE is set on the socket instead
 #endif
-            hm_dirent->hmd_elen = SWAP16(nlen);
-            pos += sizeof (*hm_dirent) + nlen;
-            if (host_path != NULL)
-                free(host_path);
-        } else {
-            /* Regular file */
-            if (hm_flag & HM_FLAG_SEEK0) {
-                hm_flag &= ~HM_FLAG_SEEK0;
-                (void) lseek64(handle->he_fd, 0, SEEK_SET);
-            }
+#define METRICS_SEND_MSEC 2000  // Time allowed for a client to read
 
-            rc = read(handle->he_fd, ndata, len);
-#ifdef DEBUG_READ
-            fsprintf("read %d bytes from fd=%d %s\n",
-                     rc, handle->he_fd, handle->he_name);
+/*
+ * metrics_send() sends formatted metrics to a client of the metrics
+ * socket. A client which stops reading is given up on after
+ * METRICS_SEND_MSEC, and one which disconnects does not raise SIGPIPE.
+ */
+static void
+metrics_send(int cfd, const char *buf, size_t len)
+{
+    struct timeval tv;
+    ssize_t        count;
+
+    tv.tv_sec  = METRICS_SEND_MSEC / 1000;
+    tv.tv_usec = (METRICS_SEND_MSEC % 1000) * 1000;
+    (void) setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+#ifdef SO_NOSIGPIPE
+    {
+        int on = 1;
+        (void) setsockopt(cfd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof (on));
+    }
 #endif
-            if (rc <= 0) {
-                if (rc == 0) {
-                    rc = KM_STATUS_EOF;
-                } else {
-                    rc = errno_to_km_status();
-                }
-                break;
-            }
-            pos += rc;
-            rc = 0;
+    while (len > 0) {
+        count = send(cfd, buf, len, MSG_NOSIGNAL);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;  // EPIPE, timeout, or other client failure
         }
+        buf += count;
+        len -= count;
     }
-    if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
-        fsprintf("Returning odd rc=%d\n", rc);
+}
 
-    hmr->hm_hdr.km_op = hm->hm_hdr.km_op;
-    hmr->hm_hdr.km_status = rc;
-    hmr->hm_hdr.km_tag = hm->hm_hdr.km_tag;
-    hmr->hm_handle = hm->hm_handle;
-    hmr->hm_length = SWAP32(pos);
-    hmr->hm_flag = 0;
-    hmr->hm_unused = 0;
-#ifdef DEBUG_READ_DATA
-    dump_memory(hmr, sizeof (*hmr) + pos, VALUE_UNASSIGNED);
+/*
+ * metrics_serve_socket() answers each connection to the metrics Unix
+ * socket with the current metrics. The metrics are formatted in memory,
+ * so metrics_lock is not held while a client reads them. It does not
+ * return.
+ */
+static void
+metrics_serve_socket(const char *path)
+{
+    struct sockaddr_un addr;
+    int                sfd;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof (addr.sun_path))
+        errx(EXIT_FAILURE, "Metrics socket path too long: %s", path);
+    strcpy(addr.sun_path, path);
+
+    sfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sfd < 0)
+        err(EXIT_FAILURE, "Failed to create metrics socket");
+    (void) unlink(path);
+    if ((bind(sfd, (struct sockaddr *) &addr, sizeof (addr)) != 0) ||
+        (listen(sfd, 4) != 0)) {
+        err(EXIT_FAILURE, "Failed to listen on %s", path);
+    }
+    while (1) {
+        FILE  *fp;
+        char  *buf = NULL;
+        size_t len = 0;
+        int    cfd = accept(sfd, NULL, NULL);
+
+        if (cfd < 0) {
+            if (errno != EINTR)
+                time_delay_msec(100);
+            continue;
+        }
+        fp = open_memstream(&buf, &len);
+        if (fp != NULL) {
+            metrics_write(fp);
+            if (fclose(fp) == 0)
+                metrics_send(cfd, buf, len);
+            free(buf);
+        }
+        close(cfd);
+    }
+}
 #endif
-    rc = send_msg(hmr, sizeof (*hmr) + pos, status);
-    free(hmr);
-    return (rc);
+
+/*
+ * th_metrics() is a thread which exports metrics.
+ */
+static void *
+th_metrics(void *arg)
+{
+#ifdef HAVE_UNIX_SOCKET
+    if (strncmp(metrics_path, "unix:", 5) == 0)
+        metrics_serve_socket(metrics_path + 5);
+#endif
+    while (1) {
+        metrics_export_file();
+        time_delay_msec(METRICS_EXPORT_MSEC);
+    }
+    return (NULL);
 }
 
-static uint
-sm_fwrite(hm_freadwrite_t *hm, uint rxlen, uint *status)
+static void
+metrics_start(void)
 {
-    uint             rc;
-    uint             hm_length = SWAP32(hm->hm_length);
-    uint             hm_flag   = SWAP16(hm->hm_flag);
-    handle_ent_t    *handle    = handle_get(hm->hm_handle);
-    uint8_t         *ndata     = (uint8_t *)(hm + 1);
+    pthread_attr_t thread_attr;
+    pthread_t      thread_id;
 
-    fsprintf("fwrite(%x, l=%x)\n", hm->hm_handle, hm_length);
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread_id, &thread_attr, th_metrics, NULL))
+        err(EXIT_FAILURE, "failed to create metrics thread");
+}
 
-    if (handle == NULL) {
-        fsprintf("handle get %x failed\n", hm->hm_handle);
-reply_write_fail:
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
-    if ((handle->he_mode & HM_MODE_WRITE) == 0) {
-        fsprintf("%s not opened for write mode: %x\n",
-                 handle->he_name, handle->he_mode);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_write_fail;
-    }
-    if ((handle->he_type == HM_TYPE_DIR) ||
-        (handle->he_type == HM_TYPE_VOLDIR) ||
-        (handle->he_mode & HM_MODE_DIR)) {
-        fsprintf("Can't write to directory\n");
-        /*
-         * XXX: Writing a file's dirent could be used as a method to
-         *      change atime, ctime, mtime, aperms, ouid, ogid, and
-         *      maybe even allow rename.
-         *      Maybe require a field which specifies which other
-         *      fields are to be updated.
-         */
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_write_fail;
+static uint sm_batch(hm_batch_t *hm, uint rxlen, uint *status);
+
+/*
+ * process_msg_op() runs the handler for a single request message. The
+ * handler sends its own reply.
+ */
+static uint
+process_msg_op(uint8_t *rxdata, uint rxlen, uint *status)
+{
+    km_msg_hdr_t *km = (km_msg_hdr_t *) rxdata;
+    uint          op = km->km_op;  // Reply is built in place
+    uint64_t      start = bench_usec();
+    uint          held = handle_held_count;
+    uint          rc;
+
+    switch (km->km_op) {
+        case KM_OP_NULL:
+            rc = sm_null(km, status);
+            break;
+        case KM_OP_LOOPBACK:
+            rc = sm_loopback(km, rxdata, rxlen, status);
+            break;
+        case KM_OP_ID:
+            rc = sm_id(km, status);
+            break;
+        case KM_OP_FOPEN:
+            rc = sm_fopen((hm_fopenhandle_t *)rxdata, status);
+            break;
+        case KM_OP_FCLOSE:
+            rc = sm_fclose((hm_fopenhandle_t *)rxdata, status);
+            break;
+        case KM_OP_FREAD:
+            rc = sm_fread((hm_freadwrite_t *)rxdata, status);
+            break;
+        case KM_OP_FWRITE:
+            rc = sm_fwrite((hm_freadwrite_t *)rxdata, rxlen, status);
+            break;
+        case KM_OP_FSEEK:
+            rc = sm_fseek((hm_fseek_t *)rxdata, status);
+            break;
+        case KM_OP_FCREATE:
+            rc = sm_fcreate((hm_fopenhandle_t *)rxdata, status);
+            break;
+        case KM_OP_FDELETE:
+            rc = sm_fdelete((hm_fhandle_t *)rxdata, status);
+            break;
+        case KM_OP_FRENAME:
+            rc = sm_frename((hm_frename_t *)rxdata, status);
+            break;
+        case KM_OP_FPATH:
+            rc = sm_fpath((hm_fhandle_t *)rxdata, status);
+            break;
+        case KM_OP_FSETDATE:
+            rc = sm_fsetdate((hm_fsetdate_t *)rxdata, status);
+            break;
+        case KM_OP_FSETOWN:
+            rc = sm_fsetown((hm_fsetown_t *)rxdata, status);
+            break;
+        case KM_OP_FSETPERMS:
+            rc = sm_fsetprotect((hm_fopenhandle_t *)rxdata, status);
+            break;
+        case KM_OP_BATCH:
+            rc = sm_batch((hm_batch_t *)rxdata, rxlen, status);
+            break;
+        default:
+            rc = sm_unknown(km, status);
+            break;
     }
+    metrics_op_done(op, rxlen, bench_usec() - start, rc ? rc : *status);
+    handle_release(held);
 
-    if (rxlen >= sizeof (hm_freadwrite_t))
-        rxlen -= sizeof (hm_freadwrite_t);
-    else
-        rxlen = 0;
+    return (rc);
+}
 
-    if (rxlen < hm_length) {
-        /* More data pending */
-        uint8_t *rdata = malloc(hm_length + sizeof (km_msg_hdr_t));
-        uint8_t  rxdata[4096];
-        uint     rdatapos = rxlen;
-        uint     timeout = 0;
+/*
+ * sm_batch() executes the requests of a KM_OP_BATCH message in order,
+ * then sends their replies together as one message. See hm_batch_t.
+ */
+static uint
+sm_batch(hm_batch_t *hm, uint rxlen, uint *status)
+{
+    batch_capture_t bc;
+    hm_batch_t      hmr;
+    uint8_t        *pos = (uint8_t *) (hm + 1);
+    uint8_t        *end;
+    uint            count = SWAP16(hm->hm_count);
+    uint            length = SWAP32(hm->hm_length);
+    uint            batch_status = KM_STATUS_OK;
+    batch_capture_t *prev_capture = batch_capture;
+    handle_t        prev_handle = 0;
+    uint            have_handle = 0;
+    uint            cur;
+    uint            rc = 0;
+
+    fsprintf("batch(count=%u, l=%x)\n", count, length);
+    memset(&bc, 0, sizeof (bc));
+    if ((rxlen < sizeof (*hm)) || (length > rxlen - sizeof (*hm))) {
+        batch_status = KM_STATUS_INVALID;
+        count = 0;
+    }
+    end = pos + length;
+
+    batch_capture = &bc;
+    for (cur = 0; cur < count; cur++) {
+        hm_batch_ent_t *ent = (hm_batch_ent_t *) pos;
+        km_msg_hdr_t   *km;
+        uint            len;
+        uint            flags;
+        uint            start;
+        uint            sub_status;
+
+        if (pos + sizeof (*ent) > end) {
+            batch_status = KM_STATUS_INVALID;
+            break;
+        }
+        len = SWAP16(ent->hmb_len);
+        flags = SWAP16(ent->hmb_flags);
+        if ((len < sizeof (*km)) || (len > end - pos - sizeof (*ent))) {
+            batch_status = KM_STATUS_INVALID;
+            break;
+        }
+        pos += sizeof (*ent) + ((len + 3) & ~3);
 
-        if (rdata == NULL) {
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-            return (send_msg(hm, sizeof (*hm), status));
+        /* Private copy, zero-filled as handlers may assume a full struct */
+        km = calloc(1, len + sizeof (hm_fdirent_t));
+        if (km == NULL) {
+            batch_status = KM_STATUS_FAIL;
+            break;
         }
-        memcpy(rdata, ndata, rxlen);
-        ndata = (uint8_t *) ((km_msg_hdr_t *) rxdata + 1);
-        while (rdatapos < hm_length) {
-            uint rxmax = hm_length - rdatapos + sizeof (km_msg_hdr_t);
-            rc = recv_msg(rxdata, rxmax, status, &rxlen);
-            if (rc != RC_SUCCESS)
-                break;
-            if (rxlen == 0) {
-                if (++timeout < 20)
-                    continue;
-                fsprintf("fwrite(%x) data timeout at pos=%x\n",
-                         hm->hm_handle, rdatapos);
-                rc = RC_FAILURE;
-                break;
-            }
-            timeout = 0;
-            if (rxlen >= sizeof (km_msg_hdr_t))
-                rxlen -= sizeof (km_msg_hdr_t);
-            else
-                rxlen = 0;
-            if (((km_msg_hdr_t *)rxdata)->km_tag != hm->hm_hdr.km_tag) {
-                fsprintf("tag mismatch: %04x != expected %04x\n",
-                         ((km_msg_hdr_t *)rxdata)->km_tag, hm->hm_hdr.km_tag);
-                rc = RC_FAILURE;
-                break;
+        memcpy(km, ent + 1, len);
+
+        if (flags & HM_BATCH_PREV_HANDLE) {
+            if (have_handle && (len >= sizeof (hm_fhandle_t))) {
+                ((hm_fhandle_t *) km)->hm_handle = prev_handle;
+            } else {
+                km->km_status = (batch_status != KM_STATUS_OK) ?
+                                batch_status : KM_STATUS_INVALID;
+                km->km_op |= KM_OP_REPLY;
+                send_msg(km, sizeof (*km), status);
+                free(km);
+                continue;
             }
-            memcpy(rdata + rdatapos, ndata, rxlen);
-            rdatapos += rxlen;
         }
-        if (rc == RC_SUCCESS) {
-            if (hm_flag & HM_FLAG_SEEK0) {
-                hm_flag &= ~HM_FLAG_SEEK0;
-                (void) lseek64(handle->he_fd, 0, SEEK_SET);
-            }
-            rc = write(handle->he_fd, rdata, hm_length);
+        if ((km->km_op == KM_OP_BATCH) ||
+            ((km->km_op == KM_OP_FWRITE) &&
+             ((len < sizeof (hm_freadwrite_t)) ||
+              (SWAP32(((hm_freadwrite_t *) km)->hm_length) >
+               len - sizeof (hm_freadwrite_t))))) {
+            /* Nested batch, or write data which did not fit */
+            km->km_status = KM_STATUS_INVALID;
+            km->km_op |= KM_OP_REPLY;
+            send_msg(km, sizeof (*km), status);
+            free(km);
+            continue;
+        }
+
+        start = bc.bc_len;
+        rc = process_msg_op((uint8_t *) km, len, status);
+        free(km);
+        if ((rc != 0) || (bc.bc_len == start)) {
+            /* Reply could not be captured; send what was collected */
+            batch_status = KM_STATUS_FAIL;
+            rc = 0;
+            break;
+        }
+
+        /* Status and handle are taken from the captured reply */
+        km = (km_msg_hdr_t *) (bc.bc_buf + start + sizeof (hm_batch_ent_t));
+        sub_status = km->km_status;
+        if ((sub_status != KM_STATUS_OK) && (sub_status != KM_STATUS_EOF) &&
+            (batch_status == KM_STATUS_OK)) {
+            batch_status = sub_status;
+        }
+        if ((km->km_op == (KM_OP_FOPEN | KM_OP_REPLY)) &&
+            (sub_status == KM_STATUS_OK)) {
+            prev_handle = ((hm_fhandle_t *) km)->hm_handle;
+            have_handle = 1;
+        }
+    }
+
+    batch_capture = prev_capture;
+
+    hmr.hm_hdr.km_op = hm->hm_hdr.km_op | KM_OP_REPLY;
+    hmr.hm_hdr.km_status = batch_status;
+    hmr.hm_hdr.km_tag = hm->hm_hdr.km_tag;
+    hmr.hm_length = SWAP32(bc.bc_len);
+    hmr.hm_count = SWAP16(bc.bc_count);
+    hmr.hm_unused = 0;
+    if (rc == 0)
+        rc = send_msg_parts(&hmr, sizeof (hmr), bc.bc_buf, bc.bc_len, status);
+    free(bc.bc_buf);
+    return (rc);
+}
+
+static void
+process_msg(uint status, uint8_t *rxdata, uint rxlen)
+{
+    km_msg_hdr_t *km = (km_msg_hdr_t *) rxdata;
+    uint pos;
+    uint rc;
+    uint retry = 1;
+
+#ifdef MSG_DEBUG
+    msgprintf("  got msg %04x len=%04x op=%02x mstatus=%02x tag=%02x data ",
+              status, rxlen, km->km_op, km->km_status, km->km_tag);
+    for (pos = sizeof (*km); pos < 32; pos++) {
+        msgprintf(" %02x", rxdata[pos]);
+    }
+    msgprintf("\n");
+#endif
+    if (rxlen < sizeof (*km)) {
+        printf("Got invalid message: len=%04x status=%04x", rxlen, status);
+        for (pos = sizeof (*km); pos < ((rxlen + 1) & ~1); pos++) {
+            printf(" %02x", rxdata[pos]);
         }
-        free(rdata);
-    } else {
-        rc = write(handle->he_fd, ndata, hm_length);
+        printf("\n");
     }
-    if (rc < 0) {
-        fsprintf("write rc=%d errno=%d\n", rc, errno);
-        rc = errno_to_km_status();
-    } else {
-        rc = KM_STATUS_OK;
+    if (km->km_op & KM_OP_REPLY) {
+        printf("Got op %02x reply, status=%02x\n",
+               km->km_op, km->km_status);
+        return;
     }
 
-    hm->hm_hdr.km_status = rc;
-    return (send_msg(hm, sizeof (*hm), status));
+    do {
+        rc = process_msg_op(rxdata, rxlen, &status);
+        if (rc == 0)
+            rc = status;
+
+        if (rc == 0)
+            break;
+
+        printf("KS send_msg failure op=%x status=%02x: %d (%s)\n",
+               km->km_op, status, rc, smash_err(rc));
+        time_delay_msec(100);
+    } while (retry-- > 0);
 }
 
-static uint
-sm_fseek(hm_fseek_t *hm, uint *status)
-{
-    handle_ent_t *handle = handle_get(hm->hm_handle);
+/*
+ * Message mode worker pool
+ *
+ * Requests from the Amiga are dispatched to a fixed set of worker lanes,
+ * each serviced by its own thread. A request which references a handle
+ * is queued to the lane selected by that handle, so requests touching
+ * the same handle complete in the order they were received while
+ * requests for unrelated handles proceed in parallel. Requests without
+ * a handle are spread across lanes by km_tag. Replies from all lanes are
+ * serialized by send_msg(). The worker threads are shared by all boards;
+ * each request carries the board which it came from.
+ */
+#define MSG_WORKERS_DEFAULT 4
+#define MSG_WORKERS_MAX     32
+#define MSG_WORK_BUFSIZE    4096  // Minimum buffer (replies are built in place)
+
+typedef struct msg_work msg_work_t;
+struct msg_work {
+    msg_work_t *mw_next;    // Next request queued to the lane
+    board_t    *mw_board;   // Board which sent the request
+    uint        mw_status;  // KS status of received message
+    uint        mw_len;     // Length of received message
+    uint8_t     mw_data[];  // Message (and in-place reply)
+};
 
-    fsprintf("fseek(%x, o=%"PRIx64" from=%d)\n", hm->hm_handle,
-             ((uint64_t) hm->hm_off_hi << 32) | hm->hm_off_lo, hm->hm_seek);
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    if (handle == NULL) {
-        fsprintf("handle get %x failed\n", hm->hm_handle);
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
-    if ((handle->he_type == HM_TYPE_VOLDIR) ||
-        (handle->he_mode & HM_MODE_DIR)) {
-        /* Can rewind volume dir or file stat */
-        hm->hm_old_hi = 0;
-        hm->hm_old_lo = SWAP32(handle->he_entnum);
-        handle->he_entnum = 0;  // Can only rewind volume dir pointer
-    } else if (handle->he_type == HM_TYPE_DIR) {
-        /* Can only rewind dir */
-        if (handle->he_dir != NULL)
-            rewinddir(handle->he_dir);
-        hm->hm_old_hi = 0;
-        hm->hm_old_lo = SWAP32(handle->he_entnum);
-        handle->he_entnum = 0;
-    } else if (handle->he_type == HM_TYPE_FILE) {
-        uint32_t hi = SWAP32(hm->hm_off_hi);
-        uint32_t lo = SWAP32(hm->hm_off_lo);
-        int seek_mode = hm->hm_seek;
-        off64_t oldpos;
-        off64_t offset = ((uint64_t) hi << 32) | lo;
-        off64_t newpos;
-        int whence;
+typedef struct {
+    pthread_mutex_t ml_lock;
+    pthread_cond_t  ml_cond;
+    msg_work_t     *ml_head;  // Oldest queued request
+    msg_work_t     *ml_tail;  // Newest queued request
+} msg_lane_t;
 
-        switch (seek_mode) {
-            default:
-                fsprintf("Unknown seek mode (%d)\n", seek_mode);
-                hm->hm_hdr.km_status = KM_STATUS_INVALID;
-                goto reply_seek;
-            case SEEK_OFFSET_BEGINNING:
-                whence = SEEK_SET;
-                break;
-            case SEEK_OFFSET_CURRENT:
-                whence = SEEK_CUR;
-                break;
-            case SEEK_OFFSET_END:
-                whence = SEEK_END;
-                break;
-        }
+static uint           msg_workers = MSG_WORKERS_DEFAULT;  // 0 = no threads
+static msg_lane_t     msg_lanes[MSG_WORKERS_MAX];
+static pthread_once_t msg_workers_once = PTHREAD_ONCE_INIT;
 
-        oldpos = lseek64(handle->he_fd, 0, SEEK_CUR);
-        newpos = lseek64(handle->he_fd, offset, whence);
-        if (newpos < 0) {
-            /* Seek failed */
-            fsprintf("Seek %x to %jd (%u) failed\n",
-                     hm->hm_handle, (intmax_t)offset, whence);
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        } else {
-            hi = newpos >> 32;
-            lo = (uint32_t) newpos;
-            hm->hm_off_hi = SWAP32(hi);
-            hm->hm_off_lo = SWAP32(lo);
-            hi = oldpos >> 32;
-            lo = (uint32_t) oldpos;
-            hm->hm_old_hi = SWAP32(hi);
-            hm->hm_old_lo = SWAP32(lo);
-        }
-    } else {
-        fsprintf("Can't seek in file type %x\n", handle->he_type);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-    }
-reply_seek:
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    return (send_msg(hm, sizeof (*hm), status));
-}
+/* Messages which passed a request being processed without workers */
+static __thread msg_work_t *msg_deferred_head;
+static __thread msg_work_t *msg_deferred_tail;
 
-static uint
-sm_fcreate(hm_fopenhandle_t *hm, uint *status)
+/*
+ * th_msg_worker() executes requests queued to a single worker lane.
+ */
+static void *
+th_msg_worker(void *arg)
 {
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    char         *hm_name = (char *)(hm + 1);
-    uint32_t      aperms  = SWAP32(hm->hm_aperms);
-    uint32_t      umode   = host_perms_from_amiga(aperms);
-    uint          hm_type = SWAP16(hm->hm_type);
-    uint          dev     = SWAP16(hm->hm_mode);
-    uint          ftype;
-    char         *host_path = NULL;
-    char         *name = NULL;
+    msg_lane_t *lane = arg;
+    msg_work_t *work;
 
-    fsprintf("fcreate(%s) type=%x perms=%x umode=%x in %x\n",
-             hm_name, hm_type, hm->hm_mode, umode, hm->hm_handle);
+    while (1) {
+        pthread_mutex_lock(&lane->ml_lock);
+        while (lane->ml_head == NULL)
+            pthread_cond_wait(&lane->ml_cond, &lane->ml_lock);
+        work = lane->ml_head;
+        lane->ml_head = work->mw_next;
+        if (lane->ml_head == NULL)
+            lane->ml_tail = NULL;
+        pthread_mutex_unlock(&lane->ml_lock);
+
+        board_cur = work->mw_board;
+        assert(board_cur != NULL);
+        process_msg(work->mw_status, work->mw_data, work->mw_len);
+        free(work);
+    }
+    return (NULL);
+}
 
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    hm->hm_hdr.km_status = KM_STATUS_OK;
+/*
+ * msg_workers_start() creates the message mode worker threads.
+ */
+static void
+msg_workers_start(void)
+{
+    pthread_attr_t thread_attr;
+    pthread_t      thread_id;
+    uint           cur;
 
-    if ((name = make_amiga_relpath(&phandle, hm_name)) == NULL) {
-        fsprintf("fcreate(%s) relative path failed\n", hm_name);
-reply_create_fail:
-        if (name != NULL)
-            free(name);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    for (cur = 0; cur < msg_workers; cur++) {
+        msg_lane_t *lane = &msg_lanes[cur];
+        pthread_mutex_init(&lane->ml_lock, NULL);
+        pthread_cond_init(&lane->ml_cond, NULL);
+        lane->ml_head = NULL;
+        lane->ml_tail = NULL;
+        if (pthread_create(&thread_id, &thread_attr, th_msg_worker, lane))
+            err(EXIT_FAILURE, "failed to create message worker thread");
     }
+}
 
-    if (phandle == NULL) {
-        /* Can't create the volume directory */
-        fsprintf("Can't create the volume directory\n");
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_create_fail;
+/*
+ * msg_work_lane() selects the worker lane for a received message. A batch
+ *                 goes to the lane of its first request, which is where
+ *                 the handle it works on is named.
+ */
+static msg_lane_t *
+msg_work_lane(const uint8_t *rxdata, uint rxlen)
+{
+    const km_msg_hdr_t *km = (const km_msg_hdr_t *) rxdata;
+    uint key = km->km_tag;
+
+    if ((km->km_op == KM_OP_BATCH) &&
+        (rxlen >= sizeof (hm_batch_t) + sizeof (hm_batch_ent_t)) &&
+        (SWAP16(((const hm_batch_t *) rxdata)->hm_count) != 0)) {
+        const hm_batch_ent_t *ent = (const hm_batch_ent_t *)
+                                    (rxdata + sizeof (hm_batch_t));
+        uint len = SWAP16(ent->hmb_len);
+        if (len <= rxlen - sizeof (hm_batch_t) - sizeof (*ent)) {
+            rxdata = (const uint8_t *) (ent + 1);
+            rxlen = len;
+            km = (const km_msg_hdr_t *) rxdata;
+        }
     }
-    host_path = make_host_path(phandle->he_avolume, name);
-    free(name);
-    name = NULL;
 
-    fsprintf("host path=%s\n", host_path);
-    switch (hm_type) {
-        case HM_TYPE_FILE:   // Regular file
-            ftype = S_IFREG;
-create_node:
-#ifdef __MINGW32__
-            (void) ftype;
-            (void) dev;
-            printf("mknod() not supported in Windows\n");
-#else
-            if (mknod(host_path, ftype | umode, dev)) {
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_create_fail;
-            }
-#endif
-            break;
-        case HM_TYPE_DIR:    // Directory
-            if (mkdir(host_path, umode)) {
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_create_fail;
-            }
+    switch (km->km_op) {
+        case KM_OP_FOPEN:
+        case KM_OP_FCLOSE:
+        case KM_OP_FREAD:
+        case KM_OP_FWRITE:
+        case KM_OP_FSEEK:
+        case KM_OP_FCREATE:
+        case KM_OP_FDELETE:
+        case KM_OP_FRENAME:
+        case KM_OP_FPATH:
+        case KM_OP_FSETPERMS:
+        case KM_OP_FSETOWN:
+        case KM_OP_FSETDATE:
+            /* All file requests have the (source) handle first */
+            if (rxlen >= sizeof (hm_fhandle_t))
+                key = ((const hm_fhandle_t *) rxdata)->hm_handle;
             break;
-#ifdef ALLOW_CREATE_LINK
-        case HM_TYPE_LINK: {   // Symbolic (soft) link
-            uint  hm_name_len = strlen(hm_name) + 1;
-            char *lname = hm_name + hm_name_len;
-            char *relname;
-            relname = amiga_link_to_host_path(phandle, lname, host_path);
+    }
+    key += board_cur->b_unit;  // Boards have separate handle namespaces
+    return (&msg_lanes[key % msg_workers]);
+}
 
-            if (symlink(relname, host_path)) {
-                fsprintf("symlink: %s -> %s failed: %d\n",
-                         host_path, lname, errno);
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_create_fail;
-            }
-            if (relname != NULL)
-                free(relname);
-            break;
-        }
-        case HM_TYPE_HLINK: {  // Hard link
-            uint  hm_name_len = strlen(hm_name) + 1;
-            char *lname = hm_name + hm_name_len;
-            char *relname;
+/*
+ * msg_deferred_run() processes, in order of arrival, messages which were
+ * received while a request was being processed with no worker threads.
+ */
+static void
+msg_deferred_run(void)
+{
+    msg_work_t *work;
 
-            relname = amiga_link_to_host_path(phandle, lname, host_path);
-            if (link(lname, host_path)) {
-                fsprintf("hard link %s -> %s failed: %d\n",
-                         host_path, lname, errno);
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_create_fail;
-            }
-            if (relname != NULL)
-                free(relname);
-            break;
+    while ((work = msg_deferred_head) != NULL) {
+        msg_deferred_head = work->mw_next;
+        if (msg_deferred_head == NULL)
+            msg_deferred_tail = NULL;
+        process_msg(work->mw_status, work->mw_data, work->mw_len);
+        free(work);
+    }
+}
+
+/*
+ * msg_dispatch() queues a received message to a worker lane, or processes
+ * it directly when no worker threads are configured. Any continuation
+ * packets of a large write are collected here, as only this thread may
+ * receive messages from Kicksmash.
+ */
+static void
+msg_dispatch(uint status, uint8_t *rxdata, uint rxlen)
+{
+    hm_freadwrite_t *hm = (hm_freadwrite_t *) rxdata;
+    msg_lane_t      *lane;
+    msg_work_t      *work;
+    uint             len = rxlen;
+    uint             bufsize;
+
+    if (msg_workers == 0) {
+        process_msg(status, rxdata, rxlen);
+        msg_deferred_run();
+        return;
+    }
+    if ((rxlen >= sizeof (*hm)) && (hm->hm_hdr.km_op == KM_OP_FWRITE) &&
+        (rxlen - sizeof (*hm) < SWAP32(hm->hm_length))) {
+        len = sizeof (*hm) + SWAP32(hm->hm_length);
+    }
+    bufsize = (len > MSG_WORK_BUFSIZE) ? len : MSG_WORK_BUFSIZE;
+    work = malloc(sizeof (*work) + bufsize);
+    if (work == NULL) {
+        process_msg(status, rxdata, rxlen);
+        return;
+    }
+    memcpy(work->mw_data, rxdata, rxlen);
+    if (len > rxlen) {
+        uint rc = recv_msg_cont(hm->hm_hdr.km_tag, work->mw_data, rxlen,
+                                len, &status);
+        if (rc != RC_SUCCESS) {
+            /* Reply with failure; the worker would not see all data */
+            hm->hm_hdr.km_op |= KM_OP_REPLY;
+            hm->hm_hdr.km_status = KM_STATUS_FAIL;
+            (void) send_msg(hm, sizeof (*hm), &status);
+            free(work);
+            return;
         }
-#endif /* ALLOW_CREATE_LINK */
-        case HM_TYPE_BDEV:   // Block device
-            ftype = S_IFBLK;
-            goto create_node;
-        case HM_TYPE_CDEV:   // Block device
-            ftype = S_IFCHR;
-            goto create_node;
-        case HM_TYPE_FIFO:   // FIFO
-            ftype = S_IFIFO;
-            goto create_node;
-#ifndef __MINGW32__
-        case HM_TYPE_SOCKET: // Socket
-            ftype = S_IFSOCK;
-            goto create_node;
-#endif
-        case HM_TYPE_WHTOUT: // Whiteout entry
-        case HM_TYPE_VOLUME: // Disk volume
-        case HM_TYPE_VOLDIR: // Volume directory
-        default:
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            break;
     }
+    work->mw_status = status;
+    work->mw_len = len;
+    work->mw_next = NULL;
+    work->mw_board = board_cur;
 
-    return (send_msg(hm, sizeof (*hm), status));
+    lane = msg_work_lane(rxdata, rxlen);
+    pthread_mutex_lock(&lane->ml_lock);
+    if (lane->ml_tail == NULL)
+        lane->ml_head = work;
+    else
+        lane->ml_tail->mw_next = work;
+    lane->ml_tail = work;
+    pthread_cond_signal(&lane->ml_cond);
+    pthread_mutex_unlock(&lane->ml_lock);
 }
 
-static uint
-sm_fdelete(hm_fhandle_t *hm, uint *status)
+/*
+ * msg_dispatch_passed() handles a priority lane message which arrived
+ * while recv_msg_cont() was collecting the packets of another request.
+ * With no worker threads, that request is still being processed by this
+ * thread, so the message is held until it has finished rather than
+ * being processed from within it.
+ */
+static void
+msg_dispatch_passed(uint status, uint8_t *rxdata, uint rxlen)
 {
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    char         *hm_name = (char *)(hm + 1);
-    char         *host_path = NULL;
-    char         *name = NULL;
-    struct stat   st;
-
-    fsprintf("fdelete(%s) in %x\n", hm_name, hm->hm_handle);
+    msg_work_t *work;
 
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-
-    if ((name = make_amiga_relpath(&phandle, hm_name)) == NULL) {
-        fsprintf("fdelete(%s) relative path failed\n", hm_name);
-reply_delete_fail:
-        if (host_path != NULL)
-            free(host_path);
-        if (name != NULL)
-            free(name);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
+    if (msg_workers != 0) {
+        msg_dispatch(status, rxdata, rxlen);
+        return;
     }
-
-    if (phandle == NULL) {
-        /* Can't delete the volume directory */
-        fsprintf("Can't delete the volume directory\n");
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_delete_fail;
+    work = malloc(sizeof (*work) +
+                  ((rxlen > MSG_WORK_BUFSIZE) ? rxlen : MSG_WORK_BUFSIZE));
+    if (work == NULL) {
+        process_msg(status, rxdata, rxlen);
+        return;
     }
-    host_path = make_host_path(phandle->he_avolume, name);
+    memcpy(work->mw_data, rxdata, rxlen);
+    work->mw_status = status;
+    work->mw_len = rxlen;
+    work->mw_next = NULL;
+    if (msg_deferred_tail == NULL)
+        msg_deferred_head = work;
+    else
+        msg_deferred_tail->mw_next = work;
+    msg_deferred_tail = work;
+}
 
-    if (lstat(host_path, &st) != 0) {
-        fsprintf("fdelete(%s) stat fail errno=%d\n", host_path, errno);
-        goto reply_delete_fail;
-    }
-    switch (st.st_mode & S_IFMT) {
-        case S_IFDIR:
-            /* Use rmdir() */
-            if (volume_get_by_path(host_path, 0) != NULL) {
-                fsprintf("fdelete(%s) can't remove a volume\n", host_path);
-                hm->hm_hdr.km_status = KM_STATUS_PERM;
-                goto reply_delete_fail;
-            }
-            if (rmdir(host_path)) {
-                /* Failed */
-                fsprintf("rmdir(%s) failed: %d\n", host_path, errno);
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_delete_fail;
-            }
+static uint
+handle_atou_messages(void)
+{
+    uint8_t   rxdata[4096];
+    uint      status;
+    uint      rxlen;
+    uint      rc;
+    uint      handled = 0;
+
+    /*
+     * Note that the length, command, and payload of messages received from
+     * the Amiga are byte-swapped (B1 B0 B3 B2 B5 B4...). The send_msg()
+     * and recv_msg() functions take care of this byte swapping.
+     */
+    while (1) {
+        rc = recv_msg(rxdata, sizeof (rxdata), &status, &rxlen);
+
+        if (rc != 0) {
+            printf("KS recv_msg failure: %d (%s)\n", rc, smash_err(rc));
+            return (rc);
+        }
+        if ((status & ~KS_MSG_PRIORITY) == KS_CMD_MSG_SEND) {
+            msg_dispatch(status, rxdata, rxlen);
+            handled++;
+        } else if ((status == KS_STATUS_NODATA) ||
+                   (status == KS_STATUS_LOCKED)) {
             break;
-        default:
-        case S_IFBLK:   // Block device
-        case S_IFCHR:   // Character device
-        case S_IFIFO:   // FIFO (Pipe)
-        case S_IFREG:   // Regular file
-#ifndef __MINGW32__
-        case S_IFLNK:   // Symlink
-        case S_IFSOCK:  // Socket
-#endif
-            /* Use unlink() */
-            if (unlink(host_path)) {
-                fsprintf("unlink(%s) failed: %d\n", host_path, errno);
-                hm->hm_hdr.km_status = errno_to_km_status();
-                goto reply_delete_fail;
+        } else {
+            printf("status=%04x len=%x", status, rxlen);
+            if (rxlen > 0) {
+                uint pos;
+                printf(" data=");
+                for (pos = 0; pos < rxlen; pos++) {
+                    if (pos > 0)
+                        printf(" ");
+                    printf("%02x", rxdata[pos]);
+                }
             }
+            printf("\n");
             break;
+        }
     }
-    free(name);
-    free(host_path);
-    return (send_msg(hm, sizeof (*hm), status));
+    return (handled);
 }
 
-static uint
-sm_frename(hm_frename_t *hm, uint *status)
+static void
+run_message_mode(void)
 {
-    handle_ent_t *phandle_old  = handle_get(hm->hm_shandle);
-    handle_ent_t *phandle_new  = handle_get(hm->hm_dhandle);
-    char         *name_old     = (char *)(hm + 1);
-    uint          len_old_name = strlen(name_old) + 1;
-    char         *name_new     = name_old + len_old_name;
-    char         *path_old     = NULL;
-    char         *path_new     = NULL;
-    char         *apath_old    = NULL;
-    char         *apath_new    = NULL;
+    char buf[2048];
+    uint rxlen;
+    uint status;
+    uint rc;
+    uint curtick = 10;
+    uint count;
+    uint16_t app_state = MSG_STATE_SERVICE_UP | MSG_STATE_HAVE_LOOPBACK;
+    smash_msg_info_t mi;
+    struct timeval keep_timeout;
+    struct timeval sample_timeout;
 
-    fsprintf("frename(%s to %s) in %x to %x\n",
-             name_old, name_new, hm->hm_shandle, hm->hm_dhandle);
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    hm->hm_hdr.km_status = KM_STATUS_OK;
+    if (board_cur->b_vol_head != NULL)
+        app_state |= MSG_STATE_HAVE_FILE;
 
-    if ((apath_old = make_amiga_relpath(&phandle_old, name_old)) == NULL) {
-        fsprintf("frename(%s) relative path failed\n", name_old);
-reply_rename_fail:
-        if (apath_old != NULL)
-            free(apath_old);
-        if (apath_new != NULL)
-            free(apath_new);
-        if (path_old != NULL)
-            free(path_old);
-        if (path_new != NULL)
-            free(path_new);
-        hm->hm_shandle = 0;
-        hm->hm_dhandle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
+    msgprintf("Message mode %s\n", board_cur->b_device_name);
+    pthread_once(&msg_workers_once, msg_workers_start);
+    if (metrics_path != NULL)
+        pthread_once(&metrics_once, metrics_start);
+    board_cur->b_app_state_send[0] = SWAP16(0xffff);     // Affect all bits
+    board_cur->b_app_state_send[1] = SWAP16(app_state);  // Message service up
 
-    if (phandle_old == NULL) {
-        /* Can't rename the volume directory */
-        fsprintf("frename(%s) Can't rename the volume directory\n", name_old);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_rename_fail;
-    }
-    path_old = make_host_path(phandle_old->he_avolume, apath_old);
+    if (send_cmd("prom service"))
+        return; // "timeout" was reported in this case
 
-    if ((apath_new = make_amiga_relpath(&phandle_new, name_new)) == NULL) {
-        fsprintf("frename(%s) relative path failed\n", name_new);
-        goto reply_rename_fail;
-    }
+    show_ks_inquiry();
 
-    if (phandle_new == NULL) {
-        /* Can't rename the volume directory */
-        fsprintf("frename(%s) Can't rename to the volume directory\n",
-                 name_new);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_rename_fail;
+    rc = send_ks_cmd(KS_CMD_MSG_STATE | KS_MSG_STATE_SET | KS_MSG_STATE_NOTIFY,
+                     board_cur->b_app_state_send,
+                     sizeof (board_cur->b_app_state_send), buf,
+                     sizeof (buf), &status, &rxlen, 1);
+    if (rc == 0)
+        rc = status;
+    if (rc != 0) {
+        printf("KS Set App State failed: %d (%s)\n", rc, smash_err(rc));
+        return;
     }
-    path_new = make_host_path(phandle_new->he_avolume, apath_new);
 
-    if (volume_get_by_path(path_old, 0) != NULL) {
-        fsprintf("frename(%s) can't rename a volume\n", path_old);
-        hm->hm_hdr.km_status = KM_STATUS_PERM;
-        goto reply_rename_fail;
-    }
-    if (volume_get_by_path(path_new, 0) != NULL) {
-        fsprintf("frename(%s) can't rename to a volume\n", path_new);
-        hm->hm_hdr.km_status = KM_STATUS_PERM;
-        goto reply_rename_fail;
-    }
-    if (rename(path_old, path_new)) {
-        fsprintf("rename %s to %s failed\n", path_old, path_new);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_rename_fail;
+    rc = send_ks_cmd(KS_CMD_MSG_FLUSH, NULL, 0, NULL, 0, &status, NULL, 0);
+    if (rc == 0)
+        rc = status;
+    if (rc != 0) {
+        printf("KS Msg Flush failed: %d (%s)\n", rc, smash_err(rc));
+        return;
     }
-    free(path_old);
-    free(path_new);
-    free(apath_old);
-    free(apath_new);
-
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    return (send_msg(hm, sizeof (*hm), status));
-}
-
-static uint
-sm_fpath(hm_fhandle_t *hm, uint *status)
-{
-    /* Resolve handle to Amiga-specific path */
-    hm_fhandle_t *hmr;
-    handle_ent_t *handle = handle_get(hm->hm_handle);
-    char         *pathbuf;
-    char          pathlen;
-    uint          rc;
 
-    fsprintf("fpath(%x)\n", hm->hm_handle);
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-    if (handle == NULL) {
-        /* Volume directory */
-        pathbuf = strdup("::");
-    } else {
-        amiga_vol_t *vol = NULL;
-        handle_ent_t *volhandle = handle->he_volume;
+    calc_timeout_msec(&keep_timeout, 5000);
+    calc_timeout_msec(&sample_timeout, METRICS_SAMPLE_MSEC);
+    while (1) {
+        if (curtick != 0) {
+            if (board_cur->b_ks_features & KS_FEATURE_MSG_NOTIFY) {
+                /*
+                 * Kicksmash sends KS_CMD_MSG_NOTIFY when a message from
+                 * the Amiga arrives, so block until then. The timeout
+                 * only paces the keep-alive below.
+                 */
+                msg_notify_wait(1000);
+            } else if (curtick < 1024) {
+                usleep(curtick);
+            } else {
+                time_delay_msec(curtick / 1024);
+            }
+        }
+        if (time_has_elapsed(&keep_timeout)) {
+            calc_timeout_msec(&keep_timeout, 5000);
+            keep_app_state();  // do this once every 5 seconds
+        }
+        if ((metrics_path != NULL) && time_has_elapsed(&sample_timeout)) {
+            calc_timeout_msec(&sample_timeout, METRICS_SAMPLE_MSEC);
+            metrics_sample();
+        }
 
-        if (volhandle != NULL)
-            vol = volume_get_by_handle(volhandle);
+        if (curtick > 1000) {
+            rc = send_ks_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi),
+                             &status, NULL, 0);
+            if (rc != 0) {
+                printf("KS message failure: %d (%s)\n", rc, smash_err(rc));
+                break;
+            }
+            if ((mi.smi_atou_inuse != 0) || (mi.smi_utoa_inuse != 0)) {
+                msgprintf("  atou inuse=%u avail=%u  utoa inuse=%u avail=%u\n",
+                          SWAP16(mi.smi_atou_inuse),
+                          SWAP16(mi.smi_atou_avail),
+                          SWAP16(mi.smi_utoa_inuse),
+                          SWAP16(mi.smi_utoa_avail));
+            }
+        }
 
-        if (vol != NULL) {
-            pathbuf = merge_amiga_paths(vol->av_volume, handle->he_name);
+        count = handle_atou_messages();
+        if (count != 0) {
+            /* Handled message */
+            curtick = 0;
         } else {
-            pathbuf = strdup(handle->he_name);
+            /* No message */
+            if (curtick == 0)
+                curtick = 10;
+            else if (curtick < 500000)
+                curtick += curtick / 2;
         }
     }
-
-    fsprintf("pathbuf=%s\n", pathbuf);
-    pathlen = strlen(pathbuf) + 1;
-    hmr = malloc(sizeof (*hmr) + pathlen + 1);
-    memcpy(hmr, hm, sizeof (*hmr));
-    strcpy((char *) (hmr + 1), pathbuf);
-    ((char *) hmr)[sizeof (*hmr) + pathlen] = '\0';  // unaligned data end init
-
-    rc = send_msg(hmr, sizeof (*hmr) + pathlen, status);
-    free(pathbuf);
-    free(hmr);
-    return (rc);
 }
 
-
-static uint
-sm_fsetdate(hm_fsetdate_t *hm, uint *status)
+/*
+ * th_message_mode() runs message mode for a single board.
+ *
+ * @param [in]  arg - The board.
+ *
+ * @return      NULL pointer (unused)
+ */
+static void *
+th_message_mode(void *arg)
 {
-    /* Resolve handle to Amiga-specific path */
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    char         *name    = (char *)(hm + 1);
-    char         *path    = NULL;
-    char         *apath;
-    uint8_t       which   = hm->hm_which;
-    uint32_t      sec     = SWAP32(hm->hm_time);
-    uint32_t      nsec    = SWAP32(hm->hm_time_ns);
-    uint32_t      utcsec  = get_utctime(sec);
-    struct stat   statbuf;
+    board_cur = arg;
+    assert(board_cur != NULL);
+    run_message_mode();
+    printf("Message mode stopped for %s\n", board_cur->b_device_name);
+    return (NULL);
+}
 
-    fsprintf("fsetdate(%s %u %u.%u)\n", name, which, utcsec, nsec);
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
+/*
+ * run_message_boards() runs message mode for every board, each in its
+ *                      own thread. It returns after all have stopped.
+ *
+ * @return       0 - Success.
+ */
+static int
+run_message_boards(void)
+{
+    board_t *board;
 
-    if ((apath = make_amiga_relpath(&phandle, name)) == NULL) {
-        fsprintf("fsetdate(%s) relative path failed\n", name);
-reply_setdate_fail:
-        if (apath != NULL)
-            free(apath);
-        if (path != NULL)
-            free(path);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
+    for (board = board_head; board != NULL; board = board->b_next) {
+        if (pthread_create(&board->b_msg_thread, NULL, th_message_mode,
+                           board)) {
+            err(EXIT_FAILURE, "failed to create %s message thread",
+                board->b_device_name);
+        }
     }
+    for (board = board_head; board != NULL; board = board->b_next)
+        pthread_join(board->b_msg_thread, NULL);
+    return (0);
+}
 
-    if (phandle == NULL) {
-        /* Can't set perms on the volume directory */
-        fsprintf("fsetdate(%s) can't set dateer of the volume directory\n",
-                 name);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_setdate_fail;
-    }
-    path = make_host_path(phandle->he_avolume, apath);
+/* Amiga time is in seconds since 1978 */
+#define AMIGA_SEC_TO_UNIX_SEC (2922 * 24 * 60 * 60)  // 1978 - 1970 = 2922 days
 
-    if (volume_get_by_path(path, 0) != NULL) {
-        fsprintf("fsetdate(%s) can't set owner of a volume\n", path);
-        hm->hm_hdr.km_status = KM_STATUS_PERM;
-        goto reply_setdate_fail;
-    }
+static rc_t
+clock_ks_set(int enter)
+{
+    rc_t rc = 0;
+    uint32_t amtime[2];
+    struct timeval tv;
+    struct timezone tz;
+    uint rxlen;
+    uint status;
 
-    if (lstat(path, &statbuf)) {
-        fsprintf("lstat fail: %d\n", errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setdate_fail;
+    if (gettimeofday(&tv, &tz)) {
+        printf("gettimeofday failed: %d\n", errno);
+        return (RC_FAILURE);
     }
+    amtime[0] = get_localtime(tv.tv_sec - AMIGA_SEC_TO_UNIX_SEC);
+    amtime[1] = tv.tv_usec;
 
-#ifdef __MINGW32__
-    struct _utimbuf times;
-    times.actime  = statbuf.st_atime;  // last access time
-    times.modtime = statbuf.st_mtime;  // last modification time
-
-    switch (which) {
-        case 0: // Set the modify date/time
-            times.modtime = (((uint64_t) utcsec) << 32) | nsec;
-            break;
-        case 1: // Get the modify date/time
-            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_ctime >> 32));
-            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_ctime);
-            goto reply_setdate_good;
-        case 2: // Set the change date/time
-            /* Not sure how to set this one */
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
-        case 3: // Get the change date/time
-            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_ctime >> 32));
-            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_ctime);
-            goto reply_setdate_good;
-        case 4: // Set the access date/time
-            times.actime = (((uint64_t) utcsec) << 32) | nsec;
-            break;
-        case 5: // Get the access date/time
-            hm->hm_time    = SWAP32((uint32_t) (statbuf.st_atime >> 32));
-            hm->hm_time_ns = SWAP32((uint32_t) statbuf.st_atime);
-            goto reply_setdate_good;
-        default:
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
+    if (enter && send_cmd("prom service")) {
+        printf("could not enter prom service\n");
+        return (RC_TIMEOUT); // "timeout" was reported in this case
     }
-
-    if (_utime(path, &times)) {
-        fsprintf("utimesat fail: %d\n", errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setdate_fail;
+    rc = send_ks_cmd(KS_CMD_CLOCK | KS_CLOCK_SET, amtime, sizeof (amtime),
+                     NULL, 0, &status, &rxlen, 0);
+    if (rc != 0) {
+        printf("KS clock set failed: %d (%s)\n", rc, smash_err(rc));
+        return (rc);
     }
-#elif defined (OSX)
-    /* MacOS */
-    struct timeval times[2];
-    timespec_to_timeval(&times[0], &statbuf.st_atimespec);  // last access time
-    timespec_to_timeval(&times[1], &statbuf.st_ctimespec);  // last modify time
+    return (rc);
+}
 
-    switch (which) {
-        case 0: // Set the modify date/time
-            times[1].tv_sec  = utcsec;
-            times[1].tv_usec = nsec / 1000;
-            break;
-        case 1: // Get the modify date/time
-            hm->hm_time    = SWAP32(statbuf.st_ctimespec.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_ctimespec.tv_nsec);
-            goto reply_setdate_good;
-        case 2: // Set the change date/time
-            /* Not sure how to set this one */
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
-        case 3: // Get the change date/time
-            hm->hm_time    = SWAP32(statbuf.st_ctimespec.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_ctimespec.tv_nsec);
-            goto reply_setdate_good;
-        case 4: // Set the access date/time
-            times[0].tv_sec  = utcsec;
-            times[0].tv_usec = nsec / 1000;
-            break;
-        case 5: // Get the access date/time
-            hm->hm_time    = SWAP32(statbuf.st_atimespec.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_atimespec.tv_nsec);
-            goto reply_setdate_good;
-        default:
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
+static rc_t
+clock_ks_show(int enter)
+{
+    time_t timev;
+    uint32_t amtime[2];
+    struct tm *tm;
+    uint rxlen;
+    uint status;
+    rc_t rc;
+
+    if (enter && send_cmd("prom service")) {
+        printf("could not enter prom service\n");
+        return (RC_TIMEOUT); // "timeout" was reported in this case
     }
-    if (utimes(path, times)) {
-        fsprintf("utimes fail: %d\n", errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setdate_fail;
+    rc = send_ks_cmd(KS_CMD_CLOCK, NULL, 0, amtime, sizeof (amtime), &status,
+                     &rxlen, 0);
+    if (rc != 0) {
+        printf("KS clock request failed: %d (%s)\n", rc, smash_err(rc));
+        return (rc);
     }
-#else
-    /* Linux */
-    struct timespec times[2];
-    times[0] = statbuf.st_atim;  // last access time
-    times[1] = statbuf.st_ctim;  // last modification time
 
-    switch (which) {
-        case 0: // Set the modify date/time
-            times[1].tv_sec  = utcsec;
-            times[1].tv_nsec = nsec;
-            break;
-        case 1: // Get the modify date/time
-            hm->hm_time    = SWAP32(statbuf.st_ctim.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_ctim.tv_nsec);
-            goto reply_setdate_good;
-        case 2: // Set the change date/time
-            /* Not sure how to set this one */
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
-        case 3: // Get the change date/time
-            hm->hm_time    = SWAP32(statbuf.st_ctim.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_ctim.tv_nsec);
-            goto reply_setdate_good;
-        case 4: // Set the access date/time
-            times[0].tv_sec  = utcsec;
-            times[0].tv_nsec = nsec;
-            break;
-        case 5: // Get the access date/time
-            hm->hm_time    = SWAP32(statbuf.st_atim.tv_sec);
-            hm->hm_time_ns = SWAP32(statbuf.st_atim.tv_nsec);
-            goto reply_setdate_good;
-        default:
-            hm->hm_hdr.km_status = KM_STATUS_INVALID;
-            goto reply_setdate_fail;
-    }
-    if (utimensat(AT_FDCWD, path, times, AT_SYMLINK_NOFOLLOW)) {
-        fsprintf("utimesat fail: %d\n", errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setdate_fail;
+    if ((amtime[0] == 0) && (amtime[1] == 0)) {
+        printf("Kicksmash time has not been set\n");
+        return (RC_FAILURE);
     }
-#endif
 
-reply_setdate_good:
-    free(apath);
-    free(path);
+    timev = get_utctime(amtime[0] + AMIGA_SEC_TO_UNIX_SEC);
+    tm = localtime(&timev);
 
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    return (send_msg(hm, sizeof (*hm), status));
+    printf("%04u-%02u-%02u %02u:%02u:%02u.%06u\n",
+            tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
+            tm->tm_hour, tm->tm_min, tm->tm_sec, amtime[1]);
+    return (0);
+}
+
+
+static FILE   *bench_out_fp   = NULL;   // Results file (--benchout)
+static bool_t  bench_out_json = FALSE;  // Results file is JSON, else CSV
+static uint    bench_out_rows = 0;      // Result rows written to file
+static char    bench_fw[32]   = "";     // Kicksmash firmware version
+static const char *bench_test = "";     // Name of benchmark being run
+static uint    bench_addr     = ADDR_NOT_SPECIFIED;
+static uint    bench_len      = EEPROM_SIZE_NOT_SPECIFIED;
+
+/* Latency summary of a benchmark case, in microseconds */
+typedef struct {
+    uint32_t bl_p50;
+    uint32_t bl_p99;
+    uint32_t bl_max;
+} bench_lat_t;
+
+/*
+ * bench_out_open() opens the machine-readable benchmark results file.
+ *                  A filename ending in ".json" selects JSON output;
+ *                  otherwise CSV is written.
+ *
+ * @param [in] path - Results file to create.
+ */
+static void
+bench_out_open(const char *path)
+{
+    size_t len = strlen(path);
+
+    bench_out_fp = fopen(path, "w");
+    if (bench_out_fp == NULL)
+        err(EXIT_FAILURE, "Failed to create %s", path);
+    bench_out_json = (len > 5) && (strcasecmp(path + len - 5, ".json") == 0);
+    if (bench_out_json) {
+        fprintf(bench_out_fp, "[");
+    } else {
+        fprintf(bench_out_fp, "test,case,size,count,bytes,usec,mb_per_sec,"
+                "p50_usec,p99_usec,max_usec,firmware\n");
+    }
 }
 
-static uint
-sm_fsetown(hm_fsetown_t *hm, uint *status)
+/*
+ * bench_out_close() terminates and closes the benchmark results file.
+ */
+static void
+bench_out_close(void)
 {
-    /* Resolve handle to Amiga-specific path */
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    char         *name    = (char *)(hm + 1);
-    char         *path    = NULL;
-    char         *apath;
-    uint32_t      oid = SWAP32(hm->hm_oid);
-    uint32_t      gid = SWAP32(hm->hm_gid);
-
-    fsprintf("fsetown(%s %d %d)\n", name, oid, gid);
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
+    if (bench_out_fp == NULL)
+        return;
+    if (bench_out_json)
+        fprintf(bench_out_fp, "%s]\n", (bench_out_rows > 0) ? "\n" : "");
+    fclose(bench_out_fp);
+    bench_out_fp = NULL;
+}
 
-    if ((apath = make_amiga_relpath(&phandle, name)) == NULL) {
-        fsprintf("fsetown(%s) relative path failed\n", name);
-reply_setown_fail:
-        if (apath != NULL)
-            free(apath);
-        if (path != NULL)
-            free(path);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
+/*
+ * bench_out_row() appends one benchmark case to the results file.
+ *
+ * @param [in] name  - Benchmark case name.
+ * @param [in] size  - Payload or block size (0 if not applicable).
+ * @param [in] count - Number of operations performed.
+ * @param [in] bytes - Number of payload bytes transferred (may be 0).
+ * @param [in] usec  - Total elapsed time.
+ * @param [in] lat   - Per-operation latency summary (may be NULL).
+ */
+static void
+bench_out_row(const char *name, uint size, uint count, uint64_t bytes,
+              uint64_t usec, const bench_lat_t *lat)
+{
+    double rate = (double) bytes / usec;
+    FILE  *fp   = bench_out_fp;
 
-    if (phandle == NULL) {
-        /* Can't set perms on the volume directory */
-        fsprintf("fsetown(%s) can't set owner of the volume directory\n",
-                 name);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_setown_fail;
+    if (fp == NULL)
+        return;
+    if (bench_out_json) {
+        fprintf(fp, "%s\n  {\"test\": \"%s\", \"case\": \"%s\", "
+                "\"size\": %u, \"count\": %u, \"bytes\": %" PRIu64 ", "
+                "\"usec\": %" PRIu64 ", \"mb_per_sec\": %.3f, ",
+                (bench_out_rows > 0) ? "," : "", bench_test, name,
+                size, count, bytes, usec, rate);
+        if (lat != NULL) {
+            fprintf(fp, "\"p50_usec\": %u, \"p99_usec\": %u, "
+                    "\"max_usec\": %u, ",
+                    lat->bl_p50, lat->bl_p99, lat->bl_max);
+        } else {
+            fprintf(fp, "\"p50_usec\": null, \"p99_usec\": null, "
+                    "\"max_usec\": null, ");
+        }
+        fprintf(fp, "\"firmware\": \"%s\"}", bench_fw);
+    } else {
+        fprintf(fp, "%s,\"%s\",%u,%u,%" PRIu64 ",%" PRIu64 ",%.3f,",
+                bench_test, name, size, count, bytes, usec, rate);
+        if (lat != NULL)
+            fprintf(fp, "%u,%u,%u,", lat->bl_p50, lat->bl_p99, lat->bl_max);
+        else
+            fprintf(fp, ",,,");
+        fprintf(fp, "%s\n", bench_fw);
     }
-    path = make_host_path(phandle->he_avolume, apath);
+    bench_out_rows++;
+}
 
-    if (volume_get_by_path(path, 0) != NULL) {
-        fsprintf("fsetown(%s) can't set owner of a volume\n", path);
-        hm->hm_hdr.km_status = KM_STATUS_PERM;
-        goto reply_setown_fail;
+static void
+bench_report(const char *name, uint count, uint64_t usec)
+{
+    double per_op;
+
+    if (usec == 0)
+        usec = 1;
+    per_op = (usec * 1000.0) / count;
+    if (per_op >= 1000000.0) {
+        /* Device round trips are better reported in milliseconds */
+        printf("  %-22s %7u ops %8" PRIu64 " usec %7.2f ms/op\n",
+               name, count, usec, per_op / 1000000.0);
+    } else {
+        printf("  %-22s %7u ops %8" PRIu64 " usec %7.1f ns/op\n",
+               name, count, usec, per_op);
     }
+    bench_out_row(name, 0, count, 0, usec, NULL);
+}
 
-#ifdef __MINGW32__
-    hm->hm_hdr.km_status = KM_STATUS_PERM;
-    goto reply_setown_fail;
-#else
-    if (chown(path, oid, gid)) {
-        fsprintf("chown fail: %d\n", errno);
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setown_fail;
-    }
-#endif
+static int
+bench_sample_cmp(const void *a, const void *b)
+{
+    uint32_t va = *(const uint32_t *) a;
+    uint32_t vb = *(const uint32_t *) b;
+    return ((va > vb) - (va < vb));
+}
 
-    free(apath);
-    free(path);
+/*
+ * bench_report_lat() reports throughput and per-operation latency
+ *                    percentiles for a benchmark case. The samples
+ *                    array is sorted as a side effect.
+ *
+ * @param [in] name    - Benchmark case name.
+ * @param [in] size    - Payload or block size.
+ * @param [in] count   - Number of operations (and latency samples).
+ * @param [in] bytes   - Number of payload bytes transferred.
+ * @param [in] usec    - Total elapsed time.
+ * @param [io] samples - Latency of each operation in microseconds.
+ */
+static void
+bench_report_lat(const char *name, uint size, uint count, uint64_t bytes,
+                 uint64_t usec, uint32_t *samples)
+{
+    bench_lat_t lat;
 
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    return (send_msg(hm, sizeof (*hm), status));
+    if (count == 0)
+        return;
+    if (usec == 0)
+        usec = 1;
+    qsort(samples, count, sizeof (*samples), bench_sample_cmp);
+    lat.bl_p50 = samples[(count - 1) * 50 / 100];
+    lat.bl_p99 = samples[(count - 1) * 99 / 100];
+    lat.bl_max = samples[count - 1];
+
+    printf("  %-16s %5u %5u ops %8.3f MB/s  p50 %6u  p99 %6u  max %6u usec\n",
+           name, size, count, (double) bytes / usec,
+           lat.bl_p50, lat.bl_p99, lat.bl_max);
+    bench_out_row(name, size, count, bytes, usec, &lat);
 }
 
+/*
+ * bench_device_enter() puts Kicksmash in service mode for a device
+ *                      benchmark and records the firmware version
+ *                      for benchmark results.
+ *
+ * @return       Kicksmash features (KS_FEATURE_*), or 0 on failure.
+ */
 static uint
-sm_fsetprotect(hm_fopenhandle_t *hm, uint *status)
+bench_device_enter(void)
 {
-    /* Resolve handle to Amiga-specific path */
-    handle_ent_t *phandle = handle_get(hm->hm_handle);
-    char         *name    = (char *)(hm + 1);
-    char         *path    = NULL;
-    char         *apath;
-    uint32_t      aperms = SWAP32(hm->hm_aperms);
-    uint          uperms;
-
-    fsprintf("fsetprotect(%s %x)\n", name, aperms);
-    hm->hm_hdr.km_op |= KM_OP_REPLY;
-
-    if ((apath = make_amiga_relpath(&phandle, name)) == NULL) {
-        fsprintf("fsetprotect(%s) relative path failed\n", name);
-reply_setprotect_fail:
-        if (path != NULL)
-            free(path);
-        if (apath != NULL)
-            free(apath);
-        hm->hm_handle = 0;
-        if (hm->hm_hdr.km_status == KM_STATUS_OK)
-            hm->hm_hdr.km_status = KM_STATUS_FAIL;
-        return (send_msg(hm, sizeof (*hm), status));
-    }
+    smash_id_t id;
+    uint       status;
+    uint       features = ks_service_enter();
 
-    if (phandle == NULL) {
-        /* Can't set perms on the volume directory */
-        fsprintf("fsetprotect(%s) can't set perms on the volume directory\n",
-                 name);
-        hm->hm_hdr.km_status = KM_STATUS_INVALID;
-        goto reply_setprotect_fail;
+    if (features == 0) {
+        warnx("Kicksmash did not enter service mode");
+        return (0);
     }
-    path = make_host_path(phandle->he_avolume, apath);
-
-    if (volume_get_by_path(path, 0) != NULL) {
-        fsprintf("fsetprotect(%s) can't set perms on a volume\n", path);
-        hm->hm_hdr.km_status = KM_STATUS_PERM;
-        goto reply_setprotect_fail;
+    if ((bench_fw[0] == '\0') &&
+        (send_ks_cmd(KS_CMD_ID, NULL, 0, &id, sizeof (id),
+                     &status, NULL, 0) == 0) && (status == KS_STATUS_OK)) {
+        snprintf(bench_fw, sizeof (bench_fw), "%u.%u-%02u%02u%02u%02u",
+                 SWAP16(id.si_ks_version[0]), SWAP16(id.si_ks_version[1]),
+                 id.si_ks_date[0], id.si_ks_date[1],
+                 id.si_ks_date[2], id.si_ks_date[3]);
     }
-    uperms = host_perms_from_amiga(aperms);
-    fsprintf("uperms=%x %o\n", uperms, uperms);
+    return (features);
+}
 
-    if (chmod(path, uperms)) {
-        fsprintf("chmod fail\n");
-        hm->hm_hdr.km_status = errno_to_km_status();
-        goto reply_setprotect_fail;
-    }
+#define BENCH_HANDLES 100000
 
-    free(apath);
-    free(path);
+/*
+ * bench_handles() measures handle table open, lookup (by handle and by
+ *                 name), and close using BENCH_HANDLES open handles.
+ */
+static int
+bench_handles(void)
+{
+    handle_ent_t **nodes = malloc(BENCH_HANDLES * sizeof (*nodes));
+    handle_t      *handles = malloc(BENCH_HANDLES * sizeof (*handles));
+    char           name[64];
+    uint64_t       start;
+    uint           cur;
+    uint           pass;
+    uint           missed = 0;
+    uint           saved_debug_fs = debug_fs;
+
+    if ((nodes == NULL) || (handles == NULL))
+        errx(EXIT_FAILURE, "Could not allocate benchmark tables");
+
+    debug_fs = 0;
+    printf("Handle table: %u handles\n", BENCH_HANDLES);
+    for (pass = 0; pass < 2; pass++) {
+        /* Second pass runs with a warm handle pool and table */
+        start = bench_usec();
+        for (cur = 0; cur < BENCH_HANDLES; cur++) {
+            sprintf(name, "Work/Drawer%u/file%u", cur / 64, cur);
+            nodes[cur] = handle_new(name, "", NULL, HM_TYPE_FILE,
+                                    HM_MODE_READ);
+            if (nodes[cur] == NULL)
+                errx(EXIT_FAILURE, "handle_new failed at %u", cur);
+            handles[cur] = nodes[cur]->he_handle;
+        }
+        bench_report(pass ? "open (warm)" : "open", BENCH_HANDLES,
+                     bench_usec() - start);
+
+        start = bench_usec();
+        for (cur = 0; cur < BENCH_HANDLES; cur++) {
+            /* Stride through the table rather than sequential order */
+            uint idx = (cur * 7919) % BENCH_HANDLES;
+            if (handle_get(handles[idx]) != nodes[idx])
+                missed++;
+            handle_release(0);
+        }
+        bench_report("lookup by handle", BENCH_HANDLES, bench_usec() - start);
 
-    hm->hm_hdr.km_status = KM_STATUS_OK;
-    return (send_msg(hm, sizeof (*hm), status));
+        start = bench_usec();
+        for (cur = 0; cur < BENCH_HANDLES; cur += 16) {
+            sprintf(name, "Work/Drawer%u/file%u", cur / 64, cur);
+            if (handle_get_name(name) != nodes[cur])
+                missed++;
+        }
+        bench_report("lookup by name", BENCH_HANDLES / 16,
+                     bench_usec() - start);
+
+        start = bench_usec();
+        for (cur = 0; cur < BENCH_HANDLES; cur++)
+            handle_free(handles[(cur * 7919) % BENCH_HANDLES]);
+        bench_report(pass ? "close (warm)" : "close", BENCH_HANDLES,
+                     bench_usec() - start);
+    }
+    debug_fs = saved_debug_fs;
+    free(nodes);
+    free(handles);
+
+    if (missed != 0 || board_cur->b_handle_count != 0) {
+        printf("Handle table inconsistency: %u missed, %u remain\n",
+               missed, board_cur->b_handle_count);
+        return (1);
+    }
+    return (0);
 }
 
-static void
-process_msg(uint status, uint8_t *rxdata, uint rxlen)
+#define BENCH_FLASHCMD_COUNT 10
+#define BENCH_FLASHCMD_LEN   0x10000
+
+/*
+ * bench_flashcmd() compares the CLI text commands against the binary
+ *                  command channel for the flash id and erase check
+ *                  operations. The Amiga must be held in reset.
+ */
+static int
+bench_flashcmd(void)
 {
-    km_msg_hdr_t *km = (km_msg_hdr_t *) rxdata;
-    uint pos;
-    uint rc;
-    uint op;
-    uint retry = 1;
+    smash_flash_id_t fid;
+    char             cmd_output[100];
+    int              rxcount;
+    int              rc_text;
+    int              rc_bin;
+    uint64_t         start;
+    uint             cur;
 
-#ifdef MSG_DEBUG
-    msgprintf("  got msg %04x len=%04x op=%02x mstatus=%02x tag=%02x data ",
-              status, rxlen, km->km_op, km->km_status, km->km_tag);
-    for (pos = sizeof (*km); pos < 32; pos++) {
-        msgprintf(" %02x", rxdata[pos]);
+    switch (amiga_is_in_reset()) {
+        case 1:
+            break;
+        case 0:
+            warnx("Amiga must be held in reset (reset amiga hold)");
+            /* FALLTHROUGH */
+        default:
+            return (1);
     }
-    msgprintf("\n");
-#endif
-    if (rxlen < sizeof (*km)) {
-        printf("Got invalid message: len=%04x status=%04x", rxlen, status);
-        for (pos = sizeof (*km); pos < ((rxlen + 1) & ~1); pos++) {
-            printf(" %02x", rxdata[pos]);
-        }
-        printf("\n");
+    if ((ks_service_enter() & KS_FEATURE_FLASH_USB) == 0) {
+        warnx("Kicksmash firmware does not support binary flash commands");
+        return (1);
     }
-    if (km->km_op & KM_OP_REPLY) {
-        printf("Got op %02x reply, status=%02x\n",
-               km->km_op, km->km_status);
-        return;
+
+    printf("Flash commands: CLI text vs binary\n");
+    start = bench_usec();
+    for (cur = 0; cur < BENCH_FLASHCMD_COUNT; cur++) {
+        if (send_cmd("prom id") ||
+            recv_output(cmd_output, sizeof (cmd_output), &rxcount, 80))
+            return (1);
     }
+    bench_report("id (text)", BENCH_FLASHCMD_COUNT, bench_usec() - start);
 
-    op = km->km_op;
-    do {
-        switch (op) {
-            case KM_OP_NULL:
-                rc = sm_null(km, &status);
-                break;
-            case KM_OP_LOOPBACK:
-                rc = sm_loopback(km, rxdata, rxlen, &status);
-                break;
-            case KM_OP_ID:
-                rc = sm_id(km, &status);
-                break;
-            case KM_OP_FOPEN:
-                rc = sm_fopen((hm_fopenhandle_t *)rxdata, &status);
-                break;
-            case KM_OP_FCLOSE:
-                rc = sm_fclose((hm_fopenhandle_t *)rxdata, &status);
-                break;
-            case KM_OP_FREAD:
-                rc = sm_fread((hm_freadwrite_t *)rxdata, &status);
-                break;
-            case KM_OP_FWRITE:
-                rc = sm_fwrite((hm_freadwrite_t *)rxdata, rxlen, &status);
-                break;
-            case KM_OP_FSEEK:
-                rc = sm_fseek((hm_fseek_t *)rxdata, &status);
-                break;
-            case KM_OP_FCREATE:
-                rc = sm_fcreate((hm_fopenhandle_t *)rxdata, &status);
-                break;
-            case KM_OP_FDELETE:
-                rc = sm_fdelete((hm_fhandle_t *)rxdata, &status);
-                break;
-            case KM_OP_FRENAME:
-                rc = sm_frename((hm_frename_t *)rxdata, &status);
-                break;
-            case KM_OP_FPATH:
-                rc = sm_fpath((hm_fhandle_t *)rxdata, &status);
-                break;
-            case KM_OP_FSETDATE:
-                rc = sm_fsetdate((hm_fsetdate_t *)rxdata, &status);
-                break;
-            case KM_OP_FSETOWN:
-                rc = sm_fsetown((hm_fsetown_t *)rxdata, &status);
-                break;
-            case KM_OP_FSETPERMS:
-                rc = sm_fsetprotect((hm_fopenhandle_t *)rxdata, &status);
-                break;
-            default:
-                rc = sm_unknown(km, &status);
-                break;
-        }
-        if (rc == 0)
-            rc = status;
+    start = bench_usec();
+    for (cur = 0; cur < BENCH_FLASHCMD_COUNT; cur++) {
+        if ((ks_service_enter() == 0) || ks_flash_getid(&fid))
+            return (1);
+    }
+    bench_report("id (binary)", BENCH_FLASHCMD_COUNT, bench_usec() - start);
 
-        if (rc == 0)
-            break;
+    start = bench_usec();
+    for (cur = 0; cur < BENCH_FLASHCMD_COUNT; cur++)
+        rc_text = eeprom_not_erased_text(0, BENCH_FLASHCMD_LEN);
+    bench_report("erase check (text)", BENCH_FLASHCMD_COUNT,
+                 bench_usec() - start);
 
-        printf("KS send_msg failure op=%x status=%02x: %d (%s)\n",
-               km->km_op, status, rc, smash_err(rc));
-        time_delay_msec(100);
-    } while (retry-- > 0);
+    start = bench_usec();
+    for (cur = 0; cur < BENCH_FLASHCMD_COUNT; cur++) {
+        if (ks_service_enter() == 0)
+            return (1);
+        rc_bin = eeprom_not_erased_bin(0, BENCH_FLASHCMD_LEN);
+    }
+    bench_report("erase check (binary)", BENCH_FLASHCMD_COUNT,
+                 bench_usec() - start);
+
+    printf("  0x%x bytes at 0x0 %s erased\n", BENCH_FLASHCMD_LEN,
+           (rc_bin == 0) ? "are" : "are not");
+    if (rc_text != rc_bin) {
+        printf("Erase check mismatch: text=%d binary=%d\n", rc_text, rc_bin);
+        return (1);
+    }
+    return (0);
 }
 
-static uint
-handle_atou_messages(void)
+#define BENCH_LOOPBACK_COUNT 200
+
+/*
+ * bench_loopback() measures KS_CMD_LOOPBACK round-trip latency over a
+ *                  range of payload sizes. Kicksmash echoes the complete
+ *                  message, so each round trip moves the payload in both
+ *                  directions.
+ */
+static int
+bench_loopback(void)
 {
-    uint8_t   rxdata[4096];
-    uint      status;
-    uint      rxlen;
-    uint      rc;
-    uint      handled = 0;
+    static const uint sizes[] = { 0, 16, 64, 256, 1024, 2000 };
+    uint8_t           txbuf[2048];
+    uint8_t           rxbuf[2048 + KS_HDR_AND_CRC_LEN];
+    uint32_t          samples[BENCH_LOOPBACK_COUNT];
+    uint              cur;
+    uint              pos;
+
+    if (bench_device_enter() == 0)
+        return (1);
+    for (pos = 0; pos < sizeof (txbuf); pos++)
+        txbuf[pos] = pos * 7 + (pos >> 8);
+
+    printf("KS_CMD_LOOPBACK round trip (Kicksmash %s)\n", bench_fw);
+    printf("  %-16s %5s %5s\n", "", "size", "");
+    for (cur = 0; cur < ARRAY_SIZE(sizes); cur++) {
+        uint     len = sizes[cur];
+        uint64_t start = bench_usec();
+        uint64_t op_start;
+
+        for (pos = 0; pos < BENCH_LOOPBACK_COUNT; pos++) {
+            uint status;
+            uint rxlen;
+            uint rc;
+
+            op_start = bench_usec();
+            rc = send_ks_cmd(KS_CMD_LOOPBACK, txbuf, len, rxbuf,
+                             sizeof (rxbuf), &status, &rxlen, 1);
+            samples[pos] = bench_usec() - op_start;
+            if ((rc != 0) || (status != 0) || (rxlen != len)) {
+                printf("Loopback of %u bytes failed: %d (%s) len=%u\n",
+                       len, rc, smash_err(rc ? rc : status), rxlen);
+                return (1);
+            }
+        }
+        bench_report_lat("loopback", len, BENCH_LOOPBACK_COUNT,
+                         (uint64_t) len * 2 * BENCH_LOOPBACK_COUNT,
+                         bench_usec() - start, samples);
+    }
+    return (0);
+}
 
-    /*
-     * Note that the length, command, and payload of messages received from
-     * the Amiga are byte-swapped (B1 B0 B3 B2 B5 B4...). The send_msg()
-     * and recv_msg() functions take care of this byte swapping.
-     */
-    while (1) {
-        rc = recv_msg(rxdata, sizeof (rxdata), &status, &rxlen);
+#define BENCH_MSG_COUNT 100
 
-        if (rc != 0) {
-            printf("KS recv_msg failure: %d (%s)\n", rc, smash_err(rc));
-            return (rc);
-        }
-        if (status == KS_CMD_MSG_SEND) {
-            process_msg(status, rxdata, rxlen);
-            handled++;
-        } else if ((status == KS_STATUS_NODATA) ||
-                   (status == KS_STATUS_LOCKED)) {
-            break;
-        } else {
-            printf("status=%04x len=%x", status, rxlen);
-            if (rxlen > 0) {
-                uint pos;
-                printf(" data=");
-                for (pos = 0; pos < rxlen; pos++) {
-                    if (pos > 0)
-                        printf(" ");
-                    printf("%02x", rxdata[pos]);
-                }
+/*
+ * bench_msg() measures KS_CMD_MSG_SEND / KS_CMD_MSG_RECEIVE throughput
+ *             over a range of payload sizes. Messages are sent to the
+ *             alternate (Amiga-to-USB) buffer, so each one is received
+ *             back by the host without requiring Amiga participation.
+ *             Each operation is one send plus one receive.
+ */
+static int
+bench_msg(void)
+{
+    static const uint sizes[] = { 16, 64, 256, 512, 1024, SEND_MSG_MAX };
+    uint8_t           txbuf[SEND_MSG_MAX];
+    uint8_t           rxbuf[SEND_MSG_MAX + 16];
+    uint32_t          samples[BENCH_MSG_COUNT];
+    uint              status;
+    uint              cur;
+    uint              pos;
+
+    if (bench_device_enter() == 0)
+        return (1);
+    if ((send_ks_cmd(KS_CMD_MSG_FLUSH, NULL, 0, NULL, 0, &status,
+                     NULL, 0) != 0) || (status != KS_STATUS_OK)) {
+        printf("KS Msg Flush failed: %d (%s)\n", status, smash_err(status));
+        return (1);
+    }
+    for (pos = 0; pos < sizeof (txbuf); pos++)
+        txbuf[pos] = pos * 13 + (pos >> 8);
+
+    printf("KS_CMD_MSG_SEND + KS_CMD_MSG_RECEIVE (Kicksmash %s)\n",
+           bench_fw);
+    printf("  %-16s %5s %5s\n", "", "size", "");
+    for (cur = 0; cur < ARRAY_SIZE(sizes); cur++) {
+        uint     len = sizes[cur];
+        uint64_t start = bench_usec();
+        uint64_t op_start;
+
+        for (pos = 0; pos < BENCH_MSG_COUNT; pos++) {
+            uint rxlen;
+            uint rc;
+
+            op_start = bench_usec();
+            rc = send_ks_cmd_swap(KS_CMD_MSG_SEND | KS_MSG_ALTBUF,
+                                  txbuf, len, NULL, 0, &status);
+            if ((rc != 0) || (status != KS_STATUS_OK)) {
+                printf("Message send of %u bytes failed: %d (%s)\n",
+                       len, rc, smash_err(rc ? rc : status));
+                return (1);
+            }
+            rc = recv_msg(rxbuf, sizeof (rxbuf), &status, &rxlen);
+            samples[pos] = bench_usec() - op_start;
+            if ((rc != 0) ||
+                ((status & ~KS_MSG_ALTBUF) != KS_CMD_MSG_SEND) ||
+                (rxlen != len) || (memcmp(rxbuf, txbuf, len) != 0)) {
+                printf("Message receive of %u bytes failed: %d (%s) "
+                       "status=%04x len=%u\n", len, rc, smash_err(rc),
+                       status, rxlen);
+                return (1);
             }
-            printf("\n");
-            break;
         }
+        bench_report_lat("msg", len, BENCH_MSG_COUNT,
+                         (uint64_t) len * BENCH_MSG_COUNT,
+                         bench_usec() - start, samples);
     }
-    return (handled);
+    return (0);
 }
 
-static void
-run_message_mode(void)
+#define BENCH_FLASH_BLOCK 0x10000
+#define BENCH_FLASH_ALIGN 0x40000  // Larger than any flash sector
+
+/*
+ * bench_flash_pass() reads or writes a flash range in BENCH_FLASH_BLOCK
+ *                    sized operations, reporting throughput and
+ *                    per-block latency.
+ *
+ * @param [in] name  - Benchmark case name.
+ * @param [io] buf   - Data to write, or buffer for read data.
+ * @param [in] addr  - Flash starting address.
+ * @param [in] len   - Length to read or write.
+ * @param [in] write - TRUE to write flash, FALSE to read.
+ *
+ * @return       0 - Success.
+ * @return       1 - Failure.
+ */
+static int
+bench_flash_pass(const char *name, uint8_t *buf, uint addr, uint len,
+                 bool_t write)
 {
-    char buf[2048];
-    uint rxlen;
-    uint status;
-    uint rc;
-    uint curtick = 10;
-    uint fstick = 0;
-    uint count;
-    uint16_t app_state = MSG_STATE_SERVICE_UP | MSG_STATE_HAVE_LOOPBACK;
-    smash_msg_info_t mi;
+    uint      count = (len + BENCH_FLASH_BLOCK - 1) / BENCH_FLASH_BLOCK;
+    uint32_t *samples = malloc(count * sizeof (*samples));
+    uint64_t  start;
+    uint64_t  op_start;
+    uint      pos;
+    uint      cur;
+    int       rc = 0;
+
+    if (samples == NULL)
+        err(EXIT_FAILURE, "malloc failed");
+    start = bench_usec();
+    for (cur = 0, pos = 0; pos < len; cur++, pos += BENCH_FLASH_BLOCK) {
+        uint blen = len - pos;
+        if (blen > BENCH_FLASH_BLOCK)
+            blen = BENCH_FLASH_BLOCK;
+        op_start = bench_usec();
+        if (write)
+            rc = eeprom_write(buf + pos, addr + pos, blen);
+        else
+            rc = eeprom_read_range(buf + pos, addr + pos, blen);
+        samples[cur] = bench_usec() - op_start;
+        if (rc != 0) {
+            printf("Flash %s at 0x%x failed\n", write ? "write" : "read",
+                   addr + pos);
+            rc = 1;
+            break;
+        }
+    }
+    if (rc == 0) {
+        bench_report_lat(name, BENCH_FLASH_BLOCK, count, len,
+                         bench_usec() - start, samples);
+    }
+    free(samples);
+    return (rc);
+}
 
-    if (amiga_vol_head != NULL)
-        app_state |= MSG_STATE_HAVE_FILE;
+/*
+ * bench_flash() measures flash read rate and, if an erased range was
+ *               specified with -a, flash write rate. The written range
+ *               is verified and erased again afterward. The Amiga must
+ *               be held in reset.
+ */
+static int
+bench_flash(void)
+{
+    uint     addr = (bench_addr == ADDR_NOT_SPECIFIED) ? 0 : bench_addr;
+    uint     len = (bench_len == EEPROM_SIZE_NOT_SPECIFIED) ?
+                   BENCH_FLASH_ALIGN : bench_len;
+    uint8_t *wbuf;
+    uint8_t *rbuf;
+    uint     pos;
+    int      rc;
 
-    msgprintf("Message mode\n");
-    app_state_send[0] = SWAP16(0xffff);     // Affect all bits
-    app_state_send[1] = SWAP16(app_state);  // Message service up
+    switch (amiga_is_in_reset()) {
+        case 1:
+            break;
+        case 0:
+            warnx("Amiga must be held in reset (reset amiga hold)");
+            /* FALLTHROUGH */
+        default:
+            return (1);
+    }
+    if (bench_device_enter() == 0)
+        return (1);
 
-    if (send_cmd("prom service"))
-        return; // "timeout" was reported in this case
+    wbuf = malloc(len);
+    rbuf = malloc(len);
+    if ((wbuf == NULL) || (rbuf == NULL))
+        err(EXIT_FAILURE, "malloc failed");
 
-    show_ks_inquiry();
+    printf("Flash 0x%x bytes at 0x%x (Kicksmash %s)\n", len, addr, bench_fw);
+    printf("  %-16s %5s %5s\n", "", "block", "");
+    rc = bench_flash_pass("flash read", rbuf, addr, len, FALSE);
+    if ((rc != 0) || (bench_addr == ADDR_NOT_SPECIFIED)) {
+        if (rc == 0)
+            printf("  Specify -a <addr> of an erased area to test writes\n");
+        goto done;
+    }
 
-    rc = send_ks_cmd(KS_CMD_MSG_STATE | KS_MSG_STATE_SET, app_state_send,
-                     sizeof (app_state_send), buf, sizeof (buf), &status,
-                     &rxlen, 1);
-    if (rc == 0)
-        rc = status;
-    if (rc != 0) {
-        printf("KS Set App State failed: %d (%s)\n", rc, smash_err(rc));
-        return;
+    if (((addr | len) & (BENCH_FLASH_ALIGN - 1)) != 0) {
+        warnx("Write test address and length must be multiples of 0x%x",
+              BENCH_FLASH_ALIGN);
+        rc = 1;
+        goto done;
+    }
+    if (eeprom_not_erased(BANK_NOT_SPECIFIED, addr, len) != 0) {
+        warnx("Flash at 0x%x is not erased; not testing writes", addr);
+        rc = 1;
+        goto done;
+    }
+    for (pos = 0; pos < len; pos++)
+        wbuf[pos] = pos * 11 + (pos >> 8);
+    rc = bench_flash_pass("flash write", wbuf, addr, len, TRUE);
+    if ((rc == 0) && (eeprom_read_range(rbuf, addr, len) == 0) &&
+        (memcmp(rbuf, wbuf, len) != 0)) {
+        printf("Flash write verify failed\n");
+        rc = 1;
     }
+    if (eeprom_erase_range(addr, len) != 0) {
+        printf("Failed to erase benchmark area at 0x%x\n", addr);
+        rc = 1;
+    }
+done:
+    free(wbuf);
+    free(rbuf);
+    return (rc);
+}
 
-    rc = send_ks_cmd(KS_CMD_MSG_FLUSH, NULL, 0, NULL, 0, &status, NULL, 0);
-    if (rc == 0)
-        rc = status;
-    if (rc != 0) {
-        printf("KS Msg Flush failed: %d (%s)\n", rc, smash_err(rc));
-        return;
+#ifndef __MINGW32__
+#define BENCH_RING_BYTES (16 << 20)
+
+typedef struct {
+    uint64_t br_len;       // Bytes to receive
+    uint64_t br_errors;    // Data miscompares
+    bool_t   br_bytewise;  // Use the single character ring interface
+    board_t *br_board;     // Board whose receive ring is drained
+} bench_ring_t;
+
+/*
+ * bench_ring_byte() returns the loopback benchmark data pattern byte
+ *                   expected at the specified stream offset.
+ */
+static inline uint8_t
+bench_ring_byte(uint64_t pos)
+{
+    return ((uint8_t) (pos + (pos >> 12)));
+}
+
+/*
+ * bench_ring_echo() is the far end of the ring buffer loopback benchmark.
+ *                   It sends back everything which it receives.
+ */
+static void *
+bench_ring_echo(void *arg)
+{
+    int     fd = *(int *) arg;
+    uint8_t buf[8192];
+    ssize_t len;
+
+    while ((len = read(fd, buf, sizeof (buf))) > 0) {
+        ssize_t pos = 0;
+        while (pos < len) {
+            ssize_t count = write(fd, buf + pos, len - pos);
+            if (count <= 0)
+                return (NULL);
+            pos += count;
+        }
     }
+    return (NULL);
+}
 
-    while (1) {
-        if (curtick != 0) {
-            if (curtick < 1024)
-                usleep(curtick);
-            else
-                time_delay_msec(curtick / 1024);
-            fstick += (curtick / 1024) + 10;
+/*
+ * bench_ring_drain() consumes and checks loopback benchmark data arriving
+ *                    in the receive ring buffer.
+ */
+static void *
+bench_ring_drain(void *arg)
+{
+    bench_ring_t *br = arg;
+    uint8_t       buf[4096];
+    uint64_t      pos = 0;
+
+    board_cur = br->br_board;
+    while (pos < br->br_len) {
+        uint count;
+        uint cur;
+
+        if (br->br_bytewise) {
+            int ch = rx_rb_get();
+            count = (ch >= 0);
+            buf[0] = ch;
         } else {
-            fstick += 20;
+            count = ring_get(&board_cur->b_rx_ring, buf, sizeof (buf));
         }
-        if (fstick >= 5000) {
-            fstick = 0;
-            keep_app_state();  // do this once every 5 seconds
+        if (count == 0) {
+            if (rx_rb_wait(2000) == 0)
+                break;  // Data stopped arriving
+            continue;
         }
+        for (cur = 0; cur < count; cur++, pos++)
+            if (buf[cur] != bench_ring_byte(pos))
+                br->br_errors++;
+    }
+    br->br_len = pos;
+    return (NULL);
+}
 
-        if (curtick > 1000) {
-            rc = send_ks_cmd(KS_CMD_MSG_INFO, NULL, 0, &mi, sizeof (mi),
-                             &status, NULL, 0);
-            if (rc != 0) {
-                printf("KS message failure: %d (%s)\n", rc, smash_err(rc));
+/*
+ * bench_ring() measures throughput of the transmit and receive ring
+ *              buffers and serial threads by looping data back through a
+ *              socket pair in place of the Kicksmash device. The first
+ *              pass uses single character ring operations and 64-byte
+ *              device writes; the second uses bulk ring operations and
+ *              coalesced writes.
+ */
+static int
+bench_ring(void)
+{
+    static int   echo_fd;
+    int          sv[2];
+    uint8_t      buf[4096];
+    uint64_t     start;
+    uint64_t     pos;
+    uint         pass;
+    int          rc = 0;
+    pthread_t    thread_id;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0)
+        err(EXIT_FAILURE, "socketpair");
+    echo_fd = sv[1];
+    board_cur->b_dev_fd = sv[0];
+    strcpy(board_cur->b_device_name, "loopback");
+    if (pthread_create(&thread_id, NULL, bench_ring_echo, &echo_fd))
+        err(EXIT_FAILURE, "failed to create loopback thread");
+    create_threads();
+
+    printf("Ring buffer loopback: %u MB\n", BENCH_RING_BYTES >> 20);
+    for (pass = 0; pass < 2; pass++) {
+        bench_ring_t br;
+        pthread_t    drain_id;
+        uint64_t     usec;
+        const char  *name;
+
+        br.br_len = BENCH_RING_BYTES;
+        br.br_errors = 0;
+        br.br_bytewise = (pass == 0);
+        br.br_board = board_cur;
+        tx_write_max = (pass == 0) ? USB_PKT_SIZE : TX_WRITE_MAX;
+
+        start = bench_usec();
+        if (pthread_create(&drain_id, NULL, bench_ring_drain, &br))
+            err(EXIT_FAILURE, "failed to create drain thread");
+        for (pos = 0; pos < BENCH_RING_BYTES; ) {
+            uint cur;
+            uint len = sizeof (buf);
+
+            for (cur = 0; cur < len; cur++)
+                buf[cur] = bench_ring_byte(pos + cur);
+            if (br.br_bytewise) {
+                for (cur = 0; cur < len; cur++)
+                    while (tx_rb_put(buf[cur]))
+                        ring_wait(&board_cur->b_tx_ring, TRUE, 100);
+            } else if (tx_rb_put_all(buf, len, 2000) < len) {
                 break;
             }
-            if ((mi.smi_atou_inuse != 0) || (mi.smi_utoa_inuse != 0)) {
-                msgprintf("  atou inuse=%u avail=%u  utoa inuse=%u avail=%u\n",
-                          SWAP16(mi.smi_atou_inuse),
-                          SWAP16(mi.smi_atou_avail),
-                          SWAP16(mi.smi_utoa_inuse),
-                          SWAP16(mi.smi_utoa_avail));
-            }
+            pos += len;
         }
-
-        count = handle_atou_messages();
-        if (count != 0) {
-            /* Handled message */
-            curtick = 0;
-            fstick += count * 10;
-        } else {
-            /* No message */
-            if (curtick == 0)
-                curtick = 10;
-            else if (curtick < 500000)
-                curtick += curtick / 2;
+        pthread_join(drain_id, NULL);
+        usec = bench_usec() - start;
+        if (usec == 0)
+            usec = 1;
+
+        name = br.br_bytewise ? "byte ring, 64B writes" :
+                                "bulk ring, 4K writes";
+        printf("  %-22s %7.1f MB/s\n", name, (double) br.br_len / usec);
+        bench_out_row(name, br.br_bytewise ? USB_PKT_SIZE : sizeof (buf),
+                      BENCH_RING_BYTES / sizeof (buf), br.br_len, usec, NULL);
+        if ((br.br_len != BENCH_RING_BYTES) || (br.br_errors != 0)) {
+            printf("Loopback failed: received %" PRIu64 " of %u bytes, "
+                   "%" PRIu64 " miscompares\n",
+                   br.br_len, BENCH_RING_BYTES, br.br_errors);
+            rc = 1;
+            break;
         }
     }
+    return (rc);
 }
+#endif
 
-/* Amiga time is in seconds since 1978 */
-#define AMIGA_SEC_TO_UNIX_SEC (2922 * 24 * 60 * 60)  // 1978 - 1970 = 2922 days
+static const struct {
+    const char *bt_name;
+    int       (*bt_func)(void);
+    bool_t      bt_device;  // Requires Kicksmash device
+} bench_tests[] = {
+    { "handles",  bench_handles,  FALSE },
+    { "flashcmd", bench_flashcmd, TRUE },
+    { "loopback", bench_loopback, TRUE },
+    { "msg",      bench_msg,      TRUE },
+    { "flash",    bench_flash,    TRUE },
+#ifndef __MINGW32__
+    { "ring",     bench_ring,     FALSE },
+#endif
+};
 
-static rc_t
-clock_ks_set(int enter)
+/*
+ * bench_needs_device() returns TRUE if the named benchmark requires a
+ *                      Kicksmash device.
+ */
+static bool_t
+bench_needs_device(const char *name)
 {
-    rc_t rc = 0;
-    uint32_t amtime[2];
-    struct timeval tv;
-    struct timezone tz;
-    uint rxlen;
-    uint status;
-
-    if (gettimeofday(&tv, &tz)) {
-        printf("gettimeofday failed: %d\n", errno);
-        return (RC_FAILURE);
-    }
-    amtime[0] = get_localtime(tv.tv_sec - AMIGA_SEC_TO_UNIX_SEC);
-    amtime[1] = tv.tv_usec;
-
-    if (enter && send_cmd("prom service")) {
-        printf("could not enter prom service\n");
-        return (RC_TIMEOUT); // "timeout" was reported in this case
-    }
-    rc = send_ks_cmd(KS_CMD_CLOCK | KS_CLOCK_SET, amtime, sizeof (amtime),
-                     NULL, 0, &status, &rxlen, 0);
-    if (rc != 0) {
-        printf("KS clock set failed: %d (%s)\n", rc, smash_err(rc));
-        return (rc);
-    }
-    return (rc);
+    uint cur;
+    for (cur = 0; cur < ARRAY_SIZE(bench_tests); cur++)
+        if (strcmp(name, bench_tests[cur].bt_name) == 0)
+            return (bench_tests[cur].bt_device);
+    return (FALSE);
 }
 
-static rc_t
-clock_ks_show(int enter)
+/*
+ * run_bench() runs the named benchmark.
+ *
+ * @param [in] name - Benchmark to run.
+ *
+ * @return       0 - Success.
+ * @return       1 - Failure.
+ */
+static int
+run_bench(const char *name)
 {
-    time_t timev;
-    uint32_t amtime[2];
-    struct tm *tm;
-    uint rxlen;
-    uint status;
-    rc_t rc;
-
-    if (enter && send_cmd("prom service")) {
-        printf("could not enter prom service\n");
-        return (RC_TIMEOUT); // "timeout" was reported in this case
-    }
-    rc = send_ks_cmd(KS_CMD_CLOCK, NULL, 0, amtime, sizeof (amtime), &status,
-                     &rxlen, 0);
-    if (rc != 0) {
-        printf("KS clock request failed: %d (%s)\n", rc, smash_err(rc));
-        return (rc);
-    }
-
-    if ((amtime[0] == 0) && (amtime[1] == 0)) {
-        printf("Kicksmash time has not been set\n");
-        return (RC_FAILURE);
+    uint cur;
+    int  rc;
+
+    for (cur = 0; cur < ARRAY_SIZE(bench_tests); cur++) {
+        if (strcmp(name, bench_tests[cur].bt_name) == 0) {
+            bench_test = name;
+            rc = bench_tests[cur].bt_func();
+            bench_out_close();
+            return (rc);
+        }
     }
 
-    timev = get_utctime(amtime[0] + AMIGA_SEC_TO_UNIX_SEC);
-    tm = localtime(&timev);
-
-    printf("%04u-%02u-%02u %02u:%02u:%02u.%06u\n",
-            tm->tm_year + 1900, tm->tm_mon + 1, tm->tm_mday,
-            tm->tm_hour, tm->tm_min, tm->tm_sec, amtime[1]);
-    return (0);
+    warnx("Unknown benchmark \"%s\": use handles, flashcmd, ring, "
+          "loopback, msg, or flash", name);
+    return (1);
 }
 
-
 /*
  * run_mode() handles command line options provided by the user.
  *
@@ -6456,7 +11986,7 @@ run_mode(uint mode, uint bank, uint baseaddr, uint len, uint report_max,
     if (mode & MODE_ERASE) {
         if (eeprom_erase(bank, baseaddr, len))
             return (1);
-    } else if (mode & MODE_WRITE) {
+    } else if ((mode & MODE_WRITE) && !(mode & MODE_DELTA)) {
         uint temp;
         switch (eeprom_not_erased(bank, baseaddr, len)) {
             case -1:
@@ -6510,8 +12040,13 @@ run_mode(uint mode, uint bank, uint baseaddr, uint len, uint report_max,
         execute_swapmode(filebuf, len, SWAP_TO_ROM);
 
         do {
-            if ((mode & MODE_WRITE) &&
-                (eeprom_write(filebuf, baseaddr, len) != 0)) {
+            if ((mode & MODE_WRITE) && (mode & MODE_DELTA)) {
+                if (eeprom_write_delta(filebuf, baseaddr, len) != 0) {
+                    rc = 1;
+                    break;
+                }
+            } else if ((mode & MODE_WRITE) &&
+                       (eeprom_write(filebuf, baseaddr, len) != 0)) {
                 rc = 1;
                 break;
             }
@@ -6589,6 +12124,10 @@ main(int argc, char * const *argv)
     char            *file1      = NULL;
     char            *file2      = NULL;
     uint             mode       = MODE_UNKNOWN;
+    const char      *bench_name = NULL;
+    const char      *bench_out_name = NULL;
+    bool_t           all_boards = FALSE;
+    board_t         *board;
 #ifndef __MINGW32__
     struct sigaction sa;
 
@@ -6598,9 +12137,14 @@ main(int argc, char * const *argv)
     (void) sigaction(SIGINT,  &sa, NULL);
     (void) sigaction(SIGQUIT, &sa, NULL);
     (void) sigaction(SIGPIPE, &sa, NULL);
+#ifdef HAVE_MMAP
+    sa.sa_handler = filemap_sigbus;
+    (void) sigaction(SIGBUS, &sa, NULL);
+#endif
 #endif
 
-    device_name[0] = '\0';
+    board_cur = &board_first;
+    board_init(&board_first, 0);
 
     while ((ch = getopt_long(argc, argv, short_opts, long_opts,
                              &long_index)) != EOF) {
@@ -6651,7 +12195,15 @@ errx(EXIT_FAILURE, "how did we get here?");
                 ic_delay = atou(optarg);
                 break;
             case 'd':
-                strcpy(device_name, optarg);
+                if (board_get_by_name(optarg) != NULL)
+                    errx(EXIT_FAILURE, "Device %s specified twice", optarg);
+                if (board_cur->b_device_name[0] == '\0') {
+                    snprintf(board_cur->b_device_name,
+                             sizeof (board_cur->b_device_name), "%s", optarg);
+                } else {
+                    /* Following -m options apply to this board */
+                    board_cur = board_new(optarg);
+                }
                 break;
             case 'e':
                 if (mode & (MODE_ID | MODE_READ | MODE_TERM))
@@ -6738,17 +12290,81 @@ errx(EXIT_FAILURE, "how did we get here?");
             case 'y':
                 force_yes = TRUE;
                 break;
+            case 0x80 + 'd':
+                mode |= MODE_DELTA;
+                break;
+            case 0x80 + 'B':
+                all_boards = TRUE;
+                break;
             case 'h':
             case '?':
                 usage(stdout);
                 exit(EXIT_SUCCESS);
                 break;
+            case 0x80 + 'b':
+                if (mode != MODE_UNKNOWN)
+                    errx(EXIT_FAILURE,
+                         "--bench may not be specified with any other mode");
+                mode = MODE_BENCH;
+                bench_name = optarg;
+                break;
+            case 0x80 + 'o':
+                bench_out_name = optarg;
+                break;
             case 0x80 + 'f':
                 debug_fs++;
                 break;
             case 0x80 + 'm':
                 debug_msg++;
                 break;
+            case 0x80 + 'M':
+                if ((sscanf(optarg, "%u%n", &filemap_min, &pos) != 1) ||
+                    (optarg[pos] != '\0') || (filemap_min > (4 << 20))) {
+                    errx(EXIT_FAILURE, "Invalid mmap file size \"%s\" KB",
+                         optarg);
+                }
+                filemap_min <<= 10;
+                break;
+            case 0x80 + 'r':
+                if ((sscanf(optarg, "%u%n", &readahead_window, &pos) != 1) ||
+                    (optarg[pos] != '\0') ||
+                    (readahead_window > (64 << 10))) {
+                    errx(EXIT_FAILURE, "Invalid read-ahead window \"%s\" KB",
+                         optarg);
+                }
+                readahead_window <<= 10;
+                break;
+            case 0x80 + 'W':
+                if ((sscanf(optarg, "%u%n", &writebehind_size, &pos) != 1) ||
+                    (optarg[pos] != '\0') ||
+                    (writebehind_size > (64 << 10))) {
+                    errx(EXIT_FAILURE, "Invalid write-behind buffer \"%s\" KB",
+                         optarg);
+                }
+                writebehind_size <<= 10;
+                break;
+            case 0x80 + 'D':
+                writebehind_durable = TRUE;
+                break;
+            case 0x80 + 'e':
+                metrics_path = optarg;
+                break;
+            case 0x80 + 's':
+                if ((sscanf(optarg, "%u%n", &dirscan_threads, &pos) != 1) ||
+                    (optarg[pos] != '\0') ||
+                    (dirscan_threads > DIRSCAN_THREADS_MAX)) {
+                    errx(EXIT_FAILURE, "Invalid directory scan thread count "
+                         "\"%s\" (0 to %u)", optarg, DIRSCAN_THREADS_MAX);
+                }
+                break;
+            case 0x80 + 'w':
+                if ((sscanf(optarg, "%u%n", &msg_workers, &pos) != 1) ||
+                    (optarg[pos] != '\0') ||
+                    (msg_workers > MSG_WORKERS_MAX)) {
+                    errx(EXIT_FAILURE, "Invalid worker count \"%s\" "
+                         "(0 to %u)", optarg, MSG_WORKERS_MAX);
+                }
+                break;
             default:
                 warnx("Unknown option -%c 0x%x", ch, ch);
                 usage(stderr);
@@ -6758,6 +12374,7 @@ errx(EXIT_FAILURE, "how did we get here?");
 
     argc -= optind;
     argv += optind;
+    board_cur = &board_first;
 
     if (mode & (MODE_READ | MODE_WRITE | MODE_VERIFY)) {
         /* First two arguments are filenames */
@@ -6777,6 +12394,9 @@ errx(EXIT_FAILURE, "how did we get here?");
         argc = 0;
     }
 
+    if ((mode & MODE_DELTA) && !(mode & MODE_WRITE))
+        errx(EXIT_USAGE, "--delta may only be used with -w");
+
     if ((mode & (MODE_READ | MODE_WRITE | MODE_VERIFY | MODE_ERASE)) &&
         ((bank == BANK_NOT_SPECIFIED) && (baseaddr == ADDR_NOT_SPECIFIED))) {
         errx(EXIT_USAGE, "You must specify either a bank or an address");
@@ -6785,31 +12405,57 @@ errx(EXIT_FAILURE, "how did we get here?");
     if (argc > 0)
         errx(EXIT_USAGE, "Too many arguments: %s", argv[0]);
 
-    if (device_name[0] == '\0')
-        find_mx_programmer();
+    if ((bench_out_name != NULL) && !(mode & MODE_BENCH))
+        errx(EXIT_USAGE, "--benchout may only be used with --bench");
+    if (mode & MODE_BENCH) {
+        bench_addr = baseaddr;
+        bench_len = len;
+        if (bench_out_name != NULL)
+            bench_out_open(bench_out_name);
+    }
+    if ((mode & MODE_BENCH) && !bench_needs_device(bench_name)) {
+        /* Host-side benchmarks do not require a Kicksmash device */
+        exit(run_bench(bench_name));
+    }
 
-    if (device_name[0] == '\0') {
+    if (all_boards && (mode != MODE_MSG))
+        errx(EXIT_USAGE, "--boards may only be used with -m");
+    if (all_boards || (board_cur->b_device_name[0] == '\0'))
+        find_mx_programmer(all_boards);
+
+    if (board_cur->b_device_name[0] == '\0') {
         warnx("You must specify a device to open (-d <dev>)");
         usage(stderr);
         exit(EXIT_USAGE);
     }
+    if ((board_count > 1) && (mode != MODE_MSG))
+        errx(EXIT_USAGE, "Multiple boards may only be served with -m");
     if (len == 0)
         errx(EXIT_USAGE, "Invalid length 0x%x", len);
 
-#ifdef __MINGW32__
-    host_device_name = malloc(strlen(device_name) + 16);
-    if (host_device_name == NULL)
-        err(EXIT_FAILURE, "malloc failed");
-    sprintf(host_device_name, "\\\\.\\%s", device_name);
-#endif
-
     atexit(at_exit_func);
 
-    if (serial_open(TRUE) != RC_SUCCESS)
-        do_exit(EXIT_FAILURE);
+    for (board = board_head; board != NULL; board = board->b_next) {
+        board_cur = board;
+#ifdef __MINGW32__
+        board->b_host_device_name = malloc(strlen(board->b_device_name) + 16);
+        if (board->b_host_device_name == NULL)
+            err(EXIT_FAILURE, "malloc failed");
+        sprintf(board->b_host_device_name, "\\\\.\\%s", board->b_device_name);
+#endif
+        if (serial_open(TRUE) != RC_SUCCESS)
+            do_exit(EXIT_FAILURE);
+        create_threads();
+    }
+    board_cur = &board_first;
 
-    create_threads();
-    rc = run_mode(mode, bank, baseaddr, len, report_max, fill, file1, file2);
+    if (mode & MODE_BENCH)
+        rc = run_bench(bench_name);
+    else if (board_count > 1)
+        rc = run_message_boards();
+    else
+        rc = run_mode(mode, bank, baseaddr, len, report_max, fill, file1,
+                      file2);
     wait_for_tx_writer();
 
     exit(rc);
@@ -0,0 +1,133 @@
+/*
+ * lztest
+ * ------
+ * Round-trip test of the message payload compressor (amiga/sm_lz.c).
+ * Each input is packed into a buffer of exactly SM_LZ_PACK_MAX() bytes,
+ * so an overrun shows up under -fsanitize=address, and is unpacked
+ * again and compared against the original.
+ *
+ * cc -o lztest lztest.c ../amiga/sm_lz.c
+ */
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../amiga/sm_lz.h"
+
+typedef unsigned int uint;
+
+static uint32_t rand_state = 1;
+
+static uint8_t
+rand_byte(void)
+{
+    rand_state = rand_state * 1103515245 + 12345;
+    return (rand_state >> 16);
+}
+
+/*
+ * fill_pattern() fills a test buffer with one of several data patterns,
+ * from incompressible through highly compressible.
+ */
+static void
+fill_pattern(uint8_t *buf, uint len, uint pattern)
+{
+    uint pos;
+
+    for (pos = 0; pos < len; pos++) {
+        switch (pattern) {
+            case 0:  // Random
+                buf[pos] = rand_byte();
+                break;
+            case 1:  // Zeros
+                buf[pos] = 0;
+                break;
+            case 2:  // Random, with a short repeat at the very end
+                buf[pos] = ((pos < 64) || (pos + 8 < len)) ? rand_byte() :
+                           buf[pos - 64];
+                break;
+            case 3:  // Random with occasional matches
+                buf[pos] = ((pos < 0x100) || ((pos & 0xff) < 0xf0)) ?
+                           rand_byte() : buf[pos - 0x100];
+                break;
+            default:  // Text-like
+                buf[pos] = "abcdefgh ijk\n"[(pos * 7 + pos / 13) % 13];
+                break;
+        }
+    }
+}
+
+/*
+ * test_one() packs and unpacks a single buffer, returning non-zero
+ * on failure.
+ */
+static int
+test_one(uint16_t *hashtab, uint len, uint pattern)
+{
+    uint     zmax = SM_LZ_PACK_MAX(len);
+    uint8_t *src  = malloc(len);
+    uint8_t *dst  = malloc(zmax);  // Exactly sized, to catch any overrun
+    uint8_t *out  = malloc(len);
+    uint32_t zlen;
+    int32_t  olen;
+    int      rc = 0;
+
+    if ((src == NULL) || (dst == NULL) || (out == NULL)) {
+        printf("malloc failed\n");
+        exit(1);
+    }
+    fill_pattern(src, len, pattern);
+
+    zlen = sm_lz_pack(src, len, dst, zmax, hashtab);
+    if (zlen > zmax) {
+        printf("len=%u pattern=%u: packed %u > max %u\n",
+               len, pattern, zlen, zmax);
+        rc = 1;
+    } else if (zlen != 0) {
+        if (sm_lz_unpacked_len(dst, zlen) != (int32_t) len) {
+            printf("len=%u pattern=%u: bad unpacked length\n", len, pattern);
+            rc = 1;
+        }
+        olen = sm_lz_unpack(dst, zlen, out, len);
+        if ((olen != (int32_t) len) || (memcmp(src, out, len) != 0)) {
+            printf("len=%u pattern=%u: round trip mismatch (%d)\n",
+                   len, pattern, olen);
+            rc = 1;
+        }
+    }
+    free(src);
+    free(dst);
+    free(out);
+    return (rc);
+}
+
+int
+main(int argc, char *argv[])
+{
+    static const uint edge[] = {
+        0x3fff, 0x4000, 0x4001, 0x4000 * 2, 0x4000 * 2 + 1, 0x10000
+    };
+    uint16_t *hashtab = malloc(SM_LZ_HASH_SIZE * sizeof (*hashtab));
+    uint      len;
+    uint      pattern;
+    uint      cur;
+    uint      fails = 0;
+
+    if (hashtab == NULL) {
+        printf("malloc failed\n");
+        return (1);
+    }
+    for (pattern = 0; pattern < 5; pattern++) {
+        for (len = 1; len <= 600; len++)
+            fails += test_one(hashtab, len, pattern);
+        for (cur = 0; cur < sizeof (edge) / sizeof (edge[0]); cur++)
+            fails += test_one(hashtab, edge[cur], pattern);
+    }
+    free(hashtab);
+    if (fails != 0) {
+        printf("FAIL: %u\n", fails);
+        return (1);
+    }
+    printf("PASS\n");
+    return (0);
+}
@@ -0,0 +1,2237 @@
+/*
+ * This is free and unencumbered software released into the public domain.
+ * See the LICENSE file for additional details.
+ *
+ * Designed by Chris Hooper in 2024.
+ *
+ * ---------------------------------------------------------------------
+ *
+ * Virtual Kicksmash for host-only testing and benchmarking.
+ *
+ * vsmash presents a pseudo-terminal which behaves like the Kicksmash USB
+ * serial port, so that hostsmash may be run without hardware. It provides
+ * the firmware command prompt, the "prom" commands which hostsmash uses
+ * for flash access, and USB message service mode as implemented by
+ * msg_usb_service() and execute_usb_cmd() in fw/msg.c, including the
+ * Amiga -> USB (atou) and USB -> Amiga (utoa) message buffers. The flash
+ * array is backed by a file.
+ *
+ * An optional script drives a virtual Amiga, which sends KM_OP_* requests
+ * through the message buffers in the same way as amiga/sm_msg.c and
+ * amiga/sm_file.c, and reports the time taken by each script command.
+ * vsmash exits when the script completes, with non-zero status if any
+ * command failed.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include "../fw/crc32.h"
+#include "../fw/smash_cmd.h"
+#include "../amiga/host_cmd.h"
+#include "../amiga/sm_lz.h"
+#include "../fw/version.h"
+
+#define SWAP16(x) __builtin_bswap16(x)
+#define SWAP32(x) __builtin_bswap32(x)
+#define SWAP64(x) __builtin_bswap64(x)
+
+#define BIT(x) (1U << (x))
+#define ARRAY_SIZE(x) (sizeof (x) / sizeof ((x)[0]))
+
+#define VS_FLASH_SIZE     (4 << 20)    // Two 2MB flash parts (32-bit mode)
+#define VS_SECTOR_SIZE    (128 << 10)  // 32K words in each of two parts
+#define VS_CHIP_ID        0x000122d2   // M29F160FT
+#define VS_CHIP_NAME      "M29F160FT"
+#define VS_MSG_BUF_SIZE   0x1000       // Matches firmware msg_atou, msg_utoa
+#define DATA_CRC_INTERVAL 256          // Bytes between "prom" transfer CRCs
+#define PROM_WRITE_CHUNK  64           // Bytes programmed between input polls
+#define PROM_SCAN_MAX_LEN (256 << 10)  // Max bytes per FLASH_CRC or BLANK
+#define SEND_MSG_MAX      2000         // Largest Amiga message (sm_msg.c)
+#define AM_RECV_MAX       4200         // Amiga receive buffer (sm_msg.c)
+
+/* Firmware rc_t values sent as status bytes during "prom" transfers */
+#define RC_SUCCESS        0
+#define RC_FAILURE        1
+#define RC_BAD_PARAM      6
+#define RC_TIMEOUT        7
+
+#define ERASE_MODE_CHIP   0
+#define ERASE_MODE_SECTOR 1
+
+#define KS_REPLY_RAW      BIT(0)  // usb_msg_reply(): message already built
+
+/* Program long format options */
+static const struct option long_opts[] = {
+    { "flash",    required_argument, NULL, 'f' },
+    { "help",     no_argument,       NULL, 'h' },
+    { "link",     required_argument, NULL, 'l' },
+    { "script",   required_argument, NULL, 's' },
+    { NULL,       no_argument,       NULL,  0  }
+};
+
+static char short_opts[] = {
+    ':',         // Missing argument
+    'f', ':',    // --flash <filename>
+    'h',         // --help
+    'l', ':',    // --link <path>
+    's', ':',    // --script <filename>
+    '\0'
+};
+
+static const char usage_text[] =
+"vsmash <opts>\n"
+"    -f --flash <filename>   flash image file (created if it does not exist)\n"
+"    -h --help               display usage\n"
+"    -l --link <path>        create a symbolic link to the pseudo-terminal\n"
+"    -s --script <filename>  run virtual Amiga script, then exit\n"
+"\n"
+"Script commands (one per line, # starts a comment):\n"
+"    compress on|off                 request compressed file transfers\n"
+"    delete <vol:path>               delete file\n"
+"    dir <vol:path> [<chunk>]        read directory entries\n"
+"    id                              KM_OP_ID request\n"
+"    loopback <len> [<count>]        KM_OP_LOOPBACK round trips\n"
+"    read <vol:path> [<chunk>] [verify]  read file (verify test pattern)\n"
+"    sleep <msec>                    pause\n"
+"    write <vol:path> <len> [<chunk>]    write file with test pattern\n"
+"\n"
+"Example:\n"
+"    vsmash -l /tmp/ttyKS -s bench.vs &\n"
+"    hostsmash -d /tmp/ttyKS -m vs: /tmp/vsdir\n"
+"";
+
+static const uint16_t sm_magic[] = { 0x0204, 0x1017, 0x0119, 0x0117 };
+static const uint8_t *sm_magic_b = (const uint8_t *) sm_magic;
+
+static const uint32_t testpatt_reply[] = {
+    0x54534554, 0x54544150, 0x53202d20, 0x54524154,
+    0xaaaa5555, 0xcccc3333, 0xeeee1111, 0x66669999,
+    0x00020001, 0x00080004, 0x00200010, 0x00800040,
+    0x02000100, 0x08000400, 0x20001000, 0x80004000,
+    0xfffdfffe, 0xfff7fffb, 0xffdfffef, 0xff7fffbf,
+    0xfdfffeff, 0xf7fffbff, 0xdfffefff, 0x7fffbfff,
+    0x54534554, 0x54544150, 0x444e4520, 0x68646320,
+};
+
+/*
+ * Message buffer, holding complete messages (magic, length, command,
+ * data, and CRC) exactly as they are sent to the USB host. Each message
+ * is padded to 16-bit alignment.
+ */
+typedef struct {
+    uint8_t rb_buf[VS_MSG_BUF_SIZE];
+    uint    rb_prod;  // Producer position
+    uint    rb_cons;  // Consumer position
+} vs_ring_t;
+
+#define RING_INUSE(rb) (((rb)->rb_prod - (rb)->rb_cons) & (VS_MSG_BUF_SIZE - 1))
+#define RING_AVAIL(rb) (VS_MSG_BUF_SIZE - 2 - RING_INUSE(rb))
+
+static int             dev_fd = -1;        // Master side of pseudo-terminal
+static int             dev_slave_fd = -1;  // Held so master never sees EIO
+static int             wake_fd[2];         // Wakes the device side
+static uint8_t         dev_rxbuf[1024];
+static uint            dev_rxpos;
+static uint            dev_rxlen;
+
+static uint8_t        *flash_mem;
+static uint            flash_size = VS_FLASH_SIZE;
+static bank_info_t     bank_info;
+static char            board_name[16] = "vsmash";
+static uint64_t        start_usec;
+static uint64_t        amiga_time;         // Amiga clock offset (usec)
+
+/* The following are protected by vs_lock */
+static pthread_mutex_t vs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  vs_cond = PTHREAD_COND_INITIALIZER;
+static vs_ring_t       msg_atou;           // Amiga -> USB buffer
+static vs_ring_t       msg_utoa;           // USB -> Amiga buffer
+static uint            msg_lock;           // KS_CMD_MSG_LOCK bits
+static uint16_t        state_amiga_app;
+static uint16_t        state_usb_app;
+static uint64_t        expire_update_amiga_app;
+static uint64_t        expire_update_usb_app;
+static bool            atou_notify;
+static bool            atou_notify_pending;
+static uint            usb_receive_count;  // KS_CMD_MSG_RECEIVE polls
+static volatile bool   vs_done;            // Script complete: exit
+
+static uint8_t         usb_msg_buffer[2048];
+static const char     *script_file;
+static uint            script_failures;
+
+static uint64_t
+vs_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static void
+mem16_swap(void *buf, uint len)
+{
+    uint16_t *ptr = buf;
+
+    for (len = (len + 1) / 2; len > 0; len--, ptr++)
+        *ptr = SWAP16(*ptr);
+}
+
+/*
+ * vs_wake() interrupts the device side wait for input, so that it may
+ *           send a pending KS_CMD_MSG_NOTIFY or notice the script has
+ *           completed.
+ */
+static void
+vs_wake(void)
+{
+    char ch = 0;
+    if (write(wake_fd[1], &ch, 1) < 0) {
+        /* Pipe full: a wakeup is already pending */
+    }
+}
+
+/*
+ * dev_getchar() returns the next character sent by the USB host, or -1
+ *               if none arrived within the specified time, or the device
+ *               side was woken by vs_wake().
+ *
+ * @param  [in]  timeout_ms - Maximum time to wait (ms).
+ *
+ * @return       Character value or -1.
+ */
+static int
+dev_getchar(uint timeout_ms)
+{
+    struct pollfd pfd[2];
+    ssize_t       len;
+
+    if (dev_rxpos < dev_rxlen)
+        return (dev_rxbuf[dev_rxpos++]);
+
+    pfd[0].fd      = dev_fd;
+    pfd[0].events  = POLLIN;
+    pfd[0].revents = 0;
+    pfd[1].fd      = wake_fd[0];
+    pfd[1].events  = POLLIN;
+    pfd[1].revents = 0;
+    if (poll(pfd, ARRAY_SIZE(pfd), timeout_ms) <= 0)
+        return (-1);
+    if (pfd[1].revents & POLLIN) {
+        char buf[64];
+        while (read(wake_fd[0], buf, sizeof (buf)) > 0)
+            ;
+    }
+    if ((pfd[0].revents & POLLIN) == 0)
+        return (-1);
+    len = read(dev_fd, dev_rxbuf, sizeof (dev_rxbuf));
+    if (len <= 0)
+        return (-1);
+    dev_rxlen = len;
+    dev_rxpos = 1;
+    return (dev_rxbuf[0]);
+}
+
+/*
+ * dev_getchar_wait() is dev_getchar() which is not cut short by vs_wake().
+ */
+static int
+dev_getchar_wait(uint timeout_ms)
+{
+    uint64_t timeout = vs_usec() + timeout_ms * 1000ULL;
+    int      ch;
+
+    while ((ch = dev_getchar(timeout_ms)) == -1)
+        if (vs_usec() >= timeout)
+            break;
+    return (ch);
+}
+
+/*
+ * dev_getchar_buf() copies input which has already been sent by the USB
+ *                   host, up to len bytes, without waiting for more.
+ *
+ * @param  [out] buf - Buffer for received data.
+ * @param  [in]  len - Maximum number of bytes to receive.
+ *
+ * @return       The number of bytes received.
+ */
+static uint
+dev_getchar_buf(void *buf, uint len)
+{
+    uint8_t *dst = buf;
+    uint     count = 0;
+    int      ch;
+
+    while (count < len) {
+        if (dev_rxpos < dev_rxlen) {
+            uint avail = dev_rxlen - dev_rxpos;
+            if (avail > len - count)
+                avail = len - count;
+            memcpy(dst + count, dev_rxbuf + dev_rxpos, avail);
+            dev_rxpos += avail;
+            count     += avail;
+            continue;
+        }
+        if ((ch = dev_getchar(0)) == -1)
+            break;
+        dst[count++] = ch;
+    }
+    return (count);
+}
+
+/*
+ * dev_puts_binary() sends data to the USB host.
+ *
+ * @param  [in]  buf - Data to send.
+ * @param  [in]  len - Number of bytes to send.
+ *
+ * @return       0 - Success.
+ * @return       1 - Send failure.
+ */
+static int
+dev_puts_binary(const void *buf, uint len)
+{
+    const uint8_t *ptr = buf;
+
+    while (len > 0) {
+        ssize_t count = write(dev_fd, ptr, len);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN) {
+                struct pollfd pfd;
+                pfd.fd     = dev_fd;
+                pfd.events = POLLOUT;
+                (void) poll(&pfd, 1, 100);
+                continue;
+            }
+            return (1);
+        }
+        ptr += count;
+        len -= count;
+    }
+    return (0);
+}
+
+/*
+ * dev_printf() sends formatted text to the USB host, as the firmware
+ *              console does.
+ */
+__attribute__((format(__gnu_printf__, 1, 2)))
+static void
+dev_printf(const char *fmt, ...)
+{
+    va_list args;
+    char    buf[512];
+    char    out[sizeof (buf) * 2];
+    uint    pos;
+    uint    opos = 0;
+
+    va_start(args, fmt);
+    (void) vsnprintf(buf, sizeof (buf), fmt, args);
+    va_end(args);
+
+    for (pos = 0; buf[pos] != '\0'; pos++) {
+        if (buf[pos] == '\n')
+            out[opos++] = '\r';
+        out[opos++] = buf[pos];
+    }
+    (void) dev_puts_binary(out, opos);
+}
+
+/*
+ * ring_add() adds a message to a message buffer.
+ *
+ * @param  [in]  rb  - Message buffer.
+ * @param  [in]  len - Length of message, including header and CRC.
+ * @param  [in]  ptr - Message to add.
+ *
+ * @return       0 - Success.
+ * @return       1 - Insufficient space.
+ */
+static uint
+ring_add(vs_ring_t *rb, uint len, const void *ptr)
+{
+    const uint8_t *sptr = ptr;
+    uint           xlen;
+
+    len = (len + 1) & ~1;  // Round up to 16-bit alignment
+    if (len > RING_AVAIL(rb))
+        return (1);
+    xlen = VS_MSG_BUF_SIZE - rb->rb_prod;
+    if (len <= xlen) {
+        memcpy(rb->rb_buf + rb->rb_prod, sptr, len);
+    } else {
+        memcpy(rb->rb_buf + rb->rb_prod, sptr, xlen);
+        memcpy(rb->rb_buf, sptr + xlen, len - xlen);
+    }
+    rb->rb_prod = (rb->rb_prod + len) & (VS_MSG_BUF_SIZE - 1);
+    return (0);
+}
+
+/*
+ * ring_next_msg_len() returns the length of the next message in a message
+ *                     buffer, or 0 if there is none. A message which does
+ *                     not begin with the magic sequence causes the buffer
+ *                     to be discarded.
+ */
+static uint
+ring_next_msg_len(vs_ring_t *rb)
+{
+    uint     len;
+    uint     pos;
+    uint     count;
+    uint16_t magic;
+
+    if (RING_INUSE(rb) < KS_HDR_AND_CRC_LEN) {
+        rb->rb_cons = rb->rb_prod;
+        return (0);
+    }
+    for (pos = rb->rb_cons, count = 0; count < ARRAY_SIZE(sm_magic);
+         count++) {
+        memcpy(&magic, rb->rb_buf + pos, sizeof (magic));
+        if (magic != sm_magic[count]) {
+            printf("Bad msg %u %04x != %04x\n", count, magic, sm_magic[count]);
+            rb->rb_cons = rb->rb_prod;
+            return (0);
+        }
+        pos = (pos + 2) & (VS_MSG_BUF_SIZE - 1);
+    }
+    len = rb->rb_buf[pos] | (rb->rb_buf[pos + 1] << 8);
+    len = (len + 1) & ~1;  // Round up
+    return (len + KS_HDR_AND_CRC_LEN);
+}
+
+/*
+ * ring_get() removes a message of the specified length (as reported by
+ *            ring_next_msg_len()) from a message buffer.
+ */
+static void
+ring_get(vs_ring_t *rb, void *buf, uint len)
+{
+    uint8_t *dptr = buf;
+    uint     xlen = VS_MSG_BUF_SIZE - rb->rb_cons;
+
+    if (len <= xlen) {
+        memcpy(dptr, rb->rb_buf + rb->rb_cons, len);
+    } else {
+        memcpy(dptr, rb->rb_buf + rb->rb_cons, xlen);
+        memcpy(dptr + xlen, rb->rb_buf, len - xlen);
+    }
+    rb->rb_cons = (rb->rb_cons + len) & (VS_MSG_BUF_SIZE - 1);
+}
+
+/*
+ * flash_sector_info() reports the erase sector containing an address.
+ *                     Boot block sub-sectors of the flash parts are not
+ *                     modeled; all sectors are VS_SECTOR_SIZE.
+ */
+static void
+flash_sector_info(uint32_t addr, uint32_t *start, uint32_t *size)
+{
+    *start = addr & ~(VS_SECTOR_SIZE - 1);
+    *size  = VS_SECTOR_SIZE;
+}
+
+static bool
+flash_range_bad(uint32_t addr, uint32_t len)
+{
+    return ((addr >= flash_size) || (len > flash_size - addr));
+}
+
+/*
+ * flash_crc() computes the CRC-32 of each flash sector in a range, in the
+ *             same way as prom_crc() in fw/prom_access.c.
+ */
+static uint
+flash_crc(uint32_t addr, uint32_t len, smash_crc_t *sc, uint *count)
+{
+    uint32_t total = 0;
+    uint     max = *count;
+
+    *count = 0;
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    while ((len > 0) && (*count < max) && (total < PROM_SCAN_MAX_LEN)) {
+        uint32_t sstart;
+        uint32_t ssize;
+        uint32_t slen;
+
+        flash_sector_info(addr, &sstart, &ssize);
+        slen = sstart + ssize - addr;
+        if (slen > len)
+            slen = len;
+        sc[*count].sc_addr = addr;
+        sc[*count].sc_len  = slen;
+        sc[(*count)++].sc_crc = crc32(0, flash_mem + addr, slen);
+        total += slen;
+        addr  += slen;
+        len   -= slen;
+    }
+    return (RC_SUCCESS);
+}
+
+/*
+ * flash_blank() checks that a flash range is erased, in the same way as
+ *               prom_blank() in fw/prom_access.c.
+ */
+static uint
+flash_blank(uint32_t addr, uint32_t len, uint32_t *checked, uint32_t *first)
+{
+    uint32_t pos;
+
+    *checked = 0;
+    *first   = 0xffffffff;
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    if (len > PROM_SCAN_MAX_LEN)
+        len = PROM_SCAN_MAX_LEN;
+    for (pos = 0; pos < len; pos++) {
+        if (flash_mem[addr + pos] != 0xff) {
+            *first   = addr + pos;
+            *checked = pos + 1;
+            return (RC_SUCCESS);
+        }
+    }
+    *checked = len;
+    return (RC_SUCCESS);
+}
+
+/*
+ * flash_erase() erases the entire flash or all sectors overlapping a
+ *               range. A length of 0 erases a single sector.
+ */
+static uint
+flash_erase(uint mode, uint32_t addr, uint32_t len)
+{
+    uint32_t sstart;
+    uint32_t ssize;
+
+    if (mode == ERASE_MODE_CHIP) {
+        memset(flash_mem, 0xff, flash_size);
+        return (RC_SUCCESS);
+    }
+    if (len == 0)
+        len = 1;
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    while (len > 0) {
+        uint32_t slen;
+        flash_sector_info(addr, &sstart, &ssize);
+        memset(flash_mem + sstart, 0xff, ssize);
+        slen = sstart + ssize - addr;
+        if (slen >= len)
+            break;
+        addr += slen;
+        len  -= slen;
+    }
+    return (RC_SUCCESS);
+}
+
+/*
+ * flash_program() writes data to flash. As with the real parts, bits may
+ *                 only be programmed from 1 to 0, so writing over data
+ *                 which has not been erased fails.
+ */
+static uint
+flash_program(uint32_t addr, uint32_t len, const uint8_t *buf)
+{
+    uint32_t pos;
+    uint     rc = RC_SUCCESS;
+
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    for (pos = 0; pos < len; pos++) {
+        flash_mem[addr + pos] &= buf[pos];
+        if (flash_mem[addr + pos] != buf[pos])
+            rc = RC_FAILURE;
+    }
+    if (rc != RC_SUCCESS)
+        dev_printf("Program failure at %x: not erased\n", addr);
+    return (rc);
+}
+
+/*
+ * flash_open() maps the flash image file, creating or extending it with
+ *              erased (0xff) content as required.
+ */
+static void
+flash_open(const char *filename)
+{
+    struct stat st;
+    int         fd = open(filename, O_RDWR | O_CREAT, 0644);
+
+    if (fd == -1)
+        err(EXIT_FAILURE, "Failed to open %s", filename);
+    if (fstat(fd, &st) != 0)
+        err(EXIT_FAILURE, "Failed to stat %s", filename);
+    if (st.st_size < flash_size) {
+        if (ftruncate(fd, flash_size) != 0)
+            err(EXIT_FAILURE, "Failed to extend %s", filename);
+    }
+    flash_mem = mmap(NULL, flash_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                     fd, 0);
+    if (flash_mem == MAP_FAILED)
+        err(EXIT_FAILURE, "Failed to map %s", filename);
+    close(fd);
+    if (st.st_size < flash_size)
+        memset(flash_mem + st.st_size, 0xff, flash_size - st.st_size);
+}
+
+static int
+check_rc(uint pos)
+{
+    int ch = dev_getchar_wait(200);
+    if (ch == -1) {
+        dev_printf("Receive timeout waiting for rc at 0x%x\n", pos);
+        return (RC_TIMEOUT);
+    }
+    if (ch != 0) {
+        dev_printf("Remote sent error %d at 0x%x\n", ch, pos);
+        return (RC_FAILURE);
+    }
+    return (RC_SUCCESS);
+}
+
+/*
+ * prom_read_binary() sends flash contents to the host with the protocol
+ *                    of prom_read_binary() in fw/prom_access.c.
+ */
+static uint
+prom_read_binary(uint32_t addr, uint32_t len)
+{
+    uint32_t crc = 0;
+    uint     crc_next = DATA_CRC_INTERVAL;
+    uint     pos = 0;
+    uint8_t  rc;
+
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    while (len > 0) {
+        uint32_t tlen = DATA_CRC_INTERVAL;
+        if (tlen > len)
+            tlen = len;
+        if (tlen > crc_next)
+            tlen = crc_next;
+        rc = RC_SUCCESS;
+        if (dev_puts_binary(&rc, 1) ||
+            dev_puts_binary(flash_mem + addr, tlen))
+            return (RC_TIMEOUT);
+        crc = crc32(crc, flash_mem + addr, tlen);
+        addr     += tlen;
+        len      -= tlen;
+        pos      += tlen;
+        crc_next -= tlen;
+        if (crc_next == 0) {
+            if (dev_puts_binary(&crc, sizeof (crc)))
+                return (RC_TIMEOUT);
+            if ((rc = check_rc(pos)) != RC_SUCCESS)
+                return (rc);
+            crc_next = DATA_CRC_INTERVAL;
+        }
+    }
+    if (crc_next != DATA_CRC_INTERVAL) {
+        if (dev_puts_binary(&crc, sizeof (crc)))
+            return (RC_TIMEOUT);
+        return (check_rc(pos));
+    }
+    return (RC_SUCCESS);
+}
+
+/*
+ * prom_write_binary() receives data from the host and writes it to flash
+ *                     with the protocol of prom_write_binary() in
+ *                     fw/prom_access.c. As there, each block is
+ *                     acknowledged before it is programmed, and input for
+ *                     the next block is collected between program chunks.
+ */
+static uint
+prom_write_binary(uint32_t addr, uint32_t len)
+{
+    /* Partial word carried from previous block, block data, and CRC */
+    uint8_t  buf[2][4 + DATA_CRC_INTERVAL + 4];
+    uint8_t *blk;
+    uint8_t *ptr;
+    uint     cur = 0;
+    uint     carry;
+    uint     rxpos = 0;     // Bytes of current block (and CRC) received
+    uint     rxlen;         // Bytes of current block
+    uint32_t waddr = addr;  // Next flash address to program
+    uint32_t wend;
+    uint32_t crc = 0;
+    uint32_t compcrc;
+    uint8_t  rc;
+
+    if (flash_range_bad(addr, len))
+        return (RC_BAD_PARAM);
+    rxlen = (len < DATA_CRC_INTERVAL) ? len : DATA_CRC_INTERVAL;
+    while (len > 0) {
+        blk = buf[cur] + 4;
+        while (rxpos < rxlen + sizeof (compcrc)) {
+            uint count = dev_getchar_buf(blk + rxpos,
+                                         rxlen + sizeof (compcrc) - rxpos);
+            if (count == 0) {
+                int ch = dev_getchar_wait(1000);
+                if (ch == -1) {
+                    dev_printf("Data receive timeout at %x\n", addr + rxpos);
+                    rc = RC_TIMEOUT;
+                    goto fail;
+                }
+                blk[rxpos] = ch;
+                count = 1;
+            }
+            rxpos += count;
+        }
+        crc = crc32(crc, blk, rxlen);
+        memcpy(&compcrc, blk + rxlen, sizeof (compcrc));
+        if (crc != compcrc) {
+            dev_printf("Received CRC %08x doesn't match %08x at 0x%x-0x%x\n",
+                       compcrc, crc, addr, addr + rxlen);
+            rc = RC_FAILURE;
+            goto fail;
+        }
+        rc = RC_SUCCESS;
+        if (dev_puts_binary(&rc, 1))
+            return (RC_TIMEOUT);
+        addr += rxlen;
+        len  -= rxlen;
+        ptr   = blk + rxlen - (addr - waddr);
+
+        /* Hold back a trailing partial word for the next block */
+        wend  = (len == 0) ? addr : (addr & ~3);
+        carry = addr - wend;
+        cur  ^= 1;
+        memcpy(buf[cur] + 4 - carry, blk + rxlen - carry, carry);
+        blk   = buf[cur] + 4;
+        rxpos = 0;
+        rxlen = (len < DATA_CRC_INTERVAL) ? len : DATA_CRC_INTERVAL;
+
+        while (waddr < wend) {
+            uint32_t wlen = ((waddr + PROM_WRITE_CHUNK) & ~3) - waddr;
+            if (wlen > wend - waddr)
+                wlen = wend - waddr;
+            rc = flash_program(waddr, wlen, ptr);
+            if (rc != RC_SUCCESS)
+                goto fail;
+            waddr += wlen;
+            ptr   += wlen;
+            if (len > 0)
+                rxpos += dev_getchar_buf(blk + rxpos,
+                                         rxlen + sizeof (compcrc) - rxpos);
+        }
+    }
+    return (RC_SUCCESS);
+
+fail:
+    (void) dev_puts_binary(&rc, 1);  // Inform remote side
+    while (dev_getchar_wait(2000) != -1)
+        ;  // Discard input
+    return (rc);
+}
+
+/*
+ * usb_msg_reply() sends a reply message to the USB host.
+ *
+ * @param  [in]  flags  - KS_REPLY_RAW if the reply is a complete message.
+ * @param  [in]  status - Reply status (KS_STATUS_*).
+ * @param  [in]  rlen1  - Length of first part of reply data.
+ * @param  [in]  rbuf1  - First part of reply data.
+ * @param  [in]  rlen2  - Length of second part of reply data.
+ * @param  [in]  rbuf2  - Second part of reply data.
+ */
+static void
+usb_msg_reply(uint flags, uint status, uint rlen1, const void *rbuf1,
+              uint rlen2, const void *rbuf2)
+{
+    uint16_t data[2];
+    uint32_t crc;
+
+    if (flags & KS_REPLY_RAW) {
+        /* raw mode sends an already constructed message */
+        if (rlen1 != 0)
+            (void) dev_puts_binary(rbuf1, rlen1);
+        if (rlen2 != 0)
+            (void) dev_puts_binary(rbuf2, rlen2);
+        return;
+    }
+    (void) dev_puts_binary(sm_magic, sizeof (sm_magic));
+    data[0] = rlen1 + rlen2;
+    data[1] = status;
+    crc = crc32s(0, data, sizeof (data));
+    (void) dev_puts_binary(data, sizeof (data));
+    if (rlen1 != 0) {
+        (void) dev_puts_binary(rbuf1, rlen1);
+        crc = crc32s(crc, rbuf1, rlen1);
+    }
+    if (rlen2 != 0) {
+        (void) dev_puts_binary(rbuf2, rlen2);
+        crc = crc32s(crc, rbuf2, rlen2);
+    }
+    crc = (crc << 16) | (crc >> 16);  // Convert to match Amiga format
+    (void) dev_puts_binary(&crc, sizeof (crc));
+}
+
+static uint32_t
+get_be32(const uint8_t *buf)
+{
+    return ((buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3]);
+}
+
+/*
+ * execute_usb_cmd() executes a command from the USB host, as the firmware
+ *                   function of the same name does. Flash commands which
+ *                   require the Amiga to be held in reset are always
+ *                   permitted, as the virtual Amiga never fetches from ROM.
+ */
+static void
+execute_usb_cmd(uint16_t cmd, uint16_t cmd_len, uint8_t *rawbuf)
+{
+    uint8_t *buf = rawbuf + 12;
+    uint64_t now = vs_usec();
+
+    switch ((uint8_t) cmd) {
+        case KS_CMD_NULL:
+            /* Do absolutely nothing (discard command) */
+            break;
+        case KS_CMD_NOP:
+            /* Do nothing but reply */
+            usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
+            break;
+        case KS_CMD_ID: {
+            /* Send identification and configuration */
+            smash_id_t reply;
+            uint temp[3];
+            int  pos = 0;
+            memset(&reply, 0, sizeof (reply));
+            sscanf(version_str + 8, "%u.%u%n", &temp[0], &temp[1], &pos);
+            reply.si_ks_version[0] = SWAP16(temp[0]);
+            reply.si_ks_version[1] = SWAP16(temp[1]);
+            if (pos == 0)
+                pos = 18;
+            else
+                pos += 8 + 7;
+            sscanf(version_str + pos, "%04u-%02u-%02u",
+                   &temp[0], &temp[1], &temp[2]);
+            reply.si_ks_date[0] = temp[0] / 100;
+            reply.si_ks_date[1] = temp[0] % 100;
+            reply.si_ks_date[2] = temp[1];
+            reply.si_ks_date[3] = temp[2];
+            pos += 11;
+            sscanf(version_str + pos, "%02u:%02u:%02u",
+                   &temp[0], &temp[1], &temp[2]);
+            reply.si_ks_time[0] = temp[0];
+            reply.si_ks_time[1] = temp[1];
+            reply.si_ks_time[2] = temp[2];
+            strcpy(reply.si_serial, "VIRTUAL");
+            reply.si_rev      = SWAP16(0x0001);     // Protocol version 0.1
+            reply.si_features = SWAP16(0x0001 |     // Features
+                                       KS_FEATURE_MSG_NOTIFY |
+                                       KS_FEATURE_FLASH_CRC |
+                                       KS_FEATURE_FLASH_USB);
+            reply.si_usbid    = SWAP32(0x12091610); // Matches USB ID
+            reply.si_mode     = 0;                  // 32-bit
+            strcpy(reply.si_name, board_name);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_UPTIME: {
+            uint64_t usec = SWAP64(now - start_usec);  // Big endian format
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (usec), &usec, 0, NULL);
+            break;
+        }
+        case KS_CMD_TESTPATT:
+            /* Send special data pattern (for test / diagnostic) */
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (testpatt_reply),
+                          &testpatt_reply, 0, NULL);
+            break;
+        case KS_CMD_LOOPBACK: {
+            uint raw_len = cmd_len + KS_HDR_AND_CRC_LEN;  // Magic+len+cmd+CRC
+            usb_msg_reply(KS_REPLY_RAW, 0, raw_len, rawbuf, 0, NULL);
+            break;
+        }
+        case KS_CMD_SET:
+            if (cmd & KS_SET_NAME) {
+                if (cmd_len != 16) {
+                    usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                memcpy(board_name, buf, sizeof (board_name) - 1);
+                usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
+            } else {
+                usb_msg_reply(0, KS_STATUS_BADARG, 0, NULL, 0, NULL);
+            }
+            break;
+        case KS_CMD_BANK_INFO:
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (bank_info), &bank_info,
+                          0, NULL);
+            break;
+        case KS_CMD_FLASH_CRC: {
+            /* Compute CRC of each flash sector in the requested range */
+            smash_crc_t reply[16];
+            uint        count = ARRAY_SIZE(reply);
+            uint        cur;
+
+            if (cmd_len != 8) {
+                usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                break;
+            }
+            if (flash_crc(get_be32(buf), get_be32(buf + 4), reply, &count)) {
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+                break;
+            }
+            for (cur = 0; cur < count; cur++) {
+                reply[cur].sc_addr = SWAP32(reply[cur].sc_addr);
+                reply[cur].sc_len  = SWAP32(reply[cur].sc_len);
+                reply[cur].sc_crc  = SWAP32(reply[cur].sc_crc);
+            }
+            usb_msg_reply(0, KS_STATUS_OK, count * sizeof (reply[0]), reply,
+                          0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_GETID: {
+            /* Report flash chip ids and part names */
+            smash_flash_id_t reply;
+
+            memset(&reply, 0, sizeof (reply));
+            reply.sfi_id[0] = SWAP32(VS_CHIP_ID);
+            reply.sfi_id[1] = SWAP32(VS_CHIP_ID);
+            reply.sfi_mode  = 0;  // 32-bit
+            strcpy(reply.sfi_name[0], VS_CHIP_NAME);
+            strcpy(reply.sfi_name[1], VS_CHIP_NAME);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_BLANK: {
+            /* Check flash range is erased */
+            uint32_t reply[2];
+
+            if (cmd_len != 8) {
+                usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                break;
+            }
+            if (flash_blank(get_be32(buf), get_be32(buf + 4),
+                            &reply[0], &reply[1])) {
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+                break;
+            }
+            reply[0] = SWAP32(reply[0]);
+            reply[1] = SWAP32(reply[1]);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_FLASH_DERASE: {
+            /* Erase flash chip or sectors (reply when complete) */
+            uint32_t addr = 0;
+            uint32_t len  = 0;
+            uint     mode = ERASE_MODE_CHIP;
+
+            if ((cmd & KS_DERASE_CHIP) == 0) {
+                if (cmd_len != 8) {
+                    usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                addr = get_be32(buf);
+                len  = get_be32(buf + 4);
+                mode = ERASE_MODE_SECTOR;
+            }
+            if (flash_erase(mode, addr, len) != RC_SUCCESS)
+                usb_msg_reply(0, KS_STATUS_FAIL, 0, NULL, 0, NULL);
+            else
+                usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_STATE: {
+            uint16_t reply[2];
+
+            pthread_mutex_lock(&vs_lock);
+            if (cmd & KS_MSG_STATE_SET) {
+                uint16_t mask;
+                uint16_t state;
+                uint16_t expire = 10000;  // 10 seconds
+                if ((cmd_len != 4) && (cmd_len != 6)) {
+                    pthread_mutex_unlock(&vs_lock);
+                    usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                mask  = (buf[0] << 8) | buf[1];
+                state = (buf[2] << 8) | buf[3];
+                if (cmd_len == 6)
+                    expire = (buf[4] << 8) | buf[5];
+                state_usb_app = (state_usb_app & ~mask) | (state & mask);
+                expire_update_usb_app = now + expire * 1000ULL;
+                pthread_cond_broadcast(&vs_cond);
+            }
+            if ((cmd & KS_MSG_STATE_NOTIFY) && !atou_notify) {
+                atou_notify = true;
+                if (RING_INUSE(&msg_atou) != 0)
+                    atou_notify_pending = true;  // Messages already waiting
+            }
+            reply[0] = SWAP16(state_amiga_app);
+            reply[1] = SWAP16(state_usb_app);
+            pthread_mutex_unlock(&vs_lock);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_INFO: {
+            smash_msg_info_t reply;
+            uint             inuse_atou = 0;
+            uint             avail_atou = 0;
+            uint             inuse_utoa = 0;
+            uint             avail_utoa = 0;
+
+            pthread_mutex_lock(&vs_lock);
+            if ((msg_lock & BIT(0)) == 0) {
+                inuse_atou = RING_INUSE(&msg_atou);
+                avail_atou = RING_AVAIL(&msg_atou);
+                if (avail_atou >= KS_HDR_AND_CRC_LEN)
+                    avail_atou -= KS_HDR_AND_CRC_LEN;
+                else
+                    avail_atou = 0;
+            }
+            if ((msg_lock & BIT(1)) == 0) {
+                inuse_utoa = RING_INUSE(&msg_utoa);
+                avail_utoa = RING_AVAIL(&msg_utoa);
+                if (avail_utoa >= KS_HDR_AND_CRC_LEN)
+                    avail_utoa -= KS_HDR_AND_CRC_LEN;
+                else
+                    avail_utoa = 0;
+            }
+            if (now >= expire_update_amiga_app)
+                state_amiga_app = 0;
+            if (now >= expire_update_usb_app)
+                state_usb_app = 0;
+
+            memset(&reply, 0, sizeof (reply));
+            reply.smi_atou_inuse  = SWAP16(inuse_atou);
+            reply.smi_atou_avail  = SWAP16(avail_atou);
+            reply.smi_utoa_inuse  = SWAP16(inuse_utoa);
+            reply.smi_utoa_avail  = SWAP16(avail_utoa);
+            reply.smi_state_amiga = SWAP16(state_amiga_app);
+            reply.smi_state_usb   = SWAP16(state_usb_app);
+            pthread_mutex_unlock(&vs_lock);
+            usb_msg_reply(0, KS_STATUS_OK, sizeof (reply), &reply, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_SEND: {
+            uint raw_len = cmd_len + KS_HDR_AND_CRC_LEN;  // Magic+len+cmd+CRC
+            uint status  = KS_STATUS_OK;
+
+            pthread_mutex_lock(&vs_lock);
+            if ((((cmd & KS_MSG_ALTBUF) == 0) && (msg_lock & BIT(1))) ||
+                (((cmd & KS_MSG_ALTBUF) != 0) && (msg_lock & BIT(0)))) {
+                status = KS_STATUS_LOCKED;
+            } else if ((cmd & KS_MSG_ALTBUF) == 0) {
+                if (ring_add(&msg_utoa, raw_len, rawbuf))
+                    status = KS_STATUS_BADLEN;
+                else
+                    pthread_cond_broadcast(&vs_cond);
+            } else {
+                if (ring_add(&msg_atou, raw_len, rawbuf))
+                    status = KS_STATUS_BADLEN;
+            }
+
+            /* Extend state expiration when transfer in progress */
+            if (expire_update_usb_app < now + 1000000)
+                expire_update_usb_app = now + 1000000;
+            pthread_mutex_unlock(&vs_lock);
+            usb_msg_reply(0, status, 0, NULL, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_RECEIVE: {
+            static uint8_t rbuf[VS_MSG_BUF_SIZE];
+            vs_ring_t     *rb;
+            uint           len = 0;
+            uint           status = KS_STATUS_OK;
+
+            pthread_mutex_lock(&vs_lock);
+            rb = ((cmd & KS_MSG_ALTBUF) == 0) ? &msg_atou : &msg_utoa;
+            if ((((cmd & KS_MSG_ALTBUF) == 0) && (msg_lock & BIT(0))) ||
+                (((cmd & KS_MSG_ALTBUF) != 0) && (msg_lock & BIT(1)))) {
+                status = KS_STATUS_LOCKED;
+            } else {
+                len = ring_next_msg_len(rb);
+                if (len == 0)
+                    status = KS_STATUS_NODATA;
+                else
+                    ring_get(rb, rbuf, len);
+            }
+            if (usb_receive_count++ == 0)
+                pthread_cond_broadcast(&vs_cond);
+            if (expire_update_usb_app < now + 1000000)
+                expire_update_usb_app = now + 1000000;
+            pthread_mutex_unlock(&vs_lock);
+            if (status != KS_STATUS_OK)
+                usb_msg_reply(0, status, 0, NULL, 0, NULL);
+            else
+                usb_msg_reply(KS_REPLY_RAW, 0, len, rbuf, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_LOCK: {
+            uint lockbits = (buf[0] << 8) | buf[1];
+            uint status   = KS_STATUS_OK;
+
+            pthread_mutex_lock(&vs_lock);
+            if (cmd & KS_MSG_UNLOCK) {
+                msg_lock &= ~lockbits;
+            } else if (((lockbits & BIT(2)) && (msg_lock & BIT(0))) ||
+                       ((lockbits & BIT(3)) && (msg_lock & BIT(1)))) {
+                /* Attempted to lock resource owned by the other side */
+                status = KS_STATUS_LOCKED;
+            } else {
+                msg_lock |= lockbits;
+            }
+            pthread_mutex_unlock(&vs_lock);
+            usb_msg_reply(0, status, 0, NULL, 0, NULL);
+            break;
+        }
+        case KS_CMD_MSG_FLUSH: {
+            uint status = KS_STATUS_OK;
+
+            pthread_mutex_lock(&vs_lock);
+            if ((((cmd & KS_MSG_ALTBUF) == 0) && (msg_lock & BIT(0))) ||
+                (((cmd & KS_MSG_ALTBUF) != 0) && (msg_lock & BIT(1)))) {
+                status = KS_STATUS_LOCKED;
+            } else if ((cmd & KS_MSG_ALTBUF) == 0) {
+                msg_atou.rb_cons = msg_atou.rb_prod;
+            } else {
+                msg_utoa.rb_cons = msg_utoa.rb_prod;
+            }
+            pthread_mutex_unlock(&vs_lock);
+            usb_msg_reply(0, status, 0, NULL, 0, NULL);
+            break;
+        }
+        case KS_CMD_CLOCK: {
+            uint64_t usec = now - start_usec;
+            uint32_t am_time[2];
+
+            if (cmd & (KS_CLOCK_SET | KS_CLOCK_SET_IFNOT)) {
+                if (cmd_len != 8) {
+                    usb_msg_reply(0, KS_STATUS_BADLEN, 0, NULL, 0, NULL);
+                    break;
+                }
+                memcpy(am_time, buf, sizeof (am_time));
+                if (((cmd & KS_CLOCK_SET_IFNOT) == 0) || (amiga_time == 0))
+                    amiga_time = am_time[0] * 1000000ULL + am_time[1] - usec;
+                usb_msg_reply(0, KS_STATUS_OK, 0, NULL, 0, NULL);
+            } else {
+                if (amiga_time == 0) {
+                    am_time[0] = 0;
+                    am_time[1] = 0;
+                } else {
+                    uint64_t both = usec + amiga_time;
+                    am_time[0] = both / 1000000;
+                    am_time[1] = both % 1000000;
+                }
+                usb_msg_reply(0, KS_STATUS_OK, sizeof (am_time), &am_time,
+                              0, NULL);
+            }
+            break;
+        }
+        default:
+            printf("Unknown USB command %04x\n", cmd);
+            break;
+    }
+}
+
+/*
+ * msg_usb_notify() sends the USB host an unsolicited KS_CMD_MSG_NOTIFY
+ * message if the Amiga -> USB buffer is not empty.
+ */
+static void
+msg_usb_notify(void)
+{
+    bool send;
+
+    pthread_mutex_lock(&vs_lock);
+    atou_notify_pending = false;
+    send = (RING_INUSE(&msg_atou) != 0) && ((msg_lock & BIT(0)) == 0);
+    pthread_mutex_unlock(&vs_lock);
+    if (send)
+        usb_msg_reply(0, KS_CMD_MSG_NOTIFY, 0, NULL, 0, NULL);
+}
+
+/*
+ * msg_usb_service() receives and executes binary commands from the USB
+ *                   host until it sends ^C, LF, or CR in place of a
+ *                   message, or the script completes.
+ */
+static void
+msg_usb_service(void)
+{
+    uint     len = 0;
+    uint     len_rounded = 0;
+    uint     pos = 0;
+    uint64_t last_rx = 0;
+    uint32_t crc;
+
+    while (1) {
+        int ch = dev_getchar(200);
+        if (ch == -1) {
+            /* Timeout will clobber received data and reset */
+            if ((pos != 0) && (vs_usec() - last_rx >= 200000))
+                pos = 0;
+            if (pos == 0) {
+                bool pending;
+                if (vs_done)
+                    break;
+                pthread_mutex_lock(&vs_lock);
+                pending = atou_notify_pending;
+                pthread_mutex_unlock(&vs_lock);
+                if (pending)
+                    msg_usb_notify();
+            }
+            continue;
+        }
+        last_rx = vs_usec();
+        usb_msg_buffer[pos] = ch;
+        switch (pos) {
+            case 0:  // Magic start
+                if ((ch == 0x3) || (ch == '\n') || (ch == '\r'))
+                    goto service_exit;  // Abort received ^C, LF, or CR
+                /* FALLTHROUGH */
+            case 1:  // Magic
+            case 2:  // Magic
+            case 3:  // Magic
+            case 4:  // Magic
+            case 5:  // Magic
+            case 6:  // Magic
+            case 7:  // Magic
+                if (ch != sm_magic_b[pos])
+                    pos = 0;
+                else
+                    pos++;
+                break;
+            case 8:  // Length phase 1
+                len = ch;
+                pos++;
+                break;
+            case 9:  // Length phase 2
+                len |= (ch << 8);
+                len_rounded = (len + 1) & ~1;
+                if (len > sizeof (usb_msg_buffer) - 16) {
+                    /* Bad length */
+                    pos = 0;
+                    break;
+                }
+                pos++;
+                break;
+            case 10:  // Command phase 1
+            case 11:  // Command phase 2
+                pos++;
+                break;
+            default: {  // Data and CRC phase
+                uint32_t crc_rx;
+                uint     cmd;
+                if (pos != len_rounded + 15) {
+                    /* More data pending */
+                    pos++;
+                    break;
+                }
+
+                /*
+                 * Last byte of CRC received. CRC region begins after
+                 * sm_magic (8 bytes) and includes length (2) + cmd (2).
+                 */
+                crc = crc32s(0, usb_msg_buffer + 8, len + 4);
+                cmd = usb_msg_buffer[10] | (usb_msg_buffer[11] << 8);
+                crc_rx = (usb_msg_buffer[12 + 1 + len_rounded] << 24) |
+                         (usb_msg_buffer[12 + 0 + len_rounded] << 16) |
+                         (usb_msg_buffer[12 + 3 + len_rounded] << 8) |
+                         (usb_msg_buffer[12 + 2 + len_rounded]);
+                if (crc != crc_rx) {
+                    uint16_t error[2];
+                    error[0] = KS_STATUS_CRC;
+                    error[1] = crc;
+                    usb_msg_reply(0, KS_STATUS_CRC, sizeof (error),
+                                  &error, 0, NULL);
+                    printf("Ucmd=%x l=%04x CRC %08x != calc %08x\n",
+                           cmd, len, crc_rx, crc);
+                    pos = 0;
+                    break;
+                }
+                execute_usb_cmd(cmd, len, usb_msg_buffer);
+                pos = 0;
+                break;
+            }
+        }
+    }
+service_exit:
+    pthread_mutex_lock(&vs_lock);
+    atou_notify = false;
+    pthread_mutex_unlock(&vs_lock);
+}
+
+/*
+ * cmd_exec() executes a firmware command line. Only the commands which
+ *            hostsmash issues are implemented.
+ */
+static void
+cmd_exec(char *line)
+{
+    char    *argv[8];
+    uint     argc = 0;
+    uint32_t addr = 0;
+    uint32_t len = 0;
+    uint     rc = RC_SUCCESS;
+    char    *ptr;
+
+    for (ptr = strtok(line, " \t"); (ptr != NULL) && (argc < 8);
+         ptr = strtok(NULL, " \t")) {
+        argv[argc++] = ptr;
+    }
+    if (argc == 0)
+        return;
+    if (strcmp(argv[0], "version") == 0) {
+        dev_printf("%s\n", version_str);
+        return;
+    }
+    if ((strcmp(argv[0], "prom") != 0) || (argc < 2)) {
+        dev_printf("Unknown command: %s\n", argv[0]);
+        return;
+    }
+    if (argc > 2)
+        addr = strtoul(argv[2], NULL, 16);
+    if (argc > 3)
+        len = strtoul(argv[3], NULL, 16);
+
+    if (strcmp(argv[1], "service") == 0) {
+        msg_usb_service();
+        return;
+    } else if (strcmp(argv[1], "id") == 0) {
+        dev_printf("%08x %08x %s %s\n", VS_CHIP_ID, VS_CHIP_ID,
+                   VS_CHIP_NAME, VS_CHIP_NAME);
+        return;
+    } else if (strcmp(argv[1], "mode") == 0) {
+        dev_printf("0 32-bit\n");
+        return;
+    } else if ((strcmp(argv[1], "read") == 0) && (argc == 4)) {
+        rc = prom_read_binary(addr, len);
+    } else if ((strcmp(argv[1], "write") == 0) && (argc == 4)) {
+        rc = prom_write_binary(addr, len);
+    } else if ((strcmp(argv[1], "erase") == 0) && (argc == 3) &&
+               (strcmp(argv[2], "chip") == 0)) {
+        dev_printf("Chip erase\n");
+        rc = flash_erase(ERASE_MODE_CHIP, 0, 0);
+    } else if ((strcmp(argv[1], "erase") == 0) && (argc >= 3)) {
+        dev_printf("Sector erase %x", addr);
+        if (len > 0)
+            dev_printf(" len %x", len);
+        dev_printf("\n");
+        rc = flash_erase(ERASE_MODE_SECTOR, addr, len);
+    } else {
+        dev_printf("error: unknown prom operation %s\n", argv[1]);
+        return;
+    }
+    if (rc != RC_SUCCESS)
+        dev_printf("FAILURE %d\n", rc);
+}
+
+/*
+ * cmdline() provides the firmware command prompt until the script
+ *           completes.
+ */
+static void
+cmdline(void)
+{
+    char line[256];
+    uint len = 0;
+
+    dev_printf("\nCMD> ");
+    while (!vs_done) {
+        int ch = dev_getchar(200);
+        switch (ch) {
+            case -1:
+                break;
+            case '\r':
+            case '\n':
+                dev_printf("\n");
+                line[len] = '\0';
+                len = 0;
+                cmd_exec(line);
+                dev_printf("CMD> ");
+                break;
+            case 0x03:  // ^C
+            case 0x15:  // ^U
+                for (; len > 0; len--)
+                    dev_printf("\b \b");
+                break;
+            case '\b':
+            case 0x7f:
+                if (len > 0) {
+                    len--;
+                    dev_printf("\b \b");
+                }
+                break;
+            default:
+                if ((ch >= ' ') && (ch <= '~') && (len < sizeof (line) - 1)) {
+                    line[len++] = ch;
+                    dev_printf("%c", ch);
+                }
+                break;
+        }
+    }
+}
+
+/*
+ * Virtual Amiga
+ *
+ * The following functions act as the Amiga side of the message interface.
+ * Messages are built in Amiga (big endian) byte order, then stored in the
+ * Amiga -> USB buffer byte-swapped in 16-bit units, exactly as the
+ * firmware captures them from the Amiga address bus.
+ */
+static uint16_t am_tag;
+static bool     am_compress_ok = true;  // Script allows compression
+static bool     am_compress;            // Host supports compression
+static uint8_t  am_rbuf[AM_RECV_MAX];   // Last received message
+static uint16_t am_lz_hash[SM_LZ_HASH_SIZE];
+
+/*
+ * am_state_update() refreshes the Amiga application state, as the Amiga
+ *                   does with KS_CMD_MSG_STATE | KS_MSG_STATE_SET.
+ */
+static void
+am_state_update(void)
+{
+    pthread_mutex_lock(&vs_lock);
+    state_amiga_app = MSG_STATE_SERVICE_UP;
+    expire_update_amiga_app = vs_usec() + 10000000;
+    pthread_mutex_unlock(&vs_lock);
+}
+
+/*
+ * am_send_cmd_msg() adds a message to the Amiga -> USB buffer, as the
+ *                   firmware does for KS_CMD_MSG_SEND from the Amiga.
+ *
+ * @param  [in]  msg - Message in Amiga byte order.
+ * @param  [in]  len - Length of message.
+ *
+ * @return       KS_STATUS_OK, KS_STATUS_LOCKED, or KS_STATUS_BADLEN.
+ */
+static uint
+am_send_cmd_msg(const void *msg, uint len)
+{
+    uint8_t  frame[SEND_MSG_MAX + KS_HDR_AND_CRC_LEN + 2];
+    uint16_t hdr[2];
+    uint     rlen = (len + 1) & ~1;
+    uint     rc = KS_STATUS_OK;
+    uint32_t crc;
+    bool     was_empty;
+
+    memcpy(frame, sm_magic, sizeof (sm_magic));
+    hdr[0] = len;
+    hdr[1] = KS_CMD_MSG_SEND;
+    memcpy(frame + 8, hdr, sizeof (hdr));
+    memcpy(frame + 12, msg, len);
+    frame[12 + len] = 0;
+    mem16_swap(frame + 12, rlen);
+    crc = crc32s(0, frame + 8, len + 4);
+    crc = (crc << 16) | (crc >> 16);  // Same format as usb_msg_reply()
+    memcpy(frame + 12 + rlen, &crc, sizeof (crc));
+
+    pthread_mutex_lock(&vs_lock);
+    was_empty = (RING_INUSE(&msg_atou) == 0);
+    if (msg_lock & BIT(2)) {
+        rc = KS_STATUS_LOCKED;
+    } else if (ring_add(&msg_atou, rlen + KS_HDR_AND_CRC_LEN, frame)) {
+        rc = KS_STATUS_BADLEN;
+    } else if (was_empty && atou_notify) {
+        atou_notify_pending = true;
+        vs_wake();
+    }
+    pthread_mutex_unlock(&vs_lock);
+    return (rc);
+}
+
+/*
+ * am_send_retry() is am_send_cmd_msg() which waits for buffer space.
+ */
+static uint
+am_send_retry(const void *msg, uint len)
+{
+    uint timeout;
+    uint rc = KS_STATUS_BADLEN;
+
+    for (timeout = 0; timeout < 20000; timeout++) {
+        rc = am_send_cmd_msg(msg, len);
+        if (rc != KS_STATUS_BADLEN)
+            break;
+        usleep(100);
+    }
+    return (rc);
+}
+
+/*
+ * am_send_msg() sends a message to the USB host, breaking it into units of
+ *               SEND_MSG_MAX as host_send_msg() in amiga/sm_msg.c does.
+ */
+static uint
+am_send_msg(const void *smsg, uint len)
+{
+    uint8_t        buf[SEND_MSG_MAX];
+    const uint8_t *msg = smsg;
+    uint           sendlen = len;
+    uint           pos;
+    uint           rc;
+
+    if (sendlen > SEND_MSG_MAX)
+        sendlen = SEND_MSG_MAX;
+    rc = am_send_retry(msg, sendlen);
+    pos = sendlen;
+    while ((rc == KS_STATUS_OK) && (pos < len)) {
+        uint blen = SEND_MSG_MAX - sizeof (km_msg_hdr_t);
+        if (blen > len - pos)
+            blen = len - pos;
+        memcpy(buf, msg, sizeof (km_msg_hdr_t));
+        memcpy(buf + sizeof (km_msg_hdr_t), msg + pos, blen);
+        rc = am_send_retry(buf, sizeof (km_msg_hdr_t) + blen);
+        pos += blen;
+    }
+    if (rc != KS_STATUS_OK)
+        printf("Amiga: send message l=%u failed: %04x\n", len, rc);
+    return (rc);
+}
+
+/*
+ * am_recv_msg() receives the next message from the USB -> Amiga buffer,
+ *               as KS_CMD_MSG_RECEIVE from the Amiga does, then checks
+ *               its CRC and converts it to Amiga byte order.
+ *
+ * @param  [out] buf        - Buffer for received message.
+ * @param  [in]  buflen     - Size of buffer.
+ * @param  [out] rlen       - Length of received message.
+ * @param  [in]  timeout_ms - Time to wait for a message.
+ *
+ * @return       KM_STATUS_OK, KS_STATUS_NODATA, KS_STATUS_CRC, or
+ *               KS_STATUS_BADLEN.
+ */
+static uint
+am_recv_msg(void *buf, uint buflen, uint *rlen, uint timeout_ms)
+{
+    static uint8_t  frame[VS_MSG_BUF_SIZE];
+    struct timespec ts;
+    uint16_t        hdr[2];
+    uint32_t        crc;
+    uint32_t        crc_rx;
+    uint            flen = 0;
+    uint            rounded;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&vs_lock);
+    while (((flen = ring_next_msg_len(&msg_utoa)) == 0) && !vs_done) {
+        if (pthread_cond_timedwait(&vs_cond, &vs_lock, &ts) == ETIMEDOUT)
+            break;
+    }
+    if (flen != 0)
+        ring_get(&msg_utoa, frame, flen);
+    pthread_mutex_unlock(&vs_lock);
+    if (flen == 0)
+        return (KS_STATUS_NODATA);
+
+    memcpy(hdr, frame + 8, sizeof (hdr));
+    rounded = (hdr[0] + 1) & ~1;
+    crc = crc32s(0, frame + 8, hdr[0] + 4);
+    crc_rx = (frame[12 + 1 + rounded] << 24) | (frame[12 + 0 + rounded] << 16) |
+             (frame[12 + 3 + rounded] << 8) | frame[12 + 2 + rounded];
+    if (crc != crc_rx) {
+        printf("Amiga: message CRC %08x != calc %08x\n", crc_rx, crc);
+        return (KS_STATUS_CRC);
+    }
+    if (hdr[0] > buflen)
+        return (KS_STATUS_BADLEN);
+    mem16_swap(frame + 12, rounded);
+    memcpy(buf, frame + 12, hdr[0]);
+    *rlen = hdr[0];
+    return (KM_STATUS_OK);
+}
+
+/*
+ * am_host_recv() receives the reply having the specified tag, as
+ *                host_recv_msg() in amiga/sm_msg.c does. The reply is
+ *                left in am_rbuf.
+ *
+ * @return       Transport failure status or km_status of the reply.
+ */
+static uint
+am_host_recv(uint tag, uint *rlen)
+{
+    km_msg_hdr_t *km = (km_msg_hdr_t *) am_rbuf;
+    uint          count;
+    uint          rc;
+
+    for (count = 0; count < 50; count++) {
+        rc = am_recv_msg(am_rbuf, sizeof (am_rbuf), rlen, 500);
+        if (rc == KS_STATUS_NODATA)
+            continue;
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        if ((*rlen >= sizeof (*km)) && (SWAP16(km->km_tag) == tag))
+            return (km->km_status);
+        printf("Amiga: discarded message op=%02x status=%02x tag=%04x "
+               "(want %04x)\n", km->km_op, km->km_status,
+               SWAP16(km->km_tag), tag);
+    }
+    printf("Amiga: message receive timeout\n");
+    return (KS_STATUS_NODATA);
+}
+
+/*
+ * am_host_recv_cont() receives the continuation messages of a multiple
+ *                     message reply, appending their payload to buf.
+ */
+static uint
+am_host_recv_cont(uint tag, uint8_t *buf, uint len)
+{
+    uint pos = 0;
+    uint rlen;
+    uint rc;
+
+    while (pos < len) {
+        rc = am_host_recv(tag, &rlen);
+        if (rc == KM_STATUS_EOF)
+            rc = KM_STATUS_OK;
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        if ((rlen < sizeof (km_msg_hdr_t)) ||
+            (rlen - sizeof (km_msg_hdr_t) > len - pos)) {
+            printf("Amiga: bad continuation length %x\n", rlen);
+            return (KM_STATUS_FAIL);
+        }
+        rlen -= sizeof (km_msg_hdr_t);
+        memcpy(buf + pos, am_rbuf + sizeof (km_msg_hdr_t), rlen);
+        pos += rlen;
+    }
+    return (KM_STATUS_OK);
+}
+
+/*
+ * am_host_msg() sends a request and receives the first reply message.
+ */
+static uint
+am_host_msg(void *smsg, uint slen, uint *rlen)
+{
+    km_msg_hdr_t *km = smsg;
+    uint          rc = am_send_msg(smsg, slen);
+
+    if (rc != KS_STATUS_OK)
+        return (rc);
+    return (am_host_recv(SWAP16(km->km_tag), rlen));
+}
+
+static void
+am_hdr(km_msg_hdr_t *km, uint op)
+{
+    km->km_op     = op;
+    km->km_status = 0;
+    km->km_tag    = SWAP16(am_tag++);
+}
+
+/* Test pattern data written and verified by script commands */
+static uint8_t
+am_pattern(uint pos)
+{
+    return ((pos * 13) ^ (pos >> 7) ^ (pos >> 17));
+}
+
+static uint
+am_id(void)
+{
+    km_msg_hdr_t km;
+    smash_id_t  *id = (smash_id_t *) (am_rbuf + sizeof (km));
+    uint         rlen;
+    uint         rc;
+
+    am_hdr(&km, KM_OP_ID);
+    rc = am_host_msg(&km, sizeof (km), &rlen);
+    if (rc != KM_STATUS_OK)
+        return (rc);
+    if (rlen < sizeof (km) + sizeof (*id))
+        return (KM_STATUS_FAIL);
+    am_compress = am_compress_ok &&
+                  (SWAP16(id->si_features) & HM_FEATURE_COMPRESS);
+    printf("Amiga: host %.16s version %u.%u features %04x\n", id->si_name,
+           SWAP16(id->si_ks_version[0]), SWAP16(id->si_ks_version[1]),
+           SWAP16(id->si_features));
+    return (KM_STATUS_OK);
+}
+
+static uint
+am_loopback(uint len, uint count, uint64_t *bytes)
+{
+    uint8_t msg[SEND_MSG_MAX];
+    uint    pos;
+    uint    rlen;
+    uint    rc;
+
+    if ((len < sizeof (km_msg_hdr_t)) || (len > sizeof (msg)))
+        return (KM_STATUS_INVALID);
+    for (pos = sizeof (km_msg_hdr_t); pos < len; pos++)
+        msg[pos] = am_pattern(pos);
+    while (count-- > 0) {
+        am_hdr((km_msg_hdr_t *) msg, KM_OP_LOOPBACK);
+        rc = am_host_msg(msg, len, &rlen);
+        if (rc != KM_STATUS_OK)
+            return (rc);
+        if ((rlen != len) ||
+            (memcmp(am_rbuf + sizeof (km_msg_hdr_t),
+                    msg + sizeof (km_msg_hdr_t),
+                    len - sizeof (km_msg_hdr_t)) != 0)) {
+            printf("Amiga: loopback data miscompare\n");
+            return (KM_STATUS_FAIL);
+        }
+        *bytes += len * 2;
+    }
+    return (KM_STATUS_OK);
+}
+
+static uint
+am_fopen(const char *name, uint mode, handle_t *handle)
+{
+    uint8_t           msg[sizeof (hm_fopenhandle_t) + 1024];
+    hm_fopenhandle_t *hm = (hm_fopenhandle_t *) msg;
+    uint              namelen = strlen(name) + 1;
+    uint              rlen;
+    uint              rc;
+
+    if (namelen > sizeof (msg) - sizeof (*hm))
+        return (KM_STATUS_INVALID);
+    am_hdr(&hm->hm_hdr, KM_OP_FOPEN);
+    hm->hm_handle = 0;  // Volume Directory is starting point
+    hm->hm_type   = 0;
+    hm->hm_mode   = SWAP16(mode);
+    hm->hm_aperms = 0;
+    memcpy(hm + 1, name, namelen);
+    rc = am_host_msg(msg, sizeof (*hm) + namelen, &rlen);
+    *handle = ((hm_fopenhandle_t *) am_rbuf)->hm_handle;
+    return (rc);
+}
+
+static uint
+am_fclose(handle_t handle)
+{
+    hm_fopenhandle_t hm;
+    uint             rlen;
+
+    memset(&hm, 0, sizeof (hm));
+    am_hdr(&hm.hm_hdr, KM_OP_FCLOSE);
+    hm.hm_handle = handle;
+    return (am_host_msg(&hm, sizeof (hm), &rlen));
+}
+
+static uint
+am_fdelete(const char *name)
+{
+    uint8_t       msg[sizeof (hm_fhandle_t) + 1024];
+    hm_fhandle_t *hm = (hm_fhandle_t *) msg;
+    uint          namelen = strlen(name) + 1;
+    uint          rlen;
+
+    if (namelen > sizeof (msg) - sizeof (*hm))
+        return (KM_STATUS_INVALID);
+    am_hdr(&hm->hm_hdr, KM_OP_FDELETE);
+    hm->hm_handle = 0;
+    memcpy(hm + 1, name, namelen);
+    return (am_host_msg(msg, sizeof (*hm) + namelen, &rlen));
+}
+
+/*
+ * am_fread() reads from a file handle as sm_fread() in amiga/sm_file.c
+ *            does, including multiple message and compressed replies.
+ *
+ * @param  [in]  handle - Open file handle.
+ * @param  [in]  len    - Number of bytes to request.
+ * @param  [out] buf    - Buffer for data.
+ * @param  [in]  buflen - Size of buffer, which for directories must have
+ *                        room for one more entry than requested.
+ * @param  [out] rlen   - Number of bytes read.
+ *
+ * @return       KM_STATUS_OK, KM_STATUS_EOF, or failure status.
+ */
+static uint
+am_fread(handle_t handle, uint len, uint8_t *buf, uint buflen, uint *rlen)
+{
+    static uint8_t  *zbuf;
+    static uint      zbuf_size;
+    hm_freadwrite_t  hm;
+    hm_freadwrite_t *hmr = (hm_freadwrite_t *) am_rbuf;
+    uint             flag = 0;
+    uint             total;
+    uint             rcvlen;
+    uint8_t         *dst = buf;
+    uint             rc;
+
+    *rlen = 0;
+    if (am_compress && (len >= SM_LZ_MIN_LEN))
+        flag |= HM_FLAG_COMPRESS;
+    am_hdr(&hm.hm_hdr, KM_OP_FREAD);
+    hm.hm_handle = handle;
+    hm.hm_length = SWAP32(len);
+    hm.hm_flag   = SWAP16(flag);
+    hm.hm_unused = 0;
+    rc = am_host_msg(&hm, sizeof (hm), &rcvlen);
+    if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
+        return (rc);
+    if (rcvlen < sizeof (*hmr))
+        return (rc);
+    rcvlen -= sizeof (*hmr);
+    total   = SWAP32(hmr->hm_length);
+    flag    = SWAP16(hmr->hm_flag);
+    if (flag & HM_FLAG_COMPRESS) {
+        if ((zbuf == NULL) || (zbuf_size < total)) {
+            free(zbuf);
+            zbuf_size = total;
+            zbuf = malloc(zbuf_size);
+            if (zbuf == NULL)
+                errx(EXIT_FAILURE, "Failed to allocate %u bytes", total);
+        }
+        dst = zbuf;
+    } else if (total > buflen) {
+        printf("Amiga: read reply length %x > %x\n", total, buflen);
+        return (KM_STATUS_FAIL);
+    }
+    if (rcvlen > total)
+        return (KM_STATUS_FAIL);
+    memcpy(dst, hmr + 1, rcvlen);
+    if (rcvlen < total) {
+        /* More messages are inbound */
+        uint crc = am_host_recv_cont(SWAP16(hm.hm_hdr.km_tag), dst + rcvlen,
+                                     total - rcvlen);
+        if (crc != KM_STATUS_OK)
+            return (crc);
+    }
+    if (flag & HM_FLAG_COMPRESS) {
+        int32_t ulen = sm_lz_unpack(zbuf, total, buf, buflen);
+        if (ulen < 0) {
+            printf("Amiga: corrupt compressed read data\n");
+            return (KM_STATUS_FAIL);
+        }
+        total = ulen;
+    }
+    *rlen = total;
+    return (rc);
+}
+
+/*
+ * am_fwrite() writes to a file handle as sm_fwrite() in amiga/sm_file.c
+ *             does, compressing the data if the host supports it.
+ */
+static uint
+am_fwrite(handle_t handle, const uint8_t *data, uint len)
+{
+    static uint8_t  *msg;
+    static uint      msg_size;
+    hm_freadwrite_t *hm;
+    uint             need = sizeof (*hm) + SM_LZ_PACK_MAX(len);
+    uint             dlen = 0;
+    uint             flag = 0;
+    uint             rlen;
+
+    if ((msg == NULL) || (msg_size < need)) {
+        free(msg);
+        msg_size = need;
+        msg = malloc(msg_size);
+        if (msg == NULL)
+            errx(EXIT_FAILURE, "Failed to allocate %u bytes", need);
+    }
+    hm = (hm_freadwrite_t *) msg;
+    if (am_compress && (len >= SM_LZ_MIN_LEN)) {
+        dlen = sm_lz_pack(data, len, hm + 1, SM_LZ_PACK_MAX(len), am_lz_hash);
+        if (dlen != 0)
+            flag |= HM_FLAG_COMPRESS;
+    }
+    if (dlen == 0) {
+        memcpy(hm + 1, data, len);
+        dlen = len;
+    }
+    am_hdr(&hm->hm_hdr, KM_OP_FWRITE);
+    hm->hm_handle = handle;
+    hm->hm_length = SWAP32(dlen);
+    hm->hm_flag   = SWAP16(flag);
+    hm->hm_unused = 0;
+    return (am_host_msg(msg, sizeof (*hm) + dlen, &rlen));
+}
+
+static uint
+am_file_read(const char *name, uint chunk, bool verify, uint64_t *bytes)
+{
+    handle_t handle;
+    uint8_t *buf = malloc(chunk);
+    uint     pos = 0;
+    uint     rlen;
+    uint     rc;
+    uint     crc;
+
+    if (buf == NULL)
+        errx(EXIT_FAILURE, "Failed to allocate %u bytes", chunk);
+    rc = am_fopen(name, HM_MODE_READ, &handle);
+    if (rc != KM_STATUS_OK)
+        goto fail;
+    do {
+        rc = am_fread(handle, chunk, buf, chunk, &rlen);
+        if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
+            break;
+        if (verify) {
+            uint cur;
+            for (cur = 0; cur < rlen; cur++) {
+                if (buf[cur] != am_pattern(pos + cur)) {
+                    printf("Amiga: %s miscompare at 0x%x\n", name, pos + cur);
+                    rc = KM_STATUS_FAIL;
+                    break;
+                }
+            }
+        }
+        pos += rlen;
+    } while ((rc == KM_STATUS_OK) && (rlen != 0));
+    if (rc == KM_STATUS_EOF)
+        rc = KM_STATUS_OK;
+    *bytes += pos;
+    crc = am_fclose(handle);
+    if (rc == KM_STATUS_OK)
+        rc = crc;
+fail:
+    free(buf);
+    return (rc);
+}
+
+static uint
+am_file_write(const char *name, uint len, uint chunk, uint64_t *bytes)
+{
+    handle_t handle;
+    uint8_t *buf = malloc(chunk);
+    uint     pos;
+    uint     rc;
+    uint     crc;
+
+    if (buf == NULL)
+        errx(EXIT_FAILURE, "Failed to allocate %u bytes", chunk);
+    rc = am_fopen(name, HM_MODE_WRITE | HM_MODE_CREATE | HM_MODE_TRUNC,
+                  &handle);
+    if (rc != KM_STATUS_OK)
+        goto fail;
+    for (pos = 0; (rc == KM_STATUS_OK) && (pos < len); ) {
+        uint tlen = len - pos;
+        uint cur;
+        if (tlen > chunk)
+            tlen = chunk;
+        for (cur = 0; cur < tlen; cur++)
+            buf[cur] = am_pattern(pos + cur);
+        rc = am_fwrite(handle, buf, tlen);
+        pos += tlen;
+    }
+    *bytes += pos;
+    crc = am_fclose(handle);
+    if (rc == KM_STATUS_OK)
+        rc = crc;
+fail:
+    free(buf);
+    return (rc);
+}
+
+/*
+ * am_dir_read() reads all entries of a directory, reporting the number of
+ *               entries and the CRC of the encoded dirent stream, which
+ *               is the same for every way the host may produce it.
+ */
+static uint
+am_dir_read(const char *name, uint chunk, uint64_t *bytes)
+{
+    handle_t handle;
+    uint8_t *buf = malloc(chunk + AM_RECV_MAX);
+    uint32_t crc = 0;
+    uint     count = 0;
+    uint     rlen;
+    uint     rc;
+    uint     crc2;
+
+    if (buf == NULL)
+        errx(EXIT_FAILURE, "Failed to allocate %u bytes", chunk);
+    rc = am_fopen(name, HM_MODE_READ, &handle);
+    if (rc != KM_STATUS_OK)
+        goto fail;
+    do {
+        uint pos;
+        rc = am_fread(handle, chunk, buf, chunk + AM_RECV_MAX, &rlen);
+        if ((rc != KM_STATUS_OK) && (rc != KM_STATUS_EOF))
+            break;
+        for (pos = 0; pos + sizeof (hm_fdirent_t) <= rlen; count++) {
+            hm_fdirent_t *ent = (hm_fdirent_t *) (buf + pos);
+            pos += sizeof (*ent) + SWAP16(ent->hmd_elen);
+        }
+        crc = crc32(crc, buf, rlen);
+        *bytes += rlen;
+    } while ((rc == KM_STATUS_OK) && (rlen != 0));
+    if (rc == KM_STATUS_EOF)
+        rc = KM_STATUS_OK;
+    printf("Amiga: %s %u entries, crc %08x\n", name, count, crc);
+    crc2 = am_fclose(handle);
+    if (rc == KM_STATUS_OK)
+        rc = crc2;
+fail:
+    free(buf);
+    return (rc);
+}
+
+/*
+ * script_cmd() executes a single script command.
+ *
+ * @param  [in]  argc  - Number of arguments.
+ * @param  [in]  argv  - Arguments, the first being the command.
+ * @param  [out] bytes - Number of data bytes transferred.
+ *
+ * @return       KM_STATUS_OK or failure status.
+ */
+static uint
+script_cmd(uint argc, char **argv, uint64_t *bytes)
+{
+    const char *cmd = argv[0];
+    uint        arg1 = (argc > 1) ? strtoul(argv[1], NULL, 0) : 0;
+    uint        arg2 = (argc > 2) ? strtoul(argv[2], NULL, 0) : 0;
+    uint        arg3 = (argc > 3) ? strtoul(argv[3], NULL, 0) : 0;
+
+    if (strcmp(cmd, "id") == 0) {
+        return (am_id());
+    } else if ((strcmp(cmd, "loopback") == 0) && (argc > 1)) {
+        return (am_loopback(arg1, (argc > 2) ? arg2 : 1, bytes));
+    } else if ((strcmp(cmd, "read") == 0) && (argc > 1)) {
+        bool verify = (argc > 3) && (strcmp(argv[3], "verify") == 0);
+        if ((argc > 2) && (strcmp(argv[2], "verify") == 0)) {
+            verify = true;
+            arg2 = 0;
+        }
+        return (am_file_read(argv[1], arg2 ? arg2 : 16384, verify, bytes));
+    } else if ((strcmp(cmd, "write") == 0) && (argc > 2)) {
+        return (am_file_write(argv[1], arg2, arg3 ? arg3 : 16384, bytes));
+    } else if ((strcmp(cmd, "dir") == 0) && (argc > 1)) {
+        return (am_dir_read(argv[1], arg2 ? arg2 : 16384, bytes));
+    } else if ((strcmp(cmd, "delete") == 0) && (argc > 1)) {
+        return (am_fdelete(argv[1]));
+    } else if ((strcmp(cmd, "compress") == 0) && (argc > 1)) {
+        am_compress_ok = (strcmp(argv[1], "on") == 0);
+        return (am_id());
+    } else if ((strcmp(cmd, "sleep") == 0) && (argc > 1)) {
+        usleep(arg1 * 1000);
+        return (KM_STATUS_OK);
+    }
+    printf("Amiga: unknown script command \"%s\"\n", cmd);
+    return (KM_STATUS_UNKCMD);
+}
+
+/*
+ * th_amiga() runs the virtual Amiga script once hostsmash has started
+ *            message mode. hostsmash flushes the Amiga -> USB buffer
+ *            after announcing its state, so the script does not begin
+ *            until the host has also polled for a message.
+ */
+static void *
+th_amiga(void *arg)
+{
+    FILE    *fp = fopen(script_file, "r");
+    char     line[512];
+    uint     lineno = 0;
+    uint64_t timeout = vs_usec() + 60000000;
+
+    (void) arg;
+    if (fp == NULL)
+        err(EXIT_FAILURE, "Failed to open %s", script_file);
+
+    printf("Amiga: waiting for message service\n");
+    pthread_mutex_lock(&vs_lock);
+    while (((state_usb_app & MSG_STATE_SERVICE_UP) == 0) ||
+           (vs_usec() >= expire_update_usb_app) || (usb_receive_count == 0)) {
+        struct timespec ts;
+        if (vs_usec() >= timeout) {
+            pthread_mutex_unlock(&vs_lock);
+            printf("Amiga: timeout waiting for message service\n");
+            script_failures++;
+            goto done;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec++;
+        pthread_cond_timedwait(&vs_cond, &vs_lock, &ts);
+    }
+    pthread_mutex_unlock(&vs_lock);
+
+    while (fgets(line, sizeof (line), fp) != NULL) {
+        char    *argv[8];
+        uint     argc = 0;
+        char    *ptr;
+        uint64_t bytes = 0;
+        uint64_t usec;
+        uint     rc;
+
+        lineno++;
+        if ((ptr = strchr(line, '#')) != NULL)
+            *ptr = '\0';
+        for (ptr = strtok(line, " \t\r\n"); (ptr != NULL) && (argc < 8);
+             ptr = strtok(NULL, " \t\r\n")) {
+            argv[argc++] = ptr;
+        }
+        if (argc == 0)
+            continue;
+
+        am_state_update();
+        usec = vs_usec();
+        rc = script_cmd(argc, argv, &bytes);
+        usec = vs_usec() - usec;
+        printf("%s:%u %-8s %s %" PRIu64 ".%03u sec", script_file, lineno,
+               argv[0], (rc == KM_STATUS_OK) ? "OK" : "FAIL",
+               usec / 1000000, (uint) (usec % 1000000) / 1000);
+        if ((bytes != 0) && (usec != 0))
+            printf(" %" PRIu64 " bytes %" PRIu64 " KB/sec", bytes,
+                   bytes * 1000000 / usec / 1024);
+        if (rc != KM_STATUS_OK) {
+            printf(" (status %x)", rc);
+            script_failures++;
+        }
+        printf("\n");
+    }
+done:
+    fclose(fp);
+    printf("Amiga: script complete, %u failure%s\n", script_failures,
+           (script_failures == 1) ? "" : "s");
+    pthread_mutex_lock(&vs_lock);
+    vs_done = true;
+    pthread_cond_broadcast(&vs_cond);
+    pthread_mutex_unlock(&vs_lock);
+    vs_wake();
+    return (NULL);
+}
+
+/*
+ * pty_open() creates the pseudo-terminal which hostsmash will open as
+ *            the Kicksmash serial device.
+ */
+static const char *
+pty_open(void)
+{
+    struct termios tty;
+    const char    *name;
+
+    dev_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (dev_fd == -1)
+        err(EXIT_FAILURE, "posix_openpt");
+    if ((grantpt(dev_fd) != 0) || (unlockpt(dev_fd) != 0))
+        err(EXIT_FAILURE, "Failed to unlock pseudo-terminal");
+    name = ptsname(dev_fd);
+    if (name == NULL)
+        err(EXIT_FAILURE, "ptsname");
+    dev_slave_fd = open(name, O_RDWR | O_NOCTTY);
+    if (dev_slave_fd == -1)
+        err(EXIT_FAILURE, "Failed to open %s", name);
+    if (tcgetattr(dev_slave_fd, &tty) == 0) {
+        cfmakeraw(&tty);
+        (void) tcsetattr(dev_slave_fd, TCSANOW, &tty);
+    }
+    if ((pipe(wake_fd) != 0) ||
+        (fcntl(wake_fd[0], F_SETFL, O_NONBLOCK) != 0) ||
+        (fcntl(wake_fd[1], F_SETFL, O_NONBLOCK) != 0))
+        err(EXIT_FAILURE, "Failed to create wake pipe");
+    return (name);
+}
+
+static void
+usage(FILE *fp)
+{
+    fprintf(fp, "\nvsmash "VERSION" built "BUILD_DATE" "BUILD_TIME"\n");
+    (void) fputs(usage_text, fp);
+}
+
+int
+main(int argc, char * const *argv)
+{
+    const char *flash_file = "vsmash.rom";
+    const char *link_path = NULL;
+    const char *name;
+    pthread_t   amiga_thread;
+    uint        bank;
+    int         ch;
+    int         long_index = 0;
+
+    while ((ch = getopt_long(argc, argv, short_opts, long_opts,
+                             &long_index)) != EOF) {
+        switch (ch) {
+            case 'f':
+                flash_file = optarg;
+                break;
+            case 'h':
+                usage(stdout);
+                exit(EXIT_SUCCESS);
+            case 'l':
+                link_path = optarg;
+                break;
+            case 's':
+                script_file = optarg;
+                break;
+            case ':':
+                warnx("The -%c option requires an argument", optopt);
+                usage(stderr);
+                exit(EXIT_FAILURE);
+            default:
+                warnx("Unknown option -%c", optopt);
+                usage(stderr);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (optind < argc) {
+        warnx("Unexpected argument: %s", argv[optind]);
+        usage(stderr);
+        exit(EXIT_FAILURE);
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    flash_open(flash_file);
+    memset(&bank_info, 0, sizeof (bank_info));
+    bank_info.bi_valid = 0x01;
+    for (bank = 0; bank < ROM_BANKS; bank++)
+        bank_info.bi_longreset_seq[bank] = 0xff;
+    start_usec = vs_usec();
+
+    name = pty_open();
+    if (link_path != NULL) {
+        (void) unlink(link_path);
+        if (symlink(name, link_path) != 0)
+            err(EXIT_FAILURE, "Failed to link %s", link_path);
+    }
+    printf("Virtual Kicksmash on %s", name);
+    if (link_path != NULL)
+        printf(" (%s)", link_path);
+    printf(" flash %s\n", flash_file);
+
+    if ((script_file != NULL) &&
+        pthread_create(&amiga_thread, NULL, th_amiga, NULL)) {
+        err(EXIT_FAILURE, "Failed to create Amiga thread");
+    }
+    cmdline();
+
+    if (script_file != NULL)
+        pthread_join(amiga_thread, NULL);
+    if (link_path != NULL)
+        (void) unlink(link_path);
+    (void) msync(flash_mem, flash_size, MS_SYNC);
+    exit((script_failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE);
+}